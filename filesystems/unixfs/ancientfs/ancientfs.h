@@ -7,6 +7,9 @@
 #ifndef _ANCIENTFS_H_
 #define _ANCIENTFS_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
 /* only upper-half bits */
 
 #define ANCIENTFS_UNIX_V1   0x80000000
@@ -47,5 +50,81 @@
 #define TAPEDIR_BEGIN_BLOCK_MAG 1
 #define TAPEDIR_END_BLOCK_MAG   62
 
+/* Buffered front-to-back archive reader; see ancientfs_scan.c. */
+
+#define ANCIENTFS_SCAN_BUFSIZE  (1024 * 1024)
+#define ANCIENTFS_SCAN_READSIZE 4096 /* first refill; enough for a header */
+
+struct ancientfs_scan {
+    int    as_fd;
+    char*  as_buf;
+    size_t as_bufsize;
+    size_t as_readsize; /* how much the next refill reads */
+    off_t  as_bufoff;   /* image offset of as_buf[0] */
+    size_t as_buflen;   /* valid bytes in as_buf */
+    off_t  as_pos;      /* current image offset */
+};
+
+int     ancientfs_scan_init(struct ancientfs_scan* as, int fd, size_t bufsize);
+void    ancientfs_scan_fini(struct ancientfs_scan* as);
+ssize_t ancientfs_scan_read(struct ancientfs_scan* as, void* buf,
+                            size_t nbyte);
+off_t   ancientfs_scan_seek(struct ancientfs_scan* as, off_t offset,
+                            int whence);
+
+/* Persistent archive index (--index); see ancientfs_index.c. */
+
+struct inode;
+
+struct ancientfs_index_record {
+    uint64_t ir_ino;
+    uint64_t ir_parent;
+    uint64_t ir_size;
+    uint64_t ir_dataoff;
+    uint64_t ir_rdev;
+    int64_t  ir_mtime;
+    uint32_t ir_mode;
+    uint32_t ir_uid;
+    uint32_t ir_gid;
+    uint32_t ir_nlink;
+    uint32_t ir_name;       /* offset into the string table */
+    uint32_t ir_linktarget; /* offset into the string table, or ~0 */
+};
+
+struct ancientfs_index {
+    void*                          ix_map;
+    size_t                         ix_mapsize;
+    struct ancientfs_index_record* ix_records;
+    uint32_t                       ix_nrecords;
+    uint32_t                       ix_files;
+    uint32_t                       ix_directories;
+    const char*                    ix_strtab;
+};
+
+struct ancientfs_index_writer {
+    struct ancientfs_index_record* iw_records;
+    uint32_t                       iw_nrecords;
+    uint32_t                       iw_reccapacity;
+    char*                          iw_strtab;
+    uint32_t                       iw_strsize;
+    uint32_t                       iw_strcapacity;
+    int                            iw_error;
+};
+
+int         ancientfs_index_open(struct ancientfs_index* ix, const char* path,
+                                 int imagefd, const char* fstype,
+                                 uint32_t flags);
+void        ancientfs_index_close(struct ancientfs_index* ix);
+const char* ancientfs_index_string(struct ancientfs_index* ix, uint32_t off);
+void        ancientfs_index_iload(struct ancientfs_index_record* ir,
+                                  struct inode* ip);
+void        ancientfs_index_add(struct ancientfs_index_writer* iw,
+                                struct inode* ip, ino_t parent,
+                                const char* name, const char* linktarget);
+int         ancientfs_index_write(struct ancientfs_index_writer* iw,
+                                  const char* path, int imagefd,
+                                  const char* fstype, uint32_t flags,
+                                  uint32_t files, uint32_t directories);
+
 #endif /* _ANCIENTFS_H_ */
 
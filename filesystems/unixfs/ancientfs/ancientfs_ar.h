@@ -43,8 +43,7 @@ struct ar_node_info
 { 
     struct   inode*        ar_self;
     struct   ar_node_info* ar_parent;
-    struct   ar_node_info* ar_children;
-    struct   ar_node_info* ar_next_sibling;
+    struct unixfs_dirindex ar_dirindex;
     char*    ar_name;
     uint32_t ar_namelen;
 };
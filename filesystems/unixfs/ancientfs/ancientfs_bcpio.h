@@ -34,6 +34,7 @@ struct filsys
     uint32_t s_dataoffset;
     uint32_t s_needsswap;
     struct inode* s_rootip;
+    struct ancientfs_index s_index; /* mapped by --index, if valid */
 };
 
 #define BCBLOCK       512
@@ -62,8 +63,7 @@ struct bcpio_header {
 struct bcpio_node_info {
     struct inode*           ci_self;
     struct bcpio_node_info* ci_parent;
-    struct bcpio_node_info* ci_children;
-    struct bcpio_node_info* ci_next_sibling;
+    struct unixfs_dirindex ci_dirindex;
     char*                   ci_name;
     char*                   ci_linktargetname;
 };
@@ -5,6 +5,8 @@
  */
 
 #include "ancientfs_cpio_newc.h"
+#define UNIXFS_HAVE_PMAP
+#define UNIXFS_HAVE_DIRINDEX
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -23,7 +25,7 @@ DECL_UNIXFS("UNIX cpio_newc", cpio_newc);
 #define CPIO_NEWC_ATOI(from, to, len, base) { \
     memmove(buf, from, len); \
     buf[len] = '\0'; \
-    to = strtol(buf, (char **)NULL, base); \
+    to = strtoll(buf, (char **)NULL, base); \
 }
 
 struct cpio_newc_entry {
@@ -33,16 +35,18 @@ struct cpio_newc_entry {
     struct stat stat;
 };
 
-static int ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce);
+static int ancientfs_cpio_newc_readheader(struct ancientfs_scan* as,
+                                          struct cpio_newc_entry* ce);
 
 static int
-ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
+ancientfs_cpio_newc_readheader(struct ancientfs_scan* as,
+                               struct cpio_newc_entry* ce)
 {
     int nr;
     char buf[20];
     struct cpio_newc_header _hdr, *hdr = &_hdr;
 
-    nr = read(fd, hdr, sizeof(struct cpio_newc_header));
+    nr = ancientfs_scan_read(as, hdr, sizeof(struct cpio_newc_header));
     if (nr != sizeof(struct cpio_newc_header)) {
         if (!nr)
             return 1;
@@ -56,7 +60,8 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
 
     if (strncmp(hdr->c_magic, magic, CPIO_NEWC_MAGLEN) != 0) {
         fprintf(stderr, "*** fatal error: bad magic in record @ %llu - %lu\n",
-                lseek(fd, (off_t)0, SEEK_CUR),
+                (unsigned long long)ancientfs_scan_seek(as, (off_t)0,
+                                                        SEEK_CUR),
                 (unsigned long)sizeof(struct cpio_newc_header));
         return -1;
     }
@@ -83,7 +88,7 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
     CPIO_NEWC_ATOI(hdr->c_mtime, mtime, sizeof(hdr->c_mtime), HEX);
     ce->stat.st_atime = ce->stat.st_ctime = ce->stat.st_mtime = mtime;
 
-    unsigned long filesize;
+    off_t filesize;
     CPIO_NEWC_ATOI(hdr->c_filesize, filesize, sizeof(hdr->c_filesize), HEX);
     ce->stat.st_size = filesize;
 
@@ -96,20 +101,23 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
 
     if (namesize > UNIXFS_MAXPATHLEN) {
         fprintf(stderr, "*** fatal error: file name too large (%#lx) @ %llu\n",
-                namesize, lseek(fd, (off_t)0, SEEK_CUR));
+                namesize,
+                (unsigned long long)ancientfs_scan_seek(as, (off_t)0,
+                                                        SEEK_CUR));
         return -1;
     }
 
-    if (read(fd, &ce->name, namesize) != namesize)
+    if (ancientfs_scan_read(as, &ce->name, namesize) != namesize)
         return -1;
 
     if (ce->name[0] == '\0' || ce->name[namesize - 1] != '\0') { /* corrupt */
         fprintf(stderr, "*** fatal error: file name corrupt @ %llu\n",
-                lseek(fd, (off_t)0, SEEK_CUR));
+                (unsigned long long)ancientfs_scan_seek(as, (off_t)0,
+                                                        SEEK_CUR));
         return -1;
     }
 
-    ce->daddr = lseek(fd, (off_t)0, SEEK_CUR);
+    ce->daddr = ancientfs_scan_seek(as, (off_t)0, SEEK_CUR);
     if (ce->daddr < 0) {
         fprintf(stderr, "*** fatal error: cannot read archive\n");
         return -1;
@@ -117,7 +125,7 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
     if (ce->daddr & (off_t)3) {
         off_t pad = 4 - (ce->daddr % 4);
         ce->daddr += pad;
-        (void)lseek(fd, pad, SEEK_CUR);
+        (void)ancientfs_scan_seek(as, pad, SEEK_CUR);
     }
 
     /* ce->daddr now contains the start of data */
@@ -129,7 +137,7 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
     if (!S_ISLNK(ce->stat.st_mode) || !ce->stat.st_size) {
         off_t dataend = ce->stat.st_size;
         dataend += (dataend & 3) ? (4 - (dataend % 4)) : 0;
-        (void)lseek(fd, dataend, SEEK_CUR); 
+        (void)ancientfs_scan_seek(as, dataend, SEEK_CUR); 
         return 0;
     }
 
@@ -145,7 +153,8 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
         return -1;
     }
 
-    if (read(fd, ce->linktargetname, ce->stat.st_size) != ce->stat.st_size)
+    if (ancientfs_scan_read(as, ce->linktargetname, ce->stat.st_size) !=
+        ce->stat.st_size)
         return -1;
 
     if (ce->linktargetname[0] == '\0') {
@@ -156,29 +165,110 @@ ancientfs_cpio_newc_readheader(int fd, struct cpio_newc_entry* ce)
     ce->linktargetname[ce->stat.st_size] = '\0';
 
     if ((ce->daddr + ce->stat.st_size) & 3)
-        (void)lseek(fd, (off_t)(4 - ((ce->daddr + ce->stat.st_size) % 4)),
+        (void)ancientfs_scan_seek(as,
+                    (off_t)(4 - ((ce->daddr + ce->stat.st_size) % 4)),
                     SEEK_CUR);
 
     return 0;
 }
 
+/* Rebuilds the in-core tree from a validated index instead of the archive. */
+static void
+ancientfs_cpio_newc_iload(struct filsys* fs)
+{
+    struct ancientfs_index* ix = &fs->s_index;
+    uint32_t i;
+
+    for (i = 0; i < ix->ix_nrecords; i++) {
+        struct ancientfs_index_record* ir = &ix->ix_records[i];
+        struct inode* ip = fs->s_rootip;
+        if (ir->ir_ino != ROOTINO) {
+            ip = unixfs_inodelayer_iget((ino_t)ir->ir_ino);
+            if (!ip) {
+                fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                        (unsigned long long)ir->ir_ino);
+                abort();
+            }
+        }
+
+        ancientfs_index_iload(ir, ip);
+
+        struct cpio_newc_node_info* ci =
+            (struct cpio_newc_node_info*)ip->I_private;
+        ci->ci_self = ip;
+        ci->ci_name = (char*)ancientfs_index_string(ix, ir->ir_name);
+        ci->ci_linktargetname =
+            (char*)ancientfs_index_string(ix, ir->ir_linktarget);
+
+        if (ip == fs->s_rootip)
+            continue;
+
+        struct inode* parent_ip = unixfs_internal_iget((ino_t)ir->ir_parent);
+        ci->ci_parent = (struct cpio_newc_node_info*)(parent_ip->I_private);
+        if (unixfs_dirindex_add(&ci->ci_parent->ci_dirindex, ci->ci_name,
+                                strlen(ci->ci_name), ip->I_ino) != 0) {
+            fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+            abort();
+        }
+        unixfs_internal_iput(parent_ip);
+        unixfs_inodelayer_isucceeded(ip);
+        /* no put */
+    }
+
+    fs->s_files = ix->ix_files;
+    fs->s_directories = ix->ix_directories;
+    fs->s_lastino = ix->ix_nrecords;
+}
+
+static void
+ancientfs_cpio_newc_isave(struct filsys* fs, int fd)
+{
+    struct ancientfs_index_writer iw;
+    ino_t i;
+
+    memset(&iw, 0, sizeof(iw));
+
+    for (i = ROOTINO; i <= fs->s_lastino; i++) {
+        struct inode* ip = unixfs_internal_iget(i);
+        if (!ip) {
+            iw.iw_error = ENOENT;
+            break;
+        }
+        struct cpio_newc_node_info* ci =
+            (struct cpio_newc_node_info*)ip->I_private;
+        ancientfs_index_add(&iw, ip,
+                            (ci->ci_parent) ? ci->ci_parent->ci_self->I_ino : 0,
+                            ci->ci_name, ci->ci_linktargetname);
+        unixfs_internal_iput(ip);
+    }
+
+    int err = ancientfs_index_write(&iw, unixfs_tunables.indexpath, fd,
+                                    unixfs_fstype, unixfs->s_flags,
+                                    fs->s_files, fs->s_directories);
+    if (err)
+        fprintf(stderr, "*** warning: cannot write index %s (error %d)\n",
+                unixfs_tunables.indexpath, err);
+}
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
 
     int err;
-    fs_endian_t mye, e = UNIXFS_FS_INVALID;
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
+    struct ancientfs_scan as;
+
+    memset(&as, 0, sizeof(as));
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -191,14 +281,14 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
     struct cpio_newc_header hdr;
 
-    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    if (unixfs_dev_read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
         fprintf(stderr, "failed to read data from file\n");
         err = EIO;
         goto out;
     }
 
     char* magic = CPIO_NEWC_MAGIC;
-    if (unixfs->s_flags & ANCIENTFS_NEWCRC)
+    if (flags & ANCIENTFS_NEWCRC)
         magic = CPIO_NEWCRC_MAGIC;
 
     if (strncmp(hdr.c_magic, magic, CPIO_NEWC_MAGLEN) != 0) {
@@ -207,7 +297,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    sb = malloc(sizeof(struct super_block));
+    sb = calloc(1, sizeof(struct super_block));
     if (!sb) {
         err = ENOMEM;
         goto out;
@@ -229,11 +319,12 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     /* not used */
     unixfs->s_endian = (fse == UNIXFS_FS_INVALID) ? UNIXFS_FS_LITTLE : fse;
 
-    if (e != mye)
-        fs->s_needsswap = 1;
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    if ((err = unixfs_bcache_init(unixfs)) != 0)
+        goto out;
+
     /* must initialize the inode layer before sanity checking */
     if ((err = unixfs_inodelayer_init(sizeof(struct cpio_newc_node_info))) != 0)
         goto out;
@@ -254,8 +345,6 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         (struct cpio_newc_node_info*)rootip->I_private;
     rootci->ci_self = rootip;
     rootci->ci_parent = NULL;
-    rootci->ci_children = NULL;
-    rootci->ci_next_sibling = NULL;
 
     unixfs_inodelayer_isucceeded(rootip);
 
@@ -265,12 +354,27 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     fs->s_rootip = rootip;
     fs->s_lastino = ROOTINO;
 
-    lseek(fd, (off_t)0, SEEK_SET); /* rewind tape */
+    if (unixfs_tunables.indexpath) {
+        err = ancientfs_index_open(&fs->s_index, unixfs_tunables.indexpath,
+                                   fd, unixfs_fstype, unixfs->s_flags);
+        if (!err) {
+            ancientfs_cpio_newc_iload(fs);
+            goto scanned;
+        }
+        if (err != ENOENT)
+            fprintf(stderr, "*** warning: ignoring %s index %s (error %d)\n",
+                    (err == ESTALE) ? "stale" : "unusable",
+                    unixfs_tunables.indexpath, err);
+    }
+
+    /* rewind tape */
+    if ((err = ancientfs_scan_init(&as, fd, ANCIENTFS_SCAN_BUFSIZE)) != 0)
+        goto out;
 
     struct cpio_newc_entry _ce, *ce = &_ce;
 
     for (;;) {
-        if ((err = ancientfs_cpio_newc_readheader(fd, ce)) != 0) {
+        if ((err = ancientfs_cpio_newc_readheader(&as, ce)) != 0) {
             if (err == 1)
                 break;
             else {
@@ -310,12 +414,12 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
             int missing = unixfs_internal_namei(parent_ino, cnp, &stbuf);
             if (!missing) {
                 parent_ino = stbuf.st_ino;
-                if (!term) { /* out of order */
+                if (!term || !*term) { /* out of order */
                     struct inode* dirp = unixfs_inodelayer_iget(parent_ino);
                     if (!dirp || !dirp->I_initialized) {
                         fprintf(stderr,
                                 "*** fatal error: inode %llu inconsistent\n",
-                                (ino64_t)parent_ino);
+                                (unsigned long long)parent_ino);
                         abort();
                     }
                     dirp->I_mode = ce->stat.st_mode;
@@ -330,7 +434,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                 /* unixfs_inodelayer_iget(ce->stat.st_ino); */
             if (!ip) {
                 fprintf(stderr, "*** fatal error: no inode for %llu\n",
-                        (ino64_t)(fs->s_lastino + 1));
+                        (unsigned long long)(fs->s_lastino + 1));
                 abort();
             }
 
@@ -356,7 +460,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
             memcpy(ci->ci_name, cnp, namelen);
             ci->ci_name[namelen] = '\0';
 
-            ip->I_daddr[0] = 0;
+            ip->I_dataoff = 0;
 
             if (S_ISLNK(ip->I_mode)) {
                 namelen = strlen(ce->linktargetname);
@@ -370,18 +474,21 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                 ci->ci_linktargetname[namelen] = '\0';
             } else if (S_ISREG(ip->I_mode)) {
 
-                ip->I_daddr[0] = ce->daddr;
+                ip->I_dataoff = ce->daddr;
             }
              
             ci->ci_self = ip;
-            ci->ci_children = NULL;
             struct inode* parent_ip = unixfs_internal_iget(parent_ino);
             parent_ip->I_size += 1;
             ci->ci_parent = (struct cpio_newc_node_info*)(parent_ip->I_private);
-            ci->ci_next_sibling = ci->ci_parent->ci_children;
-            ci->ci_parent->ci_children = ci;
+            if (unixfs_dirindex_add(&ci->ci_parent->ci_dirindex,
+                                    (const char*)ci->ci_name,
+                                    strlen((const char*)ci->ci_name), ip->I_ino) != 0) {
+                fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+                abort();
+            }
 
-            if (term && !S_ISDIR(ip->I_mode)) /* out of order */
+            if (term && *term && !S_ISDIR(ip->I_mode)) /* out of order */
                 ip->I_mode = S_IFDIR | 0755;
 
             if (S_ISDIR(ip->I_mode)) {
@@ -405,6 +512,12 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
     } /* for each block */
 
+    ancientfs_scan_fini(&as);
+
+    if (unixfs_tunables.indexpath)
+        ancientfs_cpio_newc_isave(fs, fd);
+
+scanned:
     err = 0;
 
     unixfs->s_statvfs.f_bsize = CPIO_NEWC_BLOCK;
@@ -429,12 +542,15 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
 out:
     if (err) {
+        ancientfs_scan_fini(&as);
         if (fd >= 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (fs)
             free(fs);
-        if (sb)
+        if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
+        }
         return NULL;
     }
 
@@ -453,9 +569,12 @@ unixfs_internal_fini(void* filsys)
             struct cpio_newc_node_info* ci =
                 (struct cpio_newc_node_info*)tmp->I_private;
             if (ci) {
-                free(ci->ci_name);
-                if (ci->ci_linktargetname)
-                    free(ci->ci_linktargetname);
+                unixfs_dirindex_clear(&ci->ci_dirindex);
+                if (!fs->s_index.ix_map) { /* else names live in the index */
+                    free(ci->ci_name);
+                    if (ci->ci_linktargetname)
+                        free(ci->ci_linktargetname);
+                }
             }
             unixfs_internal_iput(tmp);
             unixfs_internal_iput(tmp);
@@ -464,9 +583,12 @@ unixfs_internal_fini(void* filsys)
 
     unixfs_inodelayer_fini();
 
+    ancientfs_index_close(&fs->s_index);
+
     if (sb) {
+        unixfs_bcache_fini(sb);
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_dev_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -496,7 +618,8 @@ unixfs_internal_iget(ino_t ino)
 {
     struct inode* ip = unixfs_inodelayer_iget(ino);
     if (!ip) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -553,28 +676,12 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         goto out;
     }
 
-    struct cpio_newc_node_info* child =
-        ((struct cpio_newc_node_info*)dp->I_private)->ci_children;;
-
-    if (!child) {
+    struct cpio_newc_node_info* dnode = (struct cpio_newc_node_info*)dp->I_private;
+    ino_t ino = unixfs_dirindex_find(&dnode->ci_dirindex, name, namelen);
+    if (ino)
+        ret = unixfs_internal_igetattr(ino, stbuf);
+    else
         ret = ENOENT;
-        goto out;
-    }
-
-    int found = 0;
-
-    do {
-        size_t target_namelen = strlen((const char*)child->ci_name);
-        if ((namelen == target_namelen) &&
-            (memcmp(name, child->ci_name, target_namelen) == 0)) {
-            found = 1;
-            break;
-        }
-        child = child->ci_next_sibling;
-    } while (child);
-
-    if (found)
-        ret = unixfs_internal_igetattr((ino_t)child->ci_self->I_ino, stbuf);
 
 out:
     unixfs_internal_iput(dp);
@@ -607,18 +714,18 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         goto out;
     }
 
-    struct cpio_newc_node_info* child =
-        ((struct cpio_newc_node_info*)dp->I_private)->ci_children;;
+    struct unixfs_dirindex* di =
+        &((struct cpio_newc_node_info*)dp->I_private)->ci_dirindex;
 
-    off_t i;
+    off_t i = *offset - 2;
+    if (i >= di->di_count)
+        return -1;
 
-    for (i = 0; i < (*offset - 2); i++)
-        child = child->ci_next_sibling;
+    struct unixfs_dirindex_entry* de = &di->di_entries[i];
 
-    dent->ino = (ino_t)child->ci_self->I_ino;
-    size_t dirnamelen = strlen(child->ci_name);
-    dirnamelen = min(dirnamelen, UNIXFS_MAXNAMLEN);
-    memcpy(dent->name, child->ci_name, dirnamelen);
+    dent->ino = de->de_ino;
+    size_t dirnamelen = min(de->de_namelen, UNIXFS_MAXNAMLEN);
+    memcpy(dent->name, di->di_names + de->de_nameoff, dirnamelen);
     dent->name[dirnamelen] = '\0';
 
 out:
@@ -631,11 +738,17 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    off_t start = (off_t)ip->I_daddr[0];
+    off_t start = ip->I_dataoff;
 
     /* caller already checked for bounds */
 
-    return pread(unixfs->s_bdev, buf, nbyte, start + offset);
+    return unixfs_bcache_pread(unixfs, buf, nbyte, start + offset);
+}
+
+static const char*
+unixfs_internal_pmap(struct inode* ip, off_t offset, size_t nbyte)
+{
+    return unixfs_bcache_map(unixfs, ip->I_dataoff + offset, nbyte);
 }
 
 static int
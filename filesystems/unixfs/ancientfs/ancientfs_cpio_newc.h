@@ -21,6 +21,7 @@ struct filsys
     uint32_t s_dataoffset;
     uint32_t s_needsswap;
     struct inode* s_rootip;
+    struct ancientfs_index s_index; /* mapped by --index, if valid */
 };
 
 #define CPIO_NEWC_BLOCK       512
@@ -52,8 +53,7 @@ struct cpio_newc_header {
 struct cpio_newc_node_info {
     struct inode*               ci_self;
     struct cpio_newc_node_info* ci_parent;
-    struct cpio_newc_node_info* ci_children;
-    struct cpio_newc_node_info* ci_next_sibling;
+    struct unixfs_dirindex ci_dirindex;
     char*                       ci_name;
     char*                       ci_linktargetname;
 };
@@ -21,6 +21,7 @@ struct filsys
     uint32_t s_dataoffset;
     uint32_t s_needsswap;
     struct inode* s_rootip;
+    struct ancientfs_index s_index; /* mapped by --index, if valid */
 };
 
 #define CPIO_ODC_BLOCK       512
@@ -48,8 +49,7 @@ struct cpio_odc_header {
 struct cpio_odc_node_info {
     struct inode*              ci_self;
     struct cpio_odc_node_info* ci_parent;
-    struct cpio_odc_node_info* ci_children;
-    struct cpio_odc_node_info* ci_next_sibling;
+    struct unixfs_dirindex ci_dirindex;
     char*                      ci_name;
     char*                      ci_linktargetname;
 };
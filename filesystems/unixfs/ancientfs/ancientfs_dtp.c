@@ -23,7 +23,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -32,9 +32,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
-    uint32_t tapedir_begin_block = 0, tapedir_end_block = 0, last_block = 0;
+    uint32_t tapedir_begin_block = 0, tapedir_end_block = 0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -60,12 +60,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (S_ISREG(stbuf.st_mode))
-        last_block = stbuf.st_size / BSIZE;
-    else
-        last_block = tapedir_end_block;
-
-    sb = malloc(sizeof(struct super_block));
+    sb = calloc(1, sizeof(struct super_block));
     if (!sb) {
         err = ENOMEM;
         goto out;
@@ -87,6 +82,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    if ((err = unixfs_bcache_init(unixfs)) != 0)
+        goto out;
+
     /* must initialize the inode layer before sanity checking */
     if ((err = unixfs_inodelayer_init(sizeof(struct tap_node_info))) != 0)
         goto out;
@@ -122,9 +120,10 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
     for (i = tapedir_begin_block; i < tapedir_end_block; i++) {
 
-        if (pread(fd, tapeblock, BSIZE, (off_t)(i * BSIZE)) != BSIZE) {
+        if (unixfs_dev_pread(fd, tapeblock, BSIZE,
+                             (off_t)(i * BSIZE)) != BSIZE) {
             fprintf(stderr, "*** fatal error: cannot read tape block %llu\n",
-                    (off_t)i);
+                    (unsigned long long)i);
             err = EIO;
             goto out;
         }
@@ -192,7 +191,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                     unixfs_inodelayer_iget((ino_t)(fs->s_lastino + 1));
                 if (!ip) {
                     fprintf(stderr, "*** fatal error: no inode for %llu\n",
-                            (ino64_t)(fs->s_lastino + 1));
+                            (unsigned long long)(fs->s_lastino + 1));
                     abort();
                 }
                 ip->I_mode = fs16_to_host(unixfs->s_endian, di->di_mode);
@@ -253,11 +252,13 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (fs)
             free(fs);
-        if (sb)
+        if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
+        }
         return NULL;
     }
 
@@ -281,8 +282,9 @@ unixfs_internal_fini(void* filsys)
     unixfs_inodelayer_fini();
 
     if (sb) {
+        unixfs_bcache_fini(sb);
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_dev_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -314,13 +316,14 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     if (blkno >= ((struct filsys*)unixfs->s_fs_info)->s_fsize) {
         fprintf(stderr,
-                "***fatal error: bread failed for block %llu\n", blkno);
+                "***fatal error: bread failed for block %llu\n",
+                (unsigned long long)blkno);
         abort();
         /* NOTREACHED */
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_bcache_bread(unixfs, blkno * (off_t)BSIZE, UNIXFS_IOSIZE(unixfs),
+                            blkbuf) != 0)
         return EIO;
 
     return 0;
@@ -331,7 +334,8 @@ unixfs_internal_iget(ino_t ino)
 {
     struct inode* ip = unixfs_inodelayer_iget(ino);
     if (!ip) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -478,11 +482,14 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
         off_t bn = unixfs_internal_bmap(ip, lbn, error);
         if (UNIXFS_BADBLOCK(bn, *error))
             break;
-        *error = unixfs_internal_bread(bn, blkbuf);
+        /* whole blocks go straight into the caller's buffer */
+        char* dst = (remaining >= iosize) ? p : blkbuf;
+        *error = unixfs_internal_bread(bn, dst);
         if (*error != 0)
             break;
         tomove = (remaining > iosize) ? iosize : remaining;
-        memcpy(p, blkbuf, tomove);
+        if (dst != p)
+            memcpy(p, blkbuf, tomove);
         remaining -= tomove;
         done += tomove;
         offset += tomove;
@@ -23,21 +23,24 @@ DECL_UNIXFS("UNIX dump1024/restor variable-length names", dumpvn1024);
 DECL_UNIXFS("UNIX dump/restor variable-length names", dumpvn);
 #endif
 
-static int ancientfs_dump_readheader(int fd, struct spcl* spcl);
+static int   ancientfs_dump_readheader(int fd, struct spcl* spcl);
+static off_t ancientfs_dump_skipdata(int fd, struct spcl* spcl, int from,
+                                     int to);
+static void  ancientfs_dump_addextent(struct tap_node_info* ti,
+                                      off_t lblkno, off_t daddr);
 
 static int
 ancientfs_dump_readheader(int fd, struct spcl* spcl)
 {
     ssize_t ret;
 
-    if ((ret = read(fd, (char*)spcl, BSIZE)) != BSIZE) {
+    if ((ret = unixfs_dev_read(fd, (char*)spcl, BSIZE)) != BSIZE) {
         if (ret == 0) /* EOF */
             return 1;
         return -1;
     }
 
-    if (ancientfs_dump_cksum((uint16_t*)spcl, unixfs->s_endian,
-                              unixfs->s_flags) != 0)
+    if (ancientfs_dump_cksum(spcl, unixfs->s_endian, unixfs->s_flags) != 0)
         return -1;
 
     spcl->c_magic    = fs16_to_host(unixfs->s_endian, spcl->c_magic);
@@ -64,24 +67,81 @@ ancientfs_dump_readheader(int fd, struct spcl* spcl)
     return 0;
 }
 
+/*
+ * A header's data records follow it back to back, one for each nonzero
+ * c_addr[] entry. Moves past those of entries [from, to) in a single seek and
+ * returns the tape record of the first one, or 0 if there were none.
+ */
+static off_t
+ancientfs_dump_skipdata(int fd, struct spcl* spcl, int from, int to)
+{
+    off_t ndata = 0;
+    int i;
+
+    for (i = from; i < to; i++)
+        if (spcl->c_addr[i])
+            ndata++;
+
+    if (ndata == 0)
+        return (off_t)0;
+
+    off_t pos = unixfs_dev_lseek(fd, ndata * BSIZE, SEEK_CUR);
+    if (pos == -1)
+        return (off_t)-1;
+
+    return (pos / BSIZE) - ndata;
+}
+
+/* Appends one block to a file's extent list, growing the last run if it can. */
+static void
+ancientfs_dump_addextent(struct tap_node_info* ti, off_t lblkno, off_t daddr)
+{
+    if (ti->ti_nextents) {
+        struct tap_extent* te = &ti->ti_extents[ti->ti_nextents - 1];
+        if ((te->te_lblkno + te->te_nblocks == lblkno) &&
+            ((!te->te_daddr && !daddr) ||
+             (te->te_daddr && (te->te_daddr + te->te_nblocks == daddr)))) {
+            te->te_nblocks++;
+            return;
+        }
+    }
+
+    if (ti->ti_nextents == ti->ti_capacity) {
+        uint32_t capacity = ti->ti_capacity ? 2 * ti->ti_capacity : 4;
+        struct tap_extent* newp =
+            realloc(ti->ti_extents, capacity * sizeof(struct tap_extent));
+        if (!newp) {
+            fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+            abort();
+        }
+        ti->ti_extents = newp;
+        ti->ti_capacity = capacity;
+    }
+
+    struct tap_extent* te = &ti->ti_extents[ti->ti_nextents++];
+    te->te_lblkno = (uint32_t)lblkno;
+    te->te_daddr = (uint32_t)daddr;
+    te->te_nblocks = 1;
+}
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
 
-    int err, i;
+    int err, i, again = 0;
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
     assert(sizeof(struct spcl) == BSIZE);
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -105,7 +165,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    sb = malloc(sizeof(struct super_block));
+    sb = calloc(1, sizeof(struct super_block));
     if (!sb) {
         err = ENOMEM;
         goto out;
@@ -125,6 +185,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    if ((err = unixfs_bcache_init(unixfs)) != 0)
+        goto out;
+
     unixfs->s_statvfs.f_bsize = BSIZE;
     unixfs->s_statvfs.f_frsize = BSIZE;
 
@@ -172,6 +235,13 @@ next:
         case TS_TAPE:
              break;
 
+        case TS_ADDR: /* more of a file we're not keeping */
+            if (ancientfs_dump_skipdata(fd, &spcl, 0, spcl.c_count) == -1) {
+                fprintf(stderr, "*** fatal error: cannot read tape\n");
+                abort();
+            }
+            break;
+
         case TS_END:
              done = 1;
              break;
@@ -182,7 +252,7 @@ next:
                 int count = spcl.c_count;
                 char* bmp = (char*)fs->s_dumpmap;
                 while (count--) {
-                   if (read(fd, bmp, BSIZE) != BSIZE) {
+                   if (unixfs_dev_read(fd, bmp, BSIZE) != BSIZE) {
                        fprintf(stderr,
                                "*** fatal error: failed to read bitmap\n");
                        err = EIO;
@@ -197,7 +267,8 @@ next:
            } else {
                fprintf(stderr, "*** warning: duplicate inode map\n");
                /* ignore the data */
-               (void)lseek(fd, (off_t)(spcl.c_count * BSIZE), SEEK_CUR);
+               (void)unixfs_dev_lseek(fd, (off_t)(spcl.c_count * BSIZE),
+                                      SEEK_CUR);
            }
            break;
 
@@ -205,18 +276,25 @@ next:
             struct dinode* dip = &spcl.c_dinode;
             a_ino_t candidate = spcl.c_inumber;
 
-            if ((!BIT_ON(candidate, fs->s_dumpmap)) || (candidate == BADINO))
+            if ((!BIT_ON(candidate, fs->s_dumpmap)) || (candidate == BADINO)) {
+                if (ancientfs_dump_skipdata(fd, &spcl, 0,
+                                            spcl.c_count) == -1) {
+                    fprintf(stderr, "*** fatal error: cannot read tape\n");
+                    abort();
+                }
                 continue;
+            }
 
             struct inode* ip = unixfs_inodelayer_iget((ino_t)candidate);
             if (!ip) {
                 fprintf(stderr, "*** fatal error: no inode for %llu\n",
-                        (ino64_t)candidate);
+                        (unsigned long long)candidate);
                 abort();
             }
 
             struct tap_node_info* ti = (struct tap_node_info*)ip->I_private;
-            ti->ti_daddr = NULL;
+            ti->ti_extents = NULL;
+            ti->ti_nextents = ti->ti_capacity = 0;
 
             assert(!ip->I_initialized);
 
@@ -235,19 +313,18 @@ next:
             else
                 fs->s_files++;
 
-            /* populate i_daddr */
-            
-            off_t nblocks = (off_t)((ip->I_size + (BSIZE - 1)) / BSIZE);
-
-            ti->ti_daddr = (uint32_t*)calloc(nblocks, sizeof(uint32_t));
-            if (!ti->ti_daddr) {
-                fprintf(stderr, "*** fatal error: cannot allocate memory\n");
-                abort();
-            }
+            /*
+             * Map out the file's blocks as runs of tape records, skipping
+             * over each header's data in one go. Where the data lands is
+             * taken from the tape position rather than from c_tapea, which
+             * doesn't account for holes.
+             */
 
+            off_t nblocks = (off_t)((ip->I_size + (BSIZE - 1)) / BSIZE);
+            off_t lbn = 0;
             int block_index = 0;
 
-            for (i = 0; i < nblocks; i++) {
+            while (lbn < nblocks) {
                 if (block_index >= spcl.c_count) {
                     if (ancientfs_dump_readheader(fd, &spcl) == -1) {
                         fprintf(stderr,
@@ -257,26 +334,40 @@ next:
                     if (spcl.c_type != TS_ADDR) {
                         fprintf(stderr, "*** warning: expected TS_ADDR but "
                                         "got %hd\n", spcl.c_type);
-                        int k = i;
-                        for (; k < nblocks; k++)
-                            ti->ti_daddr[k] = 0;
-                        goto next;
+                        for (; lbn < nblocks; lbn++)
+                            ancientfs_dump_addextent(ti, lbn, 0);
+                        again = 1; /* that header is next */
+                        break;
                     }
                     block_index = 0;
                 }
 
-                if (spcl.c_addr[block_index]) {
-                    off_t nextb = lseek(fd, (off_t)BSIZE, SEEK_CUR);
-                    if (nextb == -1) {
-                        fprintf(stderr, "*** fatal error: cannot read tape\n");
-                        abort();
-                    }
-                    ti->ti_daddr[i] = spcl.c_tapea + block_index + 1;
-                } else {
-                    ti->ti_daddr[i] = 0; /* zero fill */
+                int last = spcl.c_count;
+                if ((off_t)(last - block_index) > nblocks - lbn)
+                    last = block_index + (int)(nblocks - lbn);
+
+                off_t daddr = ancientfs_dump_skipdata(fd, &spcl, block_index,
+                                                      last);
+                if (daddr == -1) {
+                    fprintf(stderr, "*** fatal error: cannot read tape\n");
+                    abort();
+                }
+
+                for (; block_index < last; block_index++, lbn++) {
+                    if (spcl.c_addr[block_index])
+                        ancientfs_dump_addextent(ti, lbn, daddr++);
+                    else
+                        ancientfs_dump_addextent(ti, lbn, 0); /* zero fill */
                 }
+            }
 
-                block_index++;
+            if (ti->ti_nextents && (ti->ti_nextents < ti->ti_capacity)) {
+                struct tap_extent* newp = realloc(ti->ti_extents,
+                    ti->ti_nextents * sizeof(struct tap_extent));
+                if (newp) {
+                    ti->ti_extents = newp;
+                    ti->ti_capacity = ti->ti_nextents;
+                }
             }
 
             if (S_ISCHR(ip->I_mode) || S_ISBLK(ip->I_mode)) {
@@ -297,6 +388,11 @@ next:
                 fs->s_lastino = ip->I_ino;
 
             unixfs_inodelayer_isucceeded(ip);
+
+            if (again) {
+                again = 0;
+                goto next;
+            }
             }
             break;
          }
@@ -332,11 +428,13 @@ next:
 out:
     if (err) {
         if (fs)
-            unixfs_internal_fini(fs);
-        else if (sb)
+            unixfs_internal_fini(sb);
+        else if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
+        }
         if (fd >= 0)
-            close(fd);
+            unixfs_dev_close(fd);
         return NULL;
     }
 
@@ -357,8 +455,8 @@ unixfs_internal_fini(void* filsys)
                     (struct tap_node_info*)tmp->I_private;
                 unixfs_internal_iput(tmp);
                 unixfs_internal_iput(tmp);
-                if (ti->ti_daddr)
-                    free(ti->ti_daddr);
+                if (ti->ti_extents)
+                    free(ti->ti_extents);
             }
         }
     }
@@ -366,8 +464,9 @@ unixfs_internal_fini(void* filsys)
     unixfs_inodelayer_fini();
 
     if (sb) {
+        unixfs_bcache_fini(sb);
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_dev_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (fs)
             free(fs);
@@ -392,7 +491,23 @@ unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
 
     *error = 0;
 
-    return (off_t)(((struct tap_node_info*)ip->I_private)->ti_daddr[lblkno]);
+    struct tap_node_info* ti = (struct tap_node_info*)ip->I_private;
+    uint32_t lo = 0, hi = ti->ti_nextents;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        struct tap_extent* te = &ti->ti_extents[mid];
+        if (lblkno < (off_t)te->te_lblkno)
+            hi = mid;
+        else if (lblkno >= (off_t)(te->te_lblkno + te->te_nblocks))
+            lo = mid + 1;
+        else if (te->te_daddr == 0)
+            return (off_t)0; /* zero fill */
+        else
+            return (off_t)te->te_daddr + (lblkno - te->te_lblkno);
+    }
+
+    return (off_t)0; /* zero fill */
 }
 
 static int
@@ -400,7 +515,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     if (blkno >= ((struct filsys*)unixfs->s_fs_info)->s_fsize) {
         fprintf(stderr,
-                "***fatal error: bread failed for block %llu\n", blkno);
+                "***fatal error: bread failed for block %llu\n",
+                (unsigned long long)blkno);
         abort();
         /* NOTREACHED */
     }
@@ -410,8 +526,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_bcache_bread(unixfs, blkno * (off_t)BSIZE, UNIXFS_IOSIZE(unixfs),
+                            blkbuf) != 0)
         return EIO;
 
     return 0;
@@ -425,7 +541,8 @@ unixfs_internal_iget(ino_t ino)
 
     struct inode* ip = unixfs_inodelayer_iget(ino);
     if (!ip) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -629,11 +746,14 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
         off_t bn = unixfs_internal_bmap(ip, lbn, error);
         if (UNIXFS_BADBLOCK(bn, *error))
             break;
-        *error = unixfs_internal_bread(bn, blkbuf);
+        /* whole blocks go straight into the caller's buffer */
+        char* dst = (remaining >= iosize) ? p : blkbuf;
+        *error = unixfs_internal_bread(bn, dst);
         if (*error != 0)
             break;
         tomove = (remaining > iosize) ? iosize : remaining;
-        memcpy(p, blkbuf, tomove);
+        if (dst != p)
+            memcpy(p, blkbuf, tomove);
         remaining -= tomove;
         done += tomove;
         offset += tomove;
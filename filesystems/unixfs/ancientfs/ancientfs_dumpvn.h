@@ -10,6 +10,8 @@
 #include "unixfs_internal.h"
 #include "ancientfs.h"
 
+#include <string.h>
+
 typedef int16_t  a_short;      /* ancient short */
 typedef uint16_t a_ushort;     /* ancient unsigned short */
 typedef int16_t  a_int;        /* ancient int */
@@ -88,8 +90,21 @@ struct dinode
     a_time_t di_ctime;    /* time created */
 } __attribute__((packed));
 
+/*
+ * A file's blocks, as runs: te_nblocks logical blocks from te_lblkno on are
+ * as many consecutive tape records from te_daddr on, or a hole if te_daddr
+ * is 0.
+ */
+struct tap_extent {
+    uint32_t te_lblkno;
+    uint32_t te_daddr;
+    uint32_t te_nblocks;
+};
+
 struct tap_node_info {
-    uint32_t* ti_daddr; 
+    struct tap_extent* ti_extents; /* sorted by te_lblkno */
+    uint32_t           ti_nextents;
+    uint32_t           ti_capacity;
 };
 
 #define ANCIENTFS_211BSD_DIRBLKSIZ 512
@@ -132,17 +147,19 @@ struct spcl {
 #define BIT_ON(n, w)   (MWORD16(w, n) & MBIT16(n))
 
 static inline int
-ancientfs_dump_cksum(uint16_t* buf, fs_endian_t e, uint32_t flags)
+ancientfs_dump_cksum(const void* buf, fs_endian_t e, uint32_t flags)
 {
-    uint16_t sum;
+    const char* p = (const char*)buf; /* a packed header; may be unaligned */
+    uint16_t sum, word;
     uint16_t limit;
 
     sum = 0;
     limit = BSIZE / sizeof(uint16_t);
 
     do {
-        sum += fs16_to_host(e, *buf);
-        buf++;
+        memcpy(&word, p, sizeof(word));
+        sum += fs16_to_host(e, word);
+        p += sizeof(word);
     } while (--limit);
 
     return (sum == CHECKSUM) ? 0 : 1;
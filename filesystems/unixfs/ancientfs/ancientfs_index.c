@@ -0,0 +1,335 @@
+/*
+ * Ancient UNIX File Systems for MacFUSE
+ * Amit Singh
+ * http://osxbook.com
+ */
+
+#include "ancientfs.h"
+#include "unixfs_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Index sidecars for archive formats (--index PATH).
+ *
+ * Mounting a tar or cpio archive means walking every header in it. Once the
+ * in-core tree has been built, we can write it out as a flat file: a header
+ * identifying the image, one fixed-size record per inode in inode number
+ * order, and a table of NUL-terminated names. A later mount of the same
+ * image maps that file and rebuilds the tree from the records without
+ * touching the archive. The names stay in the mapping and are used in place.
+ *
+ * The index is a host-local cache, not an interchange format: it is written
+ * in host byte order and is rejected (and rebuilt) if anything about it or
+ * the image looks different.
+ */
+
+#define ANCIENTFS_INDEX_MAGIC   "AFSINDEX"
+#define ANCIENTFS_INDEX_VERSION 1
+#define ANCIENTFS_INDEX_NONE    ((uint32_t)~0)
+
+struct ancientfs_index_header {
+    char     ih_magic[8];
+    uint32_t ih_version;
+    uint32_t ih_recsize;      /* sizeof(struct ancientfs_index_record) */
+    char     ih_fstype[32];   /* backend that wrote this index */
+    uint32_t ih_flags;        /* super block flags at mount time */
+    uint32_t ih_nrecords;
+    uint64_t ih_imagesize;    /* identity of the image we indexed */
+    int64_t  ih_imagemtime;
+    uint32_t ih_files;
+    uint32_t ih_directories;
+    uint64_t ih_strtabsize;   /* the string table follows the records */
+};
+
+static int
+ancientfs_index_grow(void** p, uint32_t* capacity, uint32_t needed,
+                     size_t elemsize)
+{
+    if (needed <= *capacity)
+        return 0;
+
+    uint32_t newcapacity = *capacity ? *capacity : 256;
+    while (newcapacity < needed)
+        newcapacity *= 2;
+
+    void* newp = realloc(*p, (size_t)newcapacity * elemsize);
+    if (!newp)
+        return ENOMEM;
+
+    *p = newp;
+    *capacity = newcapacity;
+
+    return 0;
+}
+
+static uint32_t
+ancientfs_index_addstring(struct ancientfs_index_writer* iw, const char* s)
+{
+    if (!s)
+        return ANCIENTFS_INDEX_NONE;
+
+    uint32_t len = (uint32_t)strlen(s) + 1;
+    if (ancientfs_index_grow((void**)&iw->iw_strtab, &iw->iw_strcapacity,
+                             iw->iw_strsize + len, 1) != 0) {
+        iw->iw_error = ENOMEM;
+        return ANCIENTFS_INDEX_NONE;
+    }
+
+    uint32_t off = iw->iw_strsize;
+    memcpy(iw->iw_strtab + off, s, len);
+    iw->iw_strsize += len;
+
+    return off;
+}
+
+void
+ancientfs_index_add(struct ancientfs_index_writer* iw, struct inode* ip,
+                    ino_t parent, const char* name, const char* linktarget)
+{
+    if (iw->iw_error)
+        return;
+
+    if (ancientfs_index_grow((void**)&iw->iw_records, &iw->iw_reccapacity,
+                             iw->iw_nrecords + 1,
+                             sizeof(struct ancientfs_index_record)) != 0) {
+        iw->iw_error = ENOMEM;
+        return;
+    }
+
+    struct ancientfs_index_record* ir = &iw->iw_records[iw->iw_nrecords];
+
+    memset(ir, 0, sizeof(*ir));
+    ir->ir_ino     = (uint64_t)ip->I_ino;
+    ir->ir_parent  = (uint64_t)parent;
+    ir->ir_size    = (uint64_t)ip->I_size;
+    ir->ir_dataoff = (uint64_t)ip->I_dataoff;
+    ir->ir_rdev    = (uint64_t)ip->I_rdev;
+    ir->ir_mtime   = (int64_t)ip->I_mtime_sec;
+    ir->ir_mode    = (uint32_t)ip->I_mode;
+    ir->ir_uid     = (uint32_t)ip->I_uid;
+    ir->ir_gid     = (uint32_t)ip->I_gid;
+    ir->ir_nlink   = (uint32_t)ip->I_nlink;
+    ir->ir_name    = ancientfs_index_addstring(iw, name ? name : "");
+    ir->ir_linktarget = ancientfs_index_addstring(iw, linktarget);
+
+    if (!iw->iw_error)
+        iw->iw_nrecords++;
+}
+
+int
+ancientfs_index_write(struct ancientfs_index_writer* iw, const char* path,
+                      int imagefd, const char* fstype, uint32_t flags,
+                      uint32_t files, uint32_t directories)
+{
+    int err = iw->iw_error;
+    int fd = -1;
+    char tmppath[UNIXFS_MAXPATHLEN + 1];
+    struct ancientfs_index_header ih;
+    struct stat stbuf;
+
+    if (err)
+        goto out;
+
+    if (fstat(imagefd, &stbuf) != 0) {
+        err = errno;
+        goto out;
+    }
+
+    memset(&ih, 0, sizeof(ih));
+    memcpy(ih.ih_magic, ANCIENTFS_INDEX_MAGIC, sizeof(ih.ih_magic));
+    ih.ih_version = ANCIENTFS_INDEX_VERSION;
+    ih.ih_recsize = sizeof(struct ancientfs_index_record);
+    snprintf(ih.ih_fstype, sizeof(ih.ih_fstype), "%s", fstype);
+    ih.ih_flags = flags;
+    ih.ih_nrecords = iw->iw_nrecords;
+    ih.ih_imagesize = (uint64_t)stbuf.st_size;
+    ih.ih_imagemtime = (int64_t)stbuf.st_mtime;
+    ih.ih_files = files;
+    ih.ih_directories = directories;
+    ih.ih_strtabsize = iw->iw_strsize;
+
+    /* write a temporary file and rename it so readers never see a partial */
+    snprintf(tmppath, sizeof(tmppath), "%s.%d", path, (int)getpid());
+
+    if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        err = errno;
+        goto out;
+    }
+
+    size_t recbytes = (size_t)iw->iw_nrecords * ih.ih_recsize;
+
+    if ((write(fd, &ih, sizeof(ih)) != sizeof(ih)) ||
+        (write(fd, iw->iw_records, recbytes) != (ssize_t)recbytes) ||
+        (write(fd, iw->iw_strtab, iw->iw_strsize) != (ssize_t)iw->iw_strsize)) {
+        err = EIO;
+        goto out;
+    }
+
+    if (close(fd) != 0) {
+        fd = -1;
+        err = EIO;
+        goto out;
+    }
+
+    fd = -1;
+
+    if (rename(tmppath, path) != 0)
+        err = errno;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (err)
+        (void)unlink(tmppath);
+
+    free(iw->iw_records);
+    free(iw->iw_strtab);
+    memset(iw, 0, sizeof(*iw));
+
+    return err;
+}
+
+int
+ancientfs_index_open(struct ancientfs_index* ix, const char* path,
+                     int imagefd, const char* fstype, uint32_t flags)
+{
+    int err = 0;
+    int fd = -1;
+    void* map = MAP_FAILED;
+    struct stat stbuf, istbuf;
+
+    memset(ix, 0, sizeof(*ix));
+
+    if (fstat(imagefd, &stbuf) != 0)
+        return errno;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return errno;
+
+    if (fstat(fd, &istbuf) != 0) {
+        err = errno;
+        goto out;
+    }
+
+    size_t mapsize = (size_t)istbuf.st_size;
+    if (mapsize < sizeof(struct ancientfs_index_header)) {
+        err = EINVAL;
+        goto out;
+    }
+
+    map = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, (off_t)0);
+    if (map == MAP_FAILED) {
+        err = errno;
+        goto out;
+    }
+
+    struct ancientfs_index_header* ih = (struct ancientfs_index_header*)map;
+
+    if ((memcmp(ih->ih_magic, ANCIENTFS_INDEX_MAGIC,
+                sizeof(ih->ih_magic)) != 0) ||
+        (ih->ih_version != ANCIENTFS_INDEX_VERSION) ||
+        (ih->ih_recsize != sizeof(struct ancientfs_index_record)) ||
+        (strncmp(ih->ih_fstype, fstype, sizeof(ih->ih_fstype)) != 0) ||
+        (ih->ih_flags != flags)) {
+        err = EINVAL;
+        goto out;
+    }
+
+    if ((ih->ih_imagesize != (uint64_t)stbuf.st_size) ||
+        (ih->ih_imagemtime != (int64_t)stbuf.st_mtime)) {
+        err = ESTALE;
+        goto out;
+    }
+
+    uint64_t expected = sizeof(*ih) +
+        (uint64_t)ih->ih_nrecords * ih->ih_recsize + ih->ih_strtabsize;
+    if ((expected != (uint64_t)mapsize) || !ih->ih_nrecords) {
+        err = EINVAL;
+        goto out;
+    }
+
+    struct ancientfs_index_record* records =
+        (struct ancientfs_index_record*)((char*)map + sizeof(*ih));
+    const char* strtab = (const char*)&records[ih->ih_nrecords];
+    uint64_t strtabsize = ih->ih_strtabsize;
+
+    if (!strtabsize || strtab[strtabsize - 1] != '\0') {
+        err = EINVAL;
+        goto out;
+    }
+
+    /*
+     * Records must be dense and in inode number order, and parents must come
+     * before their children; that is how the archive scan creates them, and
+     * it is what lets the caller rebuild the tree in a single pass.
+     */
+    uint32_t i;
+    for (i = 0; i < ih->ih_nrecords; i++) {
+        struct ancientfs_index_record* ir = &records[i];
+        if ((ir->ir_ino != (uint64_t)i + 1) ||
+            ((i > 0) && ((ir->ir_parent  == 0) ||
+                         (ir->ir_parent >= ir->ir_ino))) ||
+            (ir->ir_name >= strtabsize) ||
+            ((ir->ir_linktarget != ANCIENTFS_INDEX_NONE) &&
+             (ir->ir_linktarget >= strtabsize))) {
+            err = EINVAL;
+            goto out;
+        }
+    }
+
+    ix->ix_map = map;
+    ix->ix_mapsize = mapsize;
+    ix->ix_records = records;
+    ix->ix_nrecords = ih->ih_nrecords;
+    ix->ix_strtab = strtab;
+    ix->ix_files = ih->ih_files;
+    ix->ix_directories = ih->ih_directories;
+
+out:
+    if (err && (map != MAP_FAILED))
+        munmap(map, mapsize);
+    close(fd);
+
+    return err;
+}
+
+void
+ancientfs_index_close(struct ancientfs_index* ix)
+{
+    if (ix->ix_map)
+        munmap(ix->ix_map, ix->ix_mapsize);
+    memset(ix, 0, sizeof(*ix));
+}
+
+const char*
+ancientfs_index_string(struct ancientfs_index* ix, uint32_t off)
+{
+    if (off == ANCIENTFS_INDEX_NONE)
+        return NULL;
+
+    return ix->ix_strtab + off;
+}
+
+void
+ancientfs_index_iload(struct ancientfs_index_record* ir, struct inode* ip)
+{
+    ip->I_mode  = (mode_t)ir->ir_mode;
+    ip->I_uid   = (uid_t)ir->ir_uid;
+    ip->I_gid   = (gid_t)ir->ir_gid;
+    ip->I_size  = (off_t)ir->ir_size;
+    ip->I_nlink = (nlink_t)ir->ir_nlink;
+    ip->I_rdev  = (dev_t)ir->ir_rdev;
+
+    ip->I_atime_sec = ip->I_mtime_sec = ip->I_ctime_sec =
+        (time_t)ir->ir_mtime;
+
+    ip->I_dataoff = (off_t)ir->ir_dataoff;
+}
@@ -6,6 +6,7 @@
 
 #include "unixfs.h"
 #include "ancientfs.h"
+#include "unixfs_internal.h"
 
 #include <errno.h>
 #include <stddef.h>
@@ -309,9 +310,10 @@ unixfs_usage(void)
 "AncientFS (%s): a MacFUSE file system to mount ancient Unix disks and tapes\n"
 "Amit Singh <http://osxbook.com>\n"
 "usage:\n"
-"      %s [--force] [--fsendian pdp|big|little] --dmg DMG --type TYPE MOUNTPOINT [MacFUSE args...]\n"
+"      %s [--force] [--cachesize SIZE] [--inodecache N] [--readahead SIZE] [--immutable] [--entry-timeout SECS] [--attr-timeout SECS] [--mmap] [--index PATH] [--fsendian pdp|big|little] --dmg DMG --type TYPE MOUNTPOINT [MacFUSE args...]\n"
 "where:\n"
 "     . DMG is an ancient Unix disk or tape image of a valid type\n"
+"       (possibly gzip compressed)\n"
 "     . TYPE is one of the following:\n\n",
 PROGVERS, PROGNAME);
 
@@ -324,7 +326,24 @@ PROGVERS, PROGNAME);
     fprintf(stderr, "\n");
 
     fprintf(stderr, "%s",
+    "     . --cachesize SIZE sets the per-device block cache size (k/m/g\n"
+    "       suffixes are allowed; 0 disables caching)\n"
+    "     . --inodecache N keeps up to N unused inodes cached (default 1024)\n"
+    "     . --readahead SIZE caps the readahead window for sequentially read\n"
+    "       files (default 1m; 0 disables readahead)\n"
+    "     . --immutable promises that the image won't change while mounted,\n"
+    "       letting the kernel cache names, attributes and file data for\n"
+    "       much longer\n"
+    "     . --entry-timeout SECS and --attr-timeout SECS set how long the\n"
+    "       kernel may cache names and attributes (default 60, or a year\n"
+    "       with --immutable)\n"
+    "     . --mmap maps the image into memory and reads it from there\n"
+    "       rather than through the block cache\n"
+    "     . --index PATH keeps an index of a tar or cpio archive in PATH so\n"
+    "       that later mounts of the same archive need not rescan it\n"
     "     . --force attempts mounting even if there are warnings or errors\n"
+    "     . MOUNTPOINT/.unixfs_stats reads out operation counts, latencies\n"
+    "       and cache hit rates; SIGUSR1 prints them on stderr\n"
     );
 }
 
@@ -346,17 +365,17 @@ unixfs_preflight(char* dmg, char** type, struct unixfs** unixfsp)
         goto out;
     }
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         fprintf(stderr, "failed to open %s\n", dmg);
         goto out;
     }
 
-    if (read(fd, buf, 512) != 512) {
-        close(fd);
+    if (unixfs_dev_read(fd, buf, 512) != 512) {
+        unixfs_dev_close(fd);
         fprintf(stderr, "failed to read data from %s\n", dmg);
     }
 
-    close(fd);
+    unixfs_dev_close(fd);
 
     if (!*type) {
 
@@ -55,8 +55,7 @@ struct ar_node_info
     struct inode* ar_self;
     uint8_t ar_name[DIRSIZ + 1];
     struct ar_node_info* ar_parent;
-    struct ar_node_info* ar_children;
-    struct ar_node_info* ar_next_sibling;
+    struct unixfs_dirindex ar_dirindex;
 };
 
 /* modes */
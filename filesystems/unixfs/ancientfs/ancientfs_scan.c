@@ -0,0 +1,117 @@
+/*
+ * Ancient UNIX File Systems for MacFUSE
+ * Amit Singh
+ * http://osxbook.com
+ */
+
+#include "ancientfs.h"
+#include "unixfs_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Archive formats are scanned front to back at mount time. The headers are
+ * small (a few hundred bytes at most), so reading them one read(2) at a time
+ * costs a system call per header plus one lseek(2) per skipped member. The
+ * scanner below keeps a window of the archive in memory and serves read/seek
+ * from it, going to the image only when the window runs out. Seeks just move
+ * the position; nothing is read until needed.
+ *
+ * Member data is what the scan skips, so the window must not read through
+ * it. A refill starts out reading just enough for a header. Only when the
+ * next header turns out to lie close past the window, the members in between
+ * being small, does the refill size double, up to the whole buffer. A skip
+ * over a larger member drops it back. An archive of large files thus costs a
+ * small read per header, and one of small files a few large reads.
+ */
+
+int
+ancientfs_scan_init(struct ancientfs_scan* as, int fd, size_t bufsize)
+{
+    memset(as, 0, sizeof(*as));
+
+    as->as_buf = malloc(bufsize);
+    if (!as->as_buf)
+        return ENOMEM;
+
+    as->as_fd = fd;
+    as->as_bufsize = bufsize;
+    as->as_readsize = min(bufsize, ANCIENTFS_SCAN_READSIZE);
+
+    return 0;
+}
+
+void
+ancientfs_scan_fini(struct ancientfs_scan* as)
+{
+    free(as->as_buf);
+    memset(as, 0, sizeof(*as));
+}
+
+ssize_t
+ancientfs_scan_read(struct ancientfs_scan* as, void* buf, size_t nbyte)
+{
+    char* p = (char*)buf;
+    size_t done = 0;
+
+    while (done < nbyte) {
+
+        if ((as->as_pos < as->as_bufoff) ||
+            (as->as_pos >= as->as_bufoff + (off_t)as->as_buflen)) {
+            /* refill the window at the current position */
+            off_t end = as->as_bufoff + (off_t)as->as_buflen;
+            if (as->as_buflen && (as->as_pos >= end) &&
+                (as->as_pos - end < ANCIENTFS_SCAN_READSIZE))
+                as->as_readsize = min(as->as_bufsize, 2 * as->as_readsize);
+            else
+                as->as_readsize = min(as->as_bufsize,
+                                      ANCIENTFS_SCAN_READSIZE);
+            ssize_t ret = unixfs_dev_pread(as->as_fd, as->as_buf,
+                                           as->as_readsize, as->as_pos);
+            if (ret < 0)
+                return (done) ? (ssize_t)done : -1;
+            as->as_bufoff = as->as_pos;
+            as->as_buflen = (size_t)ret;
+            if (!ret) /* end of archive */
+                break;
+        }
+
+        size_t inbuf = (size_t)(as->as_bufoff + as->as_buflen - as->as_pos);
+        size_t count = min(nbyte - done, inbuf);
+        memcpy(p + done, as->as_buf + (as->as_pos - as->as_bufoff), count);
+        as->as_pos += count;
+        done += count;
+    }
+
+    return (ssize_t)done;
+}
+
+off_t
+ancientfs_scan_seek(struct ancientfs_scan* as, off_t offset, int whence)
+{
+    off_t newpos;
+
+    switch (whence) {
+    case SEEK_SET:
+        newpos = offset;
+        break;
+    case SEEK_CUR:
+        newpos = as->as_pos + offset;
+        break;
+    default:
+        errno = EINVAL;
+        return (off_t)-1;
+    }
+
+    if (newpos < 0) {
+        errno = EINVAL;
+        return (off_t)-1;
+    }
+
+    as->as_pos = newpos;
+
+    return newpos;
+}
@@ -5,6 +5,8 @@
  */
 
 #include "ancientfs_tar.h"
+#define UNIXFS_HAVE_PMAP
+#define UNIXFS_HAVE_DIRINDEX
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -24,7 +26,7 @@ DECL_UNIXFS("UNIX V7 tar/ustar", tar);
 #define TAR_ATOI(from, to, len, base) { \
         memmove(buf, from, len); \
         buf[len] = '\0'; \
-        to = strtol(buf, (char **)NULL, base); \
+        to = strtoll(buf, (char **)NULL, base); \
 }
 
 struct tar_entry {
@@ -33,7 +35,8 @@ struct tar_entry {
     struct stat stat;
 };
 
-static int ancientfs_tar_readheader(int fd, struct tar_entry* te);
+static int ancientfs_tar_readheader(struct ancientfs_scan* as,
+                                    struct tar_entry* te);
 static int ancientfs_tar_chksum(union hblock* hb);
 
 int
@@ -52,9 +55,9 @@ ancientfs_tar_chksum(union hblock* hb)
 }
 
 static int
-ancientfs_tar_readheader(int fd, struct tar_entry* te)
+ancientfs_tar_readheader(struct ancientfs_scan* as, struct tar_entry* te)
 {
-    static int cksum_failed = 0;
+    struct filsys* fs = (struct filsys*)unixfs->s_fs_info;
     int  nr, ustar;
     char buf[20];
     char hb[sizeof(union hblock) + 1];
@@ -63,7 +66,7 @@ ancientfs_tar_readheader(int fd, struct tar_entry* te)
 retry:
 
     ustar = unixfs->s_flags & ANCIENTFS_USTAR;
-    nr = read(fd, hb, sizeof(union hblock));
+    nr = ancientfs_scan_read(as, hb, sizeof(union hblock));
     if (nr != sizeof(union hblock)) {
         if (!nr)
             return 1;
@@ -76,11 +79,11 @@ retry:
     long chksum = 0;
     TAR_ATOI(hdr->chksum, chksum, sizeof(hdr->chksum), OCTAL);
     if (chksum != ancientfs_tar_chksum((union hblock*)hb)) {
-        cksum_failed++;
-        if (!(cksum_failed % 10))
+        fs->s_cksumfailures++;
+        if (!(fs->s_cksumfailures % 10))
             fprintf(stderr,
-                    "*** warning: checksum failed (%d failures so far)\n",
-                    cksum_failed);
+                    "*** warning: checksum failed (%u failures so far)\n",
+                    fs->s_cksumfailures);
         goto retry;
     }
 
@@ -181,12 +184,88 @@ retry:
     return 0;
 }
 
+/* Rebuilds the in-core tree from a validated index instead of the tape. */
+static void
+ancientfs_tar_iload(struct filsys* fs)
+{
+    struct ancientfs_index* ix = &fs->s_index;
+    uint32_t i;
+
+    for (i = 0; i < ix->ix_nrecords; i++) {
+        struct ancientfs_index_record* ir = &ix->ix_records[i];
+        struct inode* ip = fs->s_rootip;
+        if (ir->ir_ino != ROOTINO) {
+            ip = unixfs_inodelayer_iget((ino_t)ir->ir_ino);
+            if (!ip) {
+                fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                        (unsigned long long)ir->ir_ino);
+                abort();
+            }
+        }
+
+        ancientfs_index_iload(ir, ip);
+
+        struct tar_node_info* ti = (struct tar_node_info*)ip->I_private;
+        ti->ti_self = ip;
+        ti->ti_name = (char*)ancientfs_index_string(ix, ir->ir_name);
+        ti->ti_linktargetname =
+            (char*)ancientfs_index_string(ix, ir->ir_linktarget);
+
+        if (ip == fs->s_rootip)
+            continue;
+
+        struct inode* parent_ip = unixfs_internal_iget((ino_t)ir->ir_parent);
+        ti->ti_parent = (struct tar_node_info*)(parent_ip->I_private);
+        if (unixfs_dirindex_add(&ti->ti_parent->ti_dirindex, ti->ti_name,
+                                strlen(ti->ti_name), ip->I_ino) != 0) {
+            fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+            abort();
+        }
+        unixfs_internal_iput(parent_ip);
+        unixfs_inodelayer_isucceeded(ip);
+        /* no put */
+    }
+
+    fs->s_files = ix->ix_files;
+    fs->s_directories = ix->ix_directories;
+    fs->s_lastino = ix->ix_nrecords;
+}
+
+static void
+ancientfs_tar_isave(struct filsys* fs, int fd)
+{
+    struct ancientfs_index_writer iw;
+    ino_t i;
+
+    memset(&iw, 0, sizeof(iw));
+
+    for (i = ROOTINO; i <= fs->s_lastino; i++) {
+        struct inode* ip = unixfs_internal_iget(i);
+        if (!ip) {
+            iw.iw_error = ENOENT;
+            break;
+        }
+        struct tar_node_info* ti = (struct tar_node_info*)ip->I_private;
+        ancientfs_index_add(&iw, ip,
+                            (ti->ti_parent) ? ti->ti_parent->ti_self->I_ino : 0,
+                            ti->ti_name, ti->ti_linktargetname);
+        unixfs_internal_iput(ip);
+    }
+
+    int err = ancientfs_index_write(&iw, unixfs_tunables.indexpath, fd,
+                                    unixfs_fstype, unixfs->s_flags,
+                                    fs->s_files, fs->s_directories);
+    if (err)
+        fprintf(stderr, "*** warning: cannot write index %s (error %d)\n",
+                unixfs_tunables.indexpath, err);
+}
+
 static void*
 unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -195,8 +274,11 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
+    struct ancientfs_scan as;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    memset(&as, 0, sizeof(as));
+
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -209,7 +291,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
     char hb[sizeof(union hblock) + 1];
 
-    if (read(fd, hb, sizeof(union hblock)) != sizeof(union hblock)) {
+    if (unixfs_dev_read(fd, hb, sizeof(union hblock)) != sizeof(union hblock)) {
         fprintf(stderr, "failed to read data from file\n");
         err = EIO;
         goto out;
@@ -225,7 +307,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         fprintf(stderr, "*** warning: not ustar; assuming ancient tar\n");
     }
 
-    sb = malloc(sizeof(struct super_block));
+    sb = calloc(1, sizeof(struct super_block));
     if (!sb) {
         err = ENOMEM;
         goto out;
@@ -250,6 +332,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    if ((err = unixfs_bcache_init(unixfs)) != 0)
+        goto out;
+
     /* must initialize the inode layer before sanity checking */
     if ((err = unixfs_inodelayer_init(sizeof(struct tar_node_info))) != 0)
         goto out;
@@ -269,8 +354,6 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct tar_node_info* rootti = (struct tar_node_info*)rootip->I_private;
     rootti->ti_self = rootip;
     rootti->ti_parent = NULL;
-    rootti->ti_children = NULL;
-    rootti->ti_next_sibling = NULL;
 
     unixfs_inodelayer_isucceeded(rootip);
 
@@ -280,7 +363,22 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     fs->s_rootip = rootip;
     fs->s_lastino = ROOTINO;
 
-    lseek(fd, (off_t)0, SEEK_SET); /* rewind tape */
+    if (unixfs_tunables.indexpath) {
+        err = ancientfs_index_open(&fs->s_index, unixfs_tunables.indexpath,
+                                   fd, unixfs_fstype, unixfs->s_flags);
+        if (!err) {
+            ancientfs_tar_iload(fs);
+            goto scanned;
+        }
+        if (err != ENOENT)
+            fprintf(stderr, "*** warning: ignoring %s index %s (error %d)\n",
+                    (err == ESTALE) ? "stale" : "unusable",
+                    unixfs_tunables.indexpath, err);
+    }
+
+    /* rewind tape */
+    if ((err = ancientfs_scan_init(&as, fd, ANCIENTFS_SCAN_BUFSIZE)) != 0)
+        goto out;
 
     struct tar_entry _te, *te = &_te;
 
@@ -288,7 +386,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
         off_t toseek = 0;
 
-        if ((err = ancientfs_tar_readheader(fd, te)) != 0) {
+        if ((err = ancientfs_tar_readheader(&as, te)) != 0) {
             if (err == 1)
                 break;
             else {
@@ -334,7 +432,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                 unixfs_inodelayer_iget((ino_t)(fs->s_lastino + 1));
             if (!ip) {
                 fprintf(stderr, "*** fatal error: no inode for %llu\n",
-                        (ino64_t)(fs->s_lastino + 1));
+                        (unsigned long long)(fs->s_lastino + 1));
                 abort();
             }
 
@@ -359,7 +457,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
             memcpy(ti->ti_name, cnp, namelen);
             ti->ti_name[namelen] = '\0';
 
-            ip->I_daddr[0] = 0;
+            ip->I_dataoff = 0;
 
             if (S_ISLNK(ip->I_mode)) {
                 namelen = strlen(te->linktargetname);
@@ -373,18 +471,21 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                 ti->ti_linktargetname[namelen] = '\0';
             } else if (S_ISREG(ip->I_mode)) {
 
-                ip->I_daddr[0] = (uint32_t)lseek(fd, (off_t)0, SEEK_CUR);
+                ip->I_dataoff = ancientfs_scan_seek(&as, (off_t)0, SEEK_CUR);
                 toseek = ip->I_size;
 
             }
              
             ti->ti_self = ip;
-            ti->ti_children = NULL;
             struct inode* parent_ip = unixfs_internal_iget(parent_ino);
             parent_ip->I_size += 1;
             ti->ti_parent = (struct tar_node_info*)(parent_ip->I_private);
-            ti->ti_next_sibling = ti->ti_parent->ti_children;
-            ti->ti_parent->ti_children = ti;
+            if (unixfs_dirindex_add(&ti->ti_parent->ti_dirindex,
+                                    (const char*)ti->ti_name,
+                                    strlen((const char*)ti->ti_name), ip->I_ino) != 0) {
+                fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+                abort();
+            }
 
             if (S_ISDIR(ip->I_mode)) {
                 fs->s_directories++;
@@ -404,11 +505,17 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         if (toseek) {
             toseek = (toseek + TBLOCK - 1)/TBLOCK;
             toseek *= TBLOCK;
-            (void)lseek(fd, (off_t)toseek, SEEK_CUR);
+            (void)ancientfs_scan_seek(&as, (off_t)toseek, SEEK_CUR);
         }
 
     } /* for each block */
 
+    ancientfs_scan_fini(&as);
+
+    if (unixfs_tunables.indexpath)
+        ancientfs_tar_isave(fs, fd);
+
+scanned:
     err = 0;
 
     unixfs->s_statvfs.f_bsize = TBLOCK;
@@ -433,12 +540,15 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
 out:
     if (err) {
+        ancientfs_scan_fini(&as);
         if (fd >= 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (fs)
             free(fs);
-        if (sb)
+        if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
+        }
         return NULL;
     }
 
@@ -456,9 +566,12 @@ unixfs_internal_fini(void* filsys)
         if (tmp) {
             struct tar_node_info* ti = (struct tar_node_info*)tmp->I_private;
             if (ti) {
-                free(ti->ti_name);
-                if (ti->ti_linktargetname)
-                    free(ti->ti_linktargetname);
+                unixfs_dirindex_clear(&ti->ti_dirindex);
+                if (!fs->s_index.ix_map) { /* else names live in the index */
+                    free(ti->ti_name);
+                    if (ti->ti_linktargetname)
+                        free(ti->ti_linktargetname);
+                }
             }
             unixfs_internal_iput(tmp);
             unixfs_internal_iput(tmp);
@@ -467,9 +580,12 @@ unixfs_internal_fini(void* filsys)
 
     unixfs_inodelayer_fini();
 
+    ancientfs_index_close(&fs->s_index);
+
     if (sb) {
+        unixfs_bcache_fini(sb);
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_dev_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -499,7 +615,8 @@ unixfs_internal_iget(ino_t ino)
 {
     struct inode* ip = unixfs_inodelayer_iget(ino);
     if (!ip) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -556,28 +673,12 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         goto out;
     }
 
-    struct tar_node_info* child =
-        ((struct tar_node_info*)dp->I_private)->ti_children;;
-
-    if (!child) {
+    struct tar_node_info* dnode = (struct tar_node_info*)dp->I_private;
+    ino_t ino = unixfs_dirindex_find(&dnode->ti_dirindex, name, namelen);
+    if (ino)
+        ret = unixfs_internal_igetattr(ino, stbuf);
+    else
         ret = ENOENT;
-        goto out;
-    }
-
-    int found = 0;
-
-    do {
-        size_t target_namelen = strlen((const char*)child->ti_name);
-        if ((namelen == target_namelen) &&
-            (memcmp(name, child->ti_name, target_namelen) == 0)) {
-            found = 1;
-            break;
-        }
-        child = child->ti_next_sibling;
-    } while (child);
-
-    if (found)
-        ret = unixfs_internal_igetattr((ino_t)child->ti_self->I_ino, stbuf);
 
 out:
     unixfs_internal_iput(dp);
@@ -610,18 +711,18 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         goto out;
     }
 
-    struct tar_node_info* child =
-        ((struct tar_node_info*)dp->I_private)->ti_children;;
+    struct unixfs_dirindex* di =
+        &((struct tar_node_info*)dp->I_private)->ti_dirindex;
 
-    off_t i;
+    off_t i = *offset - 2;
+    if (i >= di->di_count)
+        return -1;
 
-    for (i = 0; i < (*offset - 2); i++)
-        child = child->ti_next_sibling;
+    struct unixfs_dirindex_entry* de = &di->di_entries[i];
 
-    dent->ino = (ino_t)child->ti_self->I_ino;
-    size_t dirnamelen = strlen(child->ti_name);
-    dirnamelen = min(dirnamelen, UNIXFS_MAXNAMLEN);
-    memcpy(dent->name, child->ti_name, dirnamelen);
+    dent->ino = de->de_ino;
+    size_t dirnamelen = min(de->de_namelen, UNIXFS_MAXNAMLEN);
+    memcpy(dent->name, di->di_names + de->de_nameoff, dirnamelen);
     dent->name[dirnamelen] = '\0';
 
 out:
@@ -634,11 +735,17 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    off_t start = (off_t)ip->I_daddr[0];
+    off_t start = ip->I_dataoff;
 
     /* caller already checked for bounds */
 
-    return pread(unixfs->s_bdev, buf, nbyte, start + offset);
+    return unixfs_bcache_pread(unixfs, buf, nbyte, start + offset);
+}
+
+static const char*
+unixfs_internal_pmap(struct inode* ip, off_t offset, size_t nbyte)
+{
+    return unixfs_bcache_map(unixfs, ip->I_dataoff + offset, nbyte);
 }
 
 static int
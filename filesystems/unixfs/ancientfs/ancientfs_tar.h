@@ -22,7 +22,9 @@ struct filsys
     uint32_t s_directories;
     uint32_t s_lastino;
     uint32_t s_dataoffset;
+    uint32_t s_cksumfailures; /* headers skipped for bad checksums */
     struct inode* s_rootip;
+    struct ancientfs_index s_index; /* mapped by --index, if valid */
 };
 
 #define TMAGIC   "ustar" /* space terminated (pre POSIX) or null terminated */
@@ -65,8 +67,7 @@ union hblock {
 struct tar_node_info {
     struct   inode*         ti_self;
     struct   tar_node_info* ti_parent;
-    struct   tar_node_info* ti_children;
-    struct   tar_node_info* ti_next_sibling;
+    struct unixfs_dirindex ti_dirindex;
     char*                   ti_name;
     char*                   ti_linktargetname;
 };
@@ -27,7 +27,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -37,7 +37,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -48,7 +48,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    sb = malloc(sizeof(struct super_block));
+    sb = calloc(1, sizeof(struct super_block));
     if (!sb) {
         err = ENOMEM;
         goto out;
@@ -61,7 +61,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    if (pread(fd, fs, BSIZE, (off_t)(BSIZE * SUPERB)) != BSIZE) {
+    if (unixfs_dev_pread(fd, fs, BSIZE, (off_t)(BSIZE * SUPERB)) != BSIZE) {
         perror("pread");
         err = EIO;
         goto out;
@@ -74,6 +74,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    if ((err = unixfs_bcache_init(unixfs)) != 0)
+        goto out;
+
     fs->s_isize = fs16_to_host(unixfs->s_endian, fs->s_isize);
     fs->s_fsize = fs32_to_host(unixfs->s_endian, fs->s_fsize);
     fs->s_nfree = fs16_to_host(unixfs->s_endian, fs->s_nfree);
@@ -147,11 +150,13 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (fs)
             free(fs);
-        if (sb)
+        if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
+        }
         return NULL;
     }
 
@@ -164,8 +169,9 @@ unixfs_internal_fini(void* filsys)
     unixfs_inodelayer_fini();
     struct super_block* sb = (struct super_block*)filsys;
     if (sb) {
+        unixfs_bcache_fini(sb);
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_dev_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -211,7 +217,7 @@ nospace:
 }
 
 static off_t
-unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
+__unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
 {
     a_daddr_t bn = (a_daddr_t)lblkno;
 
@@ -293,12 +299,30 @@ unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
     return (off_t)nb;
 }
 
+static off_t
+unixfs_internal_bmap(struct inode* ip, off_t lblkno, int* error)
+{
+    off_t pblkno;
+
+    if (unixfs_extentmap_lookup(ip, lblkno, &pblkno, NULL) == 0) {
+        *error = 0;
+        return pblkno;
+    }
+
+    pblkno = __unixfs_internal_bmap(ip, lblkno, error);
+    if (*error == 0)
+        unixfs_extentmap_insert(ip, lblkno, pblkno);
+
+    return pblkno;
+}
+
 static int
 unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     if (blkno >= ((struct filsys*)unixfs->s_fs_info)->s_fsize) {
         fprintf(stderr,
-                "***fatal error: bread failed for block %llu\n", blkno);
+                "***fatal error: bread failed for block %llu\n",
+                (unsigned long long)blkno);
         abort();
         /* NOTREACHED */
     }
@@ -308,8 +332,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
         return 0;
     }
 
-    if (pread(unixfs->s_bdev, blkbuf, UNIXFS_IOSIZE(unixfs),
-              blkno * (off_t)BSIZE) != UNIXFS_IOSIZE(unixfs))
+    if (unixfs_bcache_bread(unixfs, blkno * (off_t)BSIZE, UNIXFS_IOSIZE(unixfs),
+                            blkbuf) != 0)
         return EIO;
 
     return 0;
@@ -323,7 +347,8 @@ unixfs_internal_iget(ino_t ino)
 
     struct inode* ip = unixfs_inodelayer_iget(ino);
     if (!ip) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -340,8 +365,6 @@ unixfs_internal_iget(ino_t ino)
     struct dinode* dip = (struct dinode*)ubuf;
     dip += itoo((a_ino_t)ino);
 
-    ip->I_number = ino;
-
     ip->I_mode  = fs16_to_host(unixfs->s_endian, dip->di_mode);
     ip->I_nlink = fs16_to_host(unixfs->s_endian, dip->di_nlink);
     ip->I_uid   = fs16_to_host(unixfs->s_endian, dip->di_uid);
@@ -518,11 +541,26 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
         off_t bn = unixfs_internal_bmap(ip, lbn, error);
         if (UNIXFS_BADBLOCK(bn, *error))
             break;
-        *error = unixfs_internal_bread(bn, blkbuf);
-        if (*error != 0)
-            break;
-        tomove = (remaining > iosize) ? iosize : remaining;
-        memcpy(p, blkbuf, tomove);
+        off_t run = (bn != 0) ?
+            unixfs_extentmap_run(ip, lbn, bn, remaining / iosize,
+                                 unixfs_internal_bmap) : 0;
+        if (run > 1) { /* physically contiguous whole blocks: one read */
+            tomove = run * iosize;
+            if (unixfs_bcache_pread(unixfs, p, tomove,
+                                    bn * (off_t)BSIZE) != (ssize_t)tomove) {
+                *error = EIO;
+                break;
+            }
+        } else {
+            /* whole blocks go straight into the caller's buffer */
+            char* dst = (remaining >= iosize) ? p : blkbuf;
+            *error = unixfs_internal_bread(bn, dst);
+            if (*error != 0)
+                break;
+            tomove = (remaining > iosize) ? iosize : remaining;
+            if (dst != p)
+                memcpy(p, blkbuf, tomove);
+        }
         remaining -= tomove;
         done += tomove;
         offset += tomove;
@@ -586,7 +624,7 @@ unixfs_internal_sanitycheck(void* filsys, off_t disksize)
 
     if (stbuf.st_size % (off_t)sizeof(struct dent)) {
         fprintf(stderr, "*** warning: root inode's size (%llu) is suspicious\n",
-                stbuf.st_size);
+                (unsigned long long)stbuf.st_size);
         return -1;
     }
 
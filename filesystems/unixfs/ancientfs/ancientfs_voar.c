@@ -5,6 +5,8 @@
  */
 
 #include "ancientfs_voar.h"
+#define UNIXFS_HAVE_PMAP
+#define UNIXFS_HAVE_DIRINDEX
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -25,7 +27,7 @@ ancientfs_ar_readheader(int fd, struct ar_hdr* ar)
 {
     ssize_t ret;
 
-    if ((ret = read(fd, ar, sizeof(struct ar_hdr)))
+    if ((ret = unixfs_dev_read(fd, ar, sizeof(struct ar_hdr)))
                     != sizeof(struct ar_hdr)) {
         if (ret == 0) /* EOF */
             return 1;
@@ -43,7 +45,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -53,7 +55,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     struct super_block* sb = (struct super_block*)0;
     struct filsys* fs = (struct filsys*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -65,7 +67,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     }
 
     uint16_t magic;
-    if (read(fd, &magic, sizeof(uint16_t)) != sizeof(uint16_t)) {
+    if (unixfs_dev_read(fd, &magic, sizeof(uint16_t)) != sizeof(uint16_t)) {
         err = EIO;
         fprintf(stderr, "failed to read magic from file\n");
         goto out;
@@ -79,7 +81,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         goto out;
     }
 
-    sb = malloc(sizeof(struct super_block));
+    sb = calloc(1, sizeof(struct super_block));
     if (!sb) {
         err = ENOMEM;
         goto out;
@@ -101,6 +103,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     unixfs->s_fs_info = (void*)fs;
     unixfs->s_bdev = fd;
 
+    if ((err = unixfs_bcache_init(unixfs)) != 0)
+        goto out;
+
     /* must initialize the inode layer before sanity checking */
     if ((err = unixfs_inodelayer_init(sizeof(struct ar_node_info))) != 0)
         goto out;
@@ -121,8 +126,6 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
     rootai->ar_self = rootip;
     rootai->ar_name[0] = '\0';
     rootai->ar_parent = NULL;
-    rootai->ar_children = NULL;
-    rootai->ar_next_sibling = NULL;
 
     unixfs_inodelayer_isucceeded(rootip);
 
@@ -150,7 +153,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
         struct inode* ip = unixfs_inodelayer_iget((ino_t)(fs->s_lastino + 1));
         if (!ip) {
             fprintf(stderr, "*** fatal error: no inode for %llu\n",
-                   (ino64_t)(fs->s_lastino + 1));
+                   (unsigned long long)(fs->s_lastino + 1));
             abort();
         }
         ip->I_mode  = ancientfs_ar_mode(ar.ar_mode, flags);
@@ -163,22 +166,25 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
         struct ar_node_info* ai = (struct ar_node_info*)ip->I_private;
 
-        ip->I_daddr[0] = (uint32_t)lseek(fd, (off_t)0, SEEK_CUR);
+        ip->I_dataoff = unixfs_dev_lseek(fd, (off_t)0, SEEK_CUR);
 
         memcpy(ai->ar_name, cnp, strlen(cnp));
 
         ai->ar_self = ip;
-        ai->ar_children = NULL;
         struct inode* parent_ip = unixfs_internal_iget(parent_ino);
         parent_ip->I_size += 1;
         ai->ar_parent = (struct ar_node_info*)(parent_ip->I_private);
-        ai->ar_next_sibling = ai->ar_parent->ar_children;
-        ai->ar_parent->ar_children = ai;
+        if (unixfs_dirindex_add(&ai->ar_parent->ar_dirindex,
+                                (const char*)ai->ar_name,
+                                strlen((const char*)ai->ar_name), ip->I_ino) != 0) {
+            fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+            abort();
+        }
         if (S_ISDIR(ip->I_mode)) {
             fs->s_directories++;
             parent_ino = fs->s_lastino + 1;
             ip->I_size = 2;
-            ip->I_daddr[0] = 0;
+            ip->I_dataoff = 0;
         } else {
             fs->s_files++;
             fs->s_lastino++;
@@ -189,7 +195,8 @@ unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
 
         fs->s_lastino++;
 next:
-        (void)lseek(fd, (off_t)(ar.ar_size + (ar.ar_size & 1)), SEEK_CUR);
+        (void)unixfs_dev_lseek(fd, (off_t)(ar.ar_size + (ar.ar_size & 1)),
+                               SEEK_CUR);
     }
 
     unixfs->s_statvfs.f_bsize = BSIZE;
@@ -214,11 +221,13 @@ next:
 out:
     if (err) {
         if (fd >= 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (fs)
             free(fs);
-        if (sb)
+        if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
+        }
         return NULL;
     }
 
@@ -234,6 +243,9 @@ unixfs_internal_fini(void* filsys)
     for (; i >= ROOTINO; i--) {
         struct inode* tmp = unixfs_internal_iget(i);
         if (tmp) {
+            struct ar_node_info* ai = (struct ar_node_info*)tmp->I_private;
+            if (ai)
+                unixfs_dirindex_clear(&ai->ar_dirindex);
             unixfs_internal_iput(tmp);
             unixfs_internal_iput(tmp);
         }
@@ -242,8 +254,9 @@ unixfs_internal_fini(void* filsys)
     unixfs_inodelayer_fini();
 
     if (sb) {
+        unixfs_bcache_fini(sb);
         if (sb->s_bdev >= 0)
-            close(sb->s_bdev);
+            unixfs_dev_close(sb->s_bdev);
         sb->s_bdev = -1;
         if (sb->s_fs_info)
             free(sb->s_fs_info);
@@ -273,7 +286,8 @@ unixfs_internal_iget(ino_t ino)
 {
     struct inode* ip = unixfs_inodelayer_iget(ino);
     if (!ip) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", (ino64_t)ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -330,28 +344,12 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         goto out;
     }
 
-    struct ar_node_info* child =
-        ((struct ar_node_info*)dp->I_private)->ar_children;;
-
-    if (!child) {
+    struct ar_node_info* dnode = (struct ar_node_info*)dp->I_private;
+    ino_t ino = unixfs_dirindex_find(&dnode->ar_dirindex, name, namelen);
+    if (ino)
+        ret = unixfs_internal_igetattr(ino, stbuf);
+    else
         ret = ENOENT;
-        goto out;
-    }
-
-    int found = 0;
-
-    do {
-        size_t target_namelen = strlen((const char*)child->ar_name);
-        if ((namelen == target_namelen) &&
-            (memcmp(name, child->ar_name, target_namelen) == 0)) {
-            found = 1;
-            break;
-        }
-        child = child->ar_next_sibling;
-    } while (child);
-
-    if (found)
-        ret = unixfs_internal_igetattr((ino_t)child->ar_self->I_ino, stbuf);
 
 out:
     unixfs_internal_iput(dp);
@@ -384,17 +382,18 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
         goto out;
     }
 
-    struct ar_node_info* child =
-        ((struct ar_node_info*)dp->I_private)->ar_children;;
+    struct unixfs_dirindex* di =
+        &((struct ar_node_info*)dp->I_private)->ar_dirindex;
 
-    off_t i;
+    off_t i = *offset - 2;
+    if (i >= di->di_count)
+        return -1;
 
-    for (i = 0; i < (*offset - 2); i++)
-        child = child->ar_next_sibling;
+    struct unixfs_dirindex_entry* de = &di->di_entries[i];
 
-    dent->ino = (ino_t)child->ar_self->I_ino;
-    size_t dirnamelen = min(DIRSIZ, UNIXFS_MAXNAMLEN);
-    memcpy(dent->name, child->ar_name, dirnamelen);
+    dent->ino = de->de_ino;
+    size_t dirnamelen = min(de->de_namelen, UNIXFS_MAXNAMLEN);
+    memcpy(dent->name, di->di_names + de->de_nameoff, dirnamelen);
     dent->name[dirnamelen] = '\0';
 
 out:
@@ -407,11 +406,17 @@ static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    off_t start = (off_t)ip->I_daddr[0];
+    off_t start = ip->I_dataoff;
 
     /* caller already checked for bounds */
 
-    return pread(unixfs->s_bdev, buf, nbyte, start + offset);
+    return unixfs_bcache_pread(unixfs, buf, nbyte, start + offset);
+}
+
+static const char*
+unixfs_internal_pmap(struct inode* ip, off_t offset, size_t nbyte)
+{
+    return unixfs_bcache_map(unixfs, ip->I_dataoff + offset, nbyte);
 }
 
 static int
@@ -0,0 +1,45 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * The subset of <libkern/OSByteOrder.h> that UnixFS uses, on top of glibc's
+ * <endian.h>. Not <asm/byteorder.h>: the kernel headers behind that define
+ * __u32 and friends, which clash with the ones in common/linux/linux.h.
+ */
+
+#ifndef _DARWIN_OSBYTEORDER_H_
+#define _DARWIN_OSBYTEORDER_H_
+
+#include <endian.h>
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define __BIG_ENDIAN__ 1
+#elif __BYTE_ORDER == __LITTLE_ENDIAN
+#define __LITTLE_ENDIAN__ 1
+#else
+#error Endian Problem
+#endif
+
+#define OSSwapLittleToHostInt64(x) le64toh(x)
+#define OSSwapBigToHostInt64(x)    be64toh(x)
+#define OSSwapHostToLittleInt64(x) htole64(x)
+#define OSSwapHostToBigInt64(x)    htobe64(x)
+
+#define OSSwapLittleToHostInt32(x) le32toh(x)
+#define OSSwapBigToHostInt32(x)    be32toh(x)
+#define OSSwapHostToLittleInt32(x) htole32(x)
+#define OSSwapHostToBigInt32(x)    htobe32(x)
+
+#define OSSwapLittleToHostInt16(x) le16toh(x)
+#define OSSwapBigToHostInt16(x)    be16toh(x)
+#define OSSwapHostToLittleInt16(x) htole16(x)
+#define OSSwapHostToBigInt16(x)    htobe16(x)
+
+#endif /* _DARWIN_OSBYTEORDER_H_ */
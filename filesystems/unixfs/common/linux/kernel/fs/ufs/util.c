@@ -257,7 +257,7 @@ struct page *ufs_get_locked_page(struct address_space *mapping,
 		if (IS_ERR(page)) {
 			printk(KERN_ERR "ufs_change_blocknr: "
 			       "read_mapping_page error: ino %llu, index: %lu\n",
-			       mapping->host->i_ino, index);
+			       (unsigned long long)mapping->host->i_ino, index);
 			goto out;
 		}
 
@@ -277,7 +277,7 @@ struct page *ufs_get_locked_page(struct address_space *mapping,
 
 			printk(KERN_ERR "ufs_change_blocknr: "
 			       "can not read page: ino %llu, index: %lu\n",
-			       mapping->host->i_ino, index);
+			       (unsigned long long)mapping->host->i_ino, index);
 
 			page = ERR_PTR(-EIO);
 		}
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -9,11 +10,8 @@
 int
 sb_bread_intobh(struct super_block* sb, off_t block, struct buffer_head* bh)
 {
-    if (pread(sb->s_bdev, bh->b_data, sb->s_blocksize,
-              block * (off_t)sb->s_blocksize) != sb->s_blocksize)
-        return EIO;
-
-    return 0;
+    return unixfs_bcache_bread(sb, block * (off_t)sb->s_blocksize,
+                               sb->s_blocksize, (char*)bh->b_data);
 }
 
 void
@@ -45,5 +43,26 @@ sb_bread(struct super_block* sb, off_t block)
         brelse(bh);
         return NULL;
     }
+    if (bh) /* what was read, as in Linux; the rest of b_data is unused */
+        bh->b_size = sb->s_blocksize;
     return bh;
 }
+
+/*
+ * Reads nblocks physically contiguous blocks, starting at block, straight
+ * into buf with one read. A lone block goes through the buffer cache.
+ */
+int
+sb_bread_run(struct super_block* sb, off_t block, size_t nblocks, char* buf)
+{
+    off_t offset = block * (off_t)sb->s_blocksize;
+    size_t size = nblocks * sb->s_blocksize;
+
+    if (nblocks == 1)
+        return unixfs_bcache_bread(sb, offset, size, buf);
+
+    if (unixfs_bcache_pread(sb, buf, size, offset) != (ssize_t)size)
+        return EIO;
+
+    return 0;
+}
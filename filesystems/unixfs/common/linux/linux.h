@@ -1,7 +1,7 @@
 #ifndef _LINUX_TYPES_H_
 #define _LINUX_TYPES_H_
 
-#if defined(__APPLE__)
+#if defined(__APPLE__) || defined(__linux__)
 
 #include <errno.h>
 #include <sys/types.h>
@@ -12,7 +12,11 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <time.h>
+#if defined(__APPLE__)
 #include <libkern/OSByteOrder.h>
+#else
+#include <darwin/OSByteOrder.h>
+#endif
 
 #define __force
 #define __bitwise
@@ -239,6 +243,8 @@ struct buffer_head {
 int sb_bread_intobh(struct super_block* sb, off_t block,
                     struct buffer_head* bh);
 struct buffer_head* sb_bread(struct super_block* sb, off_t block);
+int sb_bread_run(struct super_block* sb, off_t block, size_t nblocks,
+                 char* buf);
 struct buffer_head* sb_getblk(struct super_block* sb, sector_t block);
 void brelse(struct buffer_head* bh);
 #define bforget brelse
@@ -418,6 +424,7 @@ found_middle:
     return result + ffz(tmp);
 }
 
+#if defined(__i386__)
 #define do_div(n, base)                     \
 ({                                  \
     unsigned long __upper, __low, __high, __mod, __base;    \
@@ -433,6 +440,15 @@ found_middle:
     asm("":"=A" (n) : "a" (__low), "d" (__high));       \
     __mod;                          \
 })
+#else
+#define do_div(n, base)                     \
+({                                  \
+    uint32_t __base = (base);                   \
+    uint32_t __rem = (uint32_t)((uint64_t)(n) % __base);    \
+    (n) = (uint64_t)(n) / __base;                   \
+    __rem;                          \
+})
+#endif
 
 /****** endian stuff ******/
 
@@ -558,6 +574,6 @@ static inline unsigned sysv_minor(u32 dev)
     return dev & 0x3ffff;
 }
 
-#endif /* __APPLE__ */
+#endif /* __APPLE__ || __linux__ */
 
 #endif /* _LINUX_TYPES_H_ */
@@ -11,6 +11,9 @@
 #include "unixfs.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,165 +21,680 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <dlfcn.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include <fuse/fuse_opt.h>
 #include <fuse/fuse_lowlevel.h>
 
-#define UNIXFS_META_TIMEOUT 60.0 /* timeout for nodes and their attributes */
+/*
+ * Everything below reaches the file system instance through the session's
+ * userdata rather than a global, so requests can be served by any number of
+ * loop threads. Whether they may be is up to the backend (unixfs->threadsafe).
+ */
+
+/*
+ * Statistics.
+ *
+ * Every request handler below counts its calls and errors and files its
+ * latency into a histogram of power-of-two microsecond buckets. Together
+ * with the hit rates of the buffer and inode caches and the directory index
+ * counts, these can be read from a virtual file, /.unixfs_stats, that every
+ * mount has; it is found by name but not listed, and it hides a real file of
+ * that name in the root directory. SIGUSR1 prints the same report on stderr.
+ */
+
+#define UNIXFS_STATS_NAME     ".unixfs_stats"
+#define UNIXFS_STATS_INO      ((fuse_ino_t)0xfffffffeUL) /* not on any disk */
+#define UNIXFS_STATS_NBUCKETS 24 /* <1us, [1, 2)us, ... [2^21, 2^22)us, more */
+
+enum {
+    UNIXFS_OP_LOOKUP,
+    UNIXFS_OP_GETATTR,
+    UNIXFS_OP_READLINK,
+    UNIXFS_OP_OPENDIR,
+    UNIXFS_OP_READDIR,
+    UNIXFS_OP_OPEN,
+    UNIXFS_OP_READ,
+    UNIXFS_OP_STATFS,
+    UNIXFS_OP_MAX
+};
+
+static const char* unixfs_stats_opnames[UNIXFS_OP_MAX] = {
+    "lookup", "getattr", "readlink", "opendir", "readdir", "open", "read",
+    "statfs",
+};
+
+static struct unixfs_opstats {
+    pthread_mutex_t lock;
+    uint64_t        count;
+    uint64_t        errors;
+    uint64_t        nsec;   /* total latency */
+    uint64_t        nbytes; /* returned; readdir and read only */
+    uint64_t        hist[UNIXFS_STATS_NBUCKETS];
+} unixfs_opstats[UNIXFS_OP_MAX];
+
+static uint64_t unixfs_stats_start;
+
+static uint64_t
+unixfs_stats_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+    struct timeval tv;
+    (void)gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+static void
+unixfs_stats_init(void)
+{
+    int op;
+    for (op = 0; op < UNIXFS_OP_MAX; op++)
+        (void)pthread_mutex_init(&unixfs_opstats[op].lock,
+                                 (const pthread_mutexattr_t*)0);
+    unixfs_stats_start = unixfs_stats_now();
+}
+
+/* Accounts for one request of the given kind that started at t0. */
+static void
+unixfs_stats_note(int op, uint64_t t0, int error, size_t nbytes)
+{
+    uint64_t nsec = unixfs_stats_now() - t0;
+    uint64_t usec = nsec / 1000;
+    int b = 0;
+
+    while (usec && (b < UNIXFS_STATS_NBUCKETS - 1)) {
+        usec >>= 1;
+        b++;
+    }
+
+    struct unixfs_opstats* os = &unixfs_opstats[op];
+
+    pthread_mutex_lock(&os->lock);
+    os->count++;
+    if (error)
+        os->errors++;
+    os->nsec += nsec;
+    os->nbytes += nbytes;
+    os->hist[b]++;
+    pthread_mutex_unlock(&os->lock);
+}
+
+struct unixfs_statsbuf {
+    char*  p;
+    size_t size;
+    size_t capacity;
+};
 
-static struct unixfs* unixfs = (struct unixfs*)0;
+static void
+unixfs_stats_printf(struct unixfs_statsbuf* sb, const char* fmt, ...)
+{
+    va_list ap;
+
+    for (;;) {
+        size_t room = sb->capacity - sb->size;
+        va_start(ap, fmt);
+        int n = vsnprintf(sb->p + sb->size, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < room) {
+            sb->size += n;
+            return;
+        }
+        size_t capacity = sb->capacity ? 2 * sb->capacity : 4096;
+        while (capacity - sb->size <= (size_t)n)
+            capacity *= 2;
+        char* newp = realloc(sb->p, capacity);
+        if (!newp) {
+            fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+            abort();
+        }
+        sb->p = newp;
+        sb->capacity = capacity;
+    }
+}
+
+static void
+unixfs_stats_ratio(struct unixfs_statsbuf* sb, const char* what,
+                   uint64_t hits, uint64_t misses)
+{
+    uint64_t total = hits + misses;
+    unixfs_stats_printf(sb, "%-14s %12llu hits %12llu misses %6.1f%%\n",
+                        what, (unsigned long long)hits,
+                        (unsigned long long)misses,
+                        total ? 100.0 * (double)hits / (double)total : 0.0);
+}
+
+/* Renders the report into a malloc()ed buffer the caller frees. */
+static char*
+unixfs_stats_report(struct unixfs* unixfs, size_t* sizep)
+{
+    struct unixfs_statsbuf sb = { NULL, 0, 0 };
+    uint64_t hits, misses, builds, lookups;
+    int op, b;
+
+    unixfs_stats_printf(&sb, "%s %s, up %.1f s\n",
+                        unixfs->fsname ? unixfs->fsname : "unixfs",
+                        unixfs->volname ? unixfs->volname : "",
+                        (double)(unixfs_stats_now() - unixfs_stats_start) /
+                        1e9);
+    unixfs_stats_printf(&sb, "\n%-10s %12s %8s %10s %14s %s\n", "op",
+                        "count", "errors", "avg us", "bytes",
+                        "latency histogram (us: count)");
+
+    for (op = 0; op < UNIXFS_OP_MAX; op++) {
+        struct unixfs_opstats os;
+
+        pthread_mutex_lock(&unixfs_opstats[op].lock);
+        os = unixfs_opstats[op];
+        pthread_mutex_unlock(&unixfs_opstats[op].lock);
+
+        unixfs_stats_printf(&sb, "%-10s %12llu %8llu %10.1f %14llu",
+                            unixfs_stats_opnames[op],
+                            (unsigned long long)os.count,
+                            (unsigned long long)os.errors,
+                            os.count ? (double)os.nsec / os.count / 1e3 : 0.0,
+                            (unsigned long long)os.nbytes);
+        for (b = 0; b < UNIXFS_STATS_NBUCKETS; b++) {
+            if (!os.hist[b])
+                continue;
+            if (b == 0)
+                unixfs_stats_printf(&sb, " <1:%llu",
+                                    (unsigned long long)os.hist[b]);
+            else
+                unixfs_stats_printf(&sb, " %s%llu:%llu",
+                                    (b == UNIXFS_STATS_NBUCKETS - 1) ?
+                                    ">=" : "", 1ULL << (b - 1),
+                                    (unsigned long long)os.hist[b]);
+        }
+        unixfs_stats_printf(&sb, "\n");
+    }
+
+    unixfs_stats_printf(&sb, "\n");
+    unixfs_bcache_stats(&hits, &misses);
+    unixfs_stats_ratio(&sb, "buffer cache", hits, misses);
+    unixfs_inodelayer_stats(&hits, &misses);
+    unixfs_stats_ratio(&sb, "inode cache", hits, misses);
+    unixfs_dirindex_stats(&builds, &lookups);
+    unixfs_stats_printf(&sb, "%-14s %12llu builds %10llu lookups\n",
+                        "dir index", (unsigned long long)builds,
+                        (unsigned long long)lookups);
+    unixfs_stats_printf(&sb, "%-14s %12llu bytes\n", "image reads",
+                        (unsigned long long)unixfs_dev_bytesread());
+
+    *sizep = sb.size;
+
+    return sb.p;
+}
+
+static struct stat*
+unixfs_stats_stat(struct stat* stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = UNIXFS_STATS_INO;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    return stbuf;
+}
+
+/*
+ * SIGUSR1 is blocked in every thread and taken synchronously by one of its
+ * own, so that the report isn't written from a signal handler.
+ */
+static void*
+unixfs_stats_sigthread(void* arg)
+{
+    struct unixfs* unixfs = (struct unixfs*)arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    for (;;) {
+        if (sigwait(&set, &sig) != 0 || sig != SIGUSR1)
+            continue;
+        size_t size;
+        char* report = unixfs_stats_report(unixfs, &size);
+        if (report) {
+            fwrite(report, 1, size, stderr);
+            fflush(stderr);
+            free(report);
+        }
+    }
+
+    return NULL;
+}
+
+/* Must run before any other thread is started so that they all inherit. */
+static int
+unixfs_stats_sigstart(struct unixfs* unixfs)
+{
+    sigset_t set;
+    pthread_t thread;
+    int error;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if ((error = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
+        return error;
+
+    if ((error = pthread_create(&thread, (const pthread_attr_t*)0,
+                                unixfs_stats_sigthread, unixfs)) != 0) {
+        (void)pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+        return error;
+    }
+
+    (void)pthread_detach(thread);
+
+    return 0;
+}
 
 static void
 unixfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
 {
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    uint64_t t0 = unixfs_stats_now();
     struct statvfs sv;
     unixfs->ops->statvfs(&sv);
     fuse_reply_statfs(req, &sv);
+    unixfs_stats_note(UNIXFS_OP_STATFS, t0, 0, 0);
 }
 
-/* no unixfs_ll_init() since we do initialization before mounting */
+/*
+ * The file system itself is initialized before mounting. Only threads are
+ * started here: this runs after fuse_daemonize(), which would lose them.
+ * Readahead threads call into the file system alongside the request loop,
+ * so a backend that isn't thread safe goes without.
+ */
+static void
+unixfs_ll_init(void* data, struct fuse_conn_info* conn)
+{
+    struct unixfs* unixfs = (struct unixfs*)data;
+    if (unixfs->threadsafe)
+        (void)unixfs_readahead_start(unixfs->ops->pbread);
+}
 
 static void
 unixfs_ll_destroy(void* data)
 {
+    struct unixfs* unixfs = (struct unixfs*)data;
+    unixfs_readahead_stop();
     unixfs->ops->fini(unixfs->filsys);
 }
 
 static void
 unixfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    uint64_t t0 = unixfs_stats_now();
     struct fuse_entry_param e;
     memset(&e, 0, sizeof(e));
 
+    if ((parent == FUSE_ROOT_ID) && !strcmp(name, UNIXFS_STATS_NAME)) {
+        e.ino = UNIXFS_STATS_INO;
+        (void)unixfs_stats_stat(&e.attr);
+        fuse_reply_entry(req, &e); /* no caching: the size is made up */
+        unixfs_stats_note(UNIXFS_OP_LOOKUP, t0, 0, 0);
+        return;
+    }
+
     int error = unixfs->ops->namei(parent, name, &(e.attr));
+    if (error == ENOENT && unixfs_tunables.immutable) {
+        /* the name can't appear later, so let the kernel remember that */
+        e.ino = 0;
+        e.entry_timeout = unixfs_tunables.entrytimeout;
+        fuse_reply_entry(req, &e);
+        unixfs_stats_note(UNIXFS_OP_LOOKUP, t0, error, 0);
+        return;
+    }
+
     if (error) {
         fuse_reply_err(req, error);
+        unixfs_stats_note(UNIXFS_OP_LOOKUP, t0, error, 0);
         return;
     }
 
     e.ino = e.attr.st_ino;
-    e.attr_timeout = e.entry_timeout = UNIXFS_META_TIMEOUT;
+    e.attr_timeout = unixfs_tunables.attrtimeout;
+    e.entry_timeout = unixfs_tunables.entrytimeout;
 
     fuse_reply_entry(req, &e);
+    unixfs_stats_note(UNIXFS_OP_LOOKUP, t0, 0, 0);
 }
 
 static
 void unixfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
                        struct fuse_file_info* fi)
 {
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    uint64_t t0 = unixfs_stats_now();
     struct stat stbuf;
-    int error = unixfs->ops->igetattr(ino, &stbuf);
-    if (!error)
-        fuse_reply_attr(req, &stbuf, UNIXFS_META_TIMEOUT);
+    int error = 0;
+    if (ino == UNIXFS_STATS_INO)
+        fuse_reply_attr(req, unixfs_stats_stat(&stbuf), 0.0);
+    else if (!(error = unixfs->ops->igetattr(ino, &stbuf)))
+        fuse_reply_attr(req, &stbuf, unixfs_tunables.attrtimeout);
     else
         fuse_reply_err(req, error);
+    unixfs_stats_note(UNIXFS_OP_GETATTR, t0, error, 0);
 }
 
 static void
 unixfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
 {
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    uint64_t t0 = unixfs_stats_now();
     int ret = ENOSYS;
 
     char path[UNIXFS_MAXPATHLEN];
 
     if ((ret = unixfs->ops->readlink(ino, path)) != 0)
         fuse_reply_err(req, ret);
+    else
+        fuse_reply_readlink(req, path);
 
-    fuse_reply_readlink(req, path);
+    unixfs_stats_note(UNIXFS_OP_READLINK, t0, ret, 0);
 }
 
-static void
-unixfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                  struct fuse_file_info* fi)
-{
-    (void)fi;
+struct unixfs_dirhandle {
+    char*  p;
+    size_t size;
+};
 
+/* Enumerates an entire directory into a fuse_add_direntry() reply buffer. */
+static int
+unixfs_ll_dirfill(fuse_req_t req, fuse_ino_t ino, struct unixfs_dirhandle* b)
+{
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
     struct inode* dp = unixfs->ops->iget(ino);
-    if (!dp) {
-        fuse_reply_err(req, ENOENT);
-        return;
-    }
+    if (!dp)
+        return ENOENT;
 
     struct stat stbuf;
     unixfs->ops->istat(dp, &stbuf);
 
     if (!S_ISDIR(stbuf.st_mode)) {
         unixfs->ops->iput(dp);
-        fuse_reply_err(req, ENOTDIR);
-        return;
+        return ENOTDIR;
     }
 
     off_t offset = 0;
-    struct unixfs_direntry dent;
 
-    struct replybuf {
-        char*  p;
-        size_t size;
-    } b;
+    memset(b, 0, sizeof(*b));
 
-    memset(&b, 0, sizeof(b));
+    /*
+     * Collect the entries first so that the file system can fetch all their
+     * attributes in one go, in whatever order suits its disk layout.
+     */
+
+    size_t count = 0, capacity = 0;
+    ino_t* inos = NULL;
+    char* names = NULL;
+    size_t namesize = 0, namecapacity = 0;
+    size_t* nameoffs = NULL;
 
     struct unixfs_dirbuf dirbuf;
+    struct unixfs_direntry* dents =
+        malloc(UNIXFS_DIRBATCH * sizeof(struct unixfs_direntry));
+    ssize_t n, j;
 
-    while (unixfs->ops->nextdirentry(dp, &dirbuf, &offset, &dent) == 0) {
+    if (!dents) {
+        fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+        abort();
+    }
 
-        if (dent.ino == 0)
-            continue;
+    memset(&dirbuf, 0, sizeof(dirbuf));
+
+    while ((n = unixfs_readdir(unixfs->ops, dp, &dirbuf, &offset, dents,
+                               UNIXFS_DIRBATCH)) > 0) {
+
+        for (j = 0; j < n; j++) {
 
-        if (unixfs->ops->igetattr(dent.ino, &stbuf) != 0)
+            size_t namelen = strlen(dents[j].name) + 1;
+
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                inos = realloc(inos, capacity * sizeof(ino_t));
+                nameoffs = realloc(nameoffs, capacity * sizeof(size_t));
+            }
+            if (namesize + namelen > namecapacity) {
+                while (namesize + namelen > namecapacity)
+                    namecapacity = namecapacity ? 2 * namecapacity : 4096;
+                names = realloc(names, namecapacity);
+            }
+            if (!inos || !nameoffs || !names) {
+                fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+                abort();
+            }
+
+            inos[count] = dents[j].ino;
+            nameoffs[count] = namesize;
+            memcpy(names + namesize, dents[j].name, namelen);
+            namesize += namelen;
+            count++;
+        }
+    }
+
+    free(dents);
+
+    if (n < 0) {
+        free(nameoffs);
+        free(names);
+        free(inos);
+        unixfs->ops->iput(dp);
+        return EIO;
+    }
+
+    struct stat* stbufs = calloc(count ? count : 1, sizeof(struct stat));
+    int* errors = calloc(count ? count : 1, sizeof(int));
+    if (!stbufs || !errors) {
+        fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+        abort();
+    }
+
+    size_t i;
+
+    if (unixfs->ops->igetattr_many)
+        unixfs->ops->igetattr_many(inos, stbufs, errors, count);
+    else {
+        for (i = 0; i < count; i++)
+            errors[i] = unixfs->ops->igetattr(inos[i], &stbufs[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+
+        if (errors[i] != 0)
             continue;
 
-        size_t oldsize = b.size;
-        b.size += fuse_add_direntry(req, NULL, 0, dent.name, NULL, 0);
-        char* newp = (char *)realloc(b.p, b.size);
+        const char* name = names + nameoffs[i];
+
+        size_t oldsize = b->size;
+        b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+        char* newp = (char *)realloc(b->p, b->size);
         if (!newp) {
             fprintf(stderr, "*** fatal error: cannot allocate memory\n");
             abort();
         }
-        b.p = newp;
-        fuse_add_direntry(req, b.p + oldsize, b.size - oldsize, dent.name,
-                          &stbuf, b.size);
+        b->p = newp;
+        fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name,
+                          &stbufs[i], b->size);
     }
 
+    free(errors);
+    free(stbufs);
+    free(nameoffs);
+    free(names);
+    free(inos);
+
     unixfs->ops->iput(dp);
 
-    if (off < b.size)
-        fuse_reply_buf(req, b.p + off, min(b.size - off, size));
-    else
+    return 0;
+}
+
+static void
+unixfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    uint64_t t0 = unixfs_stats_now();
+    struct unixfs_dirhandle* b = malloc(sizeof(struct unixfs_dirhandle));
+    if (!b) {
+        fuse_reply_err(req, ENOMEM);
+        unixfs_stats_note(UNIXFS_OP_OPENDIR, t0, ENOMEM, 0);
+        return;
+    }
+
+    int error = unixfs_ll_dirfill(req, ino, b);
+    if (error) {
+        free(b);
+        fuse_reply_err(req, error);
+        unixfs_stats_note(UNIXFS_OP_OPENDIR, t0, error, 0);
+        return;
+    }
+
+    fi->fh = (uint64_t)(long)b;
+    fuse_reply_open(req, fi);
+    unixfs_stats_note(UNIXFS_OP_OPENDIR, t0, 0, 0);
+}
+
+static void
+unixfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    struct unixfs_dirhandle* b = (struct unixfs_dirhandle*)(long)(fi->fh);
+    if (b) {
+        free(b->p);
+        free(b);
+    }
+
+    fi->fh = 0;
+
+    fuse_reply_err(req, 0);
+}
+
+static void
+unixfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info* fi)
+{
+    uint64_t t0 = unixfs_stats_now();
+    struct unixfs_dirhandle* b = (struct unixfs_dirhandle*)(long)(fi->fh);
+    struct unixfs_dirhandle tmp;
+    size_t nbytes = 0;
+
+    if (!b) { /* no handle from opendir; enumerate just for this call */
+        int error = unixfs_ll_dirfill(req, ino, &tmp);
+        if (error) {
+            fuse_reply_err(req, error);
+            unixfs_stats_note(UNIXFS_OP_READDIR, t0, error, 0);
+            return;
+        }
+        b = &tmp;
+    }
+
+    if (off < b->size) {
+        nbytes = min(b->size - off, size);
+        fuse_reply_buf(req, b->p + off, nbytes);
+    } else
         fuse_reply_buf(req, NULL, 0);
 
-    free(b.p);
+    if (b == &tmp)
+        free(tmp.p);
+
+    unixfs_stats_note(UNIXFS_OP_READDIR, t0, 0, nbytes);
+}
+
+/* What an open file's fi->fh points to. */
+struct unixfs_filehandle {
+    struct inode*          ip;
+    struct unixfs_rastate* ra;     /* NULL if readahead is off */
+    char*                  report; /* /.unixfs_stats as of open; ip is NULL */
+    size_t                 reportsize;
+};
+
+/* Each open of /.unixfs_stats reads a snapshot taken then. */
+static void
+unixfs_ll_openstats(fuse_req_t req, struct fuse_file_info* fi)
+{
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    struct unixfs_filehandle* fh = calloc(1, sizeof(*fh));
+    if (!fh || !(fh->report = unixfs_stats_report(unixfs, &fh->reportsize))) {
+        free(fh);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uint64_t)(long)fh;
+    fi->direct_io = 1; /* st_size is 0, so don't let the kernel trust it */
+    fuse_reply_open(req, fi);
 }
 
 static void
 unixfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    uint64_t t0 = unixfs_stats_now();
+    int error = 0;
+
+    if (ino == UNIXFS_STATS_INO) {
+        unixfs_ll_openstats(req, fi);
+        return;
+    }
+
     struct inode* ip = unixfs->ops->iget(ino);
-    if (!ip)
+    if (!ip) {
         fuse_reply_err(req, ENOENT);
+        unixfs_stats_note(UNIXFS_OP_OPEN, t0, ENOENT, 0);
+        return;
+    }
 
     struct stat stbuf;
     unixfs->ops->istat(ip, &stbuf);
 
     if (!S_ISREG(stbuf.st_mode)) {
         if (S_ISDIR(stbuf.st_mode))
-            fuse_reply_err(req, EISDIR);
+            error = EISDIR;
         else if (S_ISBLK(stbuf.st_mode) || S_ISCHR(stbuf.st_mode))
-            fuse_reply_err(req, ENXIO);
+            error = ENXIO;
         else
-            fuse_reply_err(req, EACCES);
+            error = EACCES;
+        fuse_reply_err(req, error);
         unixfs->ops->iput(ip);
     } else {
-        fi->fh = (uint64_t)(long)ip;
+        struct unixfs_filehandle* fh = calloc(1, sizeof(*fh));
+        if (!fh) {
+            unixfs->ops->iput(ip);
+            fuse_reply_err(req, ENOMEM);
+            unixfs_stats_note(UNIXFS_OP_OPEN, t0, ENOMEM, 0);
+            return;
+        }
+        fh->ip = ip;
+        fh->ra = (unixfs_tunables.readahead) ? unixfs_readahead_open(ip) : NULL;
+        fi->fh = (uint64_t)(long)fh;
+        fi->keep_cache = unixfs_tunables.immutable;
         fuse_reply_open(req, fi);
     }
+
+    unixfs_stats_note(UNIXFS_OP_OPEN, t0, error, 0);
 }
 
 static void
 unixfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
 {
-    if (fi->fh)
-        unixfs->ops->iput((struct inode *)(long)(fi->fh));
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    struct unixfs_filehandle* fh = (struct unixfs_filehandle*)(long)(fi->fh);
+    if (fh) {
+        unixfs_readahead_close(fh->ra);
+        if (fh->ip)
+            unixfs->ops->iput(fh->ip);
+        free(fh->report);
+        free(fh);
+    }
 
     fi->fh = 0;
 
@@ -187,85 +705,182 @@ static void
 unixfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t count, off_t offset,
                struct fuse_file_info* fi)
 {
-    struct inode* ip = (struct inode*)(long)(fi->fh);
-    if (!ip) {
+    struct unixfs* unixfs = (struct unixfs*)fuse_req_userdata(req);
+    uint64_t t0 = unixfs_stats_now();
+    struct unixfs_filehandle* fh = (struct unixfs_filehandle*)(long)(fi->fh);
+    if (!fh) {
         fuse_reply_err(req, EBADF);
+        unixfs_stats_note(UNIXFS_OP_READ, t0, EBADF, 0);
         return;
     }
 
+    if (fh->report) {
+        if (offset < (off_t)fh->reportsize) {
+            count = min(fh->reportsize - (size_t)offset, count);
+            fuse_reply_buf(req, fh->report + offset, count);
+        } else
+            fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    struct inode* ip = fh->ip;
+
     struct stat stbuf;
     unixfs->ops->istat(ip, &stbuf);
     off_t size = stbuf.st_size;
 
     if ((count == 0) || (offset > size)) {
         fuse_reply_buf(req, NULL, 0);
+        unixfs_stats_note(UNIXFS_OP_READ, t0, 0, 0);
         return;
     }
 
     if ((offset + count) > size)
         count = size - offset;
 
-    char *buf = calloc(count, 1);
+    if (unixfs->ops->pmap) {
+        const char* data = unixfs->ops->pmap(ip, offset, count);
+        if (data) {
+            fuse_reply_buf(req, data, count);
+            unixfs_stats_note(UNIXFS_OP_READ, t0, 0, count);
+            return;
+        }
+    }
+
+    /* No need to zero: only the nbytes filled in below get replied. */
+    char *buf = malloc(count);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
+        unixfs_stats_note(UNIXFS_OP_READ, t0, ENOMEM, 0);
         return;
     }
 
     int error = 0;
-    char* bp = buf;
-    size_t nbytes = 0;
+    size_t nbytes = unixfs_readahead_copy(fh->ra, buf, count, offset);
+    char* bp = buf + nbytes;
+
+    count -= nbytes;
+    offset += nbytes;
 
-    do {
+    while (!error && count) {
         ssize_t ret = unixfs->ops->pbread(ip, bp, count, offset, &error);
-        if (ret < 0)
-            goto out; 
+        if (ret <= 0)
+            goto out;
         count -= ret;
         offset += ret;
         nbytes += ret;
         bp += ret;
-    } while (!error && count);
+    }
 
 out:
     fuse_reply_buf(req, buf, nbytes);
 
     free(buf);
+
+    if (nbytes)
+        unixfs_readahead_note(fh->ra, offset - nbytes, nbytes, size);
+
+    unixfs_stats_note(UNIXFS_OP_READ, t0, error, nbytes);
 }
 
 static struct fuse_lowlevel_ops unixfs_ll_oper = {
+    .init       = unixfs_ll_init,
     .statfs     = unixfs_ll_statfs,
     .destroy    = unixfs_ll_destroy,
     .lookup     = unixfs_ll_lookup,
     .getattr    = unixfs_ll_getattr,
     .readlink   = unixfs_ll_readlink,
+    .opendir    = unixfs_ll_opendir,
     .readdir    = unixfs_ll_readdir,
+    .releasedir = unixfs_ll_releasedir,
     .open       = unixfs_ll_open,
     .release    = unixfs_ll_release,
     .read       = unixfs_ll_read,
 };
 
 struct options {
+    char* attrtimeout;
+    char* cachesize;
     char* dmg;
+    char* entrytimeout;
     int   force;
     char* fsendian;
+    int   immutable;
+    char* index;
+    char* inodecache;
+    int   mmap;
+    char* readahead;
     char* type;
+    int   verifycgs;
 } options;
 
 #define UNIXFS_OPT_KEY(t, p, v) { t, offsetof(struct options, p), v }
 
 static struct fuse_opt unixfs_opts[] = {
 
+    UNIXFS_OPT_KEY("--attr-timeout %s", attrtimeout, 0),
+    UNIXFS_OPT_KEY("--cachesize %s", cachesize, 0),
     UNIXFS_OPT_KEY("--dmg %s", dmg, 0),
+    UNIXFS_OPT_KEY("--entry-timeout %s", entrytimeout, 0),
     UNIXFS_OPT_KEY("--force", force, 1),
     UNIXFS_OPT_KEY("--fsendian %s", fsendian, 0),
+    UNIXFS_OPT_KEY("--immutable", immutable, 1),
+    UNIXFS_OPT_KEY("--index %s", index, 0),
+    UNIXFS_OPT_KEY("--inodecache %s", inodecache, 0),
+    UNIXFS_OPT_KEY("--mmap", mmap, 1),
+    UNIXFS_OPT_KEY("--readahead %s", readahead, 0),
     UNIXFS_OPT_KEY("--type %s", type, 0),
+    UNIXFS_OPT_KEY("--verify-cgs", verifycgs, 1),
 
     FUSE_OPT_END
 };
 
+/* Parses a byte count with an optional k, m or g suffix. */
+static int
+unixfs_parsesize(const char* str, size_t* result)
+{
+    char* end;
+    unsigned long long val = strtoull(str, &end, 0);
+
+    if (end == str)
+        return EINVAL;
+
+    switch (*end) {
+    case 'g': case 'G': val <<= 10; /* FALLTHROUGH */
+    case 'm': case 'M': val <<= 10; /* FALLTHROUGH */
+    case 'k': case 'K': val <<= 10; end++; break;
+    case '\0': break;
+    default: return EINVAL;
+    }
+
+    if (*end != '\0')
+        return EINVAL;
+
+    *result = (size_t)val;
+
+    return 0;
+}
+
+/* Parses a non-negative number of seconds. */
+static int
+unixfs_parsetimeout(const char* str, double* result)
+{
+    char* end;
+    double val = strtod(str, &end);
+
+    if ((end == str) || (*end != '\0') || !(val >= 0.0))
+        return EINVAL;
+
+    *result = val;
+
+    return 0;
+}
+
 int
 main(int argc, char* argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct unixfs* unixfs = NULL;
 
     memset(&options, 0, sizeof(struct options));
 
@@ -296,6 +911,54 @@ main(int argc, char* argv[])
     if (options.force)
         unixfs->flags |= UNIXFS_FORCE;
 
+    if (multithreaded && !unixfs->threadsafe) {
+        fprintf(stderr, "*** warning: %s is not thread safe; using a "
+                "single-threaded loop\n", options.type);
+        multithreaded = 0;
+    }
+
+    if (options.cachesize &&
+        unixfs_parsesize(options.cachesize, &unixfs_tunables.cachesize)) {
+        fprintf(stderr, "invalid cache size %s\n", options.cachesize);
+        return -1;
+    }
+
+    if (options.inodecache &&
+        unixfs_parsesize(options.inodecache, &unixfs_tunables.inodecache)) {
+        fprintf(stderr, "invalid inode cache size %s\n", options.inodecache);
+        return -1;
+    }
+
+    if (options.readahead &&
+        unixfs_parsesize(options.readahead, &unixfs_tunables.readahead)) {
+        fprintf(stderr, "invalid readahead size %s\n", options.readahead);
+        return -1;
+    }
+
+    if (options.immutable) {
+        unixfs_tunables.immutable = 1;
+        unixfs_tunables.entrytimeout = UNIXFS_IMMUTABLE_TIMEOUT;
+        unixfs_tunables.attrtimeout = UNIXFS_IMMUTABLE_TIMEOUT;
+    }
+
+    if (options.entrytimeout &&
+        unixfs_parsetimeout(options.entrytimeout,
+                            &unixfs_tunables.entrytimeout)) {
+        fprintf(stderr, "invalid entry timeout %s\n", options.entrytimeout);
+        return -1;
+    }
+
+    if (options.attrtimeout &&
+        unixfs_parsetimeout(options.attrtimeout,
+                            &unixfs_tunables.attrtimeout)) {
+        fprintf(stderr, "invalid attribute timeout %s\n", options.attrtimeout);
+        return -1;
+    }
+
+    unixfs_tunables.indexpath = options.index;
+    unixfs_tunables.mmap = options.mmap;
+    unixfs_tunables.verifycgs = options.verifycgs;
+
     unixfs->fsname = options.type; /* XXX quick fix */
 
     unixfs->fsendian = UNIXFS_FS_INVALID;
@@ -320,6 +983,8 @@ main(int argc, char* argv[])
         return -1;
     }
 
+    unixfs_stats_init();
+
     char extra_args[UNIXFS_ARGLEN] = { 0 };
     unixfs_postflight(unixfs->fsname, unixfs->volname, extra_args);
 
@@ -333,10 +998,13 @@ main(int argc, char* argv[])
         struct fuse_session* se;
 
         se = fuse_lowlevel_new(&args, &unixfs_ll_oper, sizeof(unixfs_ll_oper),
-                               (void*)&unixfs);
+                               (void*)unixfs);
         if (se != NULL) {
             if ((err = fuse_daemonize(foregrounded)) == -1)
                 goto bailout;
+            if (unixfs_stats_sigstart(unixfs) != 0)
+                fprintf(stderr, "*** warning: SIGUSR1 won't report "
+                        "statistics\n");
             if (fuse_set_signal_handlers(se) != -1) {
                 fuse_session_add_chan(se, ch);
                 if (multithreaded)
@@ -39,12 +39,36 @@ struct unixfs {
     fs_endian_t fsendian;
     char*       fsname;
     char*       volname;
+    int         threadsafe;            /* ops may run concurrently */
+    int         dirindex;              /* namei() uses a name index */
 };
 
 /* flags */
 
 #define UNIXFS_FORCE           0x00000001 /* mount even if things look fishy */
 
+/* Framework-wide tunables; filled in from the command line before init(). */
+
+struct unixfs_tunables {
+    size_t cachesize;  /* bytes of block cache per device; 0 => no caching */
+    size_t inodecache; /* unreferenced inodes to keep around; 0 => none */
+    char*  indexpath;  /* archive index sidecar, if any (ancientfs) */
+    size_t readahead;  /* largest readahead window per open file; 0 => off */
+    int    verifycgs;  /* check every cylinder group at mount (ufs) */
+    int    immutable;  /* image won't change under us: cache hard */
+    double entrytimeout; /* seconds the kernel may cache names */
+    double attrtimeout;  /* seconds the kernel may cache attributes */
+    int    mmap;       /* map the image rather than read it */
+};
+
+extern struct unixfs_tunables unixfs_tunables;
+
+#define UNIXFS_DEFAULT_CACHESIZE  (8 * 1024 * 1024)
+#define UNIXFS_DEFAULT_INODECACHE 1024
+#define UNIXFS_DEFAULT_READAHEAD  (1024 * 1024)
+#define UNIXFS_DEFAULT_TIMEOUT    60.0       /* seconds */
+#define UNIXFS_IMMUTABLE_TIMEOUT  31536000.0 /* a year; --immutable */
+
 /* Our encapsulation of an Ancient Unix directory entry. */
 
 struct unixfs_direntry {
@@ -76,6 +100,8 @@ struct unixfs_ops {
     struct inode* (*iget)(ino_t ino);
     void          (*iput)(struct inode* ip);
     int           (*igetattr)(ino_t ino, struct stat* stbuf);
+    void          (*igetattr_many)(ino_t* inos, struct stat* stbufs,
+                                   int* errors, size_t count); /* optional */
     void          (*istat)(struct inode* ip, struct stat* stbuf);
     int           (*namei)(ino_t parentino, const char* name,
                            struct stat* stbuf);
@@ -83,13 +109,51 @@ struct unixfs_ops {
                                   struct unixfs_dirbuf* dirbuf,
                                   off_t* offset,
                                   struct unixfs_direntry* dent);
+    ssize_t       (*readdir_batch)(struct inode* ip, off_t* offset,
+                                   struct unixfs_direntry* dents,
+                                   size_t count); /* optional */
     ssize_t       (*pbread)(struct inode*ip, char* buf, size_t nbyte,
                             off_t offset, int* error);
+    const char*   (*pmap)(struct inode* ip, off_t offset,
+                          size_t nbyte); /* optional */
     int           (*readlink)(ino_t, char path[UNIXFS_MAXPATHLEN]);
     int           (*sanitycheck)(void* filsys, off_t disksize);
     int           (*statvfs)(struct statvfs* svb);
 };
 
+/* Sequential readahead for open files; see unixfs_internal.c. */
+
+struct unixfs_rastate;
+
+typedef ssize_t (*unixfs_pbread_t)(struct inode* ip, char* buf, size_t nbyte,
+                                   off_t offset, int* error);
+
+int                    unixfs_readahead_start(unixfs_pbread_t pbread);
+void                   unixfs_readahead_stop(void);
+struct unixfs_rastate* unixfs_readahead_open(struct inode* ip);
+void                   unixfs_readahead_close(struct unixfs_rastate* ra);
+size_t                 unixfs_readahead_copy(struct unixfs_rastate* ra,
+                                             char* buf, size_t count,
+                                             off_t offset);
+void                   unixfs_readahead_note(struct unixfs_rastate* ra,
+                                             off_t offset, size_t count,
+                                             off_t size);
+
+/* Directory enumeration in batches; see unixfs_internal.c. */
+
+#define UNIXFS_DIRBATCH 256 /* entries asked for at a time */
+
+ssize_t unixfs_readdir(struct unixfs_ops* ops, struct inode* dp,
+                       struct unixfs_dirbuf* dirbuf, off_t* offset,
+                       struct unixfs_direntry* dents, size_t count);
+
+/* Cache and device counters, for statistics; see unixfs_internal.c. */
+
+void     unixfs_bcache_stats(uint64_t* hits, uint64_t* misses);
+void     unixfs_inodelayer_stats(uint64_t* hits, uint64_t* misses);
+void     unixfs_dirindex_stats(uint64_t* builds, uint64_t* lookups);
+uint64_t unixfs_dev_bytesread(void); /* unixfs_dev.c */
+
 #define min(x, y) ((x) < (y) ? (x) : (y))
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
@@ -0,0 +1,1041 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * Benchmark driver.
+ *
+ * Linked in place of unixfs.c, this drives a file system's unixfs_ops
+ * directly, with no MacFUSE or kernel in the way, so that what it measures
+ * is the file system code and the image I/O beneath it. It runs a series of
+ * workloads against an image and reports, for each, operations per second,
+ * latency percentiles, bytes returned to the caller and bytes read from the
+ * image:
+ *
+ *     walk      enumerate every directory, fetching attributes of each entry
+ *     stat      igetattr() on inodes picked at random from the walk
+ *     seqread   read every regular file front to back, with readahead
+ *     randread  read random blocks of random regular files
+ *     bigdir    enumerate the largest directory over and over
+ *     lookup    look up every name in the largest directory, checking that
+ *               namei() finds what readdir gave and, for backends with a
+ *               directory index, that the index answered
+ *     statfs    count free blocks and inodes over and over, as the mount
+ *               does; statvfs() itself only copies out those counts
+ *     concurrent
+ *               --threads threads at once doing lookups, directory
+ *               listings and reads, each checked against the walk
+ *
+ * The walk always runs first, since the others pick their inodes from it.
+ * The statfs workload is skipped for backends that take their counts from
+ * the superblock, having nothing to count. The concurrent workload, as the
+ * multithreaded MacFUSE loop would, calls into the file system from several
+ * threads; it is skipped for backends that aren't thread safe.
+ */
+
+#include "unixfs_internal.h"
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNIXFS_BENCH_OPS      10000      /* default count for all but walk/seqread */
+#define UNIXFS_BENCH_IOSIZE   (128 * 1024)
+#define UNIXFS_BENCH_BLKSIZE  4096
+#define UNIXFS_BENCH_THREADS  4
+
+struct unixfs_bench_file {
+    ino_t ino;
+    off_t size;
+};
+
+struct unixfs_bench_list {
+    struct unixfs_bench_file* items;
+    size_t                    count;
+    size_t                    capacity;
+};
+
+struct unixfs_bench_result {
+    const char* name;
+    uint64_t*   lat;       /* nanoseconds, one per operation */
+    size_t      nops;
+    size_t      maxops;
+    uint64_t    errors;
+    uint64_t    nbytes;    /* returned to the caller */
+    uint64_t    devbytes;  /* read from the image */
+    uint64_t    elapsed;   /* nanoseconds */
+};
+
+static struct unixfs* unixfs;
+
+static struct unixfs_bench_list bench_dirs;
+static struct unixfs_bench_list bench_files; /* regular files only */
+static struct unixfs_bench_list bench_inodes;
+static size_t                   bench_nthreads = UNIXFS_BENCH_THREADS;
+static int                      bench_checkindex = 1; /* see lookup */
+
+static uint64_t
+unixfs_bench_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+    struct timeval tv;
+    (void)gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+static void*
+unixfs_bench_realloc(void* p, size_t size)
+{
+    void* newp = realloc(p, size);
+    if (!newp) {
+        fprintf(stderr, "*** fatal error: cannot allocate memory\n");
+        abort();
+    }
+    return newp;
+}
+
+static void
+unixfs_bench_add(struct unixfs_bench_list* l, ino_t ino, off_t size)
+{
+    if (l->count == l->capacity) {
+        l->capacity = l->capacity ? 2 * l->capacity : 1024;
+        l->items = unixfs_bench_realloc(l->items,
+                       l->capacity * sizeof(struct unixfs_bench_file));
+    }
+    l->items[l->count].ino = ino;
+    l->items[l->count].size = size;
+    l->count++;
+}
+
+static void
+unixfs_bench_begin(struct unixfs_bench_result* r, const char* name)
+{
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->devbytes = unixfs_dev_bytesread();
+    r->elapsed = unixfs_bench_now();
+}
+
+static void
+unixfs_bench_record(struct unixfs_bench_result* r, uint64_t start)
+{
+    if (r->nops == r->maxops) {
+        r->maxops = r->maxops ? 2 * r->maxops : 4096;
+        r->lat = unixfs_bench_realloc(r->lat, r->maxops * sizeof(uint64_t));
+    }
+    r->lat[r->nops++] = unixfs_bench_now() - start;
+}
+
+static int
+unixfs_bench_compare(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static double
+unixfs_bench_pct(struct unixfs_bench_result* r, double pct)
+{
+    if (r->nops == 0)
+        return 0.0;
+
+    size_t i = (size_t)(pct / 100.0 * (double)(r->nops - 1) + 0.5);
+
+    return (double)r->lat[i] / 1000.0;
+}
+
+static void
+unixfs_bench_end(struct unixfs_bench_result* r)
+{
+    r->elapsed = unixfs_bench_now() - r->elapsed;
+    r->devbytes = unixfs_dev_bytesread() - r->devbytes;
+
+    qsort(r->lat, r->nops, sizeof(uint64_t), unixfs_bench_compare);
+
+    double secs = (double)r->elapsed / 1e9;
+
+    printf("%-9s %10zu %12.0f %9.1f %9.1f %9.1f %10.1f %12llu %12llu %6llu\n",
+           r->name, r->nops, secs > 0 ? (double)r->nops / secs : 0.0,
+           unixfs_bench_pct(r, 50.0), unixfs_bench_pct(r, 90.0),
+           unixfs_bench_pct(r, 99.0),
+           r->nops ? (double)r->lat[r->nops - 1] / 1000.0 : 0.0,
+           (unsigned long long)r->nbytes, (unsigned long long)r->devbytes,
+           (unsigned long long)r->errors);
+
+    free(r->lat);
+    r->lat = NULL;
+}
+
+/*
+ * Lists directory ino the way readdir does: entries first, then all their
+ * attributes. Subdirectories found are appended to more, if it is given,
+ * and how many entries had their attributes fetched goes in *nlisted.
+ */
+static int
+unixfs_bench_listdir(ino_t ino, struct unixfs_bench_list* more,
+                     struct unixfs_bench_result* r, size_t* nlisted)
+{
+    struct inode* dp = unixfs->ops->iget(ino);
+    if (!dp)
+        return ENOENT;
+
+    struct unixfs_dirbuf dirbuf;
+    struct unixfs_direntry* dents =
+        unixfs_bench_realloc(NULL, UNIXFS_DIRBATCH *
+                                   sizeof(struct unixfs_direntry));
+    off_t offset = 0;
+    size_t count = 0, capacity = 0;
+    ino_t* inos = NULL;
+    ssize_t n, j;
+
+    memset(&dirbuf, 0, sizeof(dirbuf));
+
+    while ((n = unixfs_readdir(unixfs->ops, dp, &dirbuf, &offset, dents,
+                               UNIXFS_DIRBATCH)) > 0) {
+        for (j = 0; j < n; j++) {
+            if ((strcmp(dents[j].name, ".") == 0) ||
+                (strcmp(dents[j].name, "..") == 0))
+                continue;
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                inos = unixfs_bench_realloc(inos, capacity * sizeof(ino_t));
+            }
+            inos[count++] = dents[j].ino;
+        }
+    }
+
+    free(dents);
+
+    unixfs->ops->iput(dp);
+
+    if (n < 0) {
+        free(inos);
+        return EIO;
+    }
+
+    struct stat* stbufs = unixfs_bench_realloc(NULL,
+                              (count ? count : 1) * sizeof(struct stat));
+    int* errors = unixfs_bench_realloc(NULL,
+                                       (count ? count : 1) * sizeof(int));
+    size_t i, listed = 0;
+
+    if (unixfs->ops->igetattr_many)
+        unixfs->ops->igetattr_many(inos, stbufs, errors, count);
+    else {
+        for (i = 0; i < count; i++)
+            errors[i] = unixfs->ops->igetattr(inos[i], &stbufs[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (errors[i]) {
+            r->errors++;
+            continue;
+        }
+        r->nbytes += sizeof(struct stat);
+        listed++;
+        if (!more)
+            continue;
+        unixfs_bench_add(&bench_inodes, inos[i], stbufs[i].st_size);
+        if (S_ISDIR(stbufs[i].st_mode))
+            unixfs_bench_add(more, inos[i], (off_t)0);
+        else if (S_ISREG(stbufs[i].st_mode))
+            unixfs_bench_add(&bench_files, inos[i], stbufs[i].st_size);
+    }
+
+    free(errors);
+    free(stbufs);
+    free(inos);
+
+    if (nlisted)
+        *nlisted = listed;
+
+    return 0;
+}
+
+static void
+unixfs_bench_walk(void)
+{
+    struct unixfs_bench_result r;
+    size_t next;
+
+    unixfs_bench_begin(&r, "walk");
+
+    unixfs_bench_add(&bench_dirs, (ino_t)MACFUSE_ROOTINO, 0);
+    unixfs_bench_add(&bench_inodes, (ino_t)MACFUSE_ROOTINO, 0);
+
+    /*
+     * Breadth first, so that bench_dirs is both the work queue and the
+     * result. A directory's size field is replaced by its entry count.
+     */
+    for (next = 0; next < bench_dirs.count; next++) {
+        size_t listed = 0;
+        uint64_t start = unixfs_bench_now();
+        if (unixfs_bench_listdir(bench_dirs.items[next].ino, &bench_dirs,
+                                 &r, &listed) != 0)
+            r.errors++;
+        unixfs_bench_record(&r, start);
+        bench_dirs.items[next].size = (off_t)listed;
+    }
+
+    unixfs_bench_end(&r);
+}
+
+static void
+unixfs_bench_stat(size_t nops)
+{
+    struct unixfs_bench_result r;
+    size_t i;
+
+    unixfs_bench_begin(&r, "stat");
+
+    for (i = 0; i < nops && bench_inodes.count; i++) {
+        ino_t ino = bench_inodes.items[random() % bench_inodes.count].ino;
+        struct stat stbuf;
+        uint64_t start = unixfs_bench_now();
+        if (unixfs->ops->igetattr(ino, &stbuf) != 0)
+            r.errors++;
+        else
+            r.nbytes += sizeof(struct stat);
+        unixfs_bench_record(&r, start);
+    }
+
+    unixfs_bench_end(&r);
+}
+
+/*
+ * statvfs() only copies out counts that minixfs makes at mount and sysvfs
+ * makes once, on a thread, so the statfs workload calls the backends'
+ * counting functions instead. They are looked up by name, the way
+ * unixfs_preflight() finds the backend, since only one of them is linked in.
+ */
+typedef int           (*unixfs_bench_minixcount_t)(struct super_block* sb,
+                                                   struct statvfs* buf);
+typedef unsigned long (*unixfs_bench_sysvcount_t)(struct super_block* sb);
+
+static void
+unixfs_bench_statfs(size_t nops)
+{
+    struct unixfs_bench_result r;
+    struct super_block* sb = (struct super_block*)unixfs->filsys;
+    size_t i;
+
+    unixfs_bench_minixcount_t minixcount = (unixfs_bench_minixcount_t)
+        dlsym(RTLD_DEFAULT, "minixfs_statvfs");
+    unixfs_bench_sysvcount_t sysvblocks = (unixfs_bench_sysvcount_t)
+        dlsym(RTLD_DEFAULT, "sysv_count_free_blocks");
+    unixfs_bench_sysvcount_t sysvinodes = (unixfs_bench_sysvcount_t)
+        dlsym(RTLD_DEFAULT, "sysv_count_free_inodes");
+
+    if (!minixcount && !(sysvblocks && sysvinodes)) {
+        printf("%-9s skipped: %s keeps no counts of its own\n", "statfs",
+               unixfs->fsname);
+        return;
+    }
+
+    unixfs_bench_begin(&r, "statfs");
+
+    for (i = 0; i < nops; i++) {
+        struct statvfs svb;
+        uint64_t start = unixfs_bench_now();
+        memset(&svb, 0, sizeof(svb));
+        if (minixcount) {
+            if (minixcount(sb, &svb) != 0)
+                r.errors++;
+            else
+                r.nbytes += sizeof(struct statvfs);
+        } else {
+            svb.f_bfree = sysvblocks(sb);
+            svb.f_ffree = sysvinodes(sb);
+            r.nbytes += sizeof(struct statvfs);
+        }
+        unixfs_bench_record(&r, start);
+    }
+
+    unixfs_bench_end(&r);
+}
+
+static ssize_t
+unixfs_bench_pread(struct inode* ip, char* buf, size_t nbyte, off_t offset)
+{
+    size_t done = 0;
+    int error = 0;
+
+    while (done < nbyte) {
+        ssize_t ret = unixfs->ops->pbread(ip, buf + done, nbyte - done,
+                                          offset + (off_t)done, &error);
+        if (ret <= 0 || error)
+            break;
+        done += ret;
+    }
+
+    return (error) ? -1 : (ssize_t)done;
+}
+
+static void
+unixfs_bench_seqread(void)
+{
+    struct unixfs_bench_result r;
+    char* buf = unixfs_bench_realloc(NULL, UNIXFS_BENCH_IOSIZE);
+    size_t i;
+
+    unixfs_bench_begin(&r, "seqread");
+
+    for (i = 0; i < bench_files.count; i++) {
+        struct inode* ip = unixfs->ops->iget(bench_files.items[i].ino);
+        if (!ip) {
+            r.errors++;
+            continue;
+        }
+        /* as unixfs_ll_read() does it */
+        struct unixfs_rastate* ra =
+            (unixfs_tunables.readahead) ? unixfs_readahead_open(ip) : NULL;
+        off_t size = bench_files.items[i].size, offset;
+        for (offset = 0; offset < size; offset += UNIXFS_BENCH_IOSIZE) {
+            size_t n = min((off_t)UNIXFS_BENCH_IOSIZE, size - offset);
+            uint64_t start = unixfs_bench_now();
+            size_t copied = unixfs_readahead_copy(ra, buf, n, offset);
+            ssize_t ret = unixfs_bench_pread(ip, buf + copied, n - copied,
+                                             offset + (off_t)copied);
+            unixfs_bench_record(&r, start);
+            if (ret < 0) {
+                r.errors++;
+                break;
+            }
+            r.nbytes += copied + ret;
+            unixfs_readahead_note(ra, offset, copied + ret, size);
+        }
+        unixfs_readahead_close(ra);
+        unixfs->ops->iput(ip);
+    }
+
+    unixfs_bench_end(&r);
+
+    free(buf);
+}
+
+static void
+unixfs_bench_randread(size_t nops)
+{
+    struct unixfs_bench_result r;
+    char buf[UNIXFS_BENCH_BLKSIZE];
+    size_t i;
+
+    unixfs_bench_begin(&r, "randread");
+
+    for (i = 0; i < nops && bench_files.count; i++) {
+        struct unixfs_bench_file* f =
+            &bench_files.items[random() % bench_files.count];
+        if (f->size == 0)
+            continue;
+        off_t nblocks = (f->size + UNIXFS_BENCH_BLKSIZE - 1) /
+                        UNIXFS_BENCH_BLKSIZE;
+        off_t offset = (off_t)(random() % nblocks) * UNIXFS_BENCH_BLKSIZE;
+        size_t n = min((off_t)UNIXFS_BENCH_BLKSIZE, f->size - offset);
+        uint64_t start = unixfs_bench_now();
+        struct inode* ip = unixfs->ops->iget(f->ino);
+        ssize_t ret = (ip) ? unixfs_bench_pread(ip, buf, n, offset) : -1;
+        if (ip)
+            unixfs->ops->iput(ip);
+        unixfs_bench_record(&r, start);
+        if (ret < 0)
+            r.errors++;
+        else
+            r.nbytes += ret;
+    }
+
+    unixfs_bench_end(&r);
+}
+
+static size_t
+unixfs_bench_biggest(void)
+{
+    size_t i, biggest = 0;
+
+    for (i = 1; i < bench_dirs.count; i++)
+        if (bench_dirs.items[i].size > bench_dirs.items[biggest].size)
+            biggest = i;
+
+    return biggest;
+}
+
+static void
+unixfs_bench_bigdir(size_t nops)
+{
+    struct unixfs_bench_result r;
+    size_t i, biggest = unixfs_bench_biggest();
+
+    /* each listing is one op; aim for about nops entries in all */
+    off_t nentries = bench_dirs.count ? bench_dirs.items[biggest].size : 0;
+    size_t rounds = (nentries > 0) ? (size_t)(nops / nentries) : 0;
+    if (rounds < 10)
+        rounds = 10;
+
+    unixfs_bench_begin(&r, "bigdir");
+
+    for (i = 0; i < rounds && bench_dirs.count; i++) {
+        uint64_t start = unixfs_bench_now();
+        if (unixfs_bench_listdir(bench_dirs.items[biggest].ino, NULL,
+                                 &r, NULL) != 0)
+            r.errors++;
+        unixfs_bench_record(&r, start);
+    }
+
+    unixfs_bench_end(&r);
+
+    printf("          (%lld entries per listing)\n", (long long)nentries);
+}
+
+/*
+ * The lookup workload. The largest directory is listed once, and then its
+ * names are looked up in turn, nops times in all; namei() must find the
+ * inode readdir gave. A backend that keeps a directory index must answer
+ * every one of these lookups from it once the directory is bigger than
+ * UNIXFS_DIRINDEX_MINSIZE; each lookup that it didn't answer that way counts
+ * as an error. The check is off with --inodecache 0, which goes without.
+ */
+static void
+unixfs_bench_lookup(size_t nops)
+{
+    struct unixfs_bench_result r;
+    struct unixfs_bench_file* d;
+    struct unixfs_direntry* dents = NULL;
+    size_t ndents = 0, i;
+    struct stat stbuf;
+
+    unixfs_bench_begin(&r, "lookup");
+
+    if (!bench_dirs.count) {
+        unixfs_bench_end(&r);
+        return;
+    }
+
+    d = &bench_dirs.items[unixfs_bench_biggest()];
+
+    struct inode* dp = unixfs->ops->iget(d->ino);
+    if (!dp) {
+        r.errors++;
+        unixfs_bench_end(&r);
+        return;
+    }
+
+    struct unixfs_dirbuf dirbuf;
+    off_t offset = 0;
+    ssize_t n;
+
+    memset(&dirbuf, 0, sizeof(dirbuf));
+
+    do {
+        dents = unixfs_bench_realloc(dents, (ndents + UNIXFS_DIRBATCH) *
+                                            sizeof(struct unixfs_direntry));
+        n = unixfs_readdir(unixfs->ops, dp, &dirbuf, &offset, &dents[ndents],
+                           UNIXFS_DIRBATCH);
+        if (n > 0)
+            ndents += n;
+    } while (n > 0);
+
+    unixfs->ops->iput(dp);
+
+    if (n < 0)
+        r.errors++;
+
+    /* The kernel resolves . and .. itself; not every backend does. */
+    size_t nnames = 0;
+    for (i = 0; i < ndents; i++)
+        if ((strcmp(dents[i].name, ".") != 0) &&
+            (strcmp(dents[i].name, "..") != 0))
+            dents[nnames++] = dents[i];
+
+    uint64_t builds, lookups, lookups0;
+    unixfs_dirindex_stats(&builds, &lookups0);
+
+    for (i = 0; i < nops && nnames; i++) {
+        struct unixfs_direntry* de = &dents[i % nnames];
+        uint64_t start = unixfs_bench_now();
+        if (unixfs->ops->namei(d->ino, de->name, &stbuf) ||
+            (stbuf.st_ino != de->ino))
+            r.errors++;
+        else
+            r.nbytes += sizeof(struct stat);
+        unixfs_bench_record(&r, start);
+    }
+
+    unixfs_dirindex_stats(&builds, &lookups);
+    lookups -= lookups0;
+
+    if (unixfs->dirindex && bench_checkindex &&
+        (unixfs->ops->igetattr(d->ino, &stbuf) == 0) &&
+        (stbuf.st_size > UNIXFS_DIRINDEX_MINSIZE) && (lookups < r.nops))
+        r.errors += r.nops - lookups;
+
+    unixfs_bench_end(&r);
+
+    printf("          (%zu names, %llu of %zu lookups answered by an index)\n",
+           nnames, (unsigned long long)min(lookups, (uint64_t)r.nops), r.nops);
+
+    free(dents);
+}
+
+/*
+ * The concurrent workload. Before the threads start, the first block of
+ * every regular file is read and checksummed. Each thread then does its
+ * share of the operations, picking one of these at random:
+ *
+ *     - look up a name from the first batch of a random directory's entries
+ *       and check that namei() finds the inode readdir gave;
+ *     - list a random directory with attributes and check that as many
+ *       entries come back as the walk found;
+ *     - read the first block of a random file and check its checksum.
+ *
+ * A mismatch counts as an error, as does a failed call.
+ */
+
+struct unixfs_bench_thread {
+    pthread_t                  thread;
+    unsigned int               seed;
+    size_t                     nops;
+    struct unixfs_bench_result r;
+};
+
+static uint32_t* bench_sums; /* one per bench_files item */
+
+static uint32_t
+unixfs_bench_checksum(const char* buf, size_t n)
+{
+    uint32_t h = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        h ^= (uint8_t)buf[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static int
+unixfs_bench_readfirst(struct unixfs_bench_file* f, uint32_t* sum)
+{
+    char buf[UNIXFS_BENCH_BLKSIZE];
+    size_t n = min((off_t)UNIXFS_BENCH_BLKSIZE, f->size);
+
+    struct inode* ip = unixfs->ops->iget(f->ino);
+    if (!ip)
+        return ENOENT;
+
+    ssize_t ret = unixfs_bench_pread(ip, buf, n, (off_t)0);
+
+    unixfs->ops->iput(ip);
+
+    if (ret != (ssize_t)n)
+        return EIO;
+
+    *sum = unixfs_bench_checksum(buf, n);
+
+    return 0;
+}
+
+static int
+unixfs_bench_lookupone(struct unixfs_bench_file* d, unsigned int* seed,
+                       struct unixfs_bench_result* r)
+{
+    struct inode* dp = unixfs->ops->iget(d->ino);
+    if (!dp)
+        return ENOENT;
+
+    struct unixfs_dirbuf dirbuf;
+    struct unixfs_direntry* dents =
+        unixfs_bench_realloc(NULL, UNIXFS_DIRBATCH *
+                                   sizeof(struct unixfs_direntry));
+    off_t offset = 0;
+
+    memset(&dirbuf, 0, sizeof(dirbuf));
+
+    ssize_t n = unixfs_readdir(unixfs->ops, dp, &dirbuf, &offset, dents,
+                               UNIXFS_DIRBATCH);
+
+    unixfs->ops->iput(dp);
+
+    int error = 0;
+
+    if (n < 0)
+        error = EIO;
+    else if (n > 0) {
+        /* The kernel resolves . and .. itself; not every backend does. */
+        struct unixfs_direntry* de = &dents[rand_r(seed) % n];
+        struct stat stbuf;
+        if ((strcmp(de->name, ".") != 0) && (strcmp(de->name, "..") != 0) &&
+            ((error = unixfs->ops->namei(d->ino, de->name, &stbuf)) == 0)) {
+            if (stbuf.st_ino != de->ino)
+                error = EIO; /* found the wrong inode */
+            else
+                r->nbytes += sizeof(struct stat);
+        }
+    }
+
+    free(dents);
+
+    return error;
+}
+
+static void*
+unixfs_bench_concurrent_thread(void* arg)
+{
+    struct unixfs_bench_thread* t = (struct unixfs_bench_thread*)arg;
+    struct unixfs_bench_result* r = &t->r;
+    size_t i;
+
+    for (i = 0; i < t->nops; i++) {
+        int op = rand_r(&t->seed) % 3;
+        int error = 0;
+        uint64_t start = unixfs_bench_now();
+
+        if ((op == 2) && !bench_files.count)
+            op = rand_r(&t->seed) % 2;
+
+        if (op == 0) {
+            struct unixfs_bench_file* d =
+                &bench_dirs.items[rand_r(&t->seed) % bench_dirs.count];
+            error = unixfs_bench_lookupone(d, &t->seed, r);
+        } else if (op == 1) {
+            struct unixfs_bench_file* d =
+                &bench_dirs.items[rand_r(&t->seed) % bench_dirs.count];
+            size_t listed = 0;
+            uint64_t errors = r->errors;
+            error = unixfs_bench_listdir(d->ino, NULL, r, &listed);
+            if (!error && (r->errors == errors) &&
+                (listed != (size_t)d->size))
+                error = EIO; /* lost or made up entries */
+        } else {
+            size_t k = rand_r(&t->seed) % bench_files.count;
+            uint32_t sum;
+            error = unixfs_bench_readfirst(&bench_files.items[k], &sum);
+            if (!error && (sum != bench_sums[k]))
+                error = EIO; /* read the wrong data */
+            if (!error)
+                r->nbytes += min((off_t)UNIXFS_BENCH_BLKSIZE,
+                                 bench_files.items[k].size);
+        }
+
+        unixfs_bench_record(r, start);
+        if (error)
+            r->errors++;
+    }
+
+    return NULL;
+}
+
+static void
+unixfs_bench_concurrent(size_t nops)
+{
+    struct unixfs_bench_result r;
+    size_t i, started = 0;
+
+    if (!unixfs->threadsafe) {
+        printf("%-9s skipped: %s is not thread safe\n", "concurrent",
+               unixfs->fsname);
+        return;
+    }
+
+    if (!bench_dirs.count)
+        return;
+
+    bench_sums = unixfs_bench_realloc(NULL, (bench_files.count + 1) *
+                                            sizeof(uint32_t));
+    for (i = 0; i < bench_files.count; i++)
+        if (unixfs_bench_readfirst(&bench_files.items[i], &bench_sums[i]))
+            bench_sums[i] = 0;
+
+    struct unixfs_bench_thread* threads =
+        unixfs_bench_realloc(NULL, bench_nthreads *
+                                   sizeof(struct unixfs_bench_thread));
+
+    unixfs_bench_begin(&r, "concurrent");
+
+    for (i = 0; i < bench_nthreads; i++) {
+        struct unixfs_bench_thread* t = &threads[i];
+        memset(t, 0, sizeof(*t));
+        t->seed = (unsigned int)random();
+        t->nops = nops / bench_nthreads +
+                  ((i < nops % bench_nthreads) ? 1 : 0);
+        if (pthread_create(&t->thread, (const pthread_attr_t*)0,
+                           unixfs_bench_concurrent_thread, t) != 0) {
+            fprintf(stderr, "*** warning: cannot start bench thread %zu\n", i);
+            break;
+        }
+        started++;
+    }
+
+    for (i = 0; i < started; i++) {
+        struct unixfs_bench_thread* t = &threads[i];
+        size_t j;
+        (void)pthread_join(t->thread, NULL);
+        for (j = 0; j < t->r.nops; j++) {
+            if (r.nops == r.maxops) {
+                r.maxops = r.maxops ? 2 * r.maxops : 4096;
+                r.lat = unixfs_bench_realloc(r.lat,
+                                             r.maxops * sizeof(uint64_t));
+            }
+            r.lat[r.nops++] = t->r.lat[j];
+        }
+        r.errors += t->r.errors;
+        r.nbytes += t->r.nbytes;
+        free(t->r.lat);
+    }
+
+    unixfs_bench_end(&r);
+
+    printf("          (%zu threads)\n", started);
+
+    free(threads);
+    free(bench_sums);
+    bench_sums = NULL;
+}
+
+static int
+unixfs_bench_parsesize(const char* str, size_t* result)
+{
+    char* end;
+    unsigned long long val = strtoull(str, &end, 0);
+
+    switch (tolower(*end)) {
+    case 'g': val <<= 10; /* FALLTHROUGH */
+    case 'm': val <<= 10; /* FALLTHROUGH */
+    case 'k': val <<= 10; end++; break;
+    }
+
+    if ((end == str) || (*end != '\0'))
+        return EINVAL;
+
+    *result = (size_t)val;
+
+    return 0;
+}
+
+static void
+unixfs_bench_usage(const char* progname)
+{
+    fprintf(stderr,
+    "usage:\n"
+    "      %s [--type TYPE] [--fsendian pdp|big|little] [--force]\n"
+    "          [--cachesize SIZE] [--inodecache N] [--mmap] [--ops N]\n"
+    "          [--readahead SIZE] [--seed N] [--threads N]\n"
+    "          [--workload LIST] DMG\n"
+    "where:\n"
+    "     . LIST is a comma-separated list of walk, stat, seqread, randread,\n"
+    "       bigdir, lookup, statfs and concurrent (default: all of them, in\n"
+    "       that order)\n"
+    "     . --ops N sets the number of stat, randread, lookup, statfs and\n"
+    "       concurrent operations, and roughly the number of entries bigdir\n"
+    "       lists\n"
+    "       (default %d)\n"
+    "     . --threads N sets how many threads the concurrent workload runs\n"
+    "       (default %d)\n"
+    "     . the other options are as for mounting\n",
+    progname, UNIXFS_BENCH_OPS, UNIXFS_BENCH_THREADS);
+}
+
+int
+main(int argc, char* argv[])
+{
+    static struct option longopts[] = {
+        { "cachesize",  required_argument, NULL, 'c' },
+        { "force",      no_argument,       NULL, 'f' },
+        { "fsendian",   required_argument, NULL, 'e' },
+        { "inodecache", required_argument, NULL, 'i' },
+        { "mmap",       no_argument,       NULL, 'm' },
+        { "ops",        required_argument, NULL, 'n' },
+        { "readahead",  required_argument, NULL, 'r' },
+        { "seed",       required_argument, NULL, 's' },
+        { "threads",    required_argument, NULL, 'p' },
+        { "type",       required_argument, NULL, 't' },
+        { "workload",   required_argument, NULL, 'w' },
+        { NULL,         0,                 NULL, 0   },
+    };
+
+    char* type = NULL;
+    char* workload =
+        "walk,stat,seqread,randread,bigdir,lookup,statfs,concurrent";
+    char* fsendian = NULL;
+    size_t nops = UNIXFS_BENCH_OPS;
+    unsigned long seed = 1;
+    uint32_t flags = 0;
+    int ch;
+
+    while ((ch = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'c':
+            if (unixfs_bench_parsesize(optarg, &unixfs_tunables.cachesize)) {
+                fprintf(stderr, "invalid cache size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            fsendian = optarg;
+            break;
+        case 'f':
+            flags |= UNIXFS_FORCE;
+            break;
+        case 'i':
+            if (unixfs_bench_parsesize(optarg, &unixfs_tunables.inodecache)) {
+                fprintf(stderr, "invalid inode cache size %s\n", optarg);
+                return 1;
+            }
+            bench_checkindex = (unixfs_tunables.inodecache != 0);
+            break;
+        case 'm':
+            unixfs_tunables.mmap = 1;
+            break;
+        case 'n':
+            if (unixfs_bench_parsesize(optarg, &nops)) {
+                fprintf(stderr, "invalid operation count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (unixfs_bench_parsesize(optarg, &unixfs_tunables.readahead)) {
+                fprintf(stderr, "invalid readahead size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            if (unixfs_bench_parsesize(optarg, &bench_nthreads) ||
+                (bench_nthreads == 0)) {
+                fprintf(stderr, "invalid thread count %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            type = optarg;
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        default:
+            unixfs_bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        unixfs_bench_usage(argv[0]);
+        return 1;
+    }
+
+    char* dmg = argv[optind];
+
+    if (!(unixfs = unixfs_preflight(dmg, &type, &unixfs))) {
+        if (type)
+            fprintf(stderr, "invalid file system type %s\n", type);
+        else
+            fprintf(stderr, "missing file system type\n");
+        return 1;
+    }
+
+    unixfs->flags |= flags;
+    unixfs->fsname = type;
+    unixfs->fsendian = UNIXFS_FS_INVALID;
+
+    if (fsendian) {
+        if (strcasecmp(fsendian, "pdp") == 0)
+            unixfs->fsendian = UNIXFS_FS_PDP;
+        else if (strcasecmp(fsendian, "big") == 0)
+            unixfs->fsendian = UNIXFS_FS_BIG;
+        else if (strcasecmp(fsendian, "little") == 0)
+            unixfs->fsendian = UNIXFS_FS_LITTLE;
+        else {
+            fprintf(stderr, "invalid endian type %s\n", fsendian);
+            return 1;
+        }
+    }
+
+    /* mounting is part of what gets measured */
+    uint64_t start = unixfs_bench_now();
+    uint64_t devbytes = unixfs_dev_bytesread();
+
+    if ((unixfs->filsys =
+        unixfs->ops->init(dmg, unixfs->flags, unixfs->fsendian,
+                          &unixfs->fsname, &unixfs->volname)) == NULL) {
+        fprintf(stderr, "failed to initialize file system\n");
+        return 1;
+    }
+
+    printf("%s: %s (%s), mounted in %.3f ms, %llu bytes read\n", dmg,
+           unixfs->fsname, unixfs->volname ? unixfs->volname : "",
+           (double)(unixfs_bench_now() - start) / 1e6,
+           (unsigned long long)(unixfs_dev_bytesread() - devbytes));
+    printf("%-9s %10s %12s %9s %9s %9s %10s %12s %12s %6s\n",
+           "workload", "ops", "ops/s", "p50 us", "p90 us", "p99 us",
+           "max us", "bytes", "image bytes", "errors");
+
+    if (unixfs->threadsafe)
+        (void)unixfs_readahead_start(unixfs->ops->pbread);
+
+    srandom(seed);
+
+    /* the walk feeds every other workload, so it always runs */
+    unixfs_bench_walk();
+
+    char* list = strdup(workload);
+    char* next = list;
+    char* w;
+
+    while ((w = strsep(&next, ",")) != NULL) {
+        if (strcmp(w, "walk") == 0)
+            continue;
+        else if (strcmp(w, "stat") == 0)
+            unixfs_bench_stat(nops);
+        else if (strcmp(w, "seqread") == 0)
+            unixfs_bench_seqread();
+        else if (strcmp(w, "randread") == 0)
+            unixfs_bench_randread(nops);
+        else if (strcmp(w, "bigdir") == 0)
+            unixfs_bench_bigdir(nops);
+        else if (strcmp(w, "lookup") == 0)
+            unixfs_bench_lookup(nops);
+        else if (strcmp(w, "statfs") == 0)
+            unixfs_bench_statfs(nops);
+        else if (strcmp(w, "concurrent") == 0)
+            unixfs_bench_concurrent(nops);
+        else
+            fprintf(stderr, "unknown workload %s\n", w);
+    }
+
+    free(list);
+
+    printf("%zu directories, %zu regular files, %zu inodes\n",
+           bench_dirs.count, bench_files.count, bench_inodes.count);
+
+    unixfs_readahead_stop();
+
+    unixfs->ops->fini(unixfs->filsys);
+
+    free(bench_dirs.items);
+    free(bench_files.items);
+    free(bench_inodes.items);
+
+    return 0;
+}
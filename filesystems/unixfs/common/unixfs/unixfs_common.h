@@ -24,6 +24,14 @@ static int           unixfs_internal_bread(off_t blkno, char *blkbuf);
 static struct inode* unixfs_internal_iget(ino_t ino);
 static void          unixfs_internal_iput(struct inode* ip);
 static int           unixfs_internal_igetattr(ino_t ino, struct stat *stbuf);
+#ifdef UNIXFS_HAVE_IGETATTR_MANY
+static void          unixfs_internal_igetattr_many(ino_t* inos,
+                                                   struct stat* stbufs,
+                                                   int* errors, size_t count);
+#define UNIXFS_IGETATTR_MANY unixfs_internal_igetattr_many
+#else
+#define UNIXFS_IGETATTR_MANY NULL
+#endif
 static void          unixfs_internal_istat(struct inode* ip,
                                            struct stat* stbuf);
 static int           unixfs_internal_namei(ino_t parentino, const char *name,
@@ -32,38 +40,92 @@ static int           unixfs_internal_nextdirentry(struct inode* ip,
                                                   struct unixfs_dirbuf* dirbuf,
                                                   off_t* offset,
                                                   struct unixfs_direntry* dent);
+#ifdef UNIXFS_HAVE_READDIR_BATCH
+static ssize_t       unixfs_internal_readdir_batch(
+                         struct inode* ip, off_t* offset,
+                         struct unixfs_direntry* dents, size_t count);
+#define UNIXFS_READDIR_BATCH unixfs_internal_readdir_batch
+#else
+#define UNIXFS_READDIR_BATCH NULL
+#endif
 static ssize_t       unixfs_internal_pbread(struct inode* ip, char* buf,
                                             size_t nbyte, off_t offset,
                                             int* error);
+#ifdef UNIXFS_HAVE_PMAP
+static const char*   unixfs_internal_pmap(struct inode* ip, off_t offset,
+                                          size_t nbyte);
+#define UNIXFS_PMAP unixfs_internal_pmap
+#else
+#define UNIXFS_PMAP NULL
+#endif
+#ifdef UNIXFS_HAVE_DIRINDEX
+#define UNIXFS_DIRINDEX 1
+#else
+#define UNIXFS_DIRINDEX 0
+#endif
 static int           unixfs_internal_sanitycheck(void* filsys, off_t disksize);
 static int           unixfs_internal_readlink(ino_t ino,
                                               char path[UNIXFS_MAXPATHLEN]);
 static int           unixfs_internal_statvfs(struct statvfs* svb);
 
-/* To be used in file-system-specific code. */
+/*
+ * To be used in file-system-specific code.
+ *
+ * Backends declared this way are marked thread safe: the inode layer, the
+ * buffer cache and the extent map lock for themselves, and after init() a
+ * backend changes nothing shared without a lock of its own. In particular,
+ * a directory's read position lives in the caller's dirbuf and offset, not
+ * in the inode, and the page a lookup should start at is kept through
+ * unixfs_inodelayer_{get,set}dirhint(). A backend that cannot promise this
+ * must clear unixfs_<sufx>.threadsafe, and main() will then refuse to run
+ * the multithreaded loop for it.
+ *
+ * A backend that can fetch many inodes' attributes at once defines
+ * UNIXFS_HAVE_IGETATTR_MANY before including this file and implements
+ * unixfs_internal_igetattr_many(); readdir then uses it.
+ *
+ * One that can decode a whole directory page at a time defines
+ * UNIXFS_HAVE_READDIR_BATCH and implements unixfs_internal_readdir_batch(),
+ * which fills an array with the live entries from *offset on and returns
+ * how many it found, 0 at the end; otherwise directories are enumerated an
+ * entry at a time through unixfs_internal_nextdirentry().
+ *
+ * Likewise, one whose file data lies contiguously on the device defines
+ * UNIXFS_HAVE_PMAP and implements unixfs_internal_pmap(), which returns
+ * where a range of a file sits in the device mapping (see --mmap), if it is
+ * mapped; read then replies straight from there.
+ *
+ * One whose namei() answers from a struct unixfs_dirindex, at least for
+ * directories bigger than UNIXFS_DIRINDEX_MINSIZE, defines
+ * UNIXFS_HAVE_DIRINDEX; the benchmark then checks that it does.
+ */
 
-#define DECL_UNIXFS(fsname, sufx)                     \
-    static struct unixfs_ops ops_##sufx = {           \
-        .init         = unixfs_internal_init,         \
-        .fini         = unixfs_internal_fini,         \
-        .alloc        = unixfs_internal_alloc,        \
-        .bmap         = unixfs_internal_bmap,         \
-        .bread        = unixfs_internal_bread,        \
-        .iget         = unixfs_internal_iget,         \
-        .iput         = unixfs_internal_iput,         \
-        .igetattr     = unixfs_internal_igetattr,     \
-        .istat        = unixfs_internal_istat,        \
-        .namei        = unixfs_internal_namei,        \
-        .nextdirentry = unixfs_internal_nextdirentry, \
-        .pbread       = unixfs_internal_pbread,       \
-        .readlink     = unixfs_internal_readlink,     \
-        .sanitycheck  = unixfs_internal_sanitycheck,  \
-        .statvfs      = unixfs_internal_statvfs,      \
-    };                                                \
-    struct unixfs unixfs_##sufx = {                   \
-        &ops_##sufx, NULL, -1, 0                      \
-    };                                                \
-    static struct super_block* unixfs = NULL;         \
+#define DECL_UNIXFS(fsname, sufx)                      \
+    static struct unixfs_ops ops_##sufx = {            \
+        .init          = unixfs_internal_init,         \
+        .fini          = unixfs_internal_fini,         \
+        .alloc         = unixfs_internal_alloc,        \
+        .bmap          = unixfs_internal_bmap,         \
+        .bread         = unixfs_internal_bread,        \
+        .iget          = unixfs_internal_iget,         \
+        .iput          = unixfs_internal_iput,         \
+        .igetattr      = unixfs_internal_igetattr,     \
+        .igetattr_many = UNIXFS_IGETATTR_MANY,         \
+        .istat         = unixfs_internal_istat,        \
+        .namei         = unixfs_internal_namei,        \
+        .nextdirentry  = unixfs_internal_nextdirentry, \
+        .readdir_batch = UNIXFS_READDIR_BATCH,         \
+        .pbread        = unixfs_internal_pbread,       \
+        .pmap          = UNIXFS_PMAP,                  \
+        .readlink      = unixfs_internal_readlink,     \
+        .sanitycheck   = unixfs_internal_sanitycheck,  \
+        .statvfs       = unixfs_internal_statvfs,      \
+    };                                                 \
+    struct unixfs unixfs_##sufx = {                    \
+        &ops_##sufx, NULL, -1, 0, NULL, NULL, 1,       \
+        UNIXFS_DIRINDEX                                \
+    };                                                 \
+    static struct super_block* unixfs = NULL;          \
     static const char* unixfs_fstype = fsname;
 
 #endif /* _UNIXFS_COMMON_H_ */
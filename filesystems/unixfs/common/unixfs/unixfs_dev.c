@@ -0,0 +1,835 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * Device layer.
+ *
+ * Backends open their image with unixfs_dev_open() and do all their I/O on
+ * it through the unixfs_dev_*() calls below. For an ordinary image these
+ * are just the system calls. An image that is gzip compressed (one member or
+ * several, as pigz and bgzip write) is instead read in place, without first
+ * being decompressed to scratch space.
+ *
+ * Deflate data can't be entered at an arbitrary offset, so as the image is
+ * first read we note an access point about every UNIXFS_GZ_SPAN bytes of
+ * output: where the deflate block starting there lies in the compressed
+ * file, and the 32 KB of output preceding it that its back references may
+ * reach into. The index grows only as far as it has been read. A read then
+ * inflates the spans it touches from their access points; the most recently
+ * used spans are kept decompressed.
+ *
+ * fstat() needs the decompressed size before anything has been read, and
+ * takes it from the gzip trailers rather than inflating the whole image;
+ * see unixfs_gz_size().
+ */
+
+#include "unixfs_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define UNIXFS_GZ_SPAN    (1024 * 1024) /* output between access points */
+#define UNIXFS_GZ_WINSIZE 32768         /* deflate history */
+#define UNIXFS_GZ_INSIZE  16384         /* compressed bytes per read */
+#define UNIXFS_GZ_NSPANS  16            /* decompressed spans kept */
+
+struct unixfs_gzpoint {
+    off_t         gp_out;  /* offset in the decompressed image */
+    off_t         gp_in;   /* first whole compressed byte of the block */
+    int           gp_bits; /* bits of the byte before gp_in that belong */
+    unsigned char gp_window[UNIXFS_GZ_WINSIZE];
+};
+
+struct unixfs_gzspan {
+    TAILQ_ENTRY(unixfs_gzspan) gs_link;
+    size_t   gs_index;
+    size_t   gs_len;
+    uint32_t gs_count;
+    int      gs_loading; /* being inflated; wait on gz_cond */
+    int      gs_error;   /* inflating it failed; off the list */
+    char*    gs_data;
+};
+
+struct unixfs_gzdev {
+    struct unixfs_gzdev*    gz_next;
+    int                     gz_fd;
+    pthread_mutex_t         gz_lock;
+    pthread_cond_t          gz_cond;     /* a span is done inflating */
+    off_t                   gz_pos;      /* for read() and lseek() */
+
+    /* the index, and where building it left off */
+    struct unixfs_gzpoint** gz_points;
+    size_t                  gz_npoints;
+    size_t                  gz_maxpoints;
+    int                     gz_complete;
+    off_t                   gz_size;     /* per the trailers; 0 => unknown */
+    int                     gz_nmembers;
+    int                     gz_memberstart;
+    z_stream                gz_strm;
+    off_t                   gz_in;
+    off_t                   gz_out;
+    unsigned char           gz_inbuf[UNIXFS_GZ_INSIZE];
+    unsigned char           gz_window[UNIXFS_GZ_WINSIZE];
+
+    /* decompressed spans, least recently used first */
+    TAILQ_HEAD(gz_span_head, unixfs_gzspan) gz_spans;
+    size_t                  gz_nspans;
+};
+
+/*
+ * Devices are only opened and closed while mounting and unmounting, before
+ * and after any request is served, so the list needs no lock.
+ */
+static struct unixfs_gzdev* unixfs_gzdevs = NULL;
+
+static pthread_mutex_t unixfs_dev_statlock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        unixfs_dev_nbytes; /* read from image files */
+
+static void
+unixfs_dev_account(ssize_t nbytes)
+{
+    if (nbytes <= 0)
+        return;
+
+    pthread_mutex_lock(&unixfs_dev_statlock);
+    unixfs_dev_nbytes += (uint64_t)nbytes;
+    pthread_mutex_unlock(&unixfs_dev_statlock);
+}
+
+/* pread(2) on the file itself, compressed or not. */
+static ssize_t
+unixfs_dev_sysread(int fd, void* buf, size_t nbyte, off_t offset)
+{
+    ssize_t ret = pread(fd, buf, nbyte, offset);
+
+    unixfs_dev_account(ret);
+
+    return ret;
+}
+
+static struct unixfs_gzdev*
+unixfs_dev_lookup(int fd)
+{
+    struct unixfs_gzdev* gz;
+
+    for (gz = unixfs_gzdevs; gz != NULL; gz = gz->gz_next)
+        if (gz->gz_fd == fd)
+            return gz;
+
+    return NULL;
+}
+
+static int
+unixfs_gz_addpoint(struct unixfs_gzdev* gz)
+{
+    if (gz->gz_npoints == gz->gz_maxpoints) {
+        size_t n = gz->gz_maxpoints ? (gz->gz_maxpoints * 2) : 64;
+        struct unixfs_gzpoint** points =
+            realloc(gz->gz_points, n * sizeof(struct unixfs_gzpoint*));
+        if (!points)
+            return ENOMEM;
+        gz->gz_points = points;
+        gz->gz_maxpoints = n;
+    }
+
+    struct unixfs_gzpoint* pt = malloc(sizeof(struct unixfs_gzpoint));
+    if (!pt)
+        return ENOMEM;
+
+    z_stream* strm = &gz->gz_strm;
+
+    pt->gp_out = gz->gz_out;
+    pt->gp_in = gz->gz_in - strm->avail_in;
+    pt->gp_bits = strm->data_type & 7;
+
+    /* gz_window is circular; the oldest output starts at next_out */
+    size_t left = strm->avail_out;
+    if (left)
+        memcpy(pt->gp_window, gz->gz_window + UNIXFS_GZ_WINSIZE - left, left);
+    if (left < UNIXFS_GZ_WINSIZE)
+        memcpy(pt->gp_window + left, gz->gz_window, UNIXFS_GZ_WINSIZE - left);
+
+    gz->gz_points[gz->gz_npoints++] = pt;
+
+    return 0;
+}
+
+static void
+unixfs_gz_finish(struct unixfs_gzdev* gz)
+{
+    gz->gz_complete = 1;
+    (void)inflateEnd(&gz->gz_strm);
+
+    if (gz->gz_size && (gz->gz_size != gz->gz_out))
+        fprintf(stderr, "*** warning: compressed image is %llu bytes, not "
+                "%llu as its gzip trailer says\n",
+                (unsigned long long)gz->gz_out,
+                (unsigned long long)gz->gz_size);
+}
+
+/*
+ * Inflates on from where the index left off until there is an access point
+ * past upto, or the image ends. Called with gz_lock held.
+ */
+static int
+unixfs_gz_extend(struct unixfs_gzdev* gz, off_t upto)
+{
+    z_stream* strm = &gz->gz_strm;
+
+    while (!gz->gz_complete) {
+
+        if (gz->gz_npoints &&
+            (gz->gz_points[gz->gz_npoints - 1]->gp_out > upto))
+            break;
+
+        if (strm->avail_in == 0) {
+            ssize_t ret = unixfs_dev_sysread(gz->gz_fd, gz->gz_inbuf,
+                                             UNIXFS_GZ_INSIZE, gz->gz_in);
+            if (ret < 0)
+                return EIO;
+            if (ret == 0) {
+                if (!gz->gz_memberstart)
+                    return EIO; /* truncated */
+                unixfs_gz_finish(gz);
+                break;
+            }
+            gz->gz_in += ret;
+            strm->next_in = gz->gz_inbuf;
+            strm->avail_in = (uInt)ret;
+        }
+
+        if (strm->avail_out == 0) {
+            strm->next_out = gz->gz_window;
+            strm->avail_out = UNIXFS_GZ_WINSIZE;
+        }
+
+        uInt before = strm->avail_out;
+        int ret = inflate(strm, Z_BLOCK);
+        gz->gz_out += before - strm->avail_out;
+
+        if (ret == Z_STREAM_END) {
+            gz->gz_nmembers++;
+            gz->gz_memberstart = 1;
+            (void)inflateReset(strm);
+            continue;
+        }
+
+        if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            if (gz->gz_memberstart && gz->gz_nmembers) {
+                unixfs_gz_finish(gz); /* padding after the last member */
+                break;
+            }
+            return (ret == Z_MEM_ERROR) ? ENOMEM : EIO;
+        }
+
+        if (strm->data_type & 128) { /* at a block boundary */
+            gz->gz_memberstart = 0;
+            if (!(strm->data_type & 64) &&
+                ((gz->gz_npoints == 0) ||
+                 (gz->gz_out - gz->gz_points[gz->gz_npoints - 1]->gp_out >=
+                  UNIXFS_GZ_SPAN))) {
+                int error = unixfs_gz_addpoint(gz);
+                if (error)
+                    return error;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t
+unixfs_gz_le32(const unsigned char* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Sums the ISIZE of every member of a BGZF image (as bgzip writes), each of
+ * whose headers gives the member's length in a "BC" extra field. Returns 0
+ * if the image isn't made of such members.
+ */
+static off_t
+unixfs_gz_bgzfsize(struct unixfs_gzdev* gz, off_t insize)
+{
+    unsigned char hdr[12 + 256];
+    off_t in = 0, size = 0;
+
+    while (in < insize) {
+        ssize_t n = unixfs_dev_sysread(gz->gz_fd, hdr, sizeof(hdr), in);
+        if ((n < 18) || (hdr[0] != 0x1f) || (hdr[1] != 0x8b) ||
+            !(hdr[3] & 0x04))
+            return 0;
+
+        size_t xlen = hdr[10] | (hdr[11] << 8);
+        size_t x = 12;
+        off_t bsize = 0;
+
+        if (12 + xlen > (size_t)n)
+            return 0;
+
+        while (x + 4 <= 12 + xlen) {
+            size_t slen = hdr[x + 2] | (hdr[x + 3] << 8);
+            if ((hdr[x] == 'B') && (hdr[x + 1] == 'C') && (slen == 2) &&
+                (x + 6 <= 12 + xlen)) {
+                bsize = (hdr[x + 4] | (hdr[x + 5] << 8)) + 1;
+                break;
+            }
+            x += 4 + slen;
+        }
+
+        unsigned char trailer[4];
+        if ((bsize < 12 + (off_t)xlen + 8) || (in + bsize > insize) ||
+            (unixfs_dev_sysread(gz->gz_fd, trailer, 4, in + bsize - 4) != 4))
+            return 0;
+
+        size += unixfs_gz_le32(trailer);
+        in += bsize;
+    }
+
+    return size;
+}
+
+/*
+ * The decompressed size, without inflating the image. The last 4 bytes of a
+ * gzip member (ISIZE) are its decompressed length mod 2^32. A BGZF image's
+ * members can all be found, so it is their sum; otherwise, as gzip -l does,
+ * we take the image to be a single member. Deflate output is never much
+ * smaller than its input, though, so an ISIZE that is means an image of 4 GB
+ * or more, or one of several members, and then, as when the trailer doesn't
+ * look like one at all (padding, say), there is nothing to do but inflate.
+ * Called with gz_lock held.
+ */
+static int
+unixfs_gz_size(struct unixfs_gzdev* gz, off_t* size)
+{
+    struct stat stbuf;
+    unsigned char trailer[8];
+
+    if (gz->gz_complete) {
+        *size = gz->gz_out;
+        return 0;
+    }
+
+    if (gz->gz_size) {
+        *size = gz->gz_size;
+        return 0;
+    }
+
+    if (fstat(gz->gz_fd, &stbuf) != 0)
+        return errno;
+
+    off_t insize = stbuf.st_size;
+    off_t guess = unixfs_gz_bgzfsize(gz, insize);
+
+    if (!guess && (insize > 18 + 8) &&
+        (unixfs_dev_sysread(gz->gz_fd, trailer, 8, insize - 8) == 8) &&
+        (unixfs_gz_le32(trailer) || unixfs_gz_le32(trailer + 4))) {
+        guess = unixfs_gz_le32(trailer + 4);
+        if ((guess < insize - insize / 8192 - 65536) ||
+            (guess / 1032 > insize)) /* deflate's best ratio */
+            guess = 0;
+    }
+
+    if (!guess) {
+        int error = unixfs_gz_extend(gz, (off_t)INT64_MAX);
+        if (error)
+            return error;
+        *size = gz->gz_out;
+        return 0;
+    }
+
+    gz->gz_size = guess;
+    *size = guess;
+
+    return 0;
+}
+
+/* Inflates the len bytes of output that follow access point pt. */
+static int
+unixfs_gz_inflate(struct unixfs_gzdev* gz, struct unixfs_gzpoint* pt,
+                  char* out, size_t len)
+{
+    unsigned char inbuf[UNIXFS_GZ_INSIZE];
+    z_stream strm;
+    int error = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) /* raw: we start mid-member */
+        return ENOMEM;
+
+    off_t in = pt->gp_in;
+
+    if (pt->gp_bits) {
+        unsigned char c;
+        if (unixfs_dev_sysread(gz->gz_fd, &c, 1, in - 1) != 1) {
+            error = EIO;
+            goto out;
+        }
+        (void)inflatePrime(&strm, pt->gp_bits, c >> (8 - pt->gp_bits));
+    }
+
+    (void)inflateSetDictionary(&strm, pt->gp_window, UNIXFS_GZ_WINSIZE);
+
+    int raw = 1;
+    size_t skip = 0;
+
+    strm.next_out = (Bytef*)out;
+    strm.avail_out = (uInt)len;
+
+    while (strm.avail_out) {
+
+        if (strm.avail_in == 0) {
+            ssize_t ret = unixfs_dev_sysread(gz->gz_fd, inbuf, sizeof(inbuf),
+                                             in);
+            if (ret <= 0) {
+                error = EIO;
+                break;
+            }
+            in += ret;
+            strm.next_in = inbuf;
+            strm.avail_in = (uInt)ret;
+        }
+
+        if (skip) {
+            size_t n = (skip < strm.avail_in) ? skip : strm.avail_in;
+            strm.next_in += n;
+            strm.avail_in -= (uInt)n;
+            skip -= n;
+            continue;
+        }
+
+        int ret = inflate(&strm, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            /*
+             * On into the next member. Raw inflation leaves the trailer of
+             * this one for us to step over; gzip inflation eats it.
+             */
+            if (raw) {
+                skip = 8;
+                raw = 0;
+                (void)inflateReset2(&strm, 31);
+            } else
+                (void)inflateReset(&strm);
+            continue;
+        }
+
+        if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            error = (ret == Z_MEM_ERROR) ? ENOMEM : EIO;
+            break;
+        }
+    }
+
+out:
+    (void)inflateEnd(&strm);
+
+    return error;
+}
+
+/* The last access point at or before offset. Called with gz_lock held. */
+static size_t
+unixfs_gz_findpoint(struct unixfs_gzdev* gz, off_t offset)
+{
+    size_t lo = 0, hi = gz->gz_npoints;
+
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gz->gz_points[mid]->gp_out <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Drops a reference. Called with gz_lock held. */
+static void
+unixfs_gz_releasespan(struct unixfs_gzspan* gs)
+{
+    if ((--gs->gs_count == 0) && gs->gs_error) {
+        free(gs->gs_data);
+        free(gs);
+    }
+}
+
+static void
+unixfs_gz_putspan(struct unixfs_gzdev* gz, struct unixfs_gzspan* gs)
+{
+    pthread_mutex_lock(&gz->gz_lock);
+    unixfs_gz_releasespan(gs);
+    pthread_mutex_unlock(&gz->gz_lock);
+}
+
+/*
+ * Returns span index decompressed and referenced. A reader that misses on a
+ * span someone else is already inflating waits for it rather than inflate
+ * it again.
+ */
+static struct unixfs_gzspan*
+unixfs_gz_getspan(struct unixfs_gzdev* gz, size_t index, int* error)
+{
+    struct unixfs_gzspan* gs;
+
+    pthread_mutex_lock(&gz->gz_lock);
+
+    TAILQ_FOREACH(gs, &gz->gz_spans, gs_link)
+        if (gs->gs_index == index)
+            break;
+
+    if (gs) {
+        TAILQ_REMOVE(&gz->gz_spans, gs, gs_link);
+        TAILQ_INSERT_TAIL(&gz->gz_spans, gs, gs_link);
+        gs->gs_count++;
+        while (gs->gs_loading)
+            pthread_cond_wait(&gz->gz_cond, &gz->gz_lock);
+        if (gs->gs_error) {
+            *error = gs->gs_error;
+            unixfs_gz_releasespan(gs);
+            gs = NULL;
+        }
+        pthread_mutex_unlock(&gz->gz_lock);
+        return gs;
+    }
+
+    /* the points themselves never move, though the array holding them may */
+    struct unixfs_gzpoint* pt = gz->gz_points[index];
+    off_t end = (index + 1 < gz->gz_npoints) ?
+        gz->gz_points[index + 1]->gp_out : gz->gz_out;
+
+    gs = calloc(1, sizeof(struct unixfs_gzspan));
+    if (gs)
+        gs->gs_data = malloc((size_t)(end - pt->gp_out));
+    if (!gs || !gs->gs_data) {
+        pthread_mutex_unlock(&gz->gz_lock);
+        free(gs);
+        *error = ENOMEM;
+        return NULL;
+    }
+
+    gs->gs_index = index;
+    gs->gs_len = (size_t)(end - pt->gp_out);
+    gs->gs_count = 1;
+    gs->gs_loading = 1;
+
+    TAILQ_INSERT_TAIL(&gz->gz_spans, gs, gs_link);
+    gz->gz_nspans++;
+
+    pthread_mutex_unlock(&gz->gz_lock);
+
+    *error = unixfs_gz_inflate(gz, pt, gs->gs_data, gs->gs_len);
+
+    pthread_mutex_lock(&gz->gz_lock);
+
+    gs->gs_loading = 0;
+    pthread_cond_broadcast(&gz->gz_cond);
+
+    if (*error) {
+        gs->gs_error = *error;
+        TAILQ_REMOVE(&gz->gz_spans, gs, gs_link);
+        gz->gz_nspans--;
+        unixfs_gz_releasespan(gs);
+        pthread_mutex_unlock(&gz->gz_lock);
+        return NULL;
+    }
+
+    struct unixfs_gzspan* other;
+    struct unixfs_gzspan* next;
+    for (other = TAILQ_FIRST(&gz->gz_spans);
+         other && (gz->gz_nspans > UNIXFS_GZ_NSPANS); other = next) {
+        next = TAILQ_NEXT(other, gs_link);
+        if (other->gs_count)
+            continue;
+        TAILQ_REMOVE(&gz->gz_spans, other, gs_link);
+        gz->gz_nspans--;
+        free(other->gs_data);
+        free(other);
+    }
+
+    pthread_mutex_unlock(&gz->gz_lock);
+
+    return gs;
+}
+
+static ssize_t
+unixfs_gz_pread(struct unixfs_gzdev* gz, void* buf, size_t nbyte,
+                off_t offset)
+{
+    if (offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nbyte == 0)
+        return 0;
+
+    pthread_mutex_lock(&gz->gz_lock);
+    int error = unixfs_gz_extend(gz, offset + (off_t)nbyte - 1);
+    off_t known = gz->gz_out;
+    pthread_mutex_unlock(&gz->gz_lock);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    if (offset >= known)
+        return 0;
+
+    if (nbyte > (size_t)(known - offset))
+        nbyte = (size_t)(known - offset);
+
+    char* p = buf;
+    size_t done = 0;
+
+    while (done < nbyte) {
+        off_t pos = offset + (off_t)done;
+
+        pthread_mutex_lock(&gz->gz_lock);
+        size_t index = unixfs_gz_findpoint(gz, pos);
+        off_t start = gz->gz_points[index]->gp_out;
+        pthread_mutex_unlock(&gz->gz_lock);
+
+        struct unixfs_gzspan* gs = unixfs_gz_getspan(gz, index, &error);
+        if (!gs) {
+            if (done)
+                break;
+            errno = error;
+            return -1;
+        }
+
+        size_t skip = (size_t)(pos - start);
+        size_t n = gs->gs_len - skip;
+        if (n > nbyte - done)
+            n = nbyte - done;
+
+        memcpy(p + done, gs->gs_data + skip, n);
+        done += n;
+
+        unixfs_gz_putspan(gz, gs);
+    }
+
+    return (ssize_t)done;
+}
+
+static void
+unixfs_gz_free(struct unixfs_gzdev* gz)
+{
+    struct unixfs_gzspan* gs;
+    size_t i;
+
+    while ((gs = TAILQ_FIRST(&gz->gz_spans)) != NULL) {
+        TAILQ_REMOVE(&gz->gz_spans, gs, gs_link);
+        free(gs->gs_data);
+        free(gs);
+    }
+
+    for (i = 0; i < gz->gz_npoints; i++)
+        free(gz->gz_points[i]);
+    free(gz->gz_points);
+
+    if (!gz->gz_complete)
+        (void)inflateEnd(&gz->gz_strm);
+
+    (void)pthread_cond_destroy(&gz->gz_cond);
+    (void)pthread_mutex_destroy(&gz->gz_lock);
+    free(gz);
+}
+
+int
+unixfs_dev_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return fd;
+
+    unsigned char magic[2];
+    if ((pread(fd, magic, sizeof(magic), (off_t)0) != sizeof(magic)) ||
+        (magic[0] != 0x1f) || (magic[1] != 0x8b))
+        return fd; /* not compressed */
+
+    struct unixfs_gzdev* gz = calloc(1, sizeof(struct unixfs_gzdev));
+    if (!gz)
+        goto nomem;
+
+    TAILQ_INIT(&gz->gz_spans);
+    gz->gz_fd = fd;
+    gz->gz_memberstart = 1;
+    gz->gz_strm.next_out = gz->gz_window;
+    gz->gz_strm.avail_out = UNIXFS_GZ_WINSIZE;
+
+    if (inflateInit2(&gz->gz_strm, 31) != Z_OK) { /* gzip only */
+        free(gz);
+        goto nomem;
+    }
+
+    if (pthread_mutex_init(&gz->gz_lock, (const pthread_mutexattr_t*)0)) {
+        (void)inflateEnd(&gz->gz_strm);
+        free(gz);
+        goto nomem;
+    }
+
+    if (pthread_cond_init(&gz->gz_cond, (const pthread_condattr_t*)0)) {
+        (void)pthread_mutex_destroy(&gz->gz_lock);
+        (void)inflateEnd(&gz->gz_strm);
+        free(gz);
+        goto nomem;
+    }
+
+    gz->gz_next = unixfs_gzdevs;
+    unixfs_gzdevs = gz;
+
+    return fd;
+
+nomem:
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+}
+
+int
+unixfs_dev_close(int fd)
+{
+    struct unixfs_gzdev** gzp;
+
+    for (gzp = &unixfs_gzdevs; *gzp != NULL; gzp = &(*gzp)->gz_next) {
+        if ((*gzp)->gz_fd == fd) {
+            struct unixfs_gzdev* gz = *gzp;
+            *gzp = gz->gz_next;
+            unixfs_gz_free(gz);
+            break;
+        }
+    }
+
+    return close(fd);
+}
+
+int
+unixfs_dev_compressed(int fd)
+{
+    return (unixfs_dev_lookup(fd) != NULL);
+}
+
+/* For a compressed image, st_size is that of the decompressed image. */
+int
+unixfs_dev_fstat(int fd, struct stat* stbuf)
+{
+    if (fstat(fd, stbuf) != 0)
+        return -1;
+
+    struct unixfs_gzdev* gz = unixfs_dev_lookup(fd);
+    if (!gz)
+        return 0;
+
+    off_t size;
+
+    pthread_mutex_lock(&gz->gz_lock);
+    int error = unixfs_gz_size(gz, &size);
+    pthread_mutex_unlock(&gz->gz_lock);
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    stbuf->st_size = size;
+    stbuf->st_blocks = (size + 511) / 512;
+
+    return 0;
+}
+
+ssize_t
+unixfs_dev_pread(int fd, void* buf, size_t nbyte, off_t offset)
+{
+    struct unixfs_gzdev* gz = unixfs_dev_lookup(fd);
+
+    if (!gz)
+        return unixfs_dev_sysread(fd, buf, nbyte, offset);
+
+    return unixfs_gz_pread(gz, buf, nbyte, offset);
+}
+
+ssize_t
+unixfs_dev_read(int fd, void* buf, size_t nbyte)
+{
+    struct unixfs_gzdev* gz = unixfs_dev_lookup(fd);
+
+    if (!gz) {
+        ssize_t ret = read(fd, buf, nbyte);
+        unixfs_dev_account(ret);
+        return ret;
+    }
+
+    ssize_t ret = unixfs_gz_pread(gz, buf, nbyte, gz->gz_pos);
+    if (ret > 0)
+        gz->gz_pos += ret;
+
+    return ret;
+}
+
+off_t
+unixfs_dev_lseek(int fd, off_t offset, int whence)
+{
+    struct unixfs_gzdev* gz = unixfs_dev_lookup(fd);
+
+    if (!gz)
+        return lseek(fd, offset, whence);
+
+    off_t base;
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = gz->gz_pos;
+        break;
+    case SEEK_END: {
+        struct stat stbuf;
+        if (unixfs_dev_fstat(fd, &stbuf) != 0)
+            return (off_t)-1;
+        base = stbuf.st_size;
+        break;
+    }
+    default:
+        errno = EINVAL;
+        return (off_t)-1;
+    }
+
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return (off_t)-1;
+    }
+
+    gz->gz_pos = base + offset;
+
+    return gz->gz_pos;
+}
+
+/*
+ * Bytes read from image files so far, all devices together. Reads served
+ * from a --mmap mapping never reach here.
+ */
+uint64_t
+unixfs_dev_bytesread(void)
+{
+    pthread_mutex_lock(&unixfs_dev_statlock);
+    uint64_t nbytes = unixfs_dev_nbytes;
+    pthread_mutex_unlock(&unixfs_dev_statlock);
+
+    return nbytes;
+}
@@ -16,21 +16,106 @@
 #include "unixfs_internal.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct unixfs_tunables unixfs_tunables = {
+    UNIXFS_DEFAULT_CACHESIZE,  /* cachesize */
+    UNIXFS_DEFAULT_INODECACHE, /* inodecache */
+    NULL,                      /* indexpath */
+    UNIXFS_DEFAULT_READAHEAD,  /* readahead */
+    0,                         /* verifycgs */
+    0,                         /* immutable */
+    UNIXFS_DEFAULT_TIMEOUT,    /* entrytimeout */
+    UNIXFS_DEFAULT_TIMEOUT,    /* attrtimeout */
+    0,                         /* mmap */
+};
+
+/*
+ * The inode hash is split into lock-striped shards so that lookups of
+ * unrelated inodes don't serialize on a single mutex. Each shard also keeps
+ * a small pool of recycled inode allocations and, if so configured through
+ * unixfs_tunables.inodecache, an LRU list of unreferenced but initialized
+ * inodes that a later iget can pick up without going back to the disk.
+ */
+
+#define UNIXFS_IHASH_NSHARDS 16   /* must be a power of 2 */
+#define UNIXFS_IFREE_MAX     64   /* recycled allocations kept per shard */
 
 static int desirednodes = 65536;
-static pthread_mutex_t ihash_lock;
-static LIST_HEAD(ihash_head, inode) *ihash_table = NULL;
-typedef struct ihash_head ihash_head;
-static size_t ihash_count = 0;
 static size_t iprivsize = 0;
+static size_t ikeep_per_shard = 0;
+
+typedef LIST_HEAD(ihash_head, inode) ihash_head;
+typedef TAILQ_HEAD(ilist_head, inode) ilist_head;
+
+static struct ihash_shard {
+    pthread_mutex_t ihs_lock;
+    ihash_head*     ihs_table;
+    u_long          ihs_mask;
+    size_t          ihs_count;  /* inodes in the hash, cached ones included */
+    ilist_head      ihs_lru;    /* unreferenced, initialized inodes */
+    size_t          ihs_nlru;
+    ilist_head      ihs_free;   /* recycled allocations, not in the hash */
+    size_t          ihs_nfree;
+    uint64_t        ihs_hits;   /* igets that found the inode in the hash */
+    uint64_t        ihs_misses;
+} ihash_shards[UNIXFS_IHASH_NSHARDS];
+
+static int ihash_initialized = 0;
 
-static u_long ihash_mask;
+static struct ihash_shard*
+unixfs_inodelayer_shard(ino_t ino)
+{
+    return &ihash_shards[ino & (UNIXFS_IHASH_NSHARDS - 1)];
+}
 
 static ihash_head*
-unixfs_inodelayer_firstfromhash(ino_t ino)
+unixfs_inodelayer_firstfromhash(struct ihash_shard* shard, ino_t ino)
+{
+    return &shard->ihs_table[(ino / UNIXFS_IHASH_NSHARDS) & shard->ihs_mask];
+}
+
+/* Called with the shard lock held. */
+static struct inode*
+unixfs_inodelayer_alloc(struct ihash_shard* shard, ino_t ino)
+{
+    struct inode* ip = TAILQ_FIRST(&shard->ihs_free);
+
+    if (ip != NULL) {
+        TAILQ_REMOVE(&shard->ihs_free, ip, I_freelink);
+        shard->ihs_nfree--;
+        memset(ip, 0, sizeof(struct inode) + iprivsize);
+    } else {
+        ip = calloc(1, sizeof(struct inode) + iprivsize);
+        if (ip == NULL)
+            return NULL;
+    }
+
+    ip->I_number = ino;
+    if (iprivsize)
+        ip->I_private = (void*)&((struct inode *)ip)[1];
+    (void)pthread_cond_init(&ip->I_state_cond, (const pthread_condattr_t*)0);
+
+    return ip;
+}
+
+/* Called with the shard lock held; ip must no longer be in the hash. */
+static void
+unixfs_inodelayer_release(struct ihash_shard* shard, struct inode* ip)
 {
-    return (ihash_head*)&ihash_table[ino & ihash_mask];
+    unixfs_extentmap_free(ip);
+    unixfs_dirindex_free(ip);
+    (void)pthread_cond_destroy(&ip->I_state_cond);
+
+    if (shard->ihs_nfree < UNIXFS_IFREE_MAX) {
+        TAILQ_INSERT_HEAD(&shard->ihs_free, ip, I_freelink);
+        shard->ihs_nfree++;
+    } else
+        free(ip);
 }
 
 int
@@ -39,36 +124,57 @@ unixfs_inodelayer_init(size_t privsize)
     if (!UNIXFS_ENABLE_INODEHASH)
         return 0;
 
-    if (pthread_mutex_init(&ihash_lock, (const pthread_mutexattr_t*)0)) {    
-        fprintf(stderr, "failed to initialize the inode layer lock\n");
-        return -1;
-    }
-
     iprivsize = privsize;
+    ikeep_per_shard = (unixfs_tunables.inodecache + UNIXFS_IHASH_NSHARDS - 1) /
+                      UNIXFS_IHASH_NSHARDS;
 
-    int i;
     u_long hashsize;
-    LIST_HEAD(generic, generic) *hashtbl;
 
-    for (hashsize = 1; hashsize <= desirednodes; hashsize <<= 1)
+    for (hashsize = 1; hashsize <= desirednodes / UNIXFS_IHASH_NSHARDS;
+         hashsize <<= 1)
             continue;
 
     hashsize >>= 1;
 
-    hashtbl = (struct generic *)malloc(hashsize * sizeof(*hashtbl));
-    if (hashtbl != NULL) {
+    int s;
+    for (s = 0; s < UNIXFS_IHASH_NSHARDS; s++) {
+        struct ihash_shard* shard = &ihash_shards[s];
+
+        memset(shard, 0, sizeof(*shard));
+
+        if (pthread_mutex_init(&shard->ihs_lock,
+                               (const pthread_mutexattr_t*)0)) {
+            fprintf(stderr, "failed to initialize the inode layer lock\n");
+            goto bad;
+        }
+
+        shard->ihs_table = malloc(hashsize * sizeof(ihash_head));
+        if (shard->ihs_table == NULL) {
+            (void)pthread_mutex_destroy(&shard->ihs_lock);
+            goto bad;
+        }
+
+        u_long i;
         for (i = 0; i < hashsize; i++)
-            LIST_INIT(&hashtbl[i]);
-         ihash_mask = hashsize - 1;
-         ihash_table = (struct ihash_head *)hashtbl;
-    }
+            LIST_INIT(&shard->ihs_table[i]);
+        shard->ihs_mask = hashsize - 1;
 
-    if (ihash_table == NULL) {
-        (void)pthread_mutex_destroy(&ihash_lock);
-        return -1;
+        TAILQ_INIT(&shard->ihs_lru);
+        TAILQ_INIT(&shard->ihs_free);
     }
-    
+
+    ihash_initialized = 1;
+
     return 0;
+
+bad:
+    while (--s >= 0) {
+        free(ihash_shards[s].ihs_table);
+        ihash_shards[s].ihs_table = NULL;
+        (void)pthread_mutex_destroy(&ihash_shards[s].ihs_lock);
+    }
+
+    return -1;
 }
 
 void
@@ -77,36 +183,53 @@ unixfs_inodelayer_fini(void)
     if (!UNIXFS_ENABLE_INODEHASH)
         return;
 
-    if (ihash_table != NULL) {
-        if (ihash_count != 0) {
+    if (!ihash_initialized)
+        return;
+
+    int s;
+    for (s = 0; s < UNIXFS_IHASH_NSHARDS; s++) {
+        struct ihash_shard* shard = &ihash_shards[s];
+        struct inode* ip;
+
+        /* Cached inodes are expected to be around; just drop them. */
+        while ((ip = TAILQ_FIRST(&shard->ihs_lru)) != NULL) {
+            TAILQ_REMOVE(&shard->ihs_lru, ip, I_freelink);
+            LIST_REMOVE(ip, I_hashlink);
+            shard->ihs_nlru--;
+            shard->ihs_count--;
+            unixfs_extentmap_free(ip);
+            unixfs_dirindex_free(ip);
+            (void)pthread_cond_destroy(&ip->I_state_cond);
+            free(ip);
+        }
+
+        if (shard->ihs_count != 0) {
             fprintf(stderr,
                     "*** warning: ihash terminated when not empty (%lu)\n",
-                    (unsigned long)ihash_count);
+                    (unsigned long)shard->ihs_count);
 
-            int node_index = 0;
             u_long ihash_index = 0;
-            for (; ihash_index < ihash_mask; ihash_index++) {
-                struct inode* ip;
-                LIST_FOREACH(ip, &ihash_table[ihash_index], I_hashlink) {
+            for (; ihash_index <= shard->ihs_mask; ihash_index++) {
+                LIST_FOREACH(ip, &shard->ihs_table[ihash_index], I_hashlink) {
                     fprintf(stderr, "*** warning: inode %llu still present\n",
-                            (ino64_t)ip->I_number);
-                    node_index++;
+                            (unsigned long long)ip->I_number);
                 }
             }
         }
 
-        u_long i;
-        for (i = 0; i < (ihash_mask + 1); i++) {
-            if (ihash_table[i].lh_first != NULL)
-                fprintf(stderr,
-                        "*** warning: found ihash_table[%lu].lh_first = %p\n",
-                        i, ihash_table[i].lh_first);
+        while ((ip = TAILQ_FIRST(&shard->ihs_free)) != NULL) {
+            TAILQ_REMOVE(&shard->ihs_free, ip, I_freelink);
+            free(ip);
         }
-        free(ihash_table);
-        ihash_table = NULL;
+        shard->ihs_nfree = 0;
+
+        free(shard->ihs_table);
+        shard->ihs_table = NULL;
+
+        (void)pthread_mutex_destroy(&shard->ihs_lock);
     }
 
-    (void)pthread_mutex_destroy(&ihash_lock);
+    ihash_initialized = 0;
 }
 
 struct inode *
@@ -122,87 +245,63 @@ unixfs_inodelayer_iget(ino_t ino)
         return new_node;
     }
 
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ino);
     struct inode* this_node = NULL;
-    struct inode* new_node = NULL;
-    int needs_unlock = 1;
-    int err;
 
-    pthread_mutex_lock(&ihash_lock);
+    pthread_mutex_lock(&shard->ihs_lock);
 
-    do {
-        err = EAGAIN;
-        this_node = LIST_FIRST(unixfs_inodelayer_firstfromhash(ino));
-        while (this_node != NULL) {
-            if (this_node->I_number == ino)
-                break;
-            this_node = LIST_NEXT(this_node, I_hashlink);
-        }
+    this_node = LIST_FIRST(unixfs_inodelayer_firstfromhash(shard, ino));
+    while (this_node != NULL) {
+        if (this_node->I_number == ino)
+            break;
+        this_node = LIST_NEXT(this_node, I_hashlink);
+    }
 
+    if (this_node == NULL) {
+        /*
+         * The allocation comes from the shard's pool or calloc(); either way
+         * we keep the lock, so nobody can insert the same inode meanwhile.
+         */
+        this_node = unixfs_inodelayer_alloc(shard, ino);
         if (this_node == NULL) {
-            if (new_node == NULL) {
-                pthread_mutex_unlock(&ihash_lock);
-                new_node = calloc(1, sizeof(struct inode) + iprivsize);
-                if (new_node == NULL) {
-                    err = ENOMEM;
-                } else {
-                    new_node->I_number = ino;
-                    if (iprivsize)
-                        new_node->I_private =
-                            (void*)&((struct inode *)new_node)[1];
-                    (void)pthread_cond_init(&new_node->I_state_cond,
-                                            (const pthread_condattr_t*)0);
-                }
-                pthread_mutex_lock(&ihash_lock);
-            } else {
-                LIST_INSERT_HEAD(unixfs_inodelayer_firstfromhash(ino),
-                                 new_node, I_hashlink);
-                ihash_count++;
-                this_node = new_node;
-                new_node = NULL;
-            }
+            pthread_mutex_unlock(&shard->ihs_lock);
+            return NULL;
+        }
+        LIST_INSERT_HEAD(unixfs_inodelayer_firstfromhash(shard, ino),
+                         this_node, I_hashlink);
+        shard->ihs_count++;
+        shard->ihs_misses++;
+    } else {
+        if (this_node->I_count == 0 && this_node->I_initialized) {
+            /* Revive a cached inode. */
+            TAILQ_REMOVE(&shard->ihs_lru, this_node, I_freelink);
+            shard->ihs_nlru--;
         }
+        shard->ihs_hits++;
+    }
 
-        if (this_node != NULL) {
-            if (this_node->I_attachoutstanding) {
-                this_node->I_waiting = 1;
-                this_node->I_count++; /* XXX See comment below. */
-                while (this_node->I_attachoutstanding) {
-                    int ret = pthread_cond_wait(&this_node->I_state_cond,
-                                                 &ihash_lock);
-                    if (ret) {
-                        fprintf(stderr, "lock %p failed for inode %llu\n",
-                                &this_node->I_state_cond, (ino64_t)ino);
-                        abort();
-                    }
-                }
-                pthread_mutex_unlock(&ihash_lock); /* XXX See comment below. */
-                err = needs_unlock = 0; /* XXX See comment below. */
-                /*
-                 * XXX Yes, this comment. There's a subtlety here. This logic
-                 * will work only for a read-only file system. If the hash
-                 * table could change while we were sleeping, we must loop
-                 * again.
-                 */
-            } else if (this_node->I_initialized == 0) {
-                this_node->I_count++;
-                this_node->I_attachoutstanding = 1;
-                pthread_mutex_unlock(&ihash_lock);
-                err = needs_unlock = 0;
-            } else {
-                this_node->I_count++;
-                pthread_mutex_unlock(&ihash_lock);
-                err = needs_unlock = 0;
-            }
+    this_node->I_count++;
+
+    while (this_node->I_attachoutstanding) {
+        this_node->I_waiting = 1;
+        int ret = pthread_cond_wait(&this_node->I_state_cond,
+                                    &shard->ihs_lock);
+        if (ret) {
+            fprintf(stderr, "lock %p failed for inode %llu\n",
+                    &this_node->I_state_cond, (unsigned long long)ino);
+            abort();
         }
+    }
 
-    } while (err == EAGAIN);
+    /*
+     * Either we're first, or whoever was attaching the inode failed; in both
+     * cases it's now our job to initialize it.
+     */
+    if (this_node->I_initialized == 0)
+        this_node->I_attachoutstanding = 1;
 
-    if (needs_unlock)
-        pthread_mutex_unlock(&ihash_lock);
+    pthread_mutex_unlock(&shard->ihs_lock);
 
-    if (new_node != NULL)
-        free(new_node);
-        
     return this_node;
 }
 
@@ -212,14 +311,16 @@ unixfs_inodelayer_isucceeded(struct inode* ip)
     if (!UNIXFS_ENABLE_INODEHASH)
         return;
 
-    pthread_mutex_lock(&ihash_lock);
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+
+    pthread_mutex_lock(&shard->ihs_lock);
     ip->I_initialized = 1;
     ip->I_attachoutstanding = 0;
     if (ip->I_waiting) {
         ip->I_waiting = 0;
         pthread_cond_broadcast(&ip->I_state_cond);
     }
-    pthread_mutex_unlock(&ihash_lock);
+    pthread_mutex_unlock(&shard->ihs_lock);
 }
 
 void
@@ -228,57 +329,1415 @@ unixfs_inodelayer_ifailed(struct inode* ip)
     if (!UNIXFS_ENABLE_INODEHASH)
         return;
 
-    pthread_mutex_lock(&ihash_lock);
-    LIST_REMOVE(ip, I_hashlink);
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+
+    pthread_mutex_lock(&shard->ihs_lock);
     ip->I_initialized = 0;
     ip->I_attachoutstanding = 0;
     if (ip->I_waiting) {
         ip->I_waiting = 0;
         pthread_cond_broadcast(&ip->I_state_cond);
     }
-    ihash_count--;
-    pthread_mutex_unlock(&ihash_lock);
-    (void)pthread_cond_destroy(&ip->I_state_cond);
-    free(ip);
+    if (--ip->I_count == 0) {
+        LIST_REMOVE(ip, I_hashlink);
+        shard->ihs_count--;
+        unixfs_inodelayer_release(shard, ip);
+    } /* else a waiter will retry the attach */
+    pthread_mutex_unlock(&shard->ihs_lock);
 }
 
 void
 unixfs_inodelayer_iput(struct inode* ip)
 {
     if (!UNIXFS_ENABLE_INODEHASH) {
+        unixfs_extentmap_free(ip);
+        unixfs_dirindex_free(ip);
         free(ip);
         return;
     }
 
-    pthread_mutex_lock(&ihash_lock);
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+
+    pthread_mutex_lock(&shard->ihs_lock);
+
     ip->I_count--;
+
     if (ip->I_count == 0) {
+        if (ip->I_initialized && ikeep_per_shard) {
+            TAILQ_INSERT_TAIL(&shard->ihs_lru, ip, I_freelink);
+            shard->ihs_nlru++;
+            if (shard->ihs_nlru <= ikeep_per_shard)
+                goto out;
+            ip = TAILQ_FIRST(&shard->ihs_lru); /* evict the coldest one */
+            TAILQ_REMOVE(&shard->ihs_lru, ip, I_freelink);
+            shard->ihs_nlru--;
+        }
         LIST_REMOVE(ip, I_hashlink);
-        ihash_count--;
-        pthread_mutex_unlock(&ihash_lock);
-        (void)pthread_cond_destroy(&ip->I_state_cond);
-        free(ip);
-    } else
-        pthread_mutex_unlock(&ihash_lock);
+        shard->ihs_count--;
+        unixfs_inodelayer_release(shard, ip);
+    }
+
+out:
+    pthread_mutex_unlock(&shard->ihs_lock);
 }
 
 void
 unixfs_inodelayer_dump(unixfs_inodelayer_iterator_t it)
 {
-    pthread_mutex_lock(&ihash_lock);
+    int s;
+    for (s = 0; s < UNIXFS_IHASH_NSHARDS; s++) {
+        struct ihash_shard* shard = &ihash_shards[s];
 
-    int node_index = 0;
-    u_long ihash_index = 0;
+        pthread_mutex_lock(&shard->ihs_lock);
 
-    for (; ihash_index < ihash_mask; ihash_index++) {
-        struct inode* ip;
-        LIST_FOREACH(ip, &ihash_table[ihash_index], I_hashlink) {
-            if (it(ip, ip->I_private) != 0)
+        u_long ihash_index = 0;
+        for (; ihash_index <= shard->ihs_mask; ihash_index++) {
+            struct inode* ip;
+            LIST_FOREACH(ip, &shard->ihs_table[ihash_index], I_hashlink) {
+                if (it(ip, ip->I_private) != 0) {
+                    pthread_mutex_unlock(&shard->ihs_lock);
+                    return;
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&shard->ihs_lock);
+    }
+}
+
+/*
+ * Where a directory lookup should start scanning: the page in which the
+ * previous successful lookup found its name. Lookups in one directory can
+ * run concurrently, so the hint is read and set under the shard lock.
+ */
+uint32_t
+unixfs_inodelayer_getdirhint(struct inode* ip)
+{
+    if (!UNIXFS_ENABLE_INODEHASH)
+        return ip->I_dirhint;
+
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+    pthread_mutex_lock(&shard->ihs_lock);
+    uint32_t page = ip->I_dirhint;
+    pthread_mutex_unlock(&shard->ihs_lock);
+
+    return page;
+}
+
+void
+unixfs_inodelayer_setdirhint(struct inode* ip, uint32_t page)
+{
+    if (!UNIXFS_ENABLE_INODEHASH) {
+        ip->I_dirhint = page;
+        return;
+    }
+
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+    pthread_mutex_lock(&shard->ihs_lock);
+    ip->I_dirhint = page;
+    pthread_mutex_unlock(&shard->ihs_lock);
+}
+
+/* Hash hits and misses of unixfs_inodelayer_iget() so far. */
+void
+unixfs_inodelayer_stats(uint64_t* hits, uint64_t* misses)
+{
+    int s;
+
+    *hits = *misses = 0;
+
+    if (!UNIXFS_ENABLE_INODEHASH)
+        return;
+
+    for (s = 0; s < UNIXFS_IHASH_NSHARDS; s++) {
+        struct ihash_shard* shard = &ihash_shards[s];
+        pthread_mutex_lock(&shard->ihs_lock);
+        *hits += shard->ihs_hits;
+        *misses += shard->ihs_misses;
+        pthread_mutex_unlock(&shard->ihs_lock);
+    }
+}
+
+/*
+ * Extent map layer.
+ *
+ * A per-inode, lazily built, sorted array of logical-to-physical block runs.
+ * File systems with indirect blocks consult it before walking their block
+ * pointer chains and record whatever a walk finds; adjacent mappings are
+ * merged so that a contiguous file needs just a handful of entries. Holes
+ * aren't recorded.
+ */
+
+#define UNIXFS_EXTENTMAP_MAX 8192 /* extents per inode */
+
+struct unixfs_extent {
+    off_t e_lblkno;
+    off_t e_pblkno;
+    off_t e_nblocks;
+};
+
+struct unixfs_extentmap {
+    pthread_mutex_t       em_lock;
+    uint32_t              em_count;
+    uint32_t              em_capacity;
+    struct unixfs_extent* em_extents;
+};
+
+/* Returns the index of the first extent starting after lblkno. */
+static uint32_t
+unixfs_extentmap_search(struct unixfs_extentmap* em, off_t lblkno)
+{
+    uint32_t lo = 0, hi = em->em_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (em->em_extents[mid].e_lblkno <= lblkno)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* The map is attached under the shard lock, so it is looked at under it. */
+static struct unixfs_extentmap*
+unixfs_extentmap_peek(struct inode* ip)
+{
+    if (!UNIXFS_ENABLE_INODEHASH)
+        return ip->I_extents;
+
+    struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+    pthread_mutex_lock(&shard->ihs_lock);
+    struct unixfs_extentmap* em = ip->I_extents;
+    pthread_mutex_unlock(&shard->ihs_lock);
+
+    return em;
+}
+
+static struct unixfs_extentmap*
+unixfs_extentmap_get(struct inode* ip)
+{
+    struct unixfs_extentmap* em = unixfs_extentmap_peek(ip);
+    if (em)
+        return em;
+
+    if (!(em = calloc(1, sizeof(struct unixfs_extentmap))))
+        return NULL;
+
+    (void)pthread_mutex_init(&em->em_lock, (const pthread_mutexattr_t*)0);
+
+    if (UNIXFS_ENABLE_INODEHASH) {
+        struct ihash_shard* shard = unixfs_inodelayer_shard(ip->I_number);
+        struct unixfs_extentmap* winner;
+        pthread_mutex_lock(&shard->ihs_lock);
+        if (ip->I_extents == NULL)
+            ip->I_extents = em;
+        winner = ip->I_extents;
+        pthread_mutex_unlock(&shard->ihs_lock);
+        if (winner != em) { /* somebody beat us to it */
+            (void)pthread_mutex_destroy(&em->em_lock);
+            free(em);
+        }
+        return winner;
+    }
+
+    ip->I_extents = em;
+
+    return em;
+}
+
+int
+unixfs_extentmap_lookup(struct inode* ip, off_t lblkno, off_t* pblkno,
+                        off_t* contig)
+{
+    struct unixfs_extentmap* em = unixfs_extentmap_peek(ip);
+    if (!em)
+        return ENOENT;
+
+    int error = ENOENT;
+
+    pthread_mutex_lock(&em->em_lock);
+
+    uint32_t i = unixfs_extentmap_search(em, lblkno);
+    if (i > 0) {
+        struct unixfs_extent* e = &em->em_extents[i - 1];
+        off_t delta = lblkno - e->e_lblkno;
+        if (delta < e->e_nblocks) {
+            *pblkno = e->e_pblkno + delta;
+            if (contig)
+                *contig = e->e_nblocks - delta;
+            error = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&em->em_lock);
+
+    return error;
+}
+
+void
+unixfs_extentmap_insert(struct inode* ip, off_t lblkno, off_t pblkno)
+{
+    if (pblkno == 0) /* hole */
+        return;
+
+    struct unixfs_extentmap* em = unixfs_extentmap_get(ip);
+    if (!em)
+        return;
+
+    pthread_mutex_lock(&em->em_lock);
+
+    uint32_t i = unixfs_extentmap_search(em, lblkno);
+    struct unixfs_extent* prev = (i > 0) ? &em->em_extents[i - 1] : NULL;
+    struct unixfs_extent* next =
+        (i < em->em_count) ? &em->em_extents[i] : NULL;
+
+    if (prev && (lblkno < prev->e_lblkno + prev->e_nblocks))
+        goto out; /* already known */
+
+    int joinsprev = prev &&
+        (prev->e_lblkno + prev->e_nblocks == lblkno) &&
+        (prev->e_pblkno + prev->e_nblocks == pblkno);
+    int joinsnext = next &&
+        (next->e_lblkno == lblkno + 1) && (next->e_pblkno == pblkno + 1);
+
+    if (joinsprev && joinsnext) {
+        prev->e_nblocks += 1 + next->e_nblocks;
+        memmove(next, next + 1, (em->em_count - i - 1) * sizeof(*next));
+        em->em_count--;
+    } else if (joinsprev) {
+        prev->e_nblocks++;
+    } else if (joinsnext) {
+        next->e_lblkno--;
+        next->e_pblkno--;
+        next->e_nblocks++;
+    } else {
+        if (em->em_count == em->em_capacity) {
+            if (em->em_capacity >= UNIXFS_EXTENTMAP_MAX)
+                goto out; /* too fragmented to be worth it */
+            uint32_t newcapacity = em->em_capacity ? 2 * em->em_capacity : 8;
+            struct unixfs_extent* newextents =
+                realloc(em->em_extents, newcapacity * sizeof(*newextents));
+            if (!newextents)
                 goto out;
-            node_index++;
+            em->em_extents = newextents;
+            em->em_capacity = newcapacity;
         }
+        struct unixfs_extent* e = &em->em_extents[i];
+        memmove(e + 1, e, (em->em_count - i) * sizeof(*e));
+        e->e_lblkno = lblkno;
+        e->e_pblkno = pblkno;
+        e->e_nblocks = 1;
+        em->em_count++;
     }
 
 out:
-    pthread_mutex_unlock(&ihash_lock);
+    pthread_mutex_unlock(&em->em_lock);
+}
+
+/*
+ * Returns how many blocks, up to maxblocks, starting at lblkno (which maps to
+ * pblkno) are physically contiguous. Whatever the extent map doesn't already
+ * know is probed through the file system's bmap, which records it in turn.
+ */
+off_t
+unixfs_extentmap_run(struct inode* ip, off_t lblkno, off_t pblkno,
+                     off_t maxblocks, unixfs_bmap_t bmap)
+{
+    off_t run = 1, pbn, contig;
+
+    if ((unixfs_extentmap_lookup(ip, lblkno, &pbn, &contig) == 0) &&
+        (pbn == pblkno))
+        run = contig;
+
+    while (run < maxblocks) {
+        int error = 0;
+        pbn = bmap(ip, lblkno + run, &error);
+        if (error || (pbn != pblkno + run))
+            break;
+        run++;
+    }
+
+    return min(run, maxblocks);
+}
+
+void
+unixfs_extentmap_free(struct inode* ip)
+{
+    struct unixfs_extentmap* em = ip->I_extents;
+    if (!em)
+        return;
+
+    (void)pthread_mutex_destroy(&em->em_lock);
+    free(em->em_extents);
+    free(em);
+
+    ip->I_extents = NULL;
+}
+
+/*
+ * Directory name index.
+ *
+ * An open-addressed hash of a directory's names, over a vector of entries
+ * kept in the order they were added. Archive formats, which have no on-disk
+ * directories, build one per directory while scanning and read directories
+ * off the vector. The other file systems have the first lookup in a
+ * directory bigger than UNIXFS_DIRINDEX_MINSIZE enumerate it into an index,
+ * which then hangs off the in-core inode like the extent map and goes away
+ * with it. Our images are read-only, so the index is complete: a name that
+ * isn't in it isn't in the directory, and negative lookups are answered
+ * without going to the disk. It is the inode cache, on by default, that keeps
+ * a directory's inode (and with it the index) around between lookups; with
+ * --inodecache 0 the inode rarely outlives the lookup, so we don't build one.
+ */
+
+static pthread_mutex_t unixfs_dirindex_statlock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t unixfs_dirindex_nbuilds;  /* indexes filled from the disk */
+static uint64_t unixfs_dirindex_nlookups; /* names looked up in an index */
+
+static uint32_t
+unixfs_dirindex_hash(const char* name, size_t namelen)
+{
+    uint32_t h = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < namelen; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static void
+unixfs_dirindex_rehash(struct unixfs_dirindex* di, uint32_t* table,
+                       uint32_t mask)
+{
+    uint32_t i;
+
+    memset(table, 0, (mask + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < di->di_count; i++) {
+        uint32_t slot = di->di_entries[i].de_hash & mask;
+        while (table[slot])
+            slot = (slot + 1) & mask;
+        table[slot] = i + 1;
+    }
+
+    free(di->di_hash);
+    di->di_hash = table;
+    di->di_hashmask = mask;
+}
+
+int
+unixfs_dirindex_add(struct unixfs_dirindex* di, const char* name,
+                    size_t namelen, ino_t ino)
+{
+    if (di->di_count == di->di_capacity) {
+        uint32_t newcapacity = di->di_capacity ? 2 * di->di_capacity : 8;
+        struct unixfs_dirindex_entry* newentries =
+            realloc(di->di_entries, newcapacity * sizeof(*newentries));
+        if (!newentries)
+            return ENOMEM;
+        di->di_entries = newentries;
+        di->di_capacity = newcapacity;
+    }
+
+    if (di->di_namesize + namelen > di->di_namecapacity) {
+        size_t newcapacity = di->di_namecapacity ? 2 * di->di_namecapacity
+                                                 : 128;
+        while (newcapacity < di->di_namesize + namelen)
+            newcapacity *= 2;
+        char* newnames = realloc(di->di_names, newcapacity);
+        if (!newnames)
+            return ENOMEM;
+        di->di_names = newnames;
+        di->di_namecapacity = newcapacity;
+    }
+
+    struct unixfs_dirindex_entry* de = &di->di_entries[di->di_count++];
+    de->de_hash = unixfs_dirindex_hash(name, namelen);
+    de->de_namelen = (uint32_t)namelen;
+    de->de_nameoff = di->di_namesize;
+    de->de_ino = ino;
+
+    /* keep the load factor at or below one half */
+    if (!di->di_hash || (2 * di->di_count > di->di_hashmask + 1)) {
+        uint32_t size = di->di_hash ? 2 * (di->di_hashmask + 1) : 16;
+        uint32_t* table = malloc(size * sizeof(uint32_t));
+        if (!table) {
+            di->di_count--;
+            return ENOMEM;
+        }
+        unixfs_dirindex_rehash(di, table, size - 1);
+    } else {
+        uint32_t slot = de->de_hash & di->di_hashmask;
+        while (di->di_hash[slot])
+            slot = (slot + 1) & di->di_hashmask;
+        di->di_hash[slot] = di->di_count;
+    }
+
+    memcpy(di->di_names + di->di_namesize, name, namelen);
+    di->di_namesize += namelen;
+
+    return 0;
+}
+
+/* Returns the inode number for name, or 0 if the index doesn't have it. */
+ino_t
+unixfs_dirindex_find(struct unixfs_dirindex* di, const char* name,
+                     size_t namelen)
+{
+    pthread_mutex_lock(&unixfs_dirindex_statlock);
+    unixfs_dirindex_nlookups++;
+    pthread_mutex_unlock(&unixfs_dirindex_statlock);
+
+    if (!di->di_hash)
+        return (ino_t)0;
+
+    uint32_t h = unixfs_dirindex_hash(name, namelen);
+    uint32_t slot = h & di->di_hashmask;
+    uint32_t idx;
+
+    while ((idx = di->di_hash[slot]) != 0) {
+        struct unixfs_dirindex_entry* de = &di->di_entries[idx - 1];
+        if ((de->de_hash == h) && (de->de_namelen == namelen) &&
+            (memcmp(di->di_names + de->de_nameoff, name, namelen) == 0))
+            return de->de_ino;
+        slot = (slot + 1) & di->di_hashmask;
+    }
+
+    return (ino_t)0;
+}
+
+void
+unixfs_dirindex_clear(struct unixfs_dirindex* di)
+{
+    free(di->di_entries);
+    free(di->di_hash);
+    free(di->di_names);
+    memset(di, 0, sizeof(*di));
+}
+
+static struct unixfs_dirindex*
+unixfs_dirindex_get(struct inode* dp, unixfs_dirindex_fill_t fill)
+{
+    if (!UNIXFS_ENABLE_INODEHASH || !unixfs_tunables.inodecache ||
+        (dp->I_size <= UNIXFS_DIRINDEX_MINSIZE))
+        return NULL;
+
+    /* Attached under the shard lock, like the extent map. */
+    struct ihash_shard* shard = unixfs_inodelayer_shard(dp->I_number);
+    pthread_mutex_lock(&shard->ihs_lock);
+    struct unixfs_dirindex* winner = dp->I_dirindex;
+    pthread_mutex_unlock(&shard->ihs_lock);
+    if (winner)
+        return winner;
+
+    struct unixfs_dirindex* di = calloc(1, sizeof(struct unixfs_dirindex));
+    if (!di)
+        return NULL;
+
+    if (fill(dp, di)) {
+        unixfs_dirindex_clear(di);
+        free(di);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&unixfs_dirindex_statlock);
+    unixfs_dirindex_nbuilds++;
+    pthread_mutex_unlock(&unixfs_dirindex_statlock);
+
+    pthread_mutex_lock(&shard->ihs_lock);
+    if (dp->I_dirindex == NULL)
+        dp->I_dirindex = di;
+    winner = dp->I_dirindex;
+    pthread_mutex_unlock(&shard->ihs_lock);
+    if (winner != di) { /* somebody beat us to it */
+        unixfs_dirindex_clear(di);
+        free(di);
+    }
+
+    return winner;
+}
+
+/*
+ * Returns 0 and the inode number if name is in dp, ENOENT if it is not, and
+ * any other error if dp has no index, in which case the caller should scan
+ * the directory itself.
+ */
+int
+unixfs_dirindex_lookup(struct inode* dp, const char* name,
+                       unixfs_dirindex_fill_t fill, ino_t* ino)
+{
+    struct unixfs_dirindex* di = unixfs_dirindex_get(dp, fill);
+    if (!di)
+        return EAGAIN;
+
+    *ino = unixfs_dirindex_find(di, name, strlen(name));
+
+    return *ino ? 0 : ENOENT;
+}
+
+void
+unixfs_dirindex_free(struct inode* ip)
+{
+    struct unixfs_dirindex* di = ip->I_dirindex;
+    if (!di)
+        return;
+
+    unixfs_dirindex_clear(di);
+    free(di);
+
+    ip->I_dirindex = NULL;
+}
+
+/* Indexes built by lookups so far, and names looked up in any index. */
+void
+unixfs_dirindex_stats(uint64_t* builds, uint64_t* lookups)
+{
+    pthread_mutex_lock(&unixfs_dirindex_statlock);
+    *builds = unixfs_dirindex_nbuilds;
+    *lookups = unixfs_dirindex_nlookups;
+    pthread_mutex_unlock(&unixfs_dirindex_statlock);
+}
+
+/*
+ * Buffer cache layer.
+ *
+ * Every device (s_bdev) gets a hash of recently read blocks, keyed by byte
+ * offset and size, with an LRU list of unreferenced buffers to recycle from.
+ * The size limit is soft: a buffer that is in use is never evicted, so the
+ * cache can briefly exceed unixfs_tunables.cachesize under load.
+ *
+ * With unixfs_tunables.mmap, a device that is a regular file is instead
+ * mapped read-only in its entirety and there is no cache of our own: the
+ * kernel's page cache already holds the image. Buffers then point into the
+ * mapping, and archive formats whose file data is contiguous can hand out
+ * pointers into it with unixfs_bcache_map().
+ *
+ * A device can also have neither, when caching is disabled. getblk then
+ * reads into a private buffer that brelse frees.
+ */
+
+struct unixfs_bcache {
+    pthread_mutex_t bc_lock;
+    pthread_cond_t  bc_state_cond;
+    size_t          bc_maxbytes;
+    size_t          bc_curbytes;
+    u_long          bc_hashmask;
+    LIST_HEAD(bc_hash_head, unixfs_buf)* bc_hashtbl;
+    TAILQ_HEAD(bc_free_head, unixfs_buf) bc_freelist;
+    uint64_t        bc_hits;
+    uint64_t        bc_misses;
+    LIST_ENTRY(unixfs_bcache) bc_link;
+};
+
+/*
+ * Caches are only created and destroyed while mounting and unmounting, so
+ * the list of them needs no lock of its own.
+ */
+static LIST_HEAD(bc_list_head, unixfs_bcache) unixfs_bcaches =
+    LIST_HEAD_INITIALIZER(unixfs_bcaches);
+
+static struct bc_hash_head*
+unixfs_bcache_firstfromhash(struct unixfs_bcache* bc, off_t offset)
+{
+    return &bc->bc_hashtbl[((u_long)(offset >> 9)) & bc->bc_hashmask];
+}
+
+static void
+unixfs_bcache_destroybuf(struct unixfs_bcache* bc, struct unixfs_buf* bp)
+{
+    LIST_REMOVE(bp, b_hashlink);
+    bc->bc_curbytes -= bp->b_size;
+    free(bp->b_data);
+    free(bp);
+}
+
+static void
+unixfs_bcache_mapdevice(struct super_block* sb)
+{
+    struct stat stbuf;
+
+    if (unixfs_dev_compressed(sb->s_bdev) ||
+        fstat(sb->s_bdev, &stbuf) != 0 || !S_ISREG(stbuf.st_mode) ||
+        stbuf.st_size <= 0 || (uint64_t)stbuf.st_size > (size_t)-1) {
+        fprintf(stderr, "*** warning: cannot map this device; reading it "
+                "instead\n");
+        return;
+    }
+
+    void* map = mmap(NULL, (size_t)stbuf.st_size, PROT_READ, MAP_SHARED,
+                     sb->s_bdev, (off_t)0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "*** warning: failed to map the device (%d); reading "
+                "it instead\n", errno);
+        return;
+    }
+
+    sb->s_map = (char*)map;
+    sb->s_mapsize = (size_t)stbuf.st_size;
+}
+
+int
+unixfs_bcache_init(struct super_block* sb)
+{
+    sb->s_bcache = NULL;
+    sb->s_map = NULL;
+    sb->s_mapsize = 0;
+
+    if (unixfs_tunables.mmap) {
+        unixfs_bcache_mapdevice(sb);
+        if (sb->s_map)
+            return 0;
+    }
+
+    size_t maxbytes = unixfs_tunables.cachesize;
+    if (maxbytes == 0)
+        return 0; /* caching disabled */
+
+    struct unixfs_bcache* bc = calloc(1, sizeof(struct unixfs_bcache));
+    if (!bc)
+        return ENOMEM;
+
+    u_long hashsize;
+    for (hashsize = 1; hashsize < (maxbytes >> 10); hashsize <<= 1)
+        continue;
+
+    bc->bc_hashtbl = malloc(hashsize * sizeof(*bc->bc_hashtbl));
+    if (!bc->bc_hashtbl) {
+        free(bc);
+        return ENOMEM;
+    }
+
+    u_long i;
+    for (i = 0; i < hashsize; i++)
+        LIST_INIT(&bc->bc_hashtbl[i]);
+    TAILQ_INIT(&bc->bc_freelist);
+
+    bc->bc_hashmask = hashsize - 1;
+    bc->bc_maxbytes = maxbytes;
+
+    if (pthread_mutex_init(&bc->bc_lock, (const pthread_mutexattr_t*)0)) {
+        fprintf(stderr, "failed to initialize the buffer cache lock\n");
+        free(bc->bc_hashtbl);
+        free(bc);
+        return ENOMEM;
+    }
+
+    (void)pthread_cond_init(&bc->bc_state_cond, (const pthread_condattr_t*)0);
+
+    sb->s_bcache = bc;
+    LIST_INSERT_HEAD(&unixfs_bcaches, bc, bc_link);
+
+    return 0;
+}
+
+void
+unixfs_bcache_fini(struct super_block* sb)
+{
+    if (sb->s_map) {
+        (void)munmap(sb->s_map, sb->s_mapsize);
+        sb->s_map = NULL;
+        sb->s_mapsize = 0;
+    }
+
+    struct unixfs_bcache* bc = sb->s_bcache;
+    if (!bc)
+        return;
+
+    u_long i;
+    for (i = 0; i <= bc->bc_hashmask; i++) {
+        struct unixfs_buf* bp;
+        while ((bp = LIST_FIRST(&bc->bc_hashtbl[i])) != NULL) {
+            if (bp->b_count)
+                fprintf(stderr, "*** warning: buffer for offset %llu still "
+                        "referenced (%u)\n", (unsigned long long)bp->b_offset,
+                        bp->b_count);
+            else
+                TAILQ_REMOVE(&bc->bc_freelist, bp, b_freelink);
+            unixfs_bcache_destroybuf(bc, bp);
+        }
+    }
+
+    LIST_REMOVE(bc, bc_link);
+    free(bc->bc_hashtbl);
+    (void)pthread_cond_destroy(&bc->bc_state_cond);
+    (void)pthread_mutex_destroy(&bc->bc_lock);
+    free(bc);
+
+    sb->s_bcache = NULL;
+}
+
+struct unixfs_buf*
+unixfs_bcache_getblk(struct super_block* sb, off_t offset, size_t size,
+                     int* error)
+{
+    struct unixfs_bcache* bc = sb->s_bcache;
+    struct unixfs_buf* bp;
+
+    *error = 0;
+
+    if (sb->s_map) {
+        char* data = (char*)unixfs_bcache_map(sb, offset, size);
+        if (!data) {
+            *error = EIO;
+            return NULL;
+        }
+        if ((bp = calloc(1, sizeof(struct unixfs_buf))) == NULL) {
+            *error = ENOMEM;
+            return NULL;
+        }
+        bp->b_offset = offset;
+        bp->b_size = size;
+        bp->b_count = 1;
+        bp->b_flags = UNIXFS_B_MAPPED;
+        bp->b_data = data;
+        return bp;
+    }
+
+    if (!bc) { /* caching disabled: a private buffer that brelse frees */
+        if ((bp = calloc(1, sizeof(struct unixfs_buf))) != NULL)
+            bp->b_data = malloc(size);
+        if (!bp || !bp->b_data) {
+            free(bp);
+            *error = ENOMEM;
+            return NULL;
+        }
+        bp->b_offset = offset;
+        bp->b_size = size;
+        bp->b_count = 1;
+        bp->b_flags = UNIXFS_B_NOCACHE;
+        if (unixfs_dev_pread(sb->s_bdev, bp->b_data, size, offset) !=
+            (ssize_t)size) {
+            free(bp->b_data);
+            free(bp);
+            *error = EIO;
+            return NULL;
+        }
+        return bp;
+    }
+
+    pthread_mutex_lock(&bc->bc_lock);
+
+    LIST_FOREACH(bp, unixfs_bcache_firstfromhash(bc, offset), b_hashlink) {
+        if ((bp->b_offset == offset) && (bp->b_size == size))
+            break;
+    }
+
+    if (bp != NULL) {
+        if (bp->b_count == 0)
+            TAILQ_REMOVE(&bc->bc_freelist, bp, b_freelink);
+        bp->b_count++;
+        bc->bc_hits++;
+        while (bp->b_flags & UNIXFS_B_BUSY) {
+            int ret = pthread_cond_wait(&bc->bc_state_cond, &bc->bc_lock);
+            if (ret) {
+                fprintf(stderr, "lock %p failed for buffer at offset %llu\n",
+                        &bc->bc_state_cond, (unsigned long long)offset);
+                abort();
+            }
+        }
+        if (bp->b_flags & UNIXFS_B_ERROR) {
+            if (--bp->b_count == 0)
+                unixfs_bcache_destroybuf(bc, bp);
+            pthread_mutex_unlock(&bc->bc_lock);
+            *error = EIO;
+            return NULL;
+        }
+        pthread_mutex_unlock(&bc->bc_lock);
+        return bp;
+    }
+
+    bc->bc_misses++;
+
+    /* Recycle unreferenced buffers, least recently used first. */
+
+    struct unixfs_buf* reuse = NULL;
+
+    while ((bc->bc_curbytes + size > bc->bc_maxbytes) &&
+           ((bp = TAILQ_FIRST(&bc->bc_freelist)) != NULL)) {
+        TAILQ_REMOVE(&bc->bc_freelist, bp, b_freelink);
+        if (!reuse && (bp->b_size == size)) {
+            LIST_REMOVE(bp, b_hashlink);
+            bc->bc_curbytes -= bp->b_size;
+            reuse = bp;
+        } else
+            unixfs_bcache_destroybuf(bc, bp);
+    }
+
+    if ((bp = reuse) == NULL) {
+        bp = calloc(1, sizeof(struct unixfs_buf));
+        if (bp)
+            bp->b_data = malloc(size);
+        if (!bp || !bp->b_data) {
+            pthread_mutex_unlock(&bc->bc_lock);
+            free(bp);
+            *error = ENOMEM;
+            return NULL;
+        }
+    }
+
+    bp->b_offset = offset;
+    bp->b_size = size;
+    bp->b_count = 1;
+    bp->b_flags = UNIXFS_B_BUSY;
+    LIST_INSERT_HEAD(unixfs_bcache_firstfromhash(bc, offset), bp, b_hashlink);
+    bc->bc_curbytes += size;
+
+    pthread_mutex_unlock(&bc->bc_lock);
+
+    ssize_t ret = unixfs_dev_pread(sb->s_bdev, bp->b_data, size, offset);
+
+    pthread_mutex_lock(&bc->bc_lock);
+
+    bp->b_flags &= ~UNIXFS_B_BUSY;
+    if (ret != (ssize_t)size)
+        bp->b_flags |= UNIXFS_B_ERROR;
+    pthread_cond_broadcast(&bc->bc_state_cond);
+
+    if (bp->b_flags & UNIXFS_B_ERROR) {
+        if (--bp->b_count == 0)
+            unixfs_bcache_destroybuf(bc, bp);
+        bp = NULL;
+        *error = EIO;
+    }
+
+    pthread_mutex_unlock(&bc->bc_lock);
+
+    return bp;
+}
+
+void
+unixfs_bcache_brelse(struct super_block* sb, struct unixfs_buf* bp)
+{
+    struct unixfs_bcache* bc = sb->s_bcache;
+
+    if (bp->b_flags & UNIXFS_B_MAPPED) {
+        free(bp);
+        return;
+    }
+
+    if (bp->b_flags & UNIXFS_B_NOCACHE) {
+        free(bp->b_data);
+        free(bp);
+        return;
+    }
+
+    pthread_mutex_lock(&bc->bc_lock);
+    if (--bp->b_count == 0)
+        TAILQ_INSERT_TAIL(&bc->bc_freelist, bp, b_freelink);
+    pthread_mutex_unlock(&bc->bc_lock);
+}
+
+int
+unixfs_bcache_bread(struct super_block* sb, off_t offset, size_t size,
+                    char* buf)
+{
+    if (sb->s_map) {
+        const char* data = unixfs_bcache_map(sb, offset, size);
+        if (!data)
+            return EIO;
+        memcpy(buf, data, size);
+        return 0;
+    }
+
+    if (!sb->s_bcache) {
+        if (unixfs_dev_pread(sb->s_bdev, buf, size, offset) != (ssize_t)size)
+            return EIO;
+        return 0;
+    }
+
+    int error;
+    struct unixfs_buf* bp = unixfs_bcache_getblk(sb, offset, size, &error);
+    if (!bp)
+        return error;
+
+    memcpy(buf, bp->b_data, size);
+
+    unixfs_bcache_brelse(sb, bp);
+
+    return 0;
+}
+
+/* Where [offset, offset + size) of a mapped device lives; NULL if unmapped. */
+const char*
+unixfs_bcache_map(struct super_block* sb, off_t offset, size_t size)
+{
+    if (!sb->s_map || (offset < 0) || ((uint64_t)offset > sb->s_mapsize) ||
+        (size > sb->s_mapsize - (size_t)offset))
+        return NULL;
+
+    return sb->s_map + offset;
+}
+
+/*
+ * Uncached read of file data straight off the device, pread(2) style: a
+ * short count means the device ended.
+ */
+ssize_t
+unixfs_bcache_pread(struct super_block* sb, char* buf, size_t size,
+                    off_t offset)
+{
+    if (!sb->s_map)
+        return unixfs_dev_pread(sb->s_bdev, buf, size, offset);
+
+    if ((offset < 0) || ((uint64_t)offset >= sb->s_mapsize))
+        return 0;
+
+    if (size > sb->s_mapsize - (size_t)offset)
+        size = sb->s_mapsize - (size_t)offset;
+
+    memcpy(buf, sb->s_map + offset, size);
+
+    return (ssize_t)size;
+}
+
+/* Buffer lookups that hit and missed so far, all caches together. */
+void
+unixfs_bcache_stats(uint64_t* hits, uint64_t* misses)
+{
+    struct unixfs_bcache* bc;
+
+    *hits = *misses = 0;
+
+    LIST_FOREACH(bc, &unixfs_bcaches, bc_link) {
+        pthread_mutex_lock(&bc->bc_lock);
+        *hits += bc->bc_hits;
+        *misses += bc->bc_misses;
+        pthread_mutex_unlock(&bc->bc_lock);
+    }
+}
+
+/*
+ * Batched attribute lookup.
+ *
+ * Fetches the attributes of many inodes, say all the children of a
+ * directory, in the order of the device blocks that hold them (locate()
+ * gives a block number in s_blocksize units) rather than in the order asked
+ * for. Each such block is held in the buffer cache while its inodes are
+ * being read, so it is read from the device once however many of them it
+ * holds and however small the cache is.
+ */
+
+struct unixfs_iloc {
+    off_t  il_blkno;
+    size_t il_index;
+};
+
+static int
+unixfs_iloc_compare(const void* a, const void* b)
+{
+    const struct unixfs_iloc* la = a;
+    const struct unixfs_iloc* lb = b;
+
+    if (la->il_blkno != lb->il_blkno)
+        return (la->il_blkno < lb->il_blkno) ? -1 : 1;
+
+    return (la->il_index < lb->il_index) ? -1 : (la->il_index > lb->il_index);
+}
+
+void
+unixfs_igetattr_many(struct super_block* sb, ino_t* inos, struct stat* stbufs,
+                     int* errors, size_t count, unixfs_ilocate_t locate,
+                     unixfs_igetattr_t igetattr)
+{
+    size_t i;
+
+    struct unixfs_iloc* order = malloc(count * sizeof(struct unixfs_iloc));
+    if (!order) { /* just do them as they come */
+        for (i = 0; i < count; i++)
+            errors[i] = igetattr(inos[i], &stbufs[i]);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        order[i].il_blkno = locate(inos[i]);
+        order[i].il_index = i;
+    }
+
+    qsort(order, count, sizeof(struct unixfs_iloc), unixfs_iloc_compare);
+
+    struct unixfs_buf* bp = NULL;
+    off_t held = -1;
+
+    for (i = 0; i < count; i++) {
+        size_t idx = order[i].il_index;
+        if (sb->s_bcache && (order[i].il_blkno != held)) {
+            int error;
+            if (bp)
+                unixfs_bcache_brelse(sb, bp);
+            held = order[i].il_blkno;
+            bp = unixfs_bcache_getblk(sb, held * (off_t)sb->s_blocksize,
+                                      sb->s_blocksize, &error);
+        }
+        errors[idx] = igetattr(inos[idx], &stbufs[idx]);
+    }
+
+    if (bp)
+        unixfs_bcache_brelse(sb, bp);
+
+    free(order);
+}
+
+/*
+ * Batched directory enumeration.
+ *
+ * Fills dents with up to count live entries of directory dp from *offset on
+ * and returns how many; 0 means the directory is done. A file system with a
+ * readdir_batch decodes a directory page at a time, reading each page once
+ * per call; any other is asked for an entry at a time, dirbuf carrying its
+ * page from one call to the next.
+ */
+ssize_t
+unixfs_readdir(struct unixfs_ops* ops, struct inode* dp,
+               struct unixfs_dirbuf* dirbuf, off_t* offset,
+               struct unixfs_direntry* dents, size_t count)
+{
+    size_t filled = 0;
+
+    if (ops->readdir_batch)
+        return ops->readdir_batch(dp, offset, dents, count);
+
+    while ((filled < count) &&
+           (ops->nextdirentry(dp, dirbuf, offset, &dents[filled]) == 0)) {
+        if (dents[filled].ino != 0)
+            filled++;
+    }
+
+    return (ssize_t)filled;
+}
+
+/*
+ * Readahead.
+ *
+ * Every open regular file gets a unixfs_rastate. Reads that pick up where the
+ * previous one left off are sequential; each one doubles the file's window
+ * (up to unixfs_tunables.readahead) and, once less than half a window of
+ * prefetched data remains ahead of the reader, extends the prefetch range to
+ * a full window past the current read. A non-sequential read collapses the
+ * window and drops whatever was prefetched or still pending.
+ *
+ * Prefetching is done by a small pool of worker threads that call the file
+ * system's pbread() into a ring buffer of the file's own, as big as the
+ * largest window or the file, whichever is smaller. Reads take what they can
+ * from there with unixfs_readahead_copy() before going to the file system;
+ * the file data paths bypass the block cache, so this is the only place
+ * prefetched data is kept. Files with pending work sit on a single queue and
+ * are served a chunk at a time, round robin. The workers run file system code
+ * alongside the request threads, so readahead is only started for thread-safe
+ * backends.
+ */
+
+#define UNIXFS_RA_NTHREADS  2
+#define UNIXFS_RA_CHUNK     (128 * 1024)
+#define UNIXFS_RA_MINWINDOW (128 * 1024)
+
+struct unixfs_rastate {
+    TAILQ_ENTRY(unixfs_rastate) ra_link; /* on the work queue */
+    struct inode* ra_ip;
+    off_t         ra_next;    /* where a sequential reader reads next */
+    off_t         ra_start;   /* next byte to prefetch */
+    off_t         ra_end;     /* prefetch up to here */
+    size_t        ra_window;
+    uint32_t      ra_queued;
+    uint32_t      ra_busy;    /* a worker is reading for us */
+    uint32_t      ra_gen;     /* bumped when the ring is emptied under it */
+    char*         ra_buf;     /* ring of prefetched data */
+    size_t        ra_bufsize;
+    size_t        ra_bufhead; /* where in ra_buf the data held begins */
+    size_t        ra_buflen;  /* bytes held */
+    off_t         ra_bufoff;  /* file offset of the first byte held */
+};
+
+static struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_cond;
+    pthread_cond_t   done_cond;
+    TAILQ_HEAD(ra_queue_head, unixfs_rastate) queue;
+    pthread_t        threads[UNIXFS_RA_NTHREADS];
+    uint32_t         nthreads;
+    uint32_t         stopping;
+    unixfs_pbread_t  pbread;
+} unixfs_ra = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Empties the ring and has prefetching pick up at offset. A chunk still in
+ * flight is thrown away when it lands. Called with unixfs_ra.lock held, as
+ * is unixfs_readahead_drop().
+ */
+static void
+unixfs_readahead_reset(struct unixfs_rastate* ra, off_t offset)
+{
+    ra->ra_gen++;
+    ra->ra_bufhead = 0;
+    ra->ra_buflen = 0;
+    ra->ra_bufoff = offset;
+    ra->ra_start = offset;
+}
+
+/* Drops what the ring holds below offset upto. */
+static void
+unixfs_readahead_drop(struct unixfs_rastate* ra, off_t upto)
+{
+    if (upto <= ra->ra_bufoff)
+        return;
+
+    if (upto > ra->ra_bufoff + (off_t)ra->ra_buflen) { /* reader got ahead */
+        unixfs_readahead_reset(ra, upto);
+        return;
+    }
+
+    size_t n = (size_t)(upto - ra->ra_bufoff);
+    ra->ra_bufhead = (ra->ra_bufhead + n) % ra->ra_bufsize;
+    ra->ra_buflen -= n;
+    ra->ra_bufoff = upto;
+}
+
+static void*
+unixfs_readahead_worker(void* arg)
+{
+    pthread_mutex_lock(&unixfs_ra.lock);
+
+    for (;;) {
+        struct unixfs_rastate* ra;
+
+        while (!unixfs_ra.stopping &&
+               ((ra = TAILQ_FIRST(&unixfs_ra.queue)) == NULL))
+            pthread_cond_wait(&unixfs_ra.work_cond, &unixfs_ra.lock);
+
+        if (unixfs_ra.stopping)
+            break;
+
+        TAILQ_REMOVE(&unixfs_ra.queue, ra, ra_link);
+        ra->ra_queued = 0;
+
+        if (ra->ra_start >= ra->ra_end) /* the reader moved on meanwhile */
+            continue;
+
+        /*
+         * Fill the ring at its tail, without wrapping. If it is full, the
+         * reader makes room as it goes and requeues us then.
+         */
+        size_t tail = (ra->ra_bufhead + ra->ra_buflen) % ra->ra_bufsize;
+        size_t count = (size_t)min(ra->ra_end - ra->ra_start,
+                                   (off_t)UNIXFS_RA_CHUNK);
+        count = min(count, ra->ra_bufsize - ra->ra_buflen);
+        count = min(count, ra->ra_bufsize - tail);
+        if (count == 0)
+            continue;
+
+        off_t offset = ra->ra_start;
+        char* buf = ra->ra_buf + tail;
+        uint32_t gen = ra->ra_gen;
+        ra->ra_start += count;
+        ra->ra_busy = 1;
+
+        pthread_mutex_unlock(&unixfs_ra.lock);
+
+        size_t done = 0;
+        while (done < count) {
+            int error = 0;
+            ssize_t ret = unixfs_ra.pbread(ra->ra_ip, buf + done, count - done,
+                                           offset + done, &error);
+            if ((ret <= 0) || error)
+                break;
+            done += ret;
+        }
+
+        pthread_mutex_lock(&unixfs_ra.lock);
+
+        ra->ra_busy = 0;
+        if (gen == ra->ra_gen) {
+            ra->ra_buflen += done;
+            if (done < count) /* stop here until the reader comes by */
+                ra->ra_start = ra->ra_end = offset + done;
+        }
+        if (ra->ra_start < ra->ra_end) {
+            TAILQ_INSERT_TAIL(&unixfs_ra.queue, ra, ra_link);
+            ra->ra_queued = 1;
+        }
+        pthread_cond_broadcast(&unixfs_ra.done_cond);
+    }
+
+    pthread_mutex_unlock(&unixfs_ra.lock);
+
+    return NULL;
+}
+
+int
+unixfs_readahead_start(unixfs_pbread_t pbread)
+{
+    if (!unixfs_tunables.readahead || unixfs_ra.nthreads)
+        return 0;
+
+    TAILQ_INIT(&unixfs_ra.queue);
+    unixfs_ra.pbread = pbread;
+    unixfs_ra.stopping = 0;
+
+    uint32_t i;
+    for (i = 0; i < UNIXFS_RA_NTHREADS; i++) {
+        if (pthread_create(&unixfs_ra.threads[i], (const pthread_attr_t*)0,
+                           unixfs_readahead_worker, NULL) != 0)
+            break;
+        unixfs_ra.nthreads++;
+    }
+
+    if (!unixfs_ra.nthreads) {
+        fprintf(stderr, "*** warning: cannot start readahead threads\n");
+        return EAGAIN;
+    }
+
+    return 0;
+}
+
+void
+unixfs_readahead_stop(void)
+{
+    pthread_mutex_lock(&unixfs_ra.lock);
+    unixfs_ra.stopping = 1;
+    pthread_cond_broadcast(&unixfs_ra.work_cond);
+    pthread_mutex_unlock(&unixfs_ra.lock);
+
+    uint32_t i;
+    for (i = 0; i < unixfs_ra.nthreads; i++)
+        (void)pthread_join(unixfs_ra.threads[i], NULL);
+
+    unixfs_ra.nthreads = 0;
+}
+
+struct unixfs_rastate*
+unixfs_readahead_open(struct inode* ip)
+{
+    struct unixfs_rastate* ra = calloc(1, sizeof(struct unixfs_rastate));
+    if (ra)
+        ra->ra_ip = ip;
+
+    return ra;
+}
+
+void
+unixfs_readahead_close(struct unixfs_rastate* ra)
+{
+    if (!ra)
+        return;
+
+    pthread_mutex_lock(&unixfs_ra.lock);
+
+    if (ra->ra_queued) {
+        TAILQ_REMOVE(&unixfs_ra.queue, ra, ra_link);
+        ra->ra_queued = 0;
+    }
+    ra->ra_end = ra->ra_start; /* a busy worker must not requeue us */
+    while (ra->ra_busy)
+        pthread_cond_wait(&unixfs_ra.done_cond, &unixfs_ra.lock);
+
+    pthread_mutex_unlock(&unixfs_ra.lock);
+
+    free(ra->ra_buf);
+    free(ra);
+}
+
+/*
+ * Copies what has been prefetched of [offset, offset + count) into buf and
+ * returns how many bytes that was, from offset on; the rest is the caller's
+ * to read. What is copied is dropped from the ring. If a worker is reading a
+ * chunk of the range, this waits for it.
+ */
+size_t
+unixfs_readahead_copy(struct unixfs_rastate* ra, char* buf, size_t count,
+                      off_t offset)
+{
+    if (!ra || !unixfs_ra.nthreads)
+        return 0;
+
+    pthread_mutex_lock(&unixfs_ra.lock);
+
+    size_t copied = 0;
+
+    /* Rather than read it again, wait for a chunk that is on its way in. */
+    while (ra->ra_busy && (offset < ra->ra_start) &&
+           (offset + (off_t)count > ra->ra_bufoff + (off_t)ra->ra_buflen))
+        pthread_cond_wait(&unixfs_ra.done_cond, &unixfs_ra.lock);
+
+    if ((ra->ra_buflen > 0) && (offset >= ra->ra_bufoff) &&
+        (offset < ra->ra_bufoff + (off_t)ra->ra_buflen)) {
+        unixfs_readahead_drop(ra, offset);
+        copied = min(count, ra->ra_buflen);
+        size_t first = min(copied, ra->ra_bufsize - ra->ra_bufhead);
+        memcpy(buf, ra->ra_buf + ra->ra_bufhead, first);
+        memcpy(buf + first, ra->ra_buf, copied - first);
+        unixfs_readahead_drop(ra, offset + (off_t)copied);
+    }
+
+    /* The caller reads the rest itself; prefetching picks up after that. */
+    if ((copied < count) && ra->ra_buf)
+        unixfs_readahead_reset(ra, offset + (off_t)count);
+
+    pthread_mutex_unlock(&unixfs_ra.lock);
+
+    return copied;
+}
+
+void
+unixfs_readahead_note(struct unixfs_rastate* ra, off_t offset, size_t count,
+                      off_t size)
+{
+    if (!ra || !unixfs_ra.nthreads)
+        return;
+
+    pthread_mutex_lock(&unixfs_ra.lock);
+
+    off_t end = offset + count;
+
+    if (offset != ra->ra_next) { /* random access */
+        ra->ra_window = 0;
+        unixfs_readahead_reset(ra, end);
+        ra->ra_end = end;
+        if (ra->ra_queued) {
+            TAILQ_REMOVE(&unixfs_ra.queue, ra, ra_link);
+            ra->ra_queued = 0;
+        }
+        goto out;
+    }
+
+    if (end >= size) /* nothing left to prefetch */
+        goto out;
+
+    if (!ra->ra_buf) {
+        size_t bufsize = (size_t)min((off_t)unixfs_tunables.readahead, size);
+        if (!(ra->ra_buf = malloc(bufsize)))
+            goto out;
+        ra->ra_bufsize = bufsize;
+        unixfs_readahead_reset(ra, end);
+    }
+
+    unixfs_readahead_drop(ra, end);
+
+    if (ra->ra_window < UNIXFS_RA_MINWINDOW)
+        ra->ra_window = UNIXFS_RA_MINWINDOW;
+    else
+        ra->ra_window *= 2;
+    ra->ra_window = min(ra->ra_window, ra->ra_bufsize);
+
+    if ((ra->ra_end - end) < (off_t)(ra->ra_window / 2))
+        ra->ra_end = min(end + (off_t)ra->ra_window, size);
+
+    /* Also picks up a worker that stopped for want of room in the ring. */
+    if ((ra->ra_start < ra->ra_end) && !ra->ra_queued && !ra->ra_busy) {
+        TAILQ_INSERT_TAIL(&unixfs_ra.queue, ra, ra_link);
+        ra->ra_queued = 1;
+        pthread_cond_signal(&unixfs_ra.work_cond);
+    }
+
+out:
+    ra->ra_next = end;
+
+    pthread_mutex_unlock(&unixfs_ra.lock);
 }
@@ -33,31 +33,8 @@
 #define ino64_t ino_t
 extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
 
-#include <endian.h>
-#include <asm/byteorder.h>
-
-#define OSSwapLittleToHostInt64(x) __le64_to_cpu(x)
-#define OSSwapBigToHostInt64(x)    __be64_to_cpu(x)
-#define OSSwapHostToLittleInt64(x) __cpu_to_le64(x)
-#define OSSwapHostToBigInt64(x)    __cpu_to_be64(x)
-  
-#define OSSwapLittleToHostInt32(x) __le32_to_cpu(x)
-#define OSSwapBigToHostInt32(x)    __be32_to_cpu(x)
-#define OSSwapHostToLittleInt32(x) __cpu_to_le32(x)
-#define OSSwapHostToBigInt32(x)    __cpu_to_be32(x)
-  
-#define OSSwapLittleToHostInt16(x) __le16_to_cpu(x)
-#define OSSwapBigToHostInt16(x)    __be16_to_cpu(x)
-#define OSSwapHostToLittleInt16(x) __cpu_to_le16(x)
-#define OSSwapHostToBigInt16(x)    __cpu_to_be16(x)
-
-#if __BYTE_ORDER == __BIG_ENDIAN
-#define __BIG_ENDIAN__ 1
-#elif __BYTE_ORDER == __LITTLE_ENDIAN
-#define __LITTLE_ENDIAN__ 1
-#else
-#error Endian Problem
-#endif
+#include <darwin/OSByteOrder.h>
+#include <sys/sysmacros.h> /* makedev() */
 
 #elif __FreeBSD__
 
@@ -87,6 +64,9 @@ extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
 #define UNIXFS_IOSIZE(unixfs)     (uint32_t)(unixfs->s_statvfs.f_bsize)
 #define UNIXFS_NADDR_MAX          13
 
+struct unixfs_bcache;
+struct unixfs_extentmap;
+
 struct super_block {
     u_long         s_magic;
     u_long         s_flags;
@@ -101,6 +81,9 @@ struct super_block {
     char           s_fsname[UNIXFS_MNAMELEN];
     char           s_volname[UNIXFS_MAXNAMLEN];
     struct statvfs s_statvfs;
+    struct unixfs_bcache* s_bcache; /* block cache for s_bdev */
+    char*          s_map;     /* read-only mapping of s_bdev (--mmap) */
+    size_t         s_mapsize;
 };
 
 #define s_id s_fsname
@@ -123,6 +106,7 @@ struct super_block {
  */
 typedef struct inode {
     LIST_ENTRY(inode)   I_hashlink;
+    TAILQ_ENTRY(inode)  I_freelink; /* inode layer LRU/free list */
     pthread_cond_t      I_state_cond;
     uint32_t            I_initialized;
     uint32_t            I_attachoutstanding;
@@ -136,6 +120,14 @@ typedef struct inode {
         uint8_t         I_addr[UNIXFS_NADDR_MAX];
     } I_addr_un;
     void*               I_private;
+    struct unixfs_extentmap* I_extents; /* memoized bmap results */
+    struct unixfs_dirindex*  I_dirindex; /* directories: name => ino */
+    off_t               I_dataoff; /* archive formats: where the data begins */
+    uint32_t            I_dirhint; /* directories: page of the last lookup */
+#if __linux__
+    uint32_t            I_flags;   /* Linux's stat has no st_flags ... */
+    uint32_t            I_gen;     /* ... or st_gen */
+#endif
 } inode;
 
 #define I_mode       I_stat.st_mode
@@ -145,15 +137,18 @@ typedef struct inode {
 #define I_uid        I_stat.st_uid
 #define I_gid        I_stat.st_gid
 #define I_rdev       I_stat.st_rdev
-#define I_atime      I_stat.st_atimespec
-#define I_mtime      I_stat.st_mtimespec
-#define I_ctime      I_stat.st_ctimespec
-#define I_crtime     I_stat.st_birthtimespec
 #if __linux__
+#define I_atime      I_stat.st_atim
+#define I_mtime      I_stat.st_mtim
+#define I_ctime      I_stat.st_ctim
 #define I_atime_sec  I_stat.st_atime
 #define I_mtime_sec  I_stat.st_mtime
 #define I_ctime_sec  I_stat.st_ctime
 #else
+#define I_atime      I_stat.st_atimespec
+#define I_mtime      I_stat.st_mtimespec
+#define I_ctime      I_stat.st_ctimespec
+#define I_crtime     I_stat.st_birthtimespec
 #define I_atime_sec  I_stat.st_atimespec.tv_sec
 #define I_mtime_sec  I_stat.st_mtimespec.tv_sec
 #define I_ctime_sec  I_stat.st_ctimespec.tv_sec
@@ -162,10 +157,15 @@ typedef struct inode {
 #define I_size       I_stat.st_size
 #define I_blocks     I_stat.st_blocks
 #define I_blksize    I_stat.st_blksize
+#if __linux__
+#define I_generation I_gen
+#define I_version    I_gen
+#else
 #define I_flags      I_stat.st_flags
 #define I_gen        I_stat.st_gen
 #define I_generation I_stat.st_gen
 #define I_version    I_stat.st_gen
+#endif
 #define I_addr       I_addr_un.I_addr
 #define I_daddr      I_addr_un.I_daddr
 
@@ -182,6 +182,103 @@ void          unixfs_inodelayer_iput(struct inode* ip);
 void          unixfs_inodelayer_isucceeded(struct inode* ip);
 void          unixfs_inodelayer_ifailed(struct inode* ip);
 void          unixfs_inodelayer_dump(unixfs_inodelayer_iterator_t);
+uint32_t      unixfs_inodelayer_getdirhint(struct inode* ip);
+void          unixfs_inodelayer_setdirhint(struct inode* ip, uint32_t page);
+
+/* Extent map interface. */
+
+typedef off_t (*unixfs_bmap_t)(struct inode*, off_t, int*);
+
+int   unixfs_extentmap_lookup(struct inode* ip, off_t lblkno, off_t* pblkno, off_t* contig);
+void  unixfs_extentmap_insert(struct inode* ip, off_t lblkno, off_t pblkno);
+off_t unixfs_extentmap_run(struct inode* ip, off_t lblkno, off_t pblkno, off_t maxblocks, unixfs_bmap_t bmap);
+void  unixfs_extentmap_free(struct inode* ip);
+
+/* Directory name index interface. */
+
+#define UNIXFS_DIRINDEX_MINSIZE 4096 /* bytes; smaller ones get scanned */
+
+struct unixfs_dirindex_entry {
+    uint32_t de_hash;
+    uint32_t de_namelen;
+    size_t   de_nameoff; /* into di_names */
+    ino_t    de_ino;
+};
+
+struct unixfs_dirindex {
+    struct unixfs_dirindex_entry* di_entries; /* in the order added */
+    uint32_t                      di_count;
+    uint32_t                      di_capacity;
+    uint32_t*                     di_hash;    /* entry index + 1; 0 => empty */
+    uint32_t                      di_hashmask;
+    char*                         di_names;
+    size_t                        di_namesize;
+    size_t                        di_namecapacity;
+};
+
+int   unixfs_dirindex_add(struct unixfs_dirindex* di, const char* name,
+                          size_t namelen, ino_t ino);
+ino_t unixfs_dirindex_find(struct unixfs_dirindex* di, const char* name,
+                           size_t namelen);
+void  unixfs_dirindex_clear(struct unixfs_dirindex* di);
+
+/* Fills a new index with every entry of the directory, through add(). */
+typedef int (*unixfs_dirindex_fill_t)(struct inode*, struct unixfs_dirindex*);
+
+int  unixfs_dirindex_lookup(struct inode* dp, const char* name,
+                            unixfs_dirindex_fill_t fill, ino_t* ino);
+void unixfs_dirindex_free(struct inode* ip);
+
+/* Batched attribute lookup; see unixfs_igetattr_many(). */
+
+typedef off_t (*unixfs_ilocate_t)(ino_t ino);
+typedef int   (*unixfs_igetattr_t)(ino_t ino, struct stat* stbuf);
+
+void unixfs_igetattr_many(struct super_block* sb, ino_t* inos,
+                          struct stat* stbufs, int* errors, size_t count,
+                          unixfs_ilocate_t locate, unixfs_igetattr_t igetattr);
+
+/* Device interface; see unixfs_dev.c. */
+
+int      unixfs_dev_open(const char* path);
+int      unixfs_dev_close(int fd);
+int      unixfs_dev_compressed(int fd);
+int      unixfs_dev_fstat(int fd, struct stat* stbuf);
+ssize_t  unixfs_dev_pread(int fd, void* buf, size_t nbyte, off_t offset);
+ssize_t  unixfs_dev_read(int fd, void* buf, size_t nbyte);
+off_t    unixfs_dev_lseek(int fd, off_t offset, int whence);
+uint64_t unixfs_dev_bytesread(void);
+
+/* Buffer cache interface. */
+
+struct unixfs_buf {
+    LIST_ENTRY(unixfs_buf)  b_hashlink;
+    TAILQ_ENTRY(unixfs_buf) b_freelink;
+    off_t                   b_offset; /* byte offset on the device */
+    size_t                  b_size;
+    uint32_t                b_count;
+    uint32_t                b_flags;
+    char*                   b_data;
+};
+
+/* b_flags */
+#define UNIXFS_B_BUSY    0x00000001 /* I/O in progress */
+#define UNIXFS_B_ERROR   0x00000002 /* I/O failed */
+#define UNIXFS_B_MAPPED  0x00000004 /* b_data points into s_map */
+#define UNIXFS_B_NOCACHE 0x00000008 /* private to the caller; no cache */
+
+int                unixfs_bcache_init(struct super_block* sb);
+void               unixfs_bcache_fini(struct super_block* sb);
+struct unixfs_buf* unixfs_bcache_getblk(struct super_block* sb, off_t offset,
+                                        size_t size, int* error);
+void               unixfs_bcache_brelse(struct super_block* sb,
+                                        struct unixfs_buf* bp);
+int                unixfs_bcache_bread(struct super_block* sb, off_t offset,
+                                       size_t size, char* buf);
+const char*        unixfs_bcache_map(struct super_block* sb, off_t offset,
+                                     size_t size);
+ssize_t            unixfs_bcache_pread(struct super_block* sb, char* buf,
+                                       size_t size, off_t offset);
 
 /* Byte Swappers */
 
@@ -39,7 +39,7 @@ get_branch(struct inode* inode, int depth, int* offsets, Indirect chain[DEPTH],
         goto no_block;
 
     while (--depth) {
-        bh = malloc(sizeof(struct buffer_head));
+        bh = sb_getblk(sb, block_to_cpu(p->key));
         if (sb_bread_intobh(sb, block_to_cpu(p->key), bh) != 0)
             goto failure;
         if (!verify_chain(chain, p))
@@ -76,12 +76,16 @@ static inline int get_block(struct inode* inode, sector_t iblock, off_t* result)
     if (depth == 0)
         goto out;
 
+    if (unixfs_extentmap_lookup(inode, iblock, result, NULL) == 0)
+        return 0;
+
 /* reread: */ 
     partial = get_branch(inode, depth, offsets, chain, &err);
     
     /* simplest case - block found, no allocation needed */
     if (!partial) {
         *result = (off_t)(block_to_cpu(chain[depth-1].key));
+        unixfs_extentmap_insert(inode, iblock, *result);
         /* clean up and exit */
         partial = chain + depth - 1; /* the whole chain */
         goto cleanup;
@@ -37,36 +37,65 @@ static ino_t         minix_find_entry(struct inode*, const char*);
 extern int           minix_get_block_v1(struct inode*, sector_t, off_t*);
 extern int           minix_get_block_v2(struct inode*, sector_t, off_t*);
 
-static const int nibblemap[] = { 4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0 };
+/*
+ * The maps are read once, at mount, but they can run to dozens of blocks,
+ * so count them a word at a time. The compiler's builtin becomes a single
+ * instruction where the target has one.
+ */
+#if defined(__GNUC__)
+#define minix_popcount64(w) ((unsigned)__builtin_popcountll(w))
+#else
+static unsigned
+minix_popcount64(__u64 w)
+{
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (unsigned)((w * 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+/* The number of clear bits in nbytes bytes of a map. */
+static unsigned long
+count_zero_bits(const unsigned char* p, size_t nbytes)
+{
+    unsigned long sum = 0;
+    size_t j = 0;
+    __u64 w;
+
+    for (; j + sizeof(w) <= nbytes; j += sizeof(w)) {
+        memcpy(&w, p + j, sizeof(w));
+        sum += 64 - minix_popcount64(w);
+    }
+    for (; j < nbytes; j++)
+        sum += 8 - minix_popcount64(p[j]);
+
+    return sum;
+}
 
 static unsigned long
 count_free(struct buffer_head* map[], unsigned numblocks, __u32 numbits)
 {
-    unsigned i, j, sum = 0;
+    unsigned i, j;
+    unsigned long sum = 0;
     struct buffer_head* bh;
   
     for (i = 0; i < numblocks - 1; i++) {
         if (!(bh = map[i])) 
             return 0;
-        for (j = 0; j < bh->b_size; j++)
-            sum += nibblemap[bh->b_data[j] & 0xf]
-                + nibblemap[(bh->b_data[j] >> 4) & 0xf];
+        sum += count_zero_bits(bh->b_data, bh->b_size);
     }
 
     if (numblocks == 0 || !(bh = map[numblocks - 1]))
         return 0;
 
-    i = ((numbits - (numblocks - 1) * bh->b_size * 8) / 16) * 2;
-    for (j = 0; j < i; j++) {
-        sum += nibblemap[bh->b_data[j] & 0xf]
-            + nibblemap[(bh->b_data[j] >> 4) & 0xf];
-    }
+    j = ((numbits - (numblocks - 1) * bh->b_size * 8) / 16) * 2;
+    sum += count_zero_bits(bh->b_data, j);
 
     i = numbits % 16;
     if (i != 0) {
-        i = *(__u16*)(&bh->b_data[j]) | ~((1 << i) - 1);
-        sum += nibblemap[i & 0xf] + nibblemap[(i >> 4) & 0xf];
-        sum += nibblemap[(i >> 8) & 0xf] + nibblemap[(i >> 12) & 0xf];
+        i = (*(__u16*)(&bh->b_data[j]) | ~((1 << i) - 1)) & 0xffff;
+        sum += 16 - minix_popcount64(i);
     }
     return(sum);
 }
@@ -128,6 +157,22 @@ minix_V2_raw_inode(struct super_block* sb, ino_t ino, struct buffer_head** bh)
     return p + ino % minix2_inodes_per_block;
 }
 
+/* The device block (in s_blocksize units) that holds inode ino. */
+off_t
+minixfs_inode_block(struct super_block* sb, ino_t ino)
+{
+    struct minix_sb_info* sbi = minix_sb(sb);
+    unsigned long per_block;
+
+    if (sbi->s_version == MINIX_V1)
+        per_block = MINIX_INODES_PER_BLOCK;
+    else
+        per_block = sb->s_blocksize / sizeof(struct minix2_inode);
+
+    return (off_t)(2 + sbi->s_imap_blocks + sbi->s_zmap_blocks) +
+           (off_t)((ino - 1) / per_block);
+}
+
 static unsigned long
 minix_count_free_inodes(struct minix_sb_info* sbi)
 {
@@ -163,7 +208,6 @@ minix_iget_v1(struct super_block* sb, struct inode* inode)
         minix_inode->u.i1_data[i] = raw_inode->di_zone[i];
     if (S_ISCHR(inode->I_mode) || S_ISBLK(inode->I_mode))
         inode->I_rdev = old_decode_dev(raw_inode->di_zone[0]);
-    minix_inode->i_dir_start_lookup = 0;
     brelse(bh);
     return 0; 
 }
@@ -198,7 +242,6 @@ minix_iget_v2(struct super_block* sb, struct inode* inode)
         minix_inode->u.i2_data[i] = raw_inode->di_zone[i];
     if (S_ISCHR(inode->I_mode) || S_ISBLK(inode->I_mode))
         inode->I_rdev = old_decode_dev(raw_inode->di_zone[0]);
-    minix_inode->i_dir_start_lookup = 0;
     brelse(bh);
     return 0;
 }
@@ -380,7 +423,7 @@ minixfs_fill_super(int fd, void* data, int silent)
     for (i=0 ; i < sbi->s_imap_blocks ; i++) {
         if (!(sbi->s_imap[i] = sb_bread(sb, block)))
             goto out_no_bitmap;
-            block++;
+        block++;
     }
     for (i=0 ; i < sbi->s_zmap_blocks ; i++) {
         if (!(sbi->s_zmap[i] = sb_bread(sb, block)))
@@ -480,10 +523,55 @@ minixfs_iget(struct super_block* sb, struct inode* inode)
         return minix_iget_v2(sb, inode);
 }
 
+/* Feeds every live entry of dir to a new lookup index. */
+int
+minixfs_fill_dirindex(struct inode* dir, struct unixfs_dirindex* di)
+{
+    struct minix_sb_info* sbi = minix_sb(dir->I_sb);
+    unsigned long n;
+    unsigned long npages = minix_dir_pages(dir);
+    char page[PAGE_SIZE];
+    char* p;
+
+    for (n = 0; n < npages; n++) {
+        if (minix_get_dirpage(dir, n, page) != 0)
+            return EIO;
+        char* limit = page + minix_last_byte(dir, n) - sbi->s_dirsize;
+        for (p = page; p <= limit; p = minix_next_entry(p, sbi)) {
+            char* namx;
+            ino_t ino;
+            if (sbi->s_version == MINIX_V3) {
+                namx = ((minix3_dirent*)p)->name;
+                ino = ((minix3_dirent*)p)->inode;
+            } else {
+                namx = ((minix_dirent*)p)->name;
+                ino = ((minix_dirent*)p)->inode;
+            }
+            if (!ino)
+                continue;
+            int error = unixfs_dirindex_add(di, namx,
+                                            strnlen(namx, sbi->s_namelen), ino);
+            if (error)
+                return error;
+        }
+    }
+
+    return 0;
+}
+
 ino_t
 minix_inode_by_name(struct inode* dir, const char* name)
 {
-    return minix_find_entry(dir, name);
+    ino_t ino;
+
+    switch (unixfs_dirindex_lookup(dir, name, minixfs_fill_dirindex, &ino)) {
+    case 0:
+        return ino;
+    case ENOENT:
+        return 0;
+    default:
+        return minix_find_entry(dir, name);
+    }
 }
 
 int
@@ -543,6 +631,60 @@ minixfs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirbuf,
     return 0;
 }
 
+/*
+ * Like minixfs_next_direntry(), but decodes every entry it can from each
+ * page it reads, skipping free slots, until count entries are filled in or
+ * the directory ends. Returns how many; 0 at the end, -1 if a page is
+ * unreadable.
+ */
+ssize_t
+minixfs_readdir_batch(struct inode* dir, off_t* offset,
+                      struct unixfs_direntry* dents, size_t count)
+{
+    struct minix_sb_info* sbi = minix_sb(dir->I_sb);
+    unsigned long npages = minix_dir_pages(dir);
+    unsigned chunk_size = sbi->s_dirsize;
+    char page[PAGE_SIZE];
+    size_t filled = 0;
+    char* p;
+
+    *offset = (*offset + chunk_size - 1) & ~(chunk_size - 1);
+
+    while ((filled < count) && (*offset < dir->I_size)) {
+        unsigned long n = *offset >> PAGE_CACHE_SHIFT;
+        if (n >= npages)
+            break;
+        if (minix_get_dirpage(dir, n, page) != 0)
+            return filled ? (ssize_t)filled : -1;
+        char* limit = page + minix_last_byte(dir, n) - chunk_size;
+        for (p = page + (*offset & (PAGE_SIZE - 1));
+             (filled < count) && (p <= limit); p = minix_next_entry(p, sbi)) {
+            char* namx;
+            ino_t ino;
+            if (sbi->s_version == MINIX_V3) {
+                namx = ((minix3_dirent*)p)->name;
+                ino = ((minix3_dirent*)p)->inode;
+            } else {
+                namx = ((minix_dirent*)p)->name;
+                ino = ((minix_dirent*)p)->inode;
+            }
+            if (!ino)
+                continue;
+            size_t nl = strnlen(namx, sbi->s_namelen);
+            dents[filled].ino = ino;
+            memcpy(dents[filled].name, namx, nl);
+            dents[filled].name[nl] = '\0';
+            filled++;
+        }
+        if (filled < count) /* on to the next page */
+            *offset = (off_t)(n + 1) << PAGE_CACHE_SHIFT;
+        else
+            *offset = ((off_t)n << PAGE_CACHE_SHIFT) + (p - page);
+    }
+
+    return (ssize_t)filled;
+}
+
 int
 minixfs_get_block(struct inode* inode, sector_t iblock, off_t* result)
 {
@@ -557,48 +699,51 @@ minixfs_get_page(struct inode* inode, sector_t index, char* pagebuf)
 {
     sector_t iblock, lblock;
     unsigned int blocksize;
-    int nr, i;
 
     blocksize = 1 << inode->I_blkbits;
 
     iblock = index << (PAGE_CACHE_SHIFT - inode->I_blkbits);
     lblock = (inode->I_size + blocksize - 1) >> inode->I_blkbits;
 
-    nr = 0;
-    i = 0;
-
     int bytes = 0, err = 0;
     struct super_block* sb = inode->I_sb;
-    struct buffer_head _bh;
     char* p = pagebuf;
 
+    /* physically contiguous blocks are read together, into place */
+    off_t runstart = 0;
+    size_t runlen = 0;
+    char* runbuf = NULL;
+
     do {
         off_t phys64 = 0;
         int ret = minixfs_get_block(inode, iblock, &phys64);
-        if (phys64) {
-            struct buffer_head* bh = &_bh;
-            bh->b_flags.dynamic = 0;
-            if (sb_bread_intobh(sb, phys64, bh) == 0) {
-                memcpy(p, bh->b_data, blocksize);
-                p += blocksize;
-                bytes += blocksize;
-                brelse(bh); 
-            } else {
+        if (!phys64 && ret != 0) {
+            err = EIO;
+            fprintf(stderr, "*** fatal error: block mapping failed\n");
+            abort();
+        }
+
+        if (runlen && (phys64 != runstart + (off_t)runlen)) {
+            if (sb_bread_run(sb, runstart, runlen, runbuf) != 0) {
                 err = EIO;
                 fprintf(stderr, "*** fatal error: I/O error reading page\n");
                 abort();
-                exit(10);
             }
-        } else if (ret == 0) { /* zero fill */
-            memset(p, 0, blocksize);
-            p += blocksize;
-            bytes += blocksize;
-        } else {
-            err = EIO;
-            fprintf(stderr, "*** fatal error: block mapping failed\n");
-            abort();
+            runlen = 0;
         }
 
+        if (phys64) {
+            if (runlen == 0) {
+                runstart = phys64;
+                runbuf = p;
+            }
+            runlen++;
+        } else /* zero fill */
+            memset(p, 0, blocksize);
+
+        p += blocksize;
+        bytes += blocksize;
+
         iblock++;
 
         if ((bytes >= PAGE_SIZE) || (iblock >= lblock))
@@ -606,6 +751,12 @@ minixfs_get_page(struct inode* inode, sector_t index, char* pagebuf)
 
     } while (1);
 
+    if (runlen && (sb_bread_run(sb, runstart, runlen, runbuf) != 0)) {
+        err = EIO;
+        fprintf(stderr, "*** fatal error: I/O error reading page\n");
+        abort();
+    }
+
     if (err)
         return -1;
 
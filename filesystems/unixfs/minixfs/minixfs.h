@@ -16,7 +16,6 @@
 #include "unixfs_internal.h"
 #include <linux.h>
 #include <linux/minix_fs.h>
-#include <libkern/OSByteOrder.h>
 
 #define INODE_VERSION(inode) minix_sb(inode->I_sb)->s_version
 
@@ -29,7 +28,6 @@ struct minix_inode_info {
         __u16 i1_data[16];
         __u32 i2_data[16];
     } u;
-    u32 i_dir_start_lookup;
 };
 
 struct minix_sb_info {
@@ -91,10 +89,14 @@ struct super_block*
       minixfs_fill_super(int fd, void* args, int silent);
 int   minixfs_statvfs(struct super_block* sb, struct statvfs* buf);
 int   minixfs_iget(struct super_block* sb, struct inode* ip);
+off_t minixfs_inode_block(struct super_block* sb, ino_t ino);
 ino_t minixfs_inode_by_name(struct inode* dir, const char* name);
 int   minixfs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirbuf,
                           off_t* offset, struct unixfs_direntry* dent);
+ssize_t minixfs_readdir_batch(struct inode* dir, off_t* offset,
+                              struct unixfs_direntry* dents, size_t count);
 int   minixfs_get_block(struct inode* ip, sector_t fragment, off_t* result);
 int   minixfs_get_page(struct inode* ip, sector_t index, char* pagebuf);
+int   minixfs_fill_dirindex(struct inode* dir, struct unixfs_dirindex* di);
 
 #endif /* _MINIXFS_H_ */
@@ -5,6 +5,10 @@
  */
 
 #include "minixfs.h"
+
+#define UNIXFS_HAVE_IGETATTR_MANY 1
+#define UNIXFS_HAVE_READDIR_BATCH 1
+#define UNIXFS_HAVE_DIRINDEX 1
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -19,12 +23,12 @@
 DECL_UNIXFS("Minix", minix);
 
 static void*
-unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
+unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +37,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -56,6 +60,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct minix_sb_info* sbi = minix_sb(sb);
 
     unixfs = sb;
+
+    if ((err = unixfs_bcache_init(sb)) != 0)
+        goto out;
     unixfs->s_flags = flags;
 
     (void)minixfs_statvfs(sb, &(unixfs->s_statvfs));
@@ -77,8 +84,9 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
 out:
     if (err) {
         if (fd > 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (sb) {
+            unixfs_bcache_fini(sb);
             free(sb);
             sb = NULL;
         }
@@ -97,6 +105,7 @@ unixfs_internal_fini(void* filsys)
         struct minix_sb_info* sbi = minix_sb(sb);
         if (sbi)
             free(sbi);
+        unixfs_bcache_fini(sb);
         free(sb);
     }
 }
@@ -120,11 +129,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     struct super_block* sb = unixfs;
 
-    if (pread(sb->s_bdev, blkbuf, sb->s_blocksize,
-              blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
-        return EIO;
-
-    return 0;
+    return unixfs_bcache_bread(sb, blkno * (off_t)(sb->s_blocksize),
+                               sb->s_blocksize, blkbuf);
 }
 
 struct inode*
@@ -137,7 +143,8 @@ unixfs_internal_iget(ino_t ino)
 
     struct inode* inode = unixfs_inodelayer_iget(ino);
     if (!inode) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -148,7 +155,8 @@ unixfs_internal_iget(ino_t ino)
     inode->I_blkbits = sb->s_blocksize_bits;
 
     if (minixfs_iget(sb, inode) != 0) {
-        fprintf(stderr, "major problem: failed to read inode %llu\n", ino);
+        fprintf(stderr, "major problem: failed to read inode %llu\n",
+                (unsigned long long)ino);
         unixfs_inodelayer_ifailed(inode);
         goto bad_inode;
     }
@@ -184,6 +192,23 @@ unixfs_internal_igetattr(ino_t ino, struct stat* stbuf)
     return 0;
 }
 
+static off_t
+unixfs_internal_ilocate(ino_t ino)
+{
+    if (ino == MACFUSE_ROOTINO)
+        ino = MINIX_ROOT_INO;
+
+    return minixfs_inode_block(unixfs, ino);
+}
+
+static void
+unixfs_internal_igetattr_many(ino_t* inos, struct stat* stbufs, int* errors,
+                              size_t count)
+{
+    unixfs_igetattr_many(unixfs, inos, stbufs, errors, count,
+                         unixfs_internal_ilocate, unixfs_internal_igetattr);
+}
+
 static void
 unixfs_internal_istat(struct inode* ip, struct stat* stbuf)
 {
@@ -207,6 +232,14 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         return ENOTDIR;
     }
 
+    ino_t target;
+    int error = unixfs_dirindex_lookup(dir, name, minixfs_fill_dirindex,
+                                       &target);
+    if ((error == 0) || (error == ENOENT)) {
+        unixfs_internal_iput(dir);
+        return (error == 0) ? unixfs_internal_igetattr(target, stbuf) : ENOENT;
+    }
+
     int ret = ENOENT;
 
     unsigned long namelen = strlen(name);
@@ -221,9 +254,8 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
     struct super_block* sb = dir->I_sb;
     struct minix_sb_info* sbi = minix_sb(sb);
     unsigned chunk_size = sbi->s_dirsize;
-    struct minix_inode_info* minix_inode = minix_i(dir);
 
-    start = minix_inode->i_dir_start_lookup;
+    start = unixfs_inodelayer_getdirhint(dir);
     if (start >= npages)
         start = 0;
     n = start;
@@ -268,7 +300,7 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
 found:
 
     if (found_ino)
-        minix_inode->i_dir_start_lookup = n;
+        unixfs_inodelayer_setdirhint(dir, (uint32_t)n);
 
     unixfs_internal_iput(dir);
 
@@ -286,6 +318,13 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
 
 }
 
+static ssize_t
+unixfs_internal_readdir_batch(struct inode* dp, off_t* offset,
+                              struct unixfs_direntry* dents, size_t count)
+{
+    return minixfs_readdir_batch(dp, offset, dents, count);
+}
+
 static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
@@ -298,11 +337,14 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
     sector_t beginpgno = offset >> PAGE_CACHE_SHIFT;
 
     while (remaining > 0) { /* page sized reads */
-        *error = minixfs_get_page(ip, beginpgno, page);
+        /* whole pages go straight into the caller's buffer */
+        char* dst = (remaining >= PAGE_SIZE) ? p : page;
+        *error = minixfs_get_page(ip, beginpgno, dst);
         if (*error)
             break;
         tomove = (remaining > PAGE_SIZE) ? PAGE_SIZE : remaining;
-        memcpy(p, page, tomove);
+        if (dst != p)
+            memcpy(p, page, tomove);
         remaining -= tomove;
         done += tomove;
         p += tomove;
@@ -0,0 +1,769 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * Synthetic image generator.
+ *
+ * Writes a file system image or archive holding a generated tree, so that
+ * the unixfs back-ends can be exercised and benchmarked on images of any
+ * shape without hunting for real ones. The tree is described by a spec of
+ * comma-separated key=value pairs, given with -s or read one per line from
+ * a file with -f ('#' starts a comment):
+ *
+ *     depth=N      levels of subdirectories below the root      (2)
+ *     fanout=N     subdirectories per directory                  (4)
+ *     files=N      regular files per directory                   (16)
+ *     bigdir=N     files in an extra directory "big" in the root (0)
+ *     size=A[:B]   file sizes, uniform between A and B bytes     (0:8k)
+ *     namelen=N    pad names out to N characters                 (0)
+ *     data=pattern|zero  file contents                           (pattern)
+ *     seed=N       seed for sizes, names and contents            (1)
+ *     mtime=N      timestamp of every entry                      (2008-01-01)
+ *     uid=N gid=N  owner of every entry                          (0 0)
+ *     free=N       spare blocks on the free list                 (64)
+ *     inodes=N     spare inodes                                  (16)
+ *     bsize=N fsize=N fpg=N ipg=N  ufs geometry                  (16k 2k)
+ *
+ * Numbers take k, m and g suffixes. The same spec always yields the same
+ * tree, byte for byte, and the same tree is written for every format, so
+ * results can be compared across back-ends. Each writer checks the tree
+ * against its format's limits (16-bit inode numbers, path lengths and the
+ * like) and refuses rather than writing something its reader would not
+ * accept.
+ */
+
+#include "mkimage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MK_IOSIZE    (1024 * 1024)
+#define MK_MAXNODES  0xfffffff0ULL
+
+static struct mk_format mk_formats[] = {
+    { "v7",        "Seventh Edition file system",          mk_write_v7        },
+    { "sysv",      "System V Release 4 file system (1K)",  mk_write_sysv      },
+    { "minix",     "Minix v1 file system, 30-char names",  mk_write_minix1    },
+    { "minix2",    "Minix v2 file system, 30-char names",  mk_write_minix2    },
+    { "ufs",       "4.4BSD UFS1 (mount with ufstype=44bsd)", mk_write_ufs1    },
+    { "ufs2",      "FreeBSD UFS2 (mount with ufstype=ufs2)", mk_write_ufs2    },
+    { "tar",       "POSIX ustar archive",                  mk_write_tar       },
+    { "cpio_newc", "SVR4 cpio archive, no CRC",            mk_write_cpio_newc },
+    { "cpio_odc",  "POSIX.1 portable cpio archive",        mk_write_cpio_odc  },
+    { "ar",        "4.4BSD ar archive (flat)",             mk_write_ar        },
+    { NULL,        NULL,                                   NULL               },
+};
+
+static char mk_iobuf[MK_IOSIZE];
+
+/* splitmix64 */
+static uint64_t
+mk_mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static int
+mk_number(const char* s, uint64_t* result)
+{
+    char* end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 0);
+    if (errno || end == s)
+        return EINVAL;
+
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+
+    if (*end)
+        return EINVAL;
+
+    *result = v;
+
+    return 0;
+}
+
+static int
+mk_spec_set(struct mk_spec* s, char* kv)
+{
+    char* value = strchr(kv, '=');
+    char* max = NULL;
+    const char* what = "value";
+    uint64_t v = 0, limit = 0;
+
+    if (!value) {
+        fprintf(stderr, "invalid spec item: %s (expected key=value)\n", kv);
+        return EINVAL;
+    }
+    *value++ = '\0';
+
+    if (strcmp(kv, "data") == 0) {
+        if (strcmp(value, "pattern") == 0)
+            s->data = MK_DATA_PATTERN;
+        else if (strcmp(value, "zero") == 0)
+            s->data = MK_DATA_ZERO;
+        else
+            goto bad;
+        return 0;
+    }
+
+    if (strcmp(kv, "size") == 0) {
+        what = "size";
+        max = strchr(value, ':');
+        if (max)
+            *max++ = '\0';
+        if (mk_number(value, &s->minsize))
+            goto bad;
+        s->maxsize = s->minsize;
+        if (max && mk_number(max, &s->maxsize))
+            goto bad;
+        if (s->maxsize < s->minsize)
+            goto bad;
+        return 0;
+    }
+
+#define MK_KEY(key, field, max, kind)                   \
+    if (strcmp(kv, key) == 0) {                         \
+        what = kind;                                    \
+        if (mk_number(value, &v))                       \
+            goto bad;                                   \
+        if (v > (max)) {                                \
+            limit = (max);                              \
+            goto bad;                                   \
+        }                                               \
+        s->field = v;                                   \
+        return 0;                                       \
+    }
+
+    MK_KEY("depth",   depth,   64,         "number");
+    MK_KEY("fanout",  fanout,  UINT32_MAX, "number");
+    MK_KEY("files",   files,   UINT32_MAX, "number");
+    MK_KEY("bigdir",  bigdir,  UINT32_MAX, "number");
+    MK_KEY("namelen", namelen, 255,        "length");
+    MK_KEY("seed",    seed,    UINT64_MAX, "number");
+    MK_KEY("mtime",   mtime,   UINT32_MAX, "time");
+    MK_KEY("uid",     uid,     UINT32_MAX, "number");
+    MK_KEY("gid",     gid,     UINT32_MAX, "number");
+    MK_KEY("free",    free,    UINT64_MAX, "number");
+    MK_KEY("inodes",  inodes,  UINT32_MAX, "number");
+    MK_KEY("bsize",   bsize,   65536,      "size");
+    MK_KEY("fsize",   fsize,   4096,       "size");
+    MK_KEY("fpg",     fpg,     UINT32_MAX, "number");
+    MK_KEY("ipg",     ipg,     UINT32_MAX, "number");
+
+#undef MK_KEY
+
+    fprintf(stderr, "unknown spec key: %s\n", kv);
+    return EINVAL;
+
+bad:
+    if (max)
+        max[-1] = ':';
+    if (limit)
+        fprintf(stderr, "%s: invalid %s '%s' (at most %llu)\n", kv, what,
+                value, (unsigned long long)limit);
+    else
+        fprintf(stderr, "%s: invalid %s '%s'\n", kv, what, value);
+    return EINVAL;
+}
+
+static int
+mk_spec_parse(struct mk_spec* s, const char* str)
+{
+    char* copy = strdup(str);
+    char* item;
+    char* next = copy;
+    int err = 0;
+
+    if (!copy)
+        return ENOMEM;
+
+    while (!err && (item = strsep(&next, ",")) != NULL) {
+        if (*item)
+            err = mk_spec_set(s, item);
+    }
+
+    free(copy);
+
+    return err;
+}
+
+static int
+mk_spec_file(struct mk_spec* s, const char* path)
+{
+    char line[1024];
+    int err = 0;
+    FILE* fp = fopen(path, "r");
+
+    if (!fp) {
+        perror(path);
+        return errno;
+    }
+
+    while (!err && fgets(line, sizeof(line), fp)) {
+        char* p = strchr(line, '#');
+        if (p)
+            *p = '\0';
+        for (p = line; *p; p++)
+            if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+                *p = ',';
+        err = mk_spec_parse(s, line);
+    }
+
+    fclose(fp);
+
+    return err;
+}
+
+/*
+ * Tree generation.
+ */
+
+static uint32_t
+mk_tree_add(struct mk_tree* t, uint32_t parent, int isdir)
+{
+    struct mk_node* p = &t->nodes[parent];
+    struct mk_node* n = &t->nodes[t->count];
+
+    n->parent = parent;
+    n->slot = p->nchild++;
+    n->depth = p->depth + 1;
+    n->isdir = isdir;
+    if (isdir) {
+        p->nsubdir++;
+        t->ndirs++;
+    }
+    if (n->depth > t->maxdepth)
+        t->maxdepth = n->depth;
+
+    return t->count++;
+}
+
+static int
+mk_tree_build(struct mk_spec* s, struct mk_tree* t)
+{
+    uint64_t total = 0, level = 1;
+    uint64_t rng = s->seed;
+    uint32_t i, j;
+
+    for (i = 0; i <= s->depth; i++) {
+        if (level > MK_MAXNODES)
+            goto toobig;
+        total += level * (1 + (uint64_t)s->files);
+        if (total > MK_MAXNODES)
+            goto toobig;
+        level *= s->fanout;
+    }
+    if (s->bigdir)
+        total += 1 + (uint64_t)s->bigdir;
+    if (total > MK_MAXNODES)
+        goto toobig;
+
+    t->nodes = calloc(total, sizeof(struct mk_node));
+    if (!t->nodes) {
+        fprintf(stderr, "cannot allocate a tree of %llu nodes\n",
+                (unsigned long long)total);
+        return ENOMEM;
+    }
+
+    t->nodes[0].isdir = 1;
+    t->nodes[0].parent = 0;
+    t->count = 1;
+    t->ndirs = 1;
+
+    for (i = 0; i < t->count; i++) {
+        struct mk_node* n = &t->nodes[i];
+        uint32_t nfiles = s->files;
+        uint32_t nsubdirs = (n->depth < s->depth) ? s->fanout : 0;
+
+        if (!n->isdir)
+            continue;
+
+        if (t->big && i == t->big) {
+            nfiles = s->bigdir;
+            nsubdirs = 0;
+        }
+
+        n->first = t->count;
+
+        for (j = 0; j < nsubdirs; j++)
+            (void)mk_tree_add(t, i, 1);
+
+        if (i == 0 && s->bigdir)
+            t->big = mk_tree_add(t, i, 1);
+
+        for (j = 0; j < nfiles; j++) {
+            uint32_t f = mk_tree_add(t, i, 0);
+            rng = mk_mix(rng);
+            t->nodes[f].size = s->minsize;
+            if (s->maxsize > s->minsize)
+                t->nodes[f].size += rng % (s->maxsize - s->minsize + 1);
+        }
+    }
+
+    return 0;
+
+toobig:
+    fprintf(stderr, "the spec describes more than %llu entries\n",
+            MK_MAXNODES);
+    return EFBIG;
+}
+
+size_t
+mk_name(struct mk_image* im, uint32_t n, char* buf, size_t maxlen)
+{
+    struct mk_node* node = &im->tree->nodes[n];
+    size_t len;
+    uint64_t h;
+
+    if (n && n == im->tree->big)
+        len = snprintf(buf, maxlen + 1, "big");
+    else
+        len = snprintf(buf, maxlen + 1, "%c%u", node->isdir ? 'd' : 'f',
+                       node->slot);
+    if (len > maxlen)
+        len = maxlen;
+
+    if (len < im->spec->namelen && len < maxlen) {
+        buf[len++] = '_';
+        h = mk_mix(im->spec->seed ^ ((uint64_t)n << 8));
+        while (len < im->spec->namelen && len < maxlen) {
+            buf[len++] = 'a' + (h % 26);
+            h = h / 26;
+            if (h < 26)
+                h = mk_mix(h + len);
+        }
+    }
+
+    buf[len] = '\0';
+
+    return len;
+}
+
+size_t
+mk_path(struct mk_image* im, uint32_t n, char* buf, size_t bufsize)
+{
+    char name[256];
+    size_t len, plen = 0;
+
+    if (n == 0) {
+        buf[0] = '\0';
+        return 0;
+    }
+
+    if (im->tree->nodes[n].parent != 0) {
+        plen = mk_path(im, im->tree->nodes[n].parent, buf, bufsize);
+        if (plen + 1 < bufsize)
+            buf[plen++] = '/';
+    }
+
+    len = mk_name(im, n, name, sizeof(name) - 1);
+    if (plen + len >= bufsize)
+        len = (plen < bufsize) ? bufsize - plen - 1 : 0;
+    memcpy(buf + plen, name, len);
+    buf[plen + len] = '\0';
+
+    return plen + len;
+}
+
+void
+mk_fill(struct mk_image* im, uint32_t n, uint64_t off, char* buf, size_t len)
+{
+    uint64_t key;
+    unsigned char word[8];
+
+    if (im->spec->data == MK_DATA_ZERO) {
+        memset(buf, 0, len);
+        return;
+    }
+
+    key = mk_mix(im->spec->seed + ((uint64_t)n << 32));
+
+    while (len) {
+        size_t o = off & 7;
+        size_t k = 8 - o;
+        if (k > len)
+            k = len;
+        mk_le64(word, mk_mix(key + (off >> 3)));
+        memcpy(buf, word + o, k);
+        buf += k;
+        off += k;
+        len -= k;
+    }
+}
+
+/*
+ * Builds the contents of directory n for the formats whose entries are a
+ * 16-bit little-endian inode number followed by a fixed-width name: ".",
+ * "..", then the children in order. Node i has inode ino0 + i.
+ */
+char*
+mk_dirfixed(struct mk_image* im, uint32_t n, uint32_t entsize, uint32_t ino0,
+            uint64_t* size)
+{
+    struct mk_node* node = &im->tree->nodes[n];
+    char name[256];
+    char* buf;
+    char* de;
+    uint32_t i;
+
+    *size = (uint64_t)(2 + node->nchild) * entsize;
+    if (!(buf = calloc(1, *size)))
+        return NULL;
+
+    de = buf;
+    mk_le16(de, ino0 + n);
+    de[2] = '.';
+    de += entsize;
+    mk_le16(de, ino0 + node->parent);
+    de[2] = de[3] = '.';
+    de += entsize;
+
+    for (i = 0; i < node->nchild; i++, de += entsize) {
+        size_t len = mk_name(im, node->first + i, name, entsize - 2);
+        mk_le16(de, ino0 + node->first + i);
+        memcpy(de + 2, name, len);
+    }
+
+    return buf;
+}
+
+/*
+ * Image I/O.
+ */
+
+int
+mk_pwrite(struct mk_image* im, const void* buf, size_t len, off_t off)
+{
+    const char* p = buf;
+
+    while (len) {
+        ssize_t ret = pwrite(im->fd, p, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror(im->path);
+            return errno;
+        }
+        p += ret;
+        off += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+int
+mk_size(struct mk_image* im, off_t size)
+{
+    if (ftruncate(im->fd, size) < 0) {
+        perror(im->path);
+        return errno;
+    }
+
+    return 0;
+}
+
+int
+mk_filedata(struct mk_image* im, uint32_t n, uint64_t from, uint64_t len,
+            off_t off)
+{
+    int err = 0;
+
+    if (im->spec->data == MK_DATA_ZERO)
+        return 0; /* the image is created empty; leave a hole */
+
+    while (!err && len) {
+        size_t k = (len > MK_IOSIZE) ? MK_IOSIZE : len;
+        mk_fill(im, n, from, mk_iobuf, k);
+        err = mk_pwrite(im, mk_iobuf, k, off);
+        from += k;
+        off += k;
+        len -= k;
+    }
+
+    return err;
+}
+
+/*
+ * Block mapping.
+ */
+
+static void
+mk_map_flush(struct mk_map* m)
+{
+    uint64_t from = m->runlbn * m->bsize;
+    uint64_t len = m->runlen * m->bsize;
+    off_t off = (off_t)m->runpbn * m->bsize;
+
+    if (m->runlen && !m->err) {
+        if (from + len > m->size)
+            len = m->size - from;
+        if (m->mem)
+            m->err = mk_pwrite(m->im, m->mem + from, len, off);
+        else
+            m->err = mk_filedata(m->im, m->node, from, len, off);
+    }
+
+    m->runlen = 0;
+}
+
+static uint64_t
+mk_map_data(struct mk_map* m)
+{
+    uint64_t pbn = m->alloc(m);
+
+    if (m->runlen && pbn == m->runpbn + m->runlen &&
+        m->runlen * m->bsize < MK_IOSIZE) {
+        m->runlen++;
+    } else {
+        mk_map_flush(m);
+        m->runpbn = pbn;
+        m->runlbn = m->lbn;
+        m->runlen = 1;
+    }
+
+    m->lbn++;
+
+    return pbn;
+}
+
+static uint64_t
+mk_map_indirect(struct mk_map* m, uint32_t level, uint64_t nblocks)
+{
+    uint64_t self = m->alloc(m);
+    uint64_t addr;
+    uint32_t i;
+    char* ib = calloc(1, m->bsize);
+
+    if (!ib) {
+        m->err = ENOMEM;
+        return 0;
+    }
+
+    for (i = 0; i < m->apb && m->lbn < nblocks && !m->err; i++) {
+        if (level == 1)
+            addr = mk_map_data(m);
+        else
+            addr = mk_map_indirect(m, level - 1, nblocks);
+        m->putaddr(ib, i, addr * m->scale);
+    }
+
+    if (!m->err)
+        m->err = mk_pwrite(m->im, ib, m->bsize, (off_t)self * m->bsize);
+
+    free(ib);
+
+    return self;
+}
+
+int
+mk_map(struct mk_map* m, uint32_t node, const char* mem, uint64_t size,
+       uint64_t* addr)
+{
+    uint64_t nblocks = mk_howmany(size, m->bsize);
+    uint32_t i;
+
+    m->node = node;
+    m->mem = mem;
+    m->size = size;
+    m->lbn = 0;
+    m->runlen = 0;
+    m->err = 0;
+
+    for (i = 0; i < m->ndirect + m->nlevels; i++)
+        addr[i] = 0;
+
+    for (i = 0; i < m->ndirect && m->lbn < nblocks; i++)
+        addr[i] = mk_map_data(m) * m->scale;
+
+    for (i = 1; i <= m->nlevels && m->lbn < nblocks && !m->err; i++)
+        addr[m->ndirect + i - 1] = mk_map_indirect(m, i, nblocks) * m->scale;
+
+    mk_map_flush(m);
+
+    if (!m->err && m->lbn < nblocks)
+        m->err = EFBIG;
+
+    return m->err;
+}
+
+uint64_t
+mk_map_nblocks(struct mk_map* m, uint64_t size)
+{
+    uint64_t n = mk_howmany(size, m->bsize);
+    uint64_t total = n, span = 1;
+    uint32_t level, k;
+
+    if (n <= m->ndirect)
+        return n;
+
+    n -= m->ndirect;
+
+    for (level = 1; level <= m->nlevels && n; level++) {
+        uint64_t taken, per = 1;
+        span *= m->apb;
+        taken = (n < span) ? n : span;
+        for (k = 1; k <= level; k++) {
+            per *= m->apb;
+            total += mk_howmany(taken, per);
+        }
+        n -= taken;
+    }
+
+    return n ? UINT64_MAX : total;
+}
+
+uint64_t
+mk_map_seqalloc(struct mk_map* m)
+{
+    return (*(uint64_t*)m->ctx)++;
+}
+
+/*
+ * Driver.
+ */
+
+static void
+mk_usage(const char* progname)
+{
+    struct mk_format* f;
+
+    fprintf(stderr,
+        "usage: %s -t type [-s spec] [-f specfile] image\n\n"
+        "types:\n", progname);
+
+    for (f = mk_formats; f->name; f++)
+        fprintf(stderr, "    %-10s %s\n", f->name, f->desc);
+
+    fprintf(stderr,
+        "\nspec keys: depth fanout files bigdir size namelen data seed\n"
+        "           mtime uid gid free inodes bsize fsize fpg ipg\n"
+        "example:   -s depth=3,fanout=8,files=32,size=0:64k,seed=7\n");
+}
+
+int
+main(int argc, char** argv)
+{
+    struct mk_spec spec = {
+        .depth   = 2,
+        .fanout  = 4,
+        .files   = 16,
+        .bigdir  = 0,
+        .minsize = 0,
+        .maxsize = 8192,
+        .namelen = 0,
+        .seed    = 1,
+        .mtime   = 1199145600, /* 2008-01-01 00:00:00 UTC */
+        .uid     = 0,
+        .gid     = 0,
+        .free    = 64,
+        .inodes  = 16,
+        .bsize   = 16384,
+        .fsize   = 2048,
+        .fpg     = 0,
+        .ipg     = 0,
+        .data    = MK_DATA_PATTERN,
+    };
+    struct mk_tree tree = { NULL, 0, 0, 0, 0 };
+    struct mk_image im;
+    struct mk_format* f;
+    const char* type = NULL;
+    uint64_t nbytes = 0;
+    uint32_t i;
+    int ch, err;
+    off_t end;
+
+    while ((ch = getopt(argc, argv, "f:hs:t:")) != -1) {
+        switch (ch) {
+        case 'f':
+            if (mk_spec_file(&spec, optarg))
+                exit(1);
+            break;
+        case 's':
+            if (mk_spec_parse(&spec, optarg))
+                exit(1);
+            break;
+        case 't':
+            type = optarg;
+            break;
+        default:
+            mk_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (!type || optind != argc - 1) {
+        mk_usage(argv[0]);
+        exit(1);
+    }
+
+    for (f = mk_formats; f->name; f++)
+        if (strcmp(f->name, type) == 0)
+            break;
+
+    if (!f->name) {
+        fprintf(stderr, "unknown image type: %s\n", type);
+        mk_usage(argv[0]);
+        exit(1);
+    }
+
+    if ((err = mk_tree_build(&spec, &tree)) != 0)
+        exit(1);
+
+    im.path = argv[optind];
+    im.spec = &spec;
+    im.tree = &tree;
+    im.fd = open(im.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (im.fd < 0) {
+        perror(im.path);
+        exit(1);
+    }
+
+    err = f->write(&im);
+
+    if (!err && fsync(im.fd) < 0) {
+        perror(im.path);
+        err = errno;
+    }
+
+    end = lseek(im.fd, 0, SEEK_END);
+    close(im.fd);
+
+    if (err) {
+        (void)unlink(im.path);
+        exit(1);
+    }
+
+    for (i = 0; i < tree.count; i++)
+        nbytes += tree.nodes[i].size;
+
+    printf("%s: %s, %u directories, %u files, %llu bytes of file data, "
+           "%llu byte image\n", im.path, f->name, tree.ndirs,
+           tree.count - tree.ndirs, (unsigned long long)nbytes,
+           (unsigned long long)end);
+
+    free(tree.nodes);
+
+    return 0;
+}
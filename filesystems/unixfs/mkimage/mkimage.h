@@ -0,0 +1,195 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+#ifndef _UNIXFS_MKIMAGE_H_
+#define _UNIXFS_MKIMAGE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The tree to be written.
+ *
+ * Nodes are generated breadth-first, so the children of a directory are a
+ * contiguous run of the node array and every directory appears before its
+ * children. Node 0 is the root. Names are not stored; mk_name() derives
+ * them from the node index on demand, which keeps a tree of millions of
+ * entries to a few dozen bytes per entry.
+ */
+
+struct mk_node {
+    uint32_t parent;
+    uint32_t first;    /* index of the first child */
+    uint32_t nchild;
+    uint32_t nsubdir;
+    uint32_t slot;     /* position within the parent */
+    uint32_t depth;
+    int      isdir;
+    uint64_t size;     /* regular files only */
+};
+
+#define MK_DATA_PATTERN 0
+#define MK_DATA_ZERO    1
+
+struct mk_spec {
+    uint32_t depth;    /* levels of subdirectories below the root */
+    uint32_t fanout;   /* subdirectories per directory */
+    uint32_t files;    /* regular files per directory */
+    uint32_t bigdir;   /* files in an extra directory "big" under the root */
+    uint64_t minsize;
+    uint64_t maxsize;
+    uint32_t namelen;  /* pad names out to this length */
+    uint64_t seed;
+    uint32_t mtime;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t free;     /* spare blocks left on the free list */
+    uint32_t inodes;   /* spare inodes */
+    uint32_t bsize;    /* ufs */
+    uint32_t fsize;    /* ufs */
+    uint32_t fpg;      /* ufs: fragments per cylinder group */
+    uint32_t ipg;      /* ufs: inodes per cylinder group */
+    int      data;
+};
+
+struct mk_tree {
+    struct mk_node* nodes;
+    uint32_t        count;
+    uint32_t        ndirs;
+    uint32_t        maxdepth; /* deepest node */
+    uint32_t        big;      /* the bigdir directory, if any */
+};
+
+struct mk_image {
+    int             fd;
+    const char*     path;
+    struct mk_spec* spec;
+    struct mk_tree* tree;
+};
+
+/*
+ * Per-format writers. Each returns 0 or an errno value, having already
+ * said what went wrong.
+ */
+
+struct mk_format {
+    const char* name;
+    const char* desc;
+    int (*write)(struct mk_image* im);
+};
+
+int mk_write_v7(struct mk_image* im);
+int mk_write_sysv(struct mk_image* im);
+int mk_write_minix1(struct mk_image* im);
+int mk_write_minix2(struct mk_image* im);
+int mk_write_ufs1(struct mk_image* im);
+int mk_write_ufs2(struct mk_image* im);
+int mk_write_tar(struct mk_image* im);
+int mk_write_cpio_newc(struct mk_image* im);
+int mk_write_cpio_odc(struct mk_image* im);
+int mk_write_ar(struct mk_image* im);
+
+/* Tree helpers. */
+
+size_t mk_name(struct mk_image* im, uint32_t n, char* buf, size_t maxlen);
+size_t mk_path(struct mk_image* im, uint32_t n, char* buf, size_t bufsize);
+void   mk_fill(struct mk_image* im, uint32_t n, uint64_t off, char* buf,
+               size_t len);
+char*  mk_dirfixed(struct mk_image* im, uint32_t n, uint32_t entsize,
+                   uint32_t ino0, uint64_t* size);
+
+/* Image I/O. */
+
+int mk_pwrite(struct mk_image* im, const void* buf, size_t len, off_t off);
+int mk_size(struct mk_image* im, off_t size);
+int mk_filedata(struct mk_image* im, uint32_t n, uint64_t from, uint64_t len,
+                off_t off);
+
+/*
+ * Block mapping for the inode-based formats.
+ *
+ * mk_map() lays out a file of nblocks blocks: it draws blocks from the
+ * format's allocator in order, indirect blocks ahead of the data they map
+ * as mkfs and the kernel would, fills in the inode's address slots, writes
+ * the indirect blocks, and hands each run of contiguous data blocks to
+ * mk_map_data(). Data comes from the generator for regular files and from
+ * m->mem for directories.
+ */
+
+struct mk_map {
+    struct mk_image* im;
+    uint32_t  bsize;     /* allocation unit, bytes */
+    uint32_t  ndirect;
+    uint32_t  nlevels;   /* single, double, triple indirect */
+    uint32_t  apb;       /* addresses per indirect block */
+    uint32_t  scale;     /* address units per allocation unit */
+    uint64_t  (*alloc)(struct mk_map* m);
+    void      (*putaddr)(char* ib, uint32_t i, uint64_t addr);
+    void*     ctx;       /* format state */
+
+    /* per-file */
+    uint32_t    node;
+    const char* mem;
+    uint64_t    size;
+    uint64_t    lbn;
+    uint64_t    runpbn;
+    uint64_t    runlbn;
+    uint64_t    runlen;
+    int         err;
+};
+
+int      mk_map(struct mk_map* m, uint32_t node, const char* mem,
+                uint64_t size, uint64_t* addr);
+uint64_t mk_map_nblocks(struct mk_map* m, uint64_t size);
+uint64_t mk_map_seqalloc(struct mk_map* m); /* ctx is a uint64_t cursor */
+
+/* Integer encodings. */
+
+static inline void
+mk_le16(void* p, uint32_t v)
+{
+    unsigned char* c = p;
+    c[0] = v; c[1] = v >> 8;
+}
+
+static inline void
+mk_le32(void* p, uint32_t v)
+{
+    unsigned char* c = p;
+    c[0] = v; c[1] = v >> 8; c[2] = v >> 16; c[3] = v >> 24;
+}
+
+static inline void
+mk_le64(void* p, uint64_t v)
+{
+    mk_le32(p, (uint32_t)v);
+    mk_le32((char*)p + 4, (uint32_t)(v >> 32));
+}
+
+static inline void
+mk_pdp32(void* p, uint32_t v) /* high word first, each word little-endian */
+{
+    mk_le16(p, v >> 16);
+    mk_le16((char*)p + 2, v & 0xffff);
+}
+
+static inline uint64_t
+mk_howmany(uint64_t x, uint64_t y)
+{
+    return (x + y - 1) / y;
+}
+
+static inline uint64_t
+mk_roundup(uint64_t x, uint64_t y)
+{
+    return mk_howmany(x, y) * y;
+}
+
+#endif /* _UNIXFS_MKIMAGE_H_ */
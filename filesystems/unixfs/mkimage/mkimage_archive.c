@@ -0,0 +1,280 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * Archive formats: ustar, SVR4 and POSIX.1 cpio, and 4.4BSD ar. Members go
+ * out in tree order, so every directory precedes what it holds. ar has no
+ * directories; its members are the regular files, named by their paths
+ * with '-' for '/'.
+ */
+
+#include "mkimage.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAR_BLOCK        512
+#define TAR_RECORD       10240
+#define TAR_MAXPATH      98      /* ancientfs_tar keeps 99 of the 100 */
+#define CPIO_BLOCK       512
+#define CPIO_TRAILER     "TRAILER!!!"
+#define AR_MAGIC         "!<arch>\n"
+#define AR_HDRSIZE       60
+
+static uint32_t
+mk_mode(struct mk_node* node)
+{
+    return node->isdir ? 040755 : 0100644;
+}
+
+static uint32_t
+mk_nlink(struct mk_node* node)
+{
+    return node->isdir ? 2 + node->nsubdir : 1;
+}
+
+/*
+ * ustar
+ */
+
+int
+mk_write_tar(struct mk_image* im)
+{
+    struct mk_tree* t = im->tree;
+    char hdr[TAR_BLOCK];
+    char path[TAR_MAXPATH + 2];
+    uint64_t off = 0;
+    uint32_t i, j, sum;
+    int err = 0;
+
+    for (i = 1; i < t->count && !err; i++) {
+        struct mk_node* node = &t->nodes[i];
+        uint64_t size = node->isdir ? 0 : node->size;
+        size_t len = mk_path(im, i, path, sizeof(path));
+
+        if (len > TAR_MAXPATH || (node->isdir && len == TAR_MAXPATH)) {
+            fprintf(stderr, "tar: path of entry %u is longer than %u "
+                    "characters\n", i, TAR_MAXPATH);
+            return ENAMETOOLONG;
+        }
+        if (size > 077777777777ULL) {
+            fprintf(stderr, "tar: entry %u is too large (%llu bytes)\n",
+                    i, (unsigned long long)size);
+            return EFBIG;
+        }
+        if (node->isdir)
+            path[len++] = '/';
+
+        memset(hdr, 0, sizeof(hdr));
+        memcpy(hdr, path, len);
+        snprintf(hdr + 100, 8, "%07o", mk_mode(node) & 07777);
+        snprintf(hdr + 108, 8, "%07o", im->spec->uid & 07777777);
+        snprintf(hdr + 116, 8, "%07o", im->spec->gid & 07777777);
+        snprintf(hdr + 124, 12, "%011llo", (unsigned long long)size);
+        snprintf(hdr + 136, 12, "%011o", im->spec->mtime);
+        hdr[156] = node->isdir ? '5' : '0';
+        memcpy(hdr + 257, "ustar", 6);
+        memcpy(hdr + 263, "00", 2);
+        memcpy(hdr + 329, "0000000", 8);
+        memcpy(hdr + 337, "0000000", 8);
+
+        memset(hdr + 148, ' ', 8);
+        for (j = 0, sum = 0; j < TAR_BLOCK; j++)
+            sum += (unsigned char)hdr[j];
+        snprintf(hdr + 148, 8, "%06o", sum);
+        hdr[155] = ' ';
+
+        err = mk_pwrite(im, hdr, TAR_BLOCK, off);
+        off += TAR_BLOCK;
+
+        if (!err && size)
+            err = mk_filedata(im, i, 0, size, off);
+        off += mk_roundup(size, TAR_BLOCK);
+    }
+
+    /* Two zero blocks end the archive; the record is padded out too. */
+    if (!err)
+        err = mk_size(im, mk_roundup(off + 2 * TAR_BLOCK, TAR_RECORD));
+
+    return err;
+}
+
+/*
+ * cpio
+ */
+
+static int
+mk_write_cpio(struct mk_image* im, int newc)
+{
+    struct mk_tree* t = im->tree;
+    char hdr[128];
+    char path[4096];
+    uint64_t off = 0;
+    uint32_t i;
+    int err = 0;
+
+    for (i = 0; i <= t->count && !err; i++) {
+        struct mk_node* node = (i < t->count) ? &t->nodes[i] : NULL;
+        uint64_t size = (node && !node->isdir) ? node->size : 0;
+        uint32_t mode = node ? mk_mode(node) : 0;
+        uint32_t nlink = node ? mk_nlink(node) : 1;
+        uint32_t mtime = node ? im->spec->mtime : 0;
+        uint32_t ino = node ? i + 1 : 0;
+        size_t namesize, hdrsize;
+
+        if (!node)
+            strcpy(path, CPIO_TRAILER);
+        else if (i == 0)
+            strcpy(path, ".");
+        else
+            (void)mk_path(im, i, path, sizeof(path));
+        namesize = strlen(path) + 1;
+
+        if (newc) {
+            if (size > 0xffffffffULL) {
+                fprintf(stderr, "cpio: entry %u is too large (%llu bytes)\n",
+                        i, (unsigned long long)size);
+                return EFBIG;
+            }
+            hdrsize = snprintf(hdr, sizeof(hdr),
+                "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+                ino, mode, node ? im->spec->uid : 0, node ? im->spec->gid : 0,
+                nlink, mtime, (uint32_t)size, 0, 0, 0, 0,
+                (uint32_t)namesize, 0);
+        } else {
+            if (size > 077777777777ULL) {
+                fprintf(stderr, "cpio: entry %u is too large (%llu bytes)\n",
+                        i, (unsigned long long)size);
+                return EFBIG;
+            }
+            /* Six octal digits of inode number; spill over into dev. */
+            hdrsize = snprintf(hdr, sizeof(hdr),
+                "070707%06o%06o%06o%06o%06o%06o%06o%011o%06o%011llo",
+                (ino >> 18) & 0777777, ino & 0777777, mode,
+                node ? im->spec->uid & 0777777 : 0,
+                node ? im->spec->gid & 0777777 : 0,
+                nlink, 0, mtime, (uint32_t)namesize,
+                (unsigned long long)size);
+        }
+
+        err = mk_pwrite(im, hdr, hdrsize, off);
+        if (!err)
+            err = mk_pwrite(im, path, namesize, off + hdrsize);
+        off += hdrsize + namesize;
+        if (newc)
+            off = mk_roundup(off, 4);
+
+        if (!err && size)
+            err = mk_filedata(im, i, 0, size, off);
+        off += size;
+        if (newc)
+            off = mk_roundup(off, 4);
+    }
+
+    if (!err)
+        err = mk_size(im, mk_roundup(off, CPIO_BLOCK));
+
+    return err;
+}
+
+int
+mk_write_cpio_newc(struct mk_image* im)
+{
+    return mk_write_cpio(im, 1);
+}
+
+int
+mk_write_cpio_odc(struct mk_image* im)
+{
+    return mk_write_cpio(im, 0);
+}
+
+/*
+ * ar
+ */
+
+int
+mk_write_ar(struct mk_image* im)
+{
+    struct mk_tree* t = im->tree;
+    char hdr[AR_HDRSIZE + 1];
+    char name[256];
+    uint64_t off = 0;
+    uint32_t i;
+    int err;
+
+    if (im->spec->uid > 999999 || im->spec->gid > 999999) {
+        fprintf(stderr, "ar: uid and gid must fit in 6 digits\n");
+        return EINVAL;
+    }
+
+    err = mk_pwrite(im, AR_MAGIC, sizeof(AR_MAGIC) - 1, 0);
+    off = sizeof(AR_MAGIC) - 1;
+
+    for (i = 1; i < t->count && !err; i++) {
+        struct mk_node* node = &t->nodes[i];
+        uint64_t size = node->size;
+        size_t len, k;
+        int longname;
+
+        if (node->isdir)
+            continue;
+
+        len = mk_path(im, i, name, sizeof(name));
+        if (len >= sizeof(name) - 1) {
+            fprintf(stderr, "ar: name of entry %u is longer than %u "
+                    "characters\n", i, (unsigned)sizeof(name) - 2);
+            return ENAMETOOLONG;
+        }
+        for (k = 0; k < len; k++)
+            if (name[k] == '/')
+                name[k] = '-';
+
+        /* Names that don't fit go after the header, BSD style. */
+        longname = (len > 16);
+        if (longname)
+            size += len;
+        if (size > 9999999999ULL) {
+            fprintf(stderr, "ar: entry %u is too large (%llu bytes)\n",
+                    i, (unsigned long long)size);
+            return EFBIG;
+        }
+
+        if (longname)
+            snprintf(hdr, sizeof(hdr), "#1/%-13u", (unsigned)len);
+        else
+            snprintf(hdr, sizeof(hdr), "%-16.16s", name);
+        snprintf(hdr + 16, sizeof(hdr) - 16, "%-12u%-6u%-6u%-8o%-10llu`\n",
+                 im->spec->mtime, im->spec->uid, im->spec->gid,
+                 mk_mode(node), (unsigned long long)size);
+
+        err = mk_pwrite(im, hdr, AR_HDRSIZE, off);
+        off += AR_HDRSIZE;
+        if (!err && longname) {
+            err = mk_pwrite(im, name, len, off);
+            off += len;
+        }
+        if (!err && node->size)
+            err = mk_filedata(im, i, 0, node->size, off);
+        off += node->size;
+
+        if (!err && (off & 1)) {
+            err = mk_pwrite(im, "\n", 1, off);
+            off++;
+        }
+    }
+
+    if (!err)
+        err = mk_size(im, off);
+
+    return err;
+}
@@ -0,0 +1,256 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * Minix v1 and v2 file systems with 30-character names, as mkfs.minix
+ * lays them out: 1K blocks in host (little-endian) order, the superblock
+ * in block 1, then the inode and zone bitmaps, the inode table and the
+ * data zones. Version 3 is left out; minixfs does not yet get its block
+ * size right.
+ */
+
+#include "mkimage.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MINIX_BSIZE        1024
+#define MINIX_ROOTINO      1
+#define MINIX_DIRSIZE      32
+#define MINIX_BITSPB       (MINIX_BSIZE * 8)
+#define MINIX_MAXINO       65535
+#define MINIX_VALID_FS     1
+#define MINIX_MAGIC_V1     0x138f  /* v1, 30-char names */
+#define MINIX_MAGIC_V2     0x2478  /* v2, 30-char names */
+
+struct minix_layout {
+    int      version;
+    uint32_t inosize;
+    uint32_t ndirect;
+    uint32_t nlevels;
+    uint32_t addrsize;
+    uint32_t nzonemax;
+    uint32_t linkmax;
+    uint64_t maxsize;
+    uint32_t magic;
+};
+
+static const struct minix_layout minix_v1 = {
+    1, 32, 7, 2, 2, 65535, 250,
+    (7 + 512 + 512 * 512) * (uint64_t)MINIX_BSIZE, MINIX_MAGIC_V1
+};
+
+static const struct minix_layout minix_v2 = {
+    2, 64, 7, 3, 4, UINT32_MAX, 65530, 0x7fffffff, MINIX_MAGIC_V2
+};
+
+static void
+minix_putaddr16(char* ib, uint32_t i, uint64_t addr)
+{
+    mk_le16(ib + 2 * i, (uint32_t)addr);
+}
+
+static void
+minix_putaddr32(char* ib, uint32_t i, uint64_t addr)
+{
+    mk_le32(ib + 4 * i, (uint32_t)addr);
+}
+
+static void
+minix_inode(struct mk_image* im, const struct minix_layout* l, char* dip,
+            uint32_t n, uint64_t size, uint64_t* addr)
+{
+    struct mk_node* node = &im->tree->nodes[n];
+    uint32_t mode = node->isdir ? 040755 : 0100644;
+    uint32_t nlink = node->isdir ? 2 + node->nsubdir : 1;
+    uint32_t i;
+
+    if (l->version == 1) {
+        mk_le16(dip + 0, mode);
+        mk_le16(dip + 2, im->spec->uid);
+        mk_le32(dip + 4, (uint32_t)size);
+        mk_le32(dip + 8, im->spec->mtime);
+        dip[12] = im->spec->gid;
+        dip[13] = nlink;
+        for (i = 0; i < 9; i++)
+            mk_le16(dip + 14 + 2 * i, (uint32_t)addr[i]);
+    } else {
+        mk_le16(dip + 0, mode);
+        mk_le16(dip + 2, nlink);
+        mk_le16(dip + 4, im->spec->uid);
+        mk_le16(dip + 6, im->spec->gid);
+        mk_le32(dip + 8, (uint32_t)size);
+        mk_le32(dip + 12, im->spec->mtime);
+        mk_le32(dip + 16, im->spec->mtime);
+        mk_le32(dip + 20, im->spec->mtime);
+        for (i = 0; i < 10; i++)
+            mk_le32(dip + 24 + 4 * i, (uint32_t)addr[i]);
+    }
+}
+
+/* Marks bits [from, to) used and everything from pad to the end too. */
+static void
+minix_setbits(unsigned char* map, uint64_t from, uint64_t to, uint64_t pad,
+              uint64_t nbits)
+{
+    uint64_t i;
+
+    for (i = from; i < to; i++)
+        map[i >> 3] |= 1 << (i & 7);
+    for (i = pad; i < nbits; i++)
+        map[i >> 3] |= 1 << (i & 7);
+}
+
+static int
+minix_write(struct mk_image* im, const struct minix_layout* l)
+{
+    struct mk_tree* t = im->tree;
+    struct mk_map m;
+    uint64_t ninodes, inoblocks, imap, zmap, firstdata, nzones;
+    uint64_t next, need = 0;
+    uint64_t addr[10];
+    uint32_t i, inopb = MINIX_BSIZE / l->inosize;
+    unsigned char* maps = NULL;
+    char* itab = NULL;
+    char sb[MINIX_BSIZE];
+    int err = 0;
+
+    memset(&m, 0, sizeof(m));
+    m.im = im;
+    m.bsize = MINIX_BSIZE;
+    m.ndirect = l->ndirect;
+    m.nlevels = l->nlevels;
+    m.apb = MINIX_BSIZE / l->addrsize;
+    m.scale = 1;
+    m.alloc = mk_map_seqalloc;
+    m.putaddr = (l->addrsize == 2) ? minix_putaddr16 : minix_putaddr32;
+    m.ctx = &next;
+
+    ninodes = (uint64_t)t->count + im->spec->inodes;
+    if (ninodes > MINIX_MAXINO)
+        ninodes = MINIX_MAXINO;
+    if (t->count > ninodes) {
+        fprintf(stderr, "minix: %u entries exceed the %u inodes available\n",
+                t->count, MINIX_MAXINO);
+        return EFBIG;
+    }
+    inoblocks = mk_howmany(ninodes, inopb);
+
+    for (i = 0; i < t->count; i++) {
+        struct mk_node* node = &t->nodes[i];
+        uint64_t size = node->isdir ?
+            (uint64_t)(2 + node->nchild) * MINIX_DIRSIZE : node->size;
+        uint64_t nb = mk_map_nblocks(&m, size);
+        if (size > l->maxsize || nb == UINT64_MAX) {
+            fprintf(stderr, "minix: entry %u is too large (%llu bytes)\n",
+                    i, (unsigned long long)size);
+            return EFBIG;
+        }
+        if (node->isdir && 2 + node->nsubdir > l->linkmax) {
+            fprintf(stderr, "minix: directory %u has too many "
+                    "subdirectories (%u)\n", i, node->nsubdir);
+            return EFBIG;
+        }
+        need += nb;
+    }
+
+    imap = mk_howmany(ninodes + 1, MINIX_BITSPB);
+    zmap = mk_howmany(need + im->spec->free + 1, MINIX_BITSPB);
+    firstdata = 2 + imap + zmap + inoblocks;
+    nzones = firstdata + need + im->spec->free;
+
+    if (nzones > l->nzonemax || firstdata > 0xffff) {
+        fprintf(stderr, "minix: the image would need %llu zones; at most "
+                "%u are addressable\n", (unsigned long long)nzones,
+                l->nzonemax);
+        return EFBIG;
+    }
+
+    if (!(itab = calloc(inoblocks, MINIX_BSIZE)))
+        return ENOMEM;
+
+    next = firstdata;
+
+    for (i = 0; i < t->count && !err; i++) {
+        char* dir = NULL;
+        uint64_t size = t->nodes[i].size;
+
+        if (t->nodes[i].isdir) {
+            dir = mk_dirfixed(im, i, MINIX_DIRSIZE, MINIX_ROOTINO, &size);
+            if (!dir) {
+                err = ENOMEM;
+                break;
+            }
+        }
+
+        err = mk_map(&m, i, dir, size, addr);
+        if (!err)
+            minix_inode(im, l, itab + (uint64_t)i * l->inosize, i, size,
+                        addr);
+        free(dir);
+    }
+
+    if (!err)
+        err = mk_pwrite(im, itab, inoblocks * MINIX_BSIZE,
+                        (2 + imap + zmap) * MINIX_BSIZE);
+
+    /*
+     * Bit 0 of each map is reserved; inode i is bit i and zone z is bit
+     * z - firstdata + 1. Bits past the end are marked used, as mkfs does.
+     */
+    if (!err && !(maps = calloc(imap + zmap, MINIX_BSIZE)))
+        err = ENOMEM;
+
+    if (!err) {
+        minix_setbits(maps, 0, (uint64_t)t->count + 1, ninodes + 1,
+                      imap * MINIX_BITSPB);
+        minix_setbits(maps + imap * MINIX_BSIZE, 0, need + 1,
+                      nzones - firstdata + 1, zmap * MINIX_BITSPB);
+        err = mk_pwrite(im, maps, (imap + zmap) * MINIX_BSIZE,
+                        2 * MINIX_BSIZE);
+    }
+
+    if (!err) {
+        memset(sb, 0, sizeof(sb));
+        mk_le16(sb + 0, (uint32_t)ninodes);
+        mk_le16(sb + 2, (l->version == 1) ? (uint32_t)nzones : 0);
+        mk_le16(sb + 4, (uint32_t)imap);
+        mk_le16(sb + 6, (uint32_t)zmap);
+        mk_le16(sb + 8, (uint32_t)firstdata);
+        mk_le16(sb + 10, 0);
+        mk_le32(sb + 12, (uint32_t)l->maxsize);
+        mk_le16(sb + 16, l->magic);
+        mk_le16(sb + 18, MINIX_VALID_FS);
+        mk_le32(sb + 20, (l->version == 1) ? 0 : (uint32_t)nzones);
+        err = mk_pwrite(im, sb, MINIX_BSIZE, MINIX_BSIZE);
+    }
+
+    if (!err)
+        err = mk_size(im, (off_t)nzones * MINIX_BSIZE);
+
+    free(maps);
+    free(itab);
+
+    return err;
+}
+
+int
+mk_write_minix1(struct mk_image* im)
+{
+    return minix_write(im, &minix_v1);
+}
+
+int
+mk_write_minix2(struct mk_image* im)
+{
+    return minix_write(im, &minix_v2);
+}
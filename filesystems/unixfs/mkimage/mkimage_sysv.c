@@ -0,0 +1,200 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * System V Release 4 file systems with 1K blocks, little-endian, which is
+ * what sysvfs probes for first. The superblock sits in the second half of
+ * block 0, 64-byte inodes start at block 2, and free blocks are chained
+ * in 50-entry chunks whose total must agree with s_tfree, since
+ * sysv_count_free_blocks() checks one against the other.
+ */
+
+#include "mkimage.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYSV_BSIZE     1024
+#define SYSV_ROOTINO   2
+#define SYSV_INOSIZE   64
+#define SYSV_INOPB     (SYSV_BSIZE / SYSV_INOSIZE)
+#define SYSV_NADDR     13
+#define SYSV_NICFREE   50
+#define SYSV_DIRSIZ    16
+#define SYSV_MAXINO    65535
+#define SYSV_MAXBLOCK  0xffffff   /* inodes hold 3-byte addresses */
+#define SYSV_MAGIC     0xfd187e20
+#define SYSV_TYPE_1K   2
+#define SYSV_FSOKAY    0x7c269d38
+#define SYSV_JAN_1980  315532800
+
+static void
+sysv_putaddr(char* ib, uint32_t i, uint64_t addr)
+{
+    mk_le32(ib + 4 * i, (uint32_t)addr);
+}
+
+static void
+sysv_dinode(struct mk_image* im, char* dip, uint32_t n, uint64_t size,
+            uint64_t* addr)
+{
+    struct mk_node* node = &im->tree->nodes[n];
+    uint32_t t = im->spec->mtime;
+    int i;
+
+    mk_le16(dip + 0, node->isdir ? 040755 : 0100644);
+    mk_le16(dip + 2, node->isdir ? 2 + node->nsubdir : 1);
+    mk_le16(dip + 4, im->spec->uid);
+    mk_le16(dip + 6, im->spec->gid);
+    mk_le32(dip + 8, (uint32_t)size);
+    for (i = 0; i < SYSV_NADDR; i++) {
+        unsigned char* a = (unsigned char*)dip + 12 + 3 * i;
+        a[0] = addr[i];
+        a[1] = addr[i] >> 8;
+        a[2] = addr[i] >> 16;
+    }
+    mk_le32(dip + 52, t);
+    mk_le32(dip + 56, t);
+    mk_le32(dip + 60, t);
+}
+
+int
+mk_write_sysv(struct mk_image* im)
+{
+    struct mk_tree* t = im->tree;
+    struct mk_map m;
+    uint64_t ninodes, isize, fsize, next, need = 0, nfreeblocks = 0, b;
+    uint64_t addr[SYSV_NADDR];
+    uint32_t i, nfree, freelist[SYSV_NICFREE];
+    uint32_t now = im->spec->mtime;
+    char* itab = NULL;
+    char sb[512];
+    int err = 0;
+
+    memset(&m, 0, sizeof(m));
+    m.im = im;
+    m.bsize = SYSV_BSIZE;
+    m.ndirect = 10;
+    m.nlevels = 3;
+    m.apb = SYSV_BSIZE / 4;
+    m.scale = 1;
+    m.alloc = mk_map_seqalloc;
+    m.putaddr = sysv_putaddr;
+    m.ctx = &next;
+
+    /* Anything older reads as System V Release 2. */
+    if (now < SYSV_JAN_1980)
+        now = SYSV_JAN_1980;
+
+    ninodes = (uint64_t)t->count + (SYSV_ROOTINO - 1) + im->spec->inodes;
+    ninodes = mk_roundup(ninodes, SYSV_INOPB);
+    if (ninodes > SYSV_MAXINO)
+        ninodes = SYSV_MAXINO / SYSV_INOPB * SYSV_INOPB;
+    if ((uint64_t)t->count + (SYSV_ROOTINO - 1) > ninodes) {
+        fprintf(stderr, "sysv: %u entries exceed the %llu inodes available\n",
+                t->count, (unsigned long long)ninodes - (SYSV_ROOTINO - 1));
+        return EFBIG;
+    }
+    isize = 2 + ninodes / SYSV_INOPB;
+
+    for (i = 0; i < t->count; i++) {
+        uint64_t size = t->nodes[i].isdir ?
+            (uint64_t)(2 + t->nodes[i].nchild) * SYSV_DIRSIZ :
+            t->nodes[i].size;
+        uint64_t nb = mk_map_nblocks(&m, size);
+        if (size > 0x7fffffff || nb == UINT64_MAX) {
+            fprintf(stderr, "sysv: entry %u is too large (%llu bytes)\n",
+                    i, (unsigned long long)size);
+            return EFBIG;
+        }
+        need += nb;
+    }
+
+    fsize = isize + need + im->spec->free;
+    if (fsize > SYSV_MAXBLOCK) {
+        fprintf(stderr, "sysv: the image would need %llu blocks; at most %u "
+                "are addressable\n", (unsigned long long)fsize,
+                SYSV_MAXBLOCK);
+        return EFBIG;
+    }
+
+    if (!(itab = calloc(isize - 2, SYSV_BSIZE)))
+        return ENOMEM;
+
+    next = isize;
+
+    for (i = 0; i < t->count && !err; i++) {
+        char* dir = NULL;
+        uint64_t size = t->nodes[i].size;
+        uint32_t ino = SYSV_ROOTINO + i;
+
+        if (t->nodes[i].isdir) {
+            dir = mk_dirfixed(im, i, SYSV_DIRSIZ, SYSV_ROOTINO, &size);
+            if (!dir) {
+                err = ENOMEM;
+                break;
+            }
+        }
+
+        err = mk_map(&m, i, dir, size, addr);
+        if (!err)
+            sysv_dinode(im, itab + (uint64_t)(ino - 1) * SYSV_INOSIZE, i,
+                        size, addr);
+        free(dir);
+    }
+
+    if (!err)
+        err = mk_pwrite(im, itab, (isize - 2) * SYSV_BSIZE, 2 * SYSV_BSIZE);
+
+    /* The free list, built top down as mkfs does; see mkimage_v7.c. */
+    nfree = 1;
+    freelist[0] = 0;
+    for (b = fsize - 1; b >= next && !err; b--) {
+        if (nfree == SYSV_NICFREE) {
+            char fblk[SYSV_BSIZE];
+            memset(fblk, 0, sizeof(fblk));
+            mk_le16(fblk, nfree);
+            for (i = 0; i < nfree; i++)
+                mk_le32(fblk + 4 + 4 * i, freelist[i]);
+            err = mk_pwrite(im, fblk, SYSV_BSIZE, (off_t)b * SYSV_BSIZE);
+            nfree = 0;
+        }
+        freelist[nfree++] = (uint32_t)b;
+        nfreeblocks++;
+    }
+
+    if (!err) {
+        memset(sb, 0, sizeof(sb));
+        mk_le16(sb + 0, (uint32_t)isize);
+        mk_le32(sb + 4, (uint32_t)fsize);
+        mk_le16(sb + 8, nfree);
+        for (i = 0; i < nfree; i++)
+            mk_le32(sb + 12 + 4 * i, freelist[i]);
+        mk_le32(sb + 420, now);
+        mk_le32(sb + 432, (uint32_t)nfreeblocks);
+        mk_le16(sb + 436,
+                (uint32_t)(ninodes - t->count - (SYSV_ROOTINO - 1)));
+        memcpy(sb + 440, "unixfs", 6);
+        memcpy(sb + 446, "mkimg", 5);
+        mk_le32(sb + 500, SYSV_FSOKAY - now);
+        mk_le32(sb + 504, SYSV_MAGIC);
+        mk_le32(sb + 508, SYSV_TYPE_1K);
+        err = mk_pwrite(im, sb, sizeof(sb), SYSV_BSIZE / 2);
+    }
+
+    if (!err)
+        err = mk_size(im, (off_t)fsize * SYSV_BSIZE);
+
+    free(itab);
+
+    return err;
+}
@@ -0,0 +1,648 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * 4.4BSD UFS1 and FreeBSD UFS2 file systems, little-endian, laid out the
+ * way newfs lays them out: each cylinder group holds a superblock copy,
+ * its cylinder group block, an inode table and then data; the cylinder
+ * summary area opens the data of group 0. Files take whole blocks, never
+ * fragments, and data is handed out group by group in order, so shrinking
+ * fpg spreads a tree over many groups. Directories use 44BSD entries in
+ * 512-byte chunks.
+ */
+
+#include "mkimage.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UFS_SBSIZE        8192
+#define UFS1_SBLOCK       8192
+#define UFS2_SBLOCK       65536
+#define UFS1_MAGIC        0x00011954
+#define UFS2_MAGIC        0x19540119
+#define UFS_CG_MAGIC      0x090255
+#define UFS_FSOK          0x7c269d38
+#define UFS_ROOTINO       2
+#define UFS_NDADDR        12
+#define UFS_NIADDR        3
+#define UFS_DIRBLKSIZ     512
+#define UFS_LINK_MAX      32767
+#define UFS_CG_SPACE      168    /* offset of the maps in the cg block */
+#define UFS_CSUM_SIZE     16
+#define UFS_SB_SIZE       1376   /* sizeof(struct fs) */
+#define UFS_DT_DIR        4
+#define UFS_DT_REG        8
+
+struct ufs_state {
+    struct mk_image* im;
+    int       ufs2;
+    uint32_t  fsize;
+    uint32_t  bsize;
+    uint32_t  fpb;
+    uint32_t  isize;     /* bytes per inode */
+    uint32_t  inopb;
+    uint32_t  apb;
+    uint32_t  sbloc;
+    uint32_t  sblkno, cblkno, iblkno, dblkno;  /* frags from cgstart */
+    uint32_t  ipg;
+    uint32_t  fpg;
+    uint32_t  ncg;
+    uint32_t  cgsize;
+    uint32_t  cssize;
+    uint64_t  size;      /* frags */
+    uint64_t  csaddr;
+    uint64_t  next;      /* next free frag */
+    uint32_t  cg;        /* group next is in */
+    uint64_t* cgused;    /* first unused frag in each group, cg-relative */
+    uint32_t* cgdirs;
+
+    /* inode block being filled */
+    char*     iblk;
+    uint64_t  iblkno_cur;
+    int       idirty;
+};
+
+static uint64_t
+ufs_cgstart(struct ufs_state* u, uint32_t c)
+{
+    return (uint64_t)u->fpg * c;
+}
+
+static uint64_t
+ufs_cgend(struct ufs_state* u, uint32_t c)
+{
+    uint64_t end = ufs_cgstart(u, c) + u->fpg;
+    return (end > u->size) ? u->size : end;
+}
+
+static uint64_t
+ufs_alloc(struct mk_map* m)
+{
+    struct ufs_state* u = m->ctx;
+    uint64_t frag;
+
+    while (u->next + u->fpb > ufs_cgend(u, u->cg)) {
+        if (u->cg + 1 >= u->ncg) {
+            m->err = ENOSPC;
+            return 0;
+        }
+        u->cg++;
+        u->next = ufs_cgstart(u, u->cg) + u->dblkno;
+    }
+
+    frag = u->next;
+    u->next += u->fpb;
+    u->cgused[u->cg] = u->next - ufs_cgstart(u, u->cg);
+
+    return frag / u->fpb;
+}
+
+static void
+ufs_putaddr32(char* ib, uint32_t i, uint64_t addr)
+{
+    mk_le32(ib + 4 * i, (uint32_t)addr);
+}
+
+static void
+ufs_putaddr64(char* ib, uint32_t i, uint64_t addr)
+{
+    mk_le64(ib + 8 * i, addr);
+}
+
+/*
+ * Builds (or, with buf NULL, just sizes) directory n. No entry may cross
+ * a 512-byte chunk; the last entry in each chunk takes up the slack.
+ */
+static uint64_t
+ufs_dir(struct mk_image* im, uint32_t n, char* buf)
+{
+    struct mk_node* node = &im->tree->nodes[n];
+    uint64_t off = 0, last = 0;
+    uint32_t i;
+    char name[256];
+
+    for (i = 0; i < 2 + node->nchild; i++) {
+        uint32_t ino, len, reclen;
+        int type = UFS_DT_DIR;
+
+        if (i == 0) {
+            ino = UFS_ROOTINO + n;
+            len = 1;
+            strcpy(name, ".");
+        } else if (i == 1) {
+            ino = UFS_ROOTINO + node->parent;
+            len = 2;
+            strcpy(name, "..");
+        } else {
+            uint32_t c = node->first + i - 2;
+            ino = UFS_ROOTINO + c;
+            len = mk_name(im, c, name, 255);
+            if (!im->tree->nodes[c].isdir)
+                type = UFS_DT_REG;
+        }
+
+        reclen = (8 + len + 1 + 3) & ~3;
+
+        if (i && (off % UFS_DIRBLKSIZ) + reclen > UFS_DIRBLKSIZ) {
+            uint64_t chunkend = mk_roundup(off, UFS_DIRBLKSIZ);
+            if (buf)
+                mk_le16(buf + last + 4, (uint32_t)(chunkend - last));
+            off = chunkend;
+        }
+
+        if (buf) {
+            mk_le32(buf + off, ino);
+            mk_le16(buf + off + 4, reclen);
+            buf[off + 6] = type;
+            buf[off + 7] = len;
+            memcpy(buf + off + 8, name, len);
+        }
+
+        last = off;
+        off += reclen;
+    }
+
+    off = mk_roundup(off, UFS_DIRBLKSIZ);
+    if (buf)
+        mk_le16(buf + last + 4, (uint32_t)(off - last));
+
+    return off;
+}
+
+static int
+ufs_flush_inodes(struct ufs_state* u)
+{
+    int err = 0;
+
+    if (u->idirty)
+        err = mk_pwrite(u->im, u->iblk, u->bsize,
+                        (off_t)u->iblkno_cur * u->fsize);
+    u->idirty = 0;
+
+    return err;
+}
+
+static int
+ufs_putinode(struct ufs_state* u, uint32_t n, uint64_t size, uint64_t nblocks,
+             uint64_t* addr)
+{
+    struct mk_image* im = u->im;
+    struct mk_node* node = &im->tree->nodes[n];
+    uint64_t ino = UFS_ROOTINO + n;
+    uint32_t c = (uint32_t)(ino / u->ipg);
+    uint32_t cgoff = (uint32_t)(ino % u->ipg);
+    uint64_t blk = ufs_cgstart(u, c) + u->iblkno + (cgoff / u->inopb) * u->fpb;
+    uint32_t mode = node->isdir ? 040755 : 0100644;
+    uint32_t nlink = node->isdir ? 2 + node->nsubdir : 1;
+    uint64_t sectors = nblocks * (u->bsize / 512);
+    uint32_t t = im->spec->mtime;
+    char* dip;
+    int i, err;
+
+    if (blk != u->iblkno_cur) {
+        if ((err = ufs_flush_inodes(u)) != 0)
+            return err;
+        memset(u->iblk, 0, u->bsize);
+        u->iblkno_cur = blk;
+    }
+
+    dip = u->iblk + (cgoff % u->inopb) * u->isize;
+    u->idirty = 1;
+    if (node->isdir)
+        u->cgdirs[c]++;
+
+    if (!u->ufs2) {
+        mk_le16(dip + 0, mode);
+        mk_le16(dip + 2, nlink);
+        mk_le16(dip + 4, im->spec->uid);
+        mk_le16(dip + 6, im->spec->gid);
+        mk_le64(dip + 8, size);
+        mk_le32(dip + 0x10, t);
+        mk_le32(dip + 0x18, t);
+        mk_le32(dip + 0x20, t);
+        for (i = 0; i < UFS_NDADDR + UFS_NIADDR; i++)
+            mk_le32(dip + 0x28 + 4 * i, (uint32_t)addr[i]);
+        mk_le32(dip + 0x68, (uint32_t)sectors);
+        mk_le32(dip + 0x6c, 1);
+        mk_le32(dip + 0x70, im->spec->uid);
+        mk_le32(dip + 0x74, im->spec->gid);
+    } else {
+        mk_le16(dip + 0, mode);
+        mk_le16(dip + 2, nlink);
+        mk_le32(dip + 4, im->spec->uid);
+        mk_le32(dip + 8, im->spec->gid);
+        mk_le32(dip + 12, u->bsize);
+        mk_le64(dip + 16, size);
+        mk_le64(dip + 24, sectors);
+        mk_le64(dip + 32, t);
+        mk_le64(dip + 40, t);
+        mk_le64(dip + 48, t);
+        mk_le64(dip + 56, t);
+        mk_le32(dip + 80, 1);
+        for (i = 0; i < UFS_NDADDR + UFS_NIADDR; i++)
+            mk_le64(dip + 112 + 8 * i, addr[i]);
+    }
+
+    return 0;
+}
+
+static void
+ufs_setbits(unsigned char* map, uint64_t from, uint64_t to)
+{
+    uint64_t i;
+
+    for (i = from; i < to; i++)
+        map[i >> 3] |= 1 << (i & 7);
+}
+
+static int
+ufs_write_cgs(struct ufs_state* u, uint64_t* nbfree, uint64_t* nifree)
+{
+    struct mk_image* im = u->im;
+    uint64_t totalinodes = (uint64_t)im->tree->count + UFS_ROOTINO;
+    char* cgblk = malloc(u->bsize);
+    char* csum = calloc(1, mk_roundup(u->cssize, u->bsize));
+    uint32_t c, iusedoff = UFS_CG_SPACE;
+    uint32_t freeoff = iusedoff + (uint32_t)mk_howmany(u->ipg, 8);
+    uint32_t nextfreeoff = freeoff + (uint32_t)mk_howmany(u->fpg, 8);
+    int err = 0;
+
+    if (!cgblk || !csum) {
+        free(cgblk);
+        free(csum);
+        return ENOMEM;
+    }
+
+    *nbfree = 0;
+    *nifree = 0;
+
+    for (c = 0; c < u->ncg && !err; c++) {
+        uint64_t start = ufs_cgstart(u, c);
+        uint64_t ndblk = ufs_cgend(u, c) - start;
+        uint64_t used = u->cgused[c] ? u->cgused[c] : u->dblkno;
+        uint64_t firstino = (uint64_t)c * u->ipg;
+        uint64_t inused = 0;
+        uint32_t bfree = (uint32_t)((ndblk - used) / u->fpb);
+        uint32_t ifree;
+
+        if (totalinodes > firstino)
+            inused = totalinodes - firstino;
+        if (inused > u->ipg)
+            inused = u->ipg;
+        ifree = u->ipg - (uint32_t)inused;
+
+        memset(cgblk, 0, u->bsize);
+        mk_le32(cgblk + 4, UFS_CG_MAGIC);
+        mk_le32(cgblk + 8, im->spec->mtime);
+        mk_le32(cgblk + 12, c);
+        if (!u->ufs2) {
+            mk_le16(cgblk + 16, 1);
+            mk_le16(cgblk + 18, u->ipg);
+        }
+        mk_le32(cgblk + 20, (uint32_t)ndblk);
+        mk_le32(cgblk + 24, u->cgdirs[c]);
+        mk_le32(cgblk + 28, bfree);
+        mk_le32(cgblk + 32, ifree);
+        mk_le32(cgblk + 36, 0);
+        mk_le32(cgblk + 84, iusedoff);
+        mk_le32(cgblk + 88, iusedoff);
+        mk_le32(cgblk + 92, iusedoff);
+        mk_le32(cgblk + 96, freeoff);
+        mk_le32(cgblk + 100, nextfreeoff);
+        if (u->ufs2) {
+            mk_le32(cgblk + 116, u->ipg);
+            mk_le32(cgblk + 120, u->ipg);
+            mk_le64(cgblk + 136, im->spec->mtime);
+        }
+        ufs_setbits((unsigned char*)cgblk + iusedoff, 0, inused);
+        ufs_setbits((unsigned char*)cgblk + freeoff, used, ndblk);
+
+        mk_le32(csum + UFS_CSUM_SIZE * c + 0, u->cgdirs[c]);
+        mk_le32(csum + UFS_CSUM_SIZE * c + 4, bfree);
+        mk_le32(csum + UFS_CSUM_SIZE * c + 8, ifree);
+
+        *nbfree += bfree;
+        *nifree += ifree;
+
+        err = mk_pwrite(im, cgblk, u->bsize,
+                        (off_t)(start + u->cblkno) * u->fsize);
+    }
+
+    if (!err)
+        err = mk_pwrite(im, csum, u->cssize, (off_t)u->csaddr * u->fsize);
+
+    free(cgblk);
+    free(csum);
+
+    return err;
+}
+
+static int
+ufs_write_sb(struct ufs_state* u, uint64_t nbfree, uint64_t nifree)
+{
+    struct mk_image* im = u->im;
+    uint32_t t = im->spec->mtime;
+    uint32_t sbsize = (uint32_t)mk_roundup(UFS_SB_SIZE, u->fsize);
+    uint64_t dsize, maxfilesize;
+    uint32_t shift, c;
+    char* sb = calloc(1, sbsize);
+    int err = 0;
+
+    if (!sb)
+        return ENOMEM;
+
+    dsize = u->size - u->sblkno - (uint64_t)u->ncg * (u->dblkno - u->sblkno) -
+            mk_roundup(u->cssize, u->bsize) / u->fsize;
+    maxfilesize = (uint64_t)u->bsize *
+        (UFS_NDADDR + u->apb + (uint64_t)u->apb * u->apb) - 1;
+
+    mk_le32(sb + 8, u->sblkno);
+    mk_le32(sb + 12, u->cblkno);
+    mk_le32(sb + 16, u->iblkno);
+    mk_le32(sb + 20, u->dblkno);
+    mk_le32(sb + 24, 0);
+    mk_le32(sb + 28, 0xffffffff);
+    mk_le32(sb + 32, t);
+    mk_le32(sb + 36, (uint32_t)u->size);
+    mk_le32(sb + 40, (uint32_t)dsize);
+    mk_le32(sb + 44, u->ncg);
+    mk_le32(sb + 48, u->bsize);
+    mk_le32(sb + 52, u->fsize);
+    mk_le32(sb + 56, u->fpb);
+    mk_le32(sb + 60, 8);
+    mk_le32(sb + 68, 60);
+    mk_le32(sb + 72, ~(u->bsize - 1));
+    mk_le32(sb + 76, ~(u->fsize - 1));
+    for (shift = 0; (1U << shift) < u->bsize; shift++)
+        ;
+    mk_le32(sb + 80, shift);
+    mk_le32(sb + 108, ~(u->bsize - 1));
+    mk_le32(sb + 112, shift);
+    for (shift = 0; (1U << shift) < u->fsize; shift++)
+        ;
+    mk_le32(sb + 84, shift);
+    mk_le32(sb + 88, 1);
+    mk_le32(sb + 92, u->fpg / u->fpb / 4);
+    for (shift = 0; (1U << shift) < u->fpb; shift++)
+        ;
+    mk_le32(sb + 96, shift);
+    for (shift = 0; (512U << shift) < u->fsize; shift++)
+        ;
+    mk_le32(sb + 100, shift);
+    mk_le32(sb + 104, sbsize);
+    mk_le32(sb + 116, u->apb);
+    mk_le32(sb + 120, u->inopb);
+    mk_le32(sb + 124, u->fsize / 512);
+    mk_le32(sb + 132, u->fpg * (u->fsize / 512));
+    mk_le32(sb + 136, 1);
+    mk_le32(sb + 152, (uint32_t)u->csaddr);
+    mk_le32(sb + 156, u->cssize);
+    mk_le32(sb + 160, u->cgsize);
+    mk_le32(sb + 164, 1);
+    mk_le32(sb + 168, u->fpg * (u->fsize / 512));
+    mk_le32(sb + 172, u->fpg * (u->fsize / 512));
+    mk_le32(sb + 176, u->ncg);
+    mk_le32(sb + 180, 1);
+    mk_le32(sb + 184, u->ipg);
+    mk_le32(sb + 188, u->fpg);
+    mk_le32(sb + 192, im->tree->ndirs);
+    mk_le32(sb + 196, (uint32_t)nbfree);
+    mk_le32(sb + 200, (uint32_t)nifree);
+    mk_le32(sb + 204, 0);
+    sb[209] = 1;     /* clean */
+    sb[211] = 0x80;  /* totals are in the 64-bit fields too */
+    memcpy(sb + 680, "unixfs", 6);
+    mk_le32(sb + 860, u->bsize);
+    mk_le64(sb + 1000, u->sbloc);
+    mk_le64(sb + 1008, im->tree->ndirs);
+    mk_le64(sb + 1016, nbfree);
+    mk_le64(sb + 1024, nifree);
+    mk_le64(sb + 1032, 0);
+    mk_le64(sb + 1072, t);
+    mk_le64(sb + 1080, u->size);
+    mk_le64(sb + 1088, dsize);
+    mk_le64(sb + 1096, u->csaddr);
+    mk_le32(sb + 1320, u->ufs2 ? 120 : 60);
+    mk_le32(sb + 1324, 2);
+    mk_le64(sb + 1328, maxfilesize);
+    mk_le64(sb + 1336, u->bsize - 1);
+    mk_le64(sb + 1344, u->fsize - 1);
+    mk_le32(sb + 1352, UFS_FSOK - t);
+    mk_le32(sb + 1356, 1);
+    mk_le32(sb + 1360, 1);
+    mk_le32(sb + 1372, u->ufs2 ? UFS2_MAGIC : UFS1_MAGIC);
+
+    err = mk_pwrite(im, sb, sbsize, u->sbloc);
+
+    for (c = 0; c < u->ncg && !err; c++)
+        err = mk_pwrite(im, sb, sbsize,
+                        (off_t)(ufs_cgstart(u, c) + u->sblkno) * u->fsize);
+
+    free(sb);
+
+    return err;
+}
+
+static int
+ufs_write(struct mk_image* im, int ufs2)
+{
+    struct mk_tree* t = im->tree;
+    struct mk_spec* s = im->spec;
+    struct ufs_state u;
+    struct mk_map m;
+    uint64_t ninodes, need = 0, datablocks, perblocks, lastblocks;
+    uint64_t nbfree, nifree;
+    uint64_t addr[UFS_NDADDR + UFS_NIADDR];
+    uint32_t i, csblocks;
+    int err = 0;
+
+    memset(&u, 0, sizeof(u));
+    u.im = im;
+    u.ufs2 = ufs2;
+    u.fsize = s->fsize;
+    u.bsize = s->bsize;
+    u.sbloc = ufs2 ? UFS2_SBLOCK : UFS1_SBLOCK;
+    u.isize = ufs2 ? 256 : 128;
+
+    if (u.fsize < 512 || u.fsize > 4096 || (u.fsize & (u.fsize - 1)) ||
+        u.bsize < 4096 || (u.bsize & (u.bsize - 1)) ||
+        u.bsize < u.fsize || u.bsize / u.fsize > 8) {
+        fprintf(stderr, "ufs: unsupported geometry bsize=%u fsize=%u (the "
+                "fragment size must be 512 to 4096, the block size at least "
+                "4096, with at most 8 fragments per block)\n",
+                u.bsize, u.fsize);
+        return EINVAL;
+    }
+
+    u.fpb = u.bsize / u.fsize;
+    u.inopb = u.bsize / u.isize;
+    u.apb = u.bsize / (ufs2 ? 8 : 4);
+    u.sblkno = (uint32_t)mk_roundup(mk_howmany(u.sbloc + UFS_SBSIZE, u.fsize),
+                                    u.fpb);
+    u.cblkno = u.sblkno +
+               (uint32_t)mk_roundup(mk_howmany(UFS_SBSIZE, u.fsize), u.fpb);
+    u.iblkno = u.cblkno + u.fpb;
+
+    memset(&m, 0, sizeof(m));
+    m.im = im;
+    m.bsize = u.bsize;
+    m.ndirect = UFS_NDADDR;
+    m.nlevels = UFS_NIADDR;
+    m.apb = u.apb;
+    m.scale = u.fpb;
+    m.alloc = ufs_alloc;
+    m.putaddr = ufs2 ? ufs_putaddr64 : ufs_putaddr32;
+    m.ctx = &u;
+
+    for (i = 0; i < t->count; i++) {
+        struct mk_node* node = &t->nodes[i];
+        uint64_t size = node->isdir ? ufs_dir(im, i, NULL) : node->size;
+        uint64_t nb = mk_map_nblocks(&m, size);
+        if (nb == UINT64_MAX) {
+            fprintf(stderr, "ufs: entry %u is too large (%llu bytes)\n",
+                    i, (unsigned long long)size);
+            return EFBIG;
+        }
+        if (node->isdir && 2 + node->nsubdir > UFS_LINK_MAX) {
+            fprintf(stderr, "ufs: directory %u has too many subdirectories "
+                    "(%u)\n", i, node->nsubdir);
+            return EFBIG;
+        }
+        need += nb;
+    }
+
+    /*
+     * Find the fewest cylinder groups that hold both the inodes and the
+     * data. A group's inode table grows with ipg, which shrinks the room
+     * left for data, so go around until it settles.
+     */
+    ninodes = (uint64_t)t->count + UFS_ROOTINO + s->inodes;
+    /* By default, the fragment map gets half of the cylinder group block. */
+    if (s->fpg)
+        u.fpg = (uint32_t)mk_roundup(s->fpg, u.fpb);
+    else
+        u.fpg = (u.bsize - UFS_CG_SPACE) * 4 / u.fpb * u.fpb;
+    u.ncg = 1;
+    for (;;) {
+        uint64_t cs;
+
+        if (s->ipg)
+            u.ipg = (uint32_t)mk_roundup(s->ipg, u.inopb);
+        else
+            u.ipg = (uint32_t)mk_roundup(mk_howmany(ninodes, u.ncg),
+                                         u.inopb);
+        u.dblkno = u.iblkno + (u.ipg / u.inopb) * u.fpb;
+        u.cgsize = UFS_CG_SPACE + (uint32_t)mk_howmany(u.ipg, 8) +
+                   (uint32_t)mk_howmany(u.fpg, 8);
+
+        if ((uint64_t)u.dblkno + u.fpb > u.fpg || u.cgsize > u.bsize) {
+            fprintf(stderr, "ufs: a cylinder group of %u fragments cannot "
+                    "hold %u inodes and its maps (try a different fpg or "
+                    "ipg)\n", u.fpg, u.ipg);
+            return EINVAL;
+        }
+
+        cs = mk_roundup((uint64_t)u.ncg * UFS_CSUM_SIZE, u.fsize);
+        csblocks = (uint32_t)mk_howmany(cs, u.bsize);
+        datablocks = need + csblocks + s->free;
+        perblocks = (u.fpg - u.dblkno) / u.fpb;
+
+        if ((uint64_t)u.ipg * u.ncg >= ninodes &&
+            perblocks * u.ncg >= datablocks)
+            break;
+
+        if (u.ncg == UINT32_MAX / 2) {
+            fprintf(stderr, "ufs: the tree does not fit\n");
+            return EFBIG;
+        }
+        u.ncg = (uint32_t)(u.ncg + 1 > mk_howmany(datablocks, perblocks) ?
+                           u.ncg + 1 : mk_howmany(datablocks, perblocks));
+    }
+
+    u.cssize = (uint32_t)mk_roundup((uint64_t)u.ncg * UFS_CSUM_SIZE, u.fsize);
+
+    /* The last group only needs to be as large as what goes in it. */
+    lastblocks = 1;
+    if (datablocks > perblocks * (u.ncg - 1))
+        lastblocks = datablocks - perblocks * (u.ncg - 1);
+    u.size = ufs_cgstart(&u, u.ncg - 1) + u.dblkno + lastblocks * u.fpb;
+
+    if (!ufs2 && u.size > 0x7fffffff) {
+        fprintf(stderr, "ufs: %llu fragments are too many for UFS1\n",
+                (unsigned long long)u.size);
+        return EFBIG;
+    }
+
+    u.cgused = calloc(u.ncg, sizeof(uint64_t));
+    u.cgdirs = calloc(u.ncg, sizeof(uint32_t));
+    u.iblk = malloc(u.bsize);
+    if (!u.cgused || !u.cgdirs || !u.iblk) {
+        err = ENOMEM;
+        goto out;
+    }
+    u.iblkno_cur = UINT64_MAX;
+
+    /* The summary area opens group 0's data. */
+    u.next = u.dblkno;
+    u.cg = 0;
+    u.csaddr = u.next;
+    for (i = 0; i < csblocks; i++)
+        (void)ufs_alloc(&m);
+
+    for (i = 0; i < t->count && !err; i++) {
+        char* dir = NULL;
+        uint64_t size = t->nodes[i].size;
+
+        if (t->nodes[i].isdir) {
+            size = ufs_dir(im, i, NULL);
+            if (!(dir = calloc(1, size))) {
+                err = ENOMEM;
+                break;
+            }
+            (void)ufs_dir(im, i, dir);
+        }
+
+        err = mk_map(&m, i, dir, size, addr);
+        if (!err)
+            err = ufs_putinode(&u, i, size, mk_map_nblocks(&m, size), addr);
+        free(dir);
+    }
+
+    if (!err)
+        err = ufs_flush_inodes(&u);
+    if (!err)
+        err = ufs_write_cgs(&u, &nbfree, &nifree);
+    if (!err)
+        err = ufs_write_sb(&u, nbfree, nifree);
+    if (!err)
+        err = mk_size(im, (off_t)u.size * u.fsize);
+
+out:
+    free(u.cgused);
+    free(u.cgdirs);
+    free(u.iblk);
+
+    return err;
+}
+
+int
+mk_write_ufs1(struct mk_image* im)
+{
+    return ufs_write(im, 0);
+}
+
+int
+mk_write_ufs2(struct mk_image* im)
+{
+    return ufs_write(im, 1);
+}
@@ -0,0 +1,187 @@
+/*
+ * UnixFS
+ *
+ * A general-purpose file system layer for writing/reimplementing/porting
+ * Unix file systems through MacFUSE.
+
+ * Copyright (c) 2008 Amit Singh. All Rights Reserved.
+ * http://osxbook.com
+ */
+
+/*
+ * Seventh Edition file systems, as ancientfs_v7 reads them: 512-byte
+ * blocks in PDP-11 byte order, the superblock in block 1, 64-byte inodes
+ * from block 2 and the data after them. Free blocks are chained the way
+ * mkfs left them, 50 to a chunk, so the mount-time free count walks a
+ * real list.
+ */
+
+#include "mkimage.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define V7_BSIZE     512
+#define V7_ROOTINO   2
+#define V7_INOSIZE   64
+#define V7_INOPB     (V7_BSIZE / V7_INOSIZE)
+#define V7_NADDR     13
+#define V7_NICFREE   50
+#define V7_DIRSIZ    16
+#define V7_MAXINO    65535
+#define V7_MAXBLOCK  0xffffff  /* inodes hold 3-byte addresses */
+
+static void
+v7_putaddr(char* ib, uint32_t i, uint64_t addr)
+{
+    mk_pdp32(ib + 4 * i, (uint32_t)addr);
+}
+
+static void
+v7_dinode(struct mk_image* im, char* dip, uint32_t n, uint64_t size,
+          uint64_t* addr)
+{
+    struct mk_node* node = &im->tree->nodes[n];
+    uint32_t t = im->spec->mtime;
+    int i;
+
+    mk_le16(dip + 0, node->isdir ? 040755 : 0100644);
+    mk_le16(dip + 2, node->isdir ? 2 + node->nsubdir : 1);
+    mk_le16(dip + 4, im->spec->uid);
+    mk_le16(dip + 6, im->spec->gid);
+    mk_pdp32(dip + 8, (uint32_t)size);
+    for (i = 0; i < V7_NADDR; i++) {
+        unsigned char* a = (unsigned char*)dip + 12 + 3 * i;
+        a[0] = addr[i] >> 16;
+        a[1] = addr[i];
+        a[2] = addr[i] >> 8;
+    }
+    mk_pdp32(dip + 52, t);
+    mk_pdp32(dip + 56, t);
+    mk_pdp32(dip + 60, t);
+}
+
+int
+mk_write_v7(struct mk_image* im)
+{
+    struct mk_tree* t = im->tree;
+    struct mk_map m;
+    uint64_t ninodes, isize, fsize, next, need = 0, nfreeblocks = 0, b;
+    uint64_t addr[V7_NADDR];
+    uint32_t i, nfree, freelist[V7_NICFREE];
+    char* itab = NULL;
+    char sb[V7_BSIZE];
+    int err = 0;
+
+    memset(&m, 0, sizeof(m));
+    m.im = im;
+    m.bsize = V7_BSIZE;
+    m.ndirect = 10;
+    m.nlevels = 3;
+    m.apb = V7_BSIZE / 4;
+    m.scale = 1;
+    m.alloc = mk_map_seqalloc;
+    m.putaddr = v7_putaddr;
+    m.ctx = &next;
+
+    ninodes = (uint64_t)t->count + (V7_ROOTINO - 1) + im->spec->inodes;
+    ninodes = mk_roundup(ninodes, V7_INOPB);
+    if (ninodes > V7_MAXINO)
+        ninodes = V7_MAXINO;
+    if ((uint64_t)t->count + (V7_ROOTINO - 1) > ninodes) {
+        fprintf(stderr, "v7: %u entries exceed the %u inodes available\n",
+                t->count, V7_MAXINO - (V7_ROOTINO - 1));
+        return EFBIG;
+    }
+    isize = 2 + mk_howmany(ninodes, V7_INOPB);
+
+    for (i = 0; i < t->count; i++) {
+        uint64_t size = t->nodes[i].isdir ?
+            (uint64_t)(2 + t->nodes[i].nchild) * V7_DIRSIZ : t->nodes[i].size;
+        uint64_t nb = mk_map_nblocks(&m, size);
+        if (size > 0x7fffffff || nb == UINT64_MAX) {
+            fprintf(stderr, "v7: entry %u is too large (%llu bytes)\n",
+                    i, (unsigned long long)size);
+            return EFBIG;
+        }
+        need += nb;
+    }
+
+    fsize = isize + need + im->spec->free;
+    if (fsize > V7_MAXBLOCK) {
+        fprintf(stderr, "v7: the image would need %llu blocks; at most %u "
+                "are addressable\n", (unsigned long long)fsize, V7_MAXBLOCK);
+        return EFBIG;
+    }
+
+    if (!(itab = calloc(isize - 2, V7_BSIZE)))
+        return ENOMEM;
+
+    next = isize;
+
+    for (i = 0; i < t->count && !err; i++) {
+        char* dir = NULL;
+        uint64_t size = t->nodes[i].size;
+        uint32_t ino = V7_ROOTINO + i;
+
+        if (t->nodes[i].isdir) {
+            if (!(dir = mk_dirfixed(im, i, V7_DIRSIZ, V7_ROOTINO, &size))) {
+                err = ENOMEM;
+                break;
+            }
+        }
+
+        err = mk_map(&m, i, dir, size, addr);
+        if (!err)
+            v7_dinode(im, itab + (uint64_t)(ino - 1) * V7_INOSIZE, i, size,
+                      addr);
+        free(dir);
+    }
+
+    if (!err)
+        err = mk_pwrite(im, itab, (isize - 2) * V7_BSIZE, 2 * V7_BSIZE);
+
+    /*
+     * Free the rest from the top down, as mkfs did, so that the list hands
+     * out blocks in ascending order.
+     */
+    nfree = 1;
+    freelist[0] = 0;
+    for (b = fsize - 1; b >= next && !err; b--) {
+        if (nfree == V7_NICFREE) {
+            char fblk[V7_BSIZE];
+            memset(fblk, 0, sizeof(fblk));
+            mk_le16(fblk, nfree);
+            for (i = 0; i < nfree; i++)
+                mk_pdp32(fblk + 2 + 4 * i, freelist[i]);
+            err = mk_pwrite(im, fblk, V7_BSIZE, (off_t)b * V7_BSIZE);
+            nfree = 0;
+        }
+        freelist[nfree++] = (uint32_t)b;
+        nfreeblocks++;
+    }
+
+    if (!err) {
+        memset(sb, 0, sizeof(sb));
+        mk_le16(sb + 0, (uint32_t)isize);
+        mk_pdp32(sb + 2, (uint32_t)fsize);
+        mk_le16(sb + 6, nfree);
+        for (i = 0; i < nfree; i++)
+            mk_pdp32(sb + 8 + 4 * i, freelist[i]);
+        mk_pdp32(sb + 414, im->spec->mtime ? im->spec->mtime : 1);
+        mk_pdp32(sb + 418, (uint32_t)nfreeblocks);
+        mk_le16(sb + 422, (uint32_t)(ninodes - t->count - (V7_ROOTINO - 1)));
+        memcpy(sb + 428, "unixfs", 6);
+        memcpy(sb + 434, "mkimg", 5);
+        err = mk_pwrite(im, sb, V7_BSIZE, V7_BSIZE);
+    }
+
+    if (!err)
+        err = mk_size(im, (off_t)fsize * V7_BSIZE);
+
+    free(itab);
+
+    return err;
+}
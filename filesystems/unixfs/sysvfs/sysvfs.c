@@ -346,13 +346,13 @@ sysv_fill_super(int fd, void* args, int silent)
     sb->s_blocksize = BLOCK_SIZE;
     sb->s_blocksize_bits = BLOCK_SIZE_BITS;
 
-    if ((bh = malloc(sizeof(struct buffer_head))) == NULL)
+    if ((bh = sb_getblk(sb, 0)) == NULL)
         goto failed;
 
     for (i = 0; i < ARRAY_SIZE(flavours) && !size; i++) {
         blocknr = flavours[i].block;
-        if ((ret = pread(fd, bh->b_data, BLOCK_SIZE,
-                        (off_t)(flavours[i].block * BLOCK_SIZE))) != BLOCK_SIZE)
+        if ((ret = unixfs_dev_pread(fd, bh->b_data, BLOCK_SIZE,
+                   (off_t)(flavours[i].block * BLOCK_SIZE))) != BLOCK_SIZE)
             continue;
         size = flavours[i].test(SYSV_SB(sb), bh);
     }
@@ -365,12 +365,14 @@ sysv_fill_super(int fd, void* args, int silent)
             blocknr = blocknr << 1;
             sb->s_blocksize = 512;
             sb->s_blocksize_bits = blksize_bits(512);
-            if ((bh1 = malloc(sizeof(struct buffer_head))) == NULL) {
+            if ((bh1 = sb_getblk(sb, 0)) == NULL) {
                 brelse(bh);
                 goto failed;
             }
-            ret = pread(fd, bh1->b_data, 512, (off_t)(blocknr * 512));
-            ret = pread(fd, bh->b_data, 512, (off_t)((blocknr + 1) * 512));
+            ret = unixfs_dev_pread(fd, bh1->b_data, 512,
+                                   (off_t)(blocknr * 512));
+            ret = unixfs_dev_pread(fd, bh->b_data, 512,
+                                   (off_t)((blocknr + 1) * 512));
             break;
 
         case 2:
@@ -381,7 +383,8 @@ sysv_fill_super(int fd, void* args, int silent)
             blocknr = blocknr >> 1;
             sb->s_blocksize = 2048;
             sb->s_blocksize_bits = blksize_bits(2048);
-            ret = pread(fd, bh->b_data, 2048, (off_t)(blocknr * 2048));
+            ret = unixfs_dev_pread(fd, bh->b_data, 2048,
+                                   (off_t)(blocknr * 2048));
             bh1 = bh;
             break;
 
@@ -509,6 +512,16 @@ Ecount:
     goto done;
 }
 
+/* The device block (in s_blocksize units) that holds inode ino. */
+off_t
+sysv_inode_block(struct super_block* sb, ino_t ino)
+{
+    struct sysv_sb_info* sbi = SYSV_SB(sb);
+
+    return (off_t)(sbi->s_firstinodezone + sbi->s_block_base) +
+           (((unsigned int)ino - 1) >> sbi->s_inodes_per_block_bits);
+}
+
 struct sysv_dinode*
 sysv_raw_inode(struct super_block* sb, ino_t ino, struct buffer_head* bh)
 {
@@ -524,38 +537,58 @@ sysv_raw_inode(struct super_block* sb, ino_t ino, struct buffer_head* bh)
     return res + (((unsigned int)ino - 1) & sbi->s_inodes_per_block_1);
 }
 
+/*
+ * The inode table is scanned once, so it is read in runs of this many
+ * blocks straight from the device rather than a block at a time through
+ * the buffer cache.
+ */
+#define SYSV_ITABLE_BATCH 64
+
 unsigned long
 sysv_count_free_inodes(struct super_block* sb)
 {
     struct sysv_sb_info* sbi = SYSV_SB(sb);
     int ino, count, sb_count;
     struct sysv_dinode* raw_inode;
-
-    struct buffer_head bh;
+    off_t base, block, last;
+    size_t nblocks, nbytes;
+    char* buf;
 
     sb_count = fs16_to_host(sbi->s_bytesex, *sbi->s_sb_total_free_inodes);
 
     if (0)
         goto trust_sb;
 
+    buf = malloc(SYSV_ITABLE_BATCH * sb->s_blocksize);
+    if (!buf)
+        goto Eio;
+
     count = 0;
     ino = SYSV_ROOT_INO+1;
-
-    raw_inode = sysv_raw_inode(sb, ino, &bh);
-    if (!raw_inode)
-        goto Eio;
+    base = sbi->s_firstinodezone + sbi->s_block_base;
+    last = sysv_inode_block(sb, sbi->s_ninodes);
 
     while (ino <= sbi->s_ninodes) {
-        if (raw_inode->di_mode == 0 && raw_inode->di_nlink == 0)
-            count++;
-        if ((ino++ & sbi->s_inodes_per_block_1) == 0) {
-            raw_inode = sysv_raw_inode(sb, ino, &bh);
-            if (!raw_inode)
-                goto Eio;
-        } else
-            raw_inode++;
+        block = sysv_inode_block(sb, ino);
+        nblocks = min(SYSV_ITABLE_BATCH, last - block + 1);
+        nbytes = nblocks * sb->s_blocksize;
+        if (unixfs_bcache_pread(sb, buf, nbytes,
+                                block * (off_t)sb->s_blocksize) !=
+            (ssize_t)nbytes) {
+            free(buf);
+            goto Eio;
+        }
+        raw_inode = (struct sysv_dinode*)buf +
+            ((ino - 1) & sbi->s_inodes_per_block_1);
+        int lastino = (int)((block - base + nblocks) <<
+                            sbi->s_inodes_per_block_bits);
+        for (; ino <= sbi->s_ninodes && ino <= lastino; ino++, raw_inode++)
+            if (raw_inode->di_mode == 0 && raw_inode->di_nlink == 0)
+                count++;
     }
 
+    free(buf);
+
     if (count != sb_count)
         goto Einval;
 out:
@@ -653,7 +686,7 @@ get_branch(struct inode* inode, int depth, int offsets[], Indirect chain[],
 
     while (--depth) {
         int block = block_to_host(SYSV_SB(sb), p->key);
-        bh = malloc(sizeof(struct buffer_head));
+        bh = sb_getblk(sb, block);
         if (sb_bread_intobh(sb, block, bh) != 0)
             goto failure;
         if (!verify_chain(chain, p))
@@ -694,12 +727,16 @@ sysv_get_block(struct inode* inode, sector_t iblock, off_t* result)
     if (depth == 0)
         goto out;
 
+    if (unixfs_extentmap_lookup(inode, iblock, result, NULL) == 0)
+        return 0;
+
 /* reread: */
     partial = get_branch(inode, depth, offsets, chain, &err);
 
     /* simplest case - block found, no allocation needed */
     if (!partial) {
         *result = (off_t)(block_to_host(SYSV_SB(sb), chain[depth-1].key));
+        unixfs_extentmap_insert(inode, iblock, *result);
         /* clean up and exit */
         partial = chain + depth - 1; /* the whole chain */
         goto cleanup;
@@ -732,32 +769,41 @@ sysv_get_page(struct inode* inode, sector_t index, char* pagebuf)
     int err = 0, byte_count = 0;
     char *p = pagebuf;
 
+    /* physically contiguous blocks are read together, into place */
+    off_t runstart = 0;
+    size_t runlen = 0;
+    char* runbuf = NULL;
+
     do {
         off_t phys64 = 0;
         int ret = sysv_get_block(inode, iblock, &phys64);
-        if (phys64) {
-            struct buffer_head bh;
-            memset(&bh, 0, sizeof(bh));
-            ret = sb_bread_intobh(sb, phys64, &bh);
-            if (ret == 0) {
-                memcpy(p, bh.b_data, blocksize);
-                p += blocksize;
-                byte_count += blocksize;
-            } else {
+        if (!phys64 && ret != 0) {
+            err = EIO;
+            fprintf(stderr, "*** fatal error: block mapping failed\n");
+            abort();
+        }
+
+        if (runlen && (phys64 != runstart + (off_t)runlen)) {
+            if (sb_bread_run(sb, runstart, runlen, runbuf) != 0) {
                 err = EIO;
                 fprintf(stderr, "*** fatal error: I/O error\n");
                 abort();
             }
-        } else if (ret == 0) {
-            memset(p, 0, blocksize);
-            p += blocksize;
-            byte_count += blocksize;
-        } else {
-            err = EIO;
-            fprintf(stderr, "*** fatal error: block mapping failed\n");
-            abort();
+            runlen = 0;
         }
 
+        if (phys64) {
+            if (runlen == 0) {
+                runstart = phys64;
+                runbuf = p;
+            }
+            runlen++;
+        } else
+            memset(p, 0, blocksize);
+
+        p += blocksize;
+        byte_count += blocksize;
+
         iblock++;
 
         if ((byte_count >= PAGE_SIZE) || (iblock >= lblock))
@@ -765,6 +811,12 @@ sysv_get_page(struct inode* inode, sector_t index, char* pagebuf)
 
     } while (1);
 
+    if (runlen && (sb_bread_run(sb, runstart, runlen, runbuf) != 0)) {
+        err = EIO;
+        fprintf(stderr, "*** fatal error: I/O error\n");
+        abort();
+    }
+
     if (err)
         return -1;
 
@@ -816,3 +868,45 @@ sysv_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirbuf,
 
     return 0;
 }
+
+/*
+ * Like sysv_next_direntry(), but decodes every entry it can from each page
+ * it reads, skipping free slots, until count entries are filled in or the
+ * directory ends. Returns how many; 0 at the end, -1 if a page is unreadable.
+ */
+ssize_t
+sysv_readdir_batch(struct inode* dir, off_t* offset,
+                   struct unixfs_direntry* dents, size_t count)
+{
+    struct sysv_sb_info* sbi = SYSV_SB(dir->I_sb);
+    unsigned long npages = sysv_dir_pages(dir);
+    char page[PAGE_SIZE];
+    size_t filled = 0;
+
+    *offset = (*offset + SYSV_DIRSIZE-1) & ~(SYSV_DIRSIZE-1);
+
+    while ((filled < count) && (*offset < dir->I_size)) {
+        unsigned long n = *offset >> PAGE_CACHE_SHIFT;
+        if (n >= npages)
+            break;
+        if (sysv_get_page(dir, n, page) != 0)
+            return filled ? (ssize_t)filled : -1;
+        off_t end = min(dir->I_size, (off_t)(n + 1) << PAGE_CACHE_SHIFT);
+        for (; (filled < count) && (*offset + SYSV_DIRSIZE <= end);
+             *offset += SYSV_DIRSIZE) {
+            struct sysv_dir_entry* de = (struct sysv_dir_entry*)
+                (page + (*offset & (PAGE_SIZE - 1)));
+            if (!de->inode)
+                continue;
+            dents[filled].ino = fs16_to_host(sbi->s_bytesex, de->inode);
+            size_t nl = strnlen(de->name, SYSV_NAMELEN);
+            memcpy(dents[filled].name, de->name, nl);
+            dents[filled].name[nl] = '\0';
+            filled++;
+        }
+        if (filled < count) /* a short last entry ends the page too */
+            *offset = end;
+    }
+
+    return (ssize_t)filled;
+}
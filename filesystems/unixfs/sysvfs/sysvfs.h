@@ -52,7 +52,6 @@ struct sysv_dinode { /* on disk */
 
 struct sysv_inode_info { /* in memory */
     __fs32  i_data[13];
-    u32     i_dir_start_lookup;
 };
 
 static inline struct sysv_inode_info*
@@ -317,10 +316,13 @@ const char* sysv_flavor(u_int type);
 u_long sysv_count_free_blocks(struct super_block* sb);
 u_long sysv_count_free_inodes(struct super_block* sb);
 
+off_t sysv_inode_block(struct super_block* sb, ino_t ino);
 struct sysv_dinode* sysv_raw_inode(struct super_block* sb, ino_t ino,
                                    struct buffer_head* bh);
 int sysv_next_direntry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
                        off_t* offset, struct unixfs_direntry* dent);
+ssize_t sysv_readdir_batch(struct inode* dp, off_t* offset,
+                           struct unixfs_direntry* dents, size_t count);
 
 int sysv_get_block(struct inode* ip, sector_t block, off_t* result);
 int sysv_get_page(struct inode* ip, sector_t index, char* pagebuf);
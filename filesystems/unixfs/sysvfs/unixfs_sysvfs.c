@@ -5,6 +5,10 @@
  */
 
 #include "sysvfs.h"
+
+#define UNIXFS_HAVE_IGETATTR_MANY 1
+#define UNIXFS_HAVE_READDIR_BATCH 1
+#define UNIXFS_HAVE_DIRINDEX 1
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -18,13 +22,50 @@
 
 DECL_UNIXFS("UNIX System V", sysv);
 
+/*
+ * Counting free blocks means following the free list link by link, and
+ * counting free inodes means reading the whole inode table, which can take
+ * seconds on a large image. So neither is done at mount. Until the first
+ * statfs, s_statvfs carries the superblock's own totals; that statfs starts
+ * a thread to do the counting, and s_statvfs is corrected when it is done.
+ * The image is read-only, so the counts never need redoing.
+ */
+
+enum {
+    SYSV_COUNTS_IDLE,    /* no statfs yet */
+    SYSV_COUNTS_RUNNING,
+    SYSV_COUNTS_DONE,
+    SYSV_COUNTS_NOTHREAD /* the superblock's totals stand */
+};
+
+static pthread_mutex_t sysv_counts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t       sysv_counts_thread;
+static int             sysv_counts_state = SYSV_COUNTS_IDLE;
+
+static void*
+unixfs_internal_counter(void* arg)
+{
+    struct super_block* sb = (struct super_block*)arg;
+    u_long bfree = sysv_count_free_blocks(sb);
+    u_long ffree = sysv_count_free_inodes(sb);
+
+    pthread_mutex_lock(&sysv_counts_lock);
+    sb->s_statvfs.f_bfree  = bfree;
+    sb->s_statvfs.f_bavail = bfree;
+    sb->s_statvfs.f_ffree  = ffree;
+    sysv_counts_state = SYSV_COUNTS_DONE;
+    pthread_mutex_unlock(&sysv_counts_lock);
+
+    return NULL;
+}
+
 static void*
-unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
+unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +74,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -56,15 +97,20 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct sysv_sb_info* sbi = SYSV_SB(sb);
 
     unixfs = sb;
+
+    if ((err = unixfs_bcache_init(sb)) != 0)
+        goto out;
     unixfs->s_flags = flags;
 
     unixfs->s_statvfs.f_bsize   = max(PAGE_SIZE, sb->s_blocksize);
     unixfs->s_statvfs.f_frsize  = sb->s_blocksize;
     unixfs->s_statvfs.f_blocks  = sbi->s_ndatazones;
-    unixfs->s_statvfs.f_bavail  = sysv_count_free_blocks(sb);
+    unixfs->s_statvfs.f_bavail  = (sbi->s_type == FSTYPE_AFS) ? 0 :
+        fs32_to_host(sbi->s_bytesex, *sbi->s_free_blocks);
     unixfs->s_statvfs.f_bfree   = unixfs->s_statvfs.f_bavail;
     unixfs->s_statvfs.f_files   = sbi->s_ninodes;
-    unixfs->s_statvfs.f_ffree   = sysv_count_free_inodes(sb);
+    unixfs->s_statvfs.f_ffree   =
+        fs16_to_host(sbi->s_bytesex, *sbi->s_sb_total_free_inodes);
     unixfs->s_statvfs.f_namemax = SYSV_NAMELEN;
     unixfs->s_dentsize = 0;
 
@@ -78,7 +124,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
 out:
     if (err) {
         if (fd > 0)
-            close(fd);
+            unixfs_dev_close(fd);
         if (sb) {
             struct sysv_sb_info* sbi = SYSV_SB(sb);
             if (sbi) {
@@ -93,6 +139,7 @@ out:
                     brelse(bh2);
                 free(sbi);
             }
+            unixfs_bcache_fini(sb);
             free(sb);
         }
     }
@@ -103,6 +150,13 @@ out:
 static void
 unixfs_internal_fini(void* filsys)
 {
+    pthread_mutex_lock(&sysv_counts_lock);
+    int counting = (sysv_counts_state == SYSV_COUNTS_RUNNING) ||
+                   (sysv_counts_state == SYSV_COUNTS_DONE);
+    pthread_mutex_unlock(&sysv_counts_lock);
+    if (counting)
+        (void)pthread_join(sysv_counts_thread, NULL);
+
     unixfs_inodelayer_fini();
 
     struct super_block* sb = (struct super_block*)filsys;
@@ -121,6 +175,7 @@ unixfs_internal_fini(void* filsys)
                 brelse(bh2);
             free(sbi);
         }
+        unixfs_bcache_fini(sb);
         free(sb);
     }
 }
@@ -144,11 +199,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     struct super_block* sb = unixfs;
 
-    if (pread(sb->s_bdev, blkbuf, sb->s_blocksize,
-              blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
-        return EIO;
-
-    return 0;
+    return unixfs_bcache_bread(sb, blkno * (off_t)(sb->s_blocksize),
+                               sb->s_blocksize, blkbuf);
 }
 
 struct inode*
@@ -161,13 +213,14 @@ unixfs_internal_iget(ino_t ino)
    struct sysv_sb_info* sbi = SYSV_SB(sb);
 
    if (!ino || ino > sbi->s_ninodes) {
-       fprintf(stderr, "bad inode number: %llu\n", ino);
+       fprintf(stderr, "bad inode number: %llu\n", (unsigned long long)ino);
        return NULL;
     }
 
     struct inode* inode = unixfs_inodelayer_iget(ino);
     if (!inode) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -177,15 +230,14 @@ unixfs_internal_iget(ino_t ino)
     struct buffer_head  bh;
     struct sysv_dinode* raw_inode = sysv_raw_inode(sb, ino, &bh);
     if (!raw_inode) {
-        fprintf(stderr, "major problem: failed to read inode %llu\n", ino);
+        fprintf(stderr, "major problem: failed to read inode %llu\n",
+                (unsigned long long)ino);
         unixfs_inodelayer_ifailed(inode);
         goto bad_inode;
     }
 
     struct sysv_inode_info *si = SYSV_I(inode);
 
-    inode->I_ino = ino;
-
     /* SystemV FS: kludge permissions if ino==SYSV_ROOT_INO ?? */
 
     inode->I_mode = fs16_to_host(unixfs->s_endian, raw_inode->di_mode);
@@ -215,8 +267,6 @@ unixfs_internal_iget(ino_t ino)
         inode->I_rdev = makedev((rdev >> 8) & 255, rdev & 255);
     }
 
-    si->i_dir_start_lookup = 0;
-
     unixfs_inodelayer_isucceeded(inode);
 
     return inode;
@@ -248,12 +298,59 @@ unixfs_internal_igetattr(ino_t ino, struct stat* stbuf)
     return 0;
 }
 
+static off_t
+unixfs_internal_ilocate(ino_t ino)
+{
+    if (ino == MACFUSE_ROOTINO)
+        ino = SYSV_ROOT_INO;
+
+    return sysv_inode_block(unixfs, ino);
+}
+
+static void
+unixfs_internal_igetattr_many(ino_t* inos, struct stat* stbufs, int* errors,
+                              size_t count)
+{
+    unixfs_igetattr_many(unixfs, inos, stbufs, errors, count,
+                         unixfs_internal_ilocate, unixfs_internal_igetattr);
+}
+
 static void
 unixfs_internal_istat(struct inode* ip, struct stat* stbuf)
 {
     memcpy(stbuf, &ip->I_stat, sizeof(struct stat));
 }
 
+/* Feeds every live entry of dir to a new lookup index. */
+static int
+sysv_fill_dirindex(struct inode* dir, struct unixfs_dirindex* di)
+{
+    unsigned long npages = sysv_dir_pages(dir);
+    unsigned long n;
+    char page[PAGE_SIZE];
+
+    for (n = 0; n < npages; n++) {
+        if (sysv_get_page(dir, n, page) != 0)
+            return EIO;
+        off_t bytes = min(dir->I_size - ((off_t)n << PAGE_CACHE_SHIFT),
+                          (off_t)PAGE_CACHE_SIZE);
+        struct sysv_dir_entry* de = (struct sysv_dir_entry*)page;
+        struct sysv_dir_entry* end = (struct sysv_dir_entry*)(page + bytes);
+        for (; de + 1 <= end; de++) {
+            if (!de->inode)
+                continue;
+            ino_t ino = (ino_t)fs16_to_host(unixfs->s_endian, de->inode);
+            int error = unixfs_dirindex_add(di, de->name,
+                                            strnlen(de->name, SYSV_NAMELEN),
+                                            ino);
+            if (error)
+                return error;
+        }
+    }
+
+    return 0;
+}
+
 static int
 unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
 {
@@ -271,6 +368,13 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
         return ENOTDIR;
     }
 
+    ino_t target;
+    int error = unixfs_dirindex_lookup(dir, name, sysv_fill_dirindex, &target);
+    if ((error == 0) || (error == ENOENT)) {
+        unixfs_internal_iput(dir);
+        return (error == 0) ? unixfs_internal_igetattr(target, stbuf) : ENOENT;
+    }
+
     int ret = ENOENT, found = 0;
 
     unsigned long namelen = strlen(name);
@@ -280,7 +384,7 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
     char page[PAGE_SIZE];
     char* kaddr = NULL;
 
-    start = SYSV_I(dir)->i_dir_start_lookup;
+    start = unixfs_inodelayer_getdirhint(dir);
     if (start >= npages)
         start = 0;
     n = start;
@@ -308,7 +412,7 @@ unixfs_internal_namei(ino_t parentino, const char* name, struct stat* stbuf)
 found:
 
     if (found)
-        SYSV_I(dir)->i_dir_start_lookup = n;
+        unixfs_inodelayer_setdirhint(dir, (uint32_t)n);
 
     unixfs_internal_iput(dir);
 
@@ -327,6 +431,13 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
 
 }
 
+static ssize_t
+unixfs_internal_readdir_batch(struct inode* dp, off_t* offset,
+                              struct unixfs_direntry* dents, size_t count)
+{
+    return sysv_readdir_batch(dp, offset, dents, count);
+}
+
 static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
@@ -339,11 +450,14 @@ unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
     sector_t beginpgno = offset >> PAGE_CACHE_SHIFT;
 
     while (remaining > 0) { /* page sized reads */
-        *error = sysv_get_page(ip, beginpgno, page);
+        /* whole pages go straight into the caller's buffer */
+        char* dst = (remaining >= PAGE_SIZE) ? p : page;
+        *error = sysv_get_page(ip, beginpgno, dst);
         if (*error)
             break;
         tomove = (remaining > PAGE_SIZE) ? PAGE_SIZE : remaining;
-        memcpy(p, page, tomove);
+        if (dst != p)
+            memcpy(p, page, tomove);
         remaining -= tomove;
         done += tomove;
         p += tomove;
@@ -392,6 +506,15 @@ unixfs_internal_sanitycheck(void* filsys, off_t disksize)
 static int
 unixfs_internal_statvfs(struct statvfs* svb)
 {
+    pthread_mutex_lock(&sysv_counts_lock);
+    if (sysv_counts_state == SYSV_COUNTS_IDLE) {
+        if (pthread_create(&sysv_counts_thread, (const pthread_attr_t*)0,
+                           unixfs_internal_counter, unixfs) == 0)
+            sysv_counts_state = SYSV_COUNTS_RUNNING;
+        else
+            sysv_counts_state = SYSV_COUNTS_NOTHREAD;
+    }
     memcpy(svb, &unixfs->s_statvfs, sizeof(struct statvfs));
+    pthread_mutex_unlock(&sysv_counts_lock);
     return 0;
 }
@@ -26,8 +26,6 @@
 static ino_t ufs_find_entry_s(struct inode *dir, const char* name);
 static int ufs_get_dirpage(struct inode *inode, sector_t index, char *pagebuf);
 static int ufs_read_cylinder_structures(struct super_block *sb);
-static void ufs_print_cylinder_stuff(struct super_block* sb,
-                                     struct ufs_cylinder_group* cg);
 static void ufs_setup_cstotal(struct super_block* sb);
 static int ufs_read_cylinder_structures(struct super_block* sb);
 static u64 ufs_frag_map(struct inode *inode, sector_t frag, int* error);
@@ -171,43 +169,6 @@ ufs_print_super_stuff(struct super_block* sb,
     printk("\n");
 }
 
-static void
-ufs_print_cylinder_stuff(struct super_block* sb, struct ufs_cylinder_group* cg)
-{
-    printk("\nufs_print_cylinder_stuff\n");
-    printk("size of ucg: %zu\n", sizeof(struct ufs_cylinder_group));
-    printk("  magic:        %x\n", fs32_to_cpu(sb, cg->cg_magic));
-    printk("  time:         %u\n", fs32_to_cpu(sb, cg->cg_time));
-    printk("  cgx:          %u\n", fs32_to_cpu(sb, cg->cg_cgx));
-    printk("  ncyl:         %u\n", fs16_to_cpu(sb, cg->cg_ncyl));
-    printk("  niblk:        %u\n", fs16_to_cpu(sb, cg->cg_niblk));
-    printk("  ndblk:        %u\n", fs32_to_cpu(sb, cg->cg_ndblk));
-    printk("  cs_ndir:      %u\n", fs32_to_cpu(sb, cg->cg_cs.cs_ndir));
-    printk("  cs_nbfree:    %u\n", fs32_to_cpu(sb, cg->cg_cs.cs_nbfree));
-    printk("  cs_nifree:    %u\n", fs32_to_cpu(sb, cg->cg_cs.cs_nifree));
-    printk("  cs_nffree:    %u\n", fs32_to_cpu(sb, cg->cg_cs.cs_nffree));
-    printk("  rotor:        %u\n", fs32_to_cpu(sb, cg->cg_rotor));
-    printk("  frotor:       %u\n", fs32_to_cpu(sb, cg->cg_frotor));
-    printk("  irotor:       %u\n", fs32_to_cpu(sb, cg->cg_irotor));
-    printk("  frsum:        %u, %u, %u, %u, %u, %u, %u, %u\n",
-           fs32_to_cpu(sb, cg->cg_frsum[0]), fs32_to_cpu(sb, cg->cg_frsum[1]),
-           fs32_to_cpu(sb, cg->cg_frsum[2]), fs32_to_cpu(sb, cg->cg_frsum[3]),
-           fs32_to_cpu(sb, cg->cg_frsum[4]), fs32_to_cpu(sb, cg->cg_frsum[5]),
-           fs32_to_cpu(sb, cg->cg_frsum[6]), fs32_to_cpu(sb, cg->cg_frsum[7]));
-    printk("  btotoff:      %u\n", fs32_to_cpu(sb, cg->cg_btotoff));
-    printk("  boff:         %u\n", fs32_to_cpu(sb, cg->cg_boff));
-    printk("  iuseoff:      %u\n", fs32_to_cpu(sb, cg->cg_iusedoff));
-    printk("  freeoff:      %u\n", fs32_to_cpu(sb, cg->cg_freeoff));
-    printk("  nextfreeoff:  %u\n", fs32_to_cpu(sb, cg->cg_nextfreeoff));
-    printk("  clustersumoff %u\n",
-           fs32_to_cpu(sb, cg->cg_u.cg_44.cg_clustersumoff));
-    printk("  clusteroff    %u\n",
-           fs32_to_cpu(sb, cg->cg_u.cg_44.cg_clusteroff));
-    printk("  nclusterblks  %u\n",
-           fs32_to_cpu(sb, cg->cg_u.cg_44.cg_nclusterblks));
-    printk("\n");
-}
-
 static int
 ufs_parse_options(char* options, unsigned* mount_options)
 {
@@ -356,12 +317,9 @@ ufs_read_cylinder_structures(struct super_block* sb)
     unsigned char* base;
     unsigned char* space;
     unsigned size, blks, i;
-    struct ufs_super_block_third* usb3;
 
     UFSD("ENTER\n");
 
-    usb3 = ubh_get_usb_third(uspi);
-
     /* Read cs structures from (usually) first data block on the device. */
 
     size = uspi->s_cssize;
@@ -389,35 +347,6 @@ ufs_read_cylinder_structures(struct super_block* sb)
         ubh = NULL;
     }
 
-    /*
-     * Read cylinder group (we read only first fragment from block
-     * at this time) and prepare internal data structures for cg caching.
-     */
-
-    if (!(sbi->s_ucg = kmalloc(sizeof(struct buffer_head*) * uspi->s_ncg,
-        GFP_KERNEL)))
-        goto failed;
-
-    for (i = 0; i < uspi->s_ncg; i++) 
-        sbi->s_ucg[i] = NULL;
-
-    for (i = 0; i < UFS_MAX_GROUP_LOADED; i++) {
-        sbi->s_ucpi[i] = NULL;
-        sbi->s_cgno[i] = UFS_CGNO_EMPTY;
-    }
-
-    for (i = 0; i < uspi->s_ncg; i++) {
-        UFSD("read cg %u\n", i);
-        if (!(sbi->s_ucg[i] = sb_bread(sb, ufs_cgcmin(i))))
-            goto failed;
-        if (!ufs_cg_chkmagic(sb,
-            (struct ufs_cylinder_group*)sbi->s_ucg[i]->b_data))
-            goto failed;
-
-        ufs_print_cylinder_stuff(sb,
-            (struct ufs_cylinder_group*)sbi->s_ucg[i]->b_data);
-    }
-
     for (i = 0; i < UFS_MAX_GROUP_LOADED; i++) {
         if (!(sbi->s_ucpi[i] = kmalloc(sizeof(struct ufs_cg_private_info),
                                        GFP_KERNEL)))
@@ -433,14 +362,11 @@ ufs_read_cylinder_structures(struct super_block* sb)
 
 failed:
     kfree(base);
+    sbi->s_csp = NULL;
 
-    if (sbi->s_ucg) {
-        for (i = 0; i < uspi->s_ncg; i++)
-            if (sbi->s_ucg[i])
-                brelse (sbi->s_ucg[i]);
-        kfree (sbi->s_ucg);
-        for (i = 0; i < UFS_MAX_GROUP_LOADED; i++)
-            kfree (sbi->s_ucpi[i]);
+    for (i = 0; i < UFS_MAX_GROUP_LOADED; i++) {
+        kfree (sbi->s_ucpi[i]);
+        sbi->s_ucpi[i] = NULL;
     }
 
     UFSD("EXIT (FAILED)\n");
@@ -448,6 +374,58 @@ failed:
     return 0;
 }
 
+/*
+ * Optional mount-time check (--verify-cgs) of every cylinder group's magic.
+ * The headers go through one scratch buffer straight from the image, so the
+ * pass neither pins them nor pushes file data out of the block cache. It
+ * reports every bad group and returns the number found.
+ */
+unsigned
+U_ufs_verify_cylinder_groups(struct super_block* sb)
+{
+    struct ufs_sb_private_info* uspi = UFS_SB(sb)->s_uspi;
+    unsigned i, nbad = 0;
+
+    char* buf = kmalloc(sb->s_blocksize, GFP_KERNEL);
+    if (!buf)
+        return uspi->s_ncg;
+
+    for (i = 0; i < uspi->s_ncg; i++) {
+        off_t offset = (off_t)ufs_cgcmin(i) * (off_t)sb->s_blocksize;
+        if ((unixfs_bcache_pread(sb, buf, sb->s_blocksize, offset) !=
+             (ssize_t)sb->s_blocksize) ||
+            !ufs_cg_chkmagic(sb, (struct ufs_cylinder_group*)buf)) {
+            printk(KERN_ERR "ufs: cylinder group %u is unreadable or has "
+                   "bad magic\n", i);
+            nbad++;
+        }
+    }
+
+    kfree(buf);
+
+    return nbad;
+}
+
+void
+U_ufs_put_super(struct super_block* sb)
+{
+    struct ufs_sb_info* sbi = UFS_SB(sb);
+    unsigned i;
+
+    if (!sbi)
+        return;
+
+    for (i = 0; i < UFS_MAX_GROUP_LOADED; i++)
+        kfree(sbi->s_ucpi[i]);
+
+    kfree(sbi->s_csp);
+
+    ubh_brelse_uspi(sbi->s_uspi);
+    kfree(sbi->s_uspi);
+    kfree(sbi);
+    sb->s_fs_info = NULL;
+}
+
 static int
 ufs_block_to_path(struct inode* inode, sector_t i_block, sector_t offsets[4])
 {
@@ -516,6 +494,10 @@ ufs_frag_map(struct inode* inode, sector_t frag, int* error)
     if (depth == 0)
         return 0;
 
+    off_t cached;
+    if (unixfs_extentmap_lookup(inode, frag, &cached, NULL) == 0)
+        return (u64)cached;
+
     p = offsets;
 
     lock_kernel();
@@ -582,6 +564,9 @@ ufs2:
     ret = temp + (u64)(frag & uspi->s_fpbmask);
 
 out:
+    if (ret)
+        unixfs_extentmap_insert(inode, frag, (off_t)ret);
+
     unlock_kernel();
 
     return ret;
@@ -659,7 +644,8 @@ ufs1_read_inode(struct inode* inode, struct ufs_inode* ufs_inode)
 
     if (inode->I_nlink == 0) {
         fprintf(stderr,
-                "ufs_read_inode: inode %llu has zero nlink\n", inode->I_ino);
+                "ufs_read_inode: inode %llu has zero nlink\n",
+                (unsigned long long)inode->I_ino);
         return -1;
     }
     
@@ -704,7 +690,8 @@ ufs2_read_inode(struct inode* inode, struct ufs2_inode* ufs2_inode)
     inode->I_nlink = fs16_to_cpu(sb, ufs2_inode->ui_nlink);
     if (inode->I_nlink == 0) {
         fprintf(stderr,
-                "ufs_read_inode: inode %llu has zero nlink\n", inode->I_ino);
+                "ufs_read_inode: inode %llu has zero nlink\n",
+                (unsigned long long)inode->I_ino);
         return -1;
     }
 
@@ -832,7 +819,7 @@ out:
 
 Ebadsize:
     fprintf(stderr, "ufs_check_page: size of directory #%llu is "
-            "not a multiple of chunk size", dir->I_ino);
+            "not a multiple of chunk size", (unsigned long long)dir->I_ino);
     goto fail;
 
 Eshort:
@@ -857,7 +844,8 @@ Einumber:
 bad_entry:
     fprintf(stderr, "ufs_check_page: bad entry in directory #%llu: %s - "
             "offset=%llu, rec_len=%d, name_len=%d",
-            dir->I_ino, error, (index << PAGE_CACHE_SHIFT) + offs,
+            (unsigned long long)dir->I_ino, error,
+            (unsigned long long)(index << PAGE_CACHE_SHIFT) + offs,
             rec_len, ufs_get_de_namlen(sb, p));
     goto fail;
 
@@ -865,7 +853,8 @@ Eend:
     p = (struct ufs_dir_entry *)(kaddr + offs);
 
     fprintf(stderr, "entry in directory #%llu spans the page boundary"
-           "offset=%llu", dir->I_ino, (index << PAGE_CACHE_SHIFT) + offs);
+           "offset=%llu", (unsigned long long)dir->I_ino,
+           (unsigned long long)(index << PAGE_CACHE_SHIFT) + offs);
 fail:
     return fres;
 }
@@ -904,7 +893,6 @@ static ino_t
 ufs_find_entry_s(struct inode* dir, const char* name)
 {
     struct super_block* sb = dir->I_sb;
-    struct ufs_inode_info* ui = dir->I_private;
 
     int namelen = strlen(name);
     unsigned reclen = UFS_DIR_REC_LEN(namelen);
@@ -920,7 +908,7 @@ ufs_find_entry_s(struct inode* dir, const char* name)
     if (npages == 0 || namelen > UFS_MAXNAMLEN)
         goto out;
 
-    start = ui->i_dir_start_lookup;
+    start = unixfs_inodelayer_getdirhint(dir);
 
     if (start >= npages)
         start = 0;
@@ -956,7 +944,7 @@ out:
     return result;
 
 found:
-    ui->i_dir_start_lookup = n;
+    unixfs_inodelayer_setdirhint(dir, (uint32_t)n);
 
     return result;
 }
@@ -1475,13 +1463,11 @@ U_ufs_statvfs(struct super_block* sb, struct statvfs* buf)
     unsigned flags = UFS_SB(sb)->s_flags;
 
     struct ufs_super_block_first*  usb1;
-    struct ufs_super_block_second* usb2;
     struct ufs_super_block_third*  usb3;
 
     lock_kernel();
 
     usb1 = ubh_get_usb_first(uspi);
-    usb2 = ubh_get_usb_second(uspi);
     usb3 = ubh_get_usb_third(uspi);
     
     if ((flags & UFS_TYPE_MASK) == UFS_TYPE_UFS2) {
@@ -1511,6 +1497,15 @@ U_ufs_statvfs(struct super_block* sb, struct statvfs* buf)
     return 0;
 }
 
+/* The device block (in s_blocksize units) that holds inode ino. */
+off_t
+U_ufs_inode_block(struct super_block* sb, ino_t ino)
+{
+    struct ufs_sb_private_info* uspi = UFS_SB(sb)->s_uspi;
+
+    return (off_t)(uspi->s_sbbase + ufs_inotofsba(ino));
+}
+
 int
 U_ufs_iget(struct super_block* sb, struct inode* inode)
 {
@@ -1542,7 +1537,8 @@ U_ufs_iget(struct super_block* sb, struct inode* inode)
     if (sb_bread_intobh(sb, uspi->s_sbbase +
                         ufs_inotofsba(inode->I_ino), bh) != 0) {
         fprintf(stderr,
-                "ufs_read_inode: unable to read inode %llu\n", inode->I_ino);
+                "ufs_read_inode: unable to read inode %llu\n",
+                (unsigned long long)inode->I_ino);
         goto bad_inode;
     }
 
@@ -1573,10 +1569,51 @@ bad_inode:
     return -1;
 }
 
+/* Feeds every live entry of dir to a new lookup index. */
+static int
+ufs_fill_dirindex(struct inode* dir, struct unixfs_dirindex* di)
+{
+    struct super_block* sb = dir->I_sb;
+    unsigned long npages = ufs_dir_pages(dir);
+    unsigned long n;
+    char page[PAGE_SIZE];
+
+    for (n = 0; n < npages; n++) {
+        if (ufs_get_dirpage(dir, n, page) != 0)
+            return EIO;
+        char* kaddr = page;
+        struct ufs_dir_entry* de = (struct ufs_dir_entry*)kaddr;
+        kaddr += ufs_last_byte(dir, n) - UFS_DIR_REC_LEN(1);
+        while ((char*)de <= kaddr) {
+            if (de->d_reclen == 0)
+                return EIO;
+            if (de->d_ino) {
+                int error = unixfs_dirindex_add(di, (const char*)de->d_name,
+                                                ufs_get_de_namlen(sb, de),
+                                                fs32_to_cpu(sb, de->d_ino));
+                if (error)
+                    return error;
+            }
+            de = ufs_next_entry(sb, de);
+        }
+    }
+
+    return 0;
+}
+
 ino_t
 U_ufs_inode_by_name(struct inode* dir, const char* name)
 {
-    return ufs_find_entry_s(dir, name);
+    ino_t ino;
+
+    switch (unixfs_dirindex_lookup(dir, name, ufs_fill_dirindex, &ino)) {
+    case 0:
+        return ino;
+    case ENOENT:
+        return 0;
+    default:
+        return ufs_find_entry_s(dir, name);
+    }
 }
 
 int
@@ -1584,10 +1621,9 @@ U_ufs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirpagebuf,
                     off_t* offset, struct unixfs_direntry* dent)
 {
     struct super_block* sb = dir->I_sb;
-    struct ufs_inode_info* ui = dir->I_private;
 
     unsigned long npages = ufs_dir_pages(dir);
-    unsigned long start, n;
+    unsigned long n;
     struct ufs_dir_entry* de;
 
     UFSD("ENTER, dir_ino %llu\n", dir->I_ino);
@@ -1598,23 +1634,25 @@ U_ufs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirpagebuf,
     if (npages == 0)
         return -1;
 
-    start = ui->i_dir_start_lookup;
-    n = start;
+    n = *offset >> PAGE_CACHE_SHIFT; /* which page from offset */
 
-    if (start > npages)
+    if (n >= npages)
         return -1;
 
-    if ((ui->i_unused1 == 0) || (*offset & ((PAGE_SIZE - 1))) == 0) {
+    /* The page read last lives in the caller's dirbuf, not in the inode. */
+    if (!dirpagebuf->flags.initialized || (*offset & ((PAGE_SIZE - 1))) == 0) {
         int ret = ufs_get_dirpage(dir, n, dirpagebuf->data);
         if (ret != 0)
             return ret;
-        ui->i_dir_start_lookup++;
-        ui->i_unused1 = ui->i_dir_start_lookup;
+        dirpagebuf->flags.initialized = 1;
     }
 
     de = (struct ufs_dir_entry*)((char*)dirpagebuf->data +
                                  (*offset & (PAGE_SIZE - 1)));
 
+    if (de->d_reclen == 0)
+        return -1;
+
     dent->ino = fs32_to_cpu(sb, de->d_ino);
     size_t nl = ufs_get_de_namlen(sb, de);;
     memcpy(dent->name, de->d_name, nl);
@@ -1625,6 +1663,54 @@ U_ufs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirpagebuf,
     return 0;
 }
 
+/*
+ * Decodes every entry it can from each directory page it reads, skipping
+ * free ones, until count entries are filled in or the directory ends.
+ * Returns how many; 0 at the end, -1 if a page is unreadable or holds a
+ * zero-length record.
+ */
+ssize_t
+U_ufs_readdir_batch(struct inode* dir, off_t* offset,
+                    struct unixfs_direntry* dents, size_t count)
+{
+    struct super_block* sb = dir->I_sb;
+    unsigned long npages = ufs_dir_pages(dir);
+    char page[PAGE_SIZE];
+    size_t filled = 0;
+
+    while ((filled < count) &&
+           (*offset <= dir->I_size - UFS_DIR_REC_LEN(1))) {
+        unsigned long n = *offset >> PAGE_CACHE_SHIFT;
+        if (n >= npages)
+            break;
+        if (ufs_get_dirpage(dir, n, page) != 0)
+            return filled ? (ssize_t)filled : -1;
+        char* kaddr = page + ufs_last_byte(dir, n) - UFS_DIR_REC_LEN(1);
+        struct ufs_dir_entry* de =
+            (struct ufs_dir_entry*)(page + (*offset & (PAGE_SIZE - 1)));
+        while ((filled < count) && ((char*)de <= kaddr)) {
+            if (de->d_reclen == 0) {
+                *offset = ((off_t)n << PAGE_CACHE_SHIFT) + ((char*)de - page);
+                return filled ? (ssize_t)filled : -1;
+            }
+            if (de->d_ino) {
+                size_t nl = ufs_get_de_namlen(sb, de);
+                dents[filled].ino = fs32_to_cpu(sb, de->d_ino);
+                memcpy(dents[filled].name, de->d_name, nl);
+                dents[filled].name[nl] = '\0';
+                filled++;
+            }
+            de = ufs_next_entry(sb, de);
+        }
+        if (filled < count) /* on to the next page */
+            *offset = (off_t)(n + 1) << PAGE_CACHE_SHIFT;
+        else
+            *offset = ((off_t)n << PAGE_CACHE_SHIFT) + ((char*)de - page);
+    }
+
+    return (ssize_t)filled;
+}
+
 /* Interface between UFS and read/write page. */
 int
 U_ufs_get_block(struct inode* inode, sector_t fragment, off_t* result)
@@ -1640,56 +1726,75 @@ U_ufs_get_block(struct inode* inode, sector_t fragment, off_t* result)
       return ret;
 }
 
-int
-U_ufs_get_page(struct inode* inode, sector_t index, char* pagebuf)
+/*
+ * Reads file data a file system block at a time rather than a fragment at a
+ * time. The fragments of a block are contiguous on disk, so the wanted part
+ * of a block, or of the fragments that make up a short last block, costs a
+ * single uncached read straight into the caller's buffer; file data stays
+ * out of the block cache, which is left to metadata. Holes, and anything
+ * past the last fragment, read as zeros.
+ */
+ssize_t
+U_ufs_pbread(struct inode* inode, char* buf, size_t nbyte, off_t offset,
+             int* error)
 {
-    sector_t iblock, lblock;
-    unsigned int blocksize;
-    int nr, i;
+    struct super_block* sb = inode->I_sb;
+    struct ufs_sb_private_info* uspi = UFS_SB(sb)->s_uspi;
 
-    blocksize = 1 << inode->I_blkbits;
+    u64 lastfrag = (inode->I_size + uspi->s_fsize - 1) >> uspi->s_fshift;
+    size_t bmask = uspi->s_bsize - 1;
+    size_t remaining = nbyte;
+    char* p = buf;
 
-    iblock = index << (PAGE_CACHE_SHIFT - inode->I_blkbits);
-    lblock = (inode->I_size + blocksize - 1) >> inode->I_blkbits;
+    *error = 0;
 
-    nr = 0;
-    i = 0;
+    while (remaining > 0) {
+        u64 frag = ufs_blkstofrags((u64)offset >> uspi->s_bshift);
+        size_t boff = (size_t)offset & bmask;
+        size_t tomove = min(uspi->s_bsize - boff, remaining);
+        size_t span = 0; /* bytes of this block that are backed by fragments */
 
-    int bytes = 0, err = 0;
-    struct super_block* sb = inode->I_sb;
-    struct buffer_head _bh;
-    char* p = pagebuf;
+        if (frag < lastfrag)
+            span = (size_t)(min(lastfrag - frag, (u64)uspi->s_fpb)
+                            << uspi->s_fshift);
 
-    do {
-        u64 phys64 = ufs_frag_map(inode, iblock, &err);
-        if (phys64) {
-            struct buffer_head* bh = &_bh;
-            bh->b_flags.dynamic = 0;
-            if (sb_bread_intobh(sb, phys64, bh) == 0) {
-                memcpy(p, bh->b_data, blocksize);
-                p += blocksize;
-                bytes += blocksize;
-                brelse(bh); 
-            } else {
-                err = EIO;
-                fprintf(stderr, "*** fatal error: I/O error reading page\n");
-                abort();
-                exit(10);
+        u64 phys64 = 0;
+        if (boff < span) {
+            phys64 = ufs_frag_map(inode, frag, error);
+            if (*error)
+                break;
+        }
+
+        if (!phys64) { /* zero fill */
+            memset(p, 0, tomove);
+        } else {
+            size_t n = min(tomove, span - boff);
+            off_t pos = ((off_t)phys64 << sb->s_blocksize_bits) + (off_t)boff;
+            if (unixfs_bcache_pread(sb, p, n, pos) != (ssize_t)n) {
+                *error = EIO;
+                break;
             }
-        } else { /* zero fill */
-            memset(p, 0, blocksize);
-            p += blocksize;
-            bytes += blocksize;
+            memset(p + n, 0, tomove - n);
         }
 
-        if ((bytes >= PAGE_SIZE) || (iblock >= lblock))
-            break;
+        remaining -= tomove;
+        offset += tomove;
+        p += tomove;
+    }
+
+    if (remaining == nbyte && *error)
+        return -1;
 
-         iblock++;
+    return (ssize_t)(nbyte - remaining);
+}
 
-    } while (1);
+int
+U_ufs_get_page(struct inode* inode, sector_t index, char* pagebuf)
+{
+    int err;
 
-    if (err)
+    if (U_ufs_pbread(inode, pagebuf, PAGE_SIZE,
+                     (off_t)index << PAGE_CACHE_SHIFT, &err) != PAGE_SIZE)
         return -1;
 
     /* check page? */
@@ -21,10 +21,20 @@ struct super_block*
       U_ufs_fill_super(int fd, void* args, int silent);
 int   U_ufs_statvfs(struct super_block* sb, struct statvfs* buf);
 int   U_ufs_iget(struct super_block* sb, struct inode* ip);
+off_t U_ufs_inode_block(struct super_block* sb, ino_t ino);
 ino_t U_ufs_inode_by_name(struct inode* dir, const char* name);
 int   U_ufs_next_direntry(struct inode* dir, struct unixfs_dirbuf* dirbuf,
                           off_t* offset, struct unixfs_direntry* dent);
+ssize_t
+      U_ufs_readdir_batch(struct inode* dir, off_t* offset,
+                          struct unixfs_direntry* dents, size_t count);
 int   U_ufs_get_block(struct inode* ip, sector_t fragment, off_t* result);
 int   U_ufs_get_page(struct inode* ip, sector_t index, char* pagebuf);
+ssize_t
+      U_ufs_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
+                   int* error);
+unsigned
+      U_ufs_verify_cylinder_groups(struct super_block* sb);
+void  U_ufs_put_super(struct super_block* sb);
 
 #endif /* _UFS_H_ */
@@ -13,6 +13,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#if __linux__ || (__FreeBSD__ < 10)
+#define __USE_GNU 1
+#define __private_extern__
+#endif
 #include <dlfcn.h>
 
 static const char* PROGNAME = "ufs";
@@ -45,9 +49,10 @@ unixfs_usage(void)
     "%s (version %s): UFS family of file systems for MacFUSE\n"
     "Amit Singh <http://osxbook.com>\n"
     "usage:\n"
-    "      %s [--force] --dmg DMG --type TYPE MOUNTPOINT [MacFUSE args...]\n"
+    "      %s [--force] [--cachesize SIZE] [--inodecache N] [--readahead SIZE] [--immutable] [--entry-timeout SECS] [--attr-timeout SECS] [--mmap] [--verify-cgs] --dmg DMG --type TYPE MOUNTPOINT [MacFUSE args...]\n"
     "where:\n"
     "     . DMG must point to an ancient Unix disk image of a valid type\n"
+    "       (possibly gzip compressed)\n"
     "     . TYPE is one of:",
     PROGNAME, PROGVERS, PROGNAME);
 
@@ -59,7 +64,24 @@ unixfs_usage(void)
     fprintf(stderr, "\n");
 
     fprintf(stderr, "%s",
+    "     . --cachesize SIZE sets the per-device block cache size (k/m/g\n"
+    "       suffixes are allowed; 0 disables caching)\n"
+    "     . --inodecache N keeps up to N unused inodes cached (default 1024)\n"
+    "     . --readahead SIZE caps the readahead window for sequentially read\n"
+    "       files (default 1m; 0 disables readahead)\n"
+    "     . --immutable promises that the image won't change while mounted,\n"
+    "       letting the kernel cache names, attributes and file data for\n"
+    "       much longer\n"
+    "     . --entry-timeout SECS and --attr-timeout SECS set how long the\n"
+    "       kernel may cache names and attributes (default 60, or a year\n"
+    "       with --immutable)\n"
+    "     . --mmap maps the image into memory and reads it from there\n"
+    "       rather than through the block cache\n"
+    "     . --verify-cgs checks every cylinder group's magic number at mount\n"
+    "       time\n"
     "     . --force attempts mounting even if there are warnings or errors\n"
+    "     . MOUNTPOINT/.unixfs_stats reads out operation counts, latencies\n"
+    "       and cache hit rates; SIGUSR1 prints them on stderr\n"
     );
 }
 
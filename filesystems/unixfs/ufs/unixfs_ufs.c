@@ -5,6 +5,10 @@
  */
 
 #include "ufs.h"
+
+#define UNIXFS_HAVE_IGETATTR_MANY 1
+#define UNIXFS_HAVE_READDIR_BATCH 1
+#define UNIXFS_HAVE_DIRINDEX 1
 #include "unixfs_common.h"
 
 #include <errno.h>
@@ -19,12 +23,12 @@
 DECL_UNIXFS("UFS", ufs);
 
 static void*
-unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
+unixfs_internal_init(const char* dmg, uint32_t flags, fs_endian_t fse,
                      char** fsname, char** volname)
 {
     int fd = -1;
 
-    if ((fd = open(dmg, O_RDONLY)) < 0) {
+    if ((fd = unixfs_dev_open(dmg)) < 0) {
         perror("open");
         return NULL;
     }
@@ -33,7 +37,7 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
     struct stat stbuf;
     struct super_block* sb = (struct super_block*)0;
 
-    if ((err = fstat(fd, &stbuf)) != 0) {
+    if ((err = unixfs_dev_fstat(fd, &stbuf)) != 0) {
         perror("fstat");
         goto out;
     }
@@ -61,6 +65,21 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
 
     unixfs = sb;
 
+    if ((err = unixfs_bcache_init(sb)) != 0)
+        goto out;
+
+    if (unixfs_tunables.verifycgs) {
+        unsigned nbad = U_ufs_verify_cylinder_groups(sb);
+        if (nbad) {
+            fprintf(stderr, "%u bad cylinder group(s)%s\n", nbad,
+                    (flags & UNIXFS_FORCE) ? "; mounting anyway" : "");
+            if (!(flags & UNIXFS_FORCE)) {
+                err = EINVAL;
+                goto out;
+            }
+        }
+    }
+
     err = U_ufs_statvfs(sb, &(unixfs->s_statvfs));
     if (err)
         goto out;
@@ -78,9 +97,12 @@ unixfs_internal_init(const char* dmg, uint32_t flags, __unused fs_endian_t fse,
 out:
     if (err) {
         if (fd > 0)
-            close(fd);
-        if (sb)
+            unixfs_dev_close(fd);
+        if (sb) {
+            unixfs_bcache_fini(sb);
+            U_ufs_put_super(sb);
             free(sb);
+        }
     }
 
     return sb;
@@ -92,8 +114,11 @@ unixfs_internal_fini(void* filsys)
     unixfs_inodelayer_fini();
 
     struct super_block* sb = (struct super_block*)filsys;
-    if (sb)
+    if (sb) {
+        unixfs_bcache_fini(sb);
+        U_ufs_put_super(sb);
         free(sb);
+    }
 }
 
 static off_t
@@ -115,11 +140,8 @@ unixfs_internal_bread(off_t blkno, char* blkbuf)
 {
     struct super_block* sb = unixfs;
 
-    if (pread(sb->s_bdev, blkbuf, sb->s_blocksize,
-              blkno * (off_t)(sb->s_blocksize)) != sb->s_blocksize)
-        return EIO;
-
-    return 0;
+    return unixfs_bcache_bread(sb, blkno * (off_t)(sb->s_blocksize),
+                               sb->s_blocksize, blkbuf);
 }
 
 struct inode*
@@ -130,7 +152,8 @@ unixfs_internal_iget(ino_t ino)
 
     struct inode* inode = unixfs_inodelayer_iget(ino);
     if (!inode) {
-        fprintf(stderr, "*** fatal error: no inode for %llu\n", ino);
+        fprintf(stderr, "*** fatal error: no inode for %llu\n",
+                (unsigned long long)ino);
         abort();
     }
 
@@ -138,11 +161,11 @@ unixfs_internal_iget(ino_t ino)
         return inode;
 
     struct super_block* sb = unixfs;
-    inode->I_ino = ino;
 
     int error = U_ufs_iget(sb, inode);
     if (error) {
-        fprintf(stderr, "major problem: failed to read inode %llu\n", ino);
+        fprintf(stderr, "major problem: failed to read inode %llu\n",
+                (unsigned long long)ino);
         unixfs_inodelayer_ifailed(inode);
         goto bad_inode;
     }
@@ -178,6 +201,23 @@ unixfs_internal_igetattr(ino_t ino, struct stat* stbuf)
     return 0;
 }
 
+static off_t
+unixfs_internal_ilocate(ino_t ino)
+{
+    if (ino == MACFUSE_ROOTINO)
+        ino = UFS_ROOTINO;
+
+    return U_ufs_inode_block(unixfs, ino);
+}
+
+static void
+unixfs_internal_igetattr_many(ino_t* inos, struct stat* stbufs, int* errors,
+                              size_t count)
+{
+    unixfs_igetattr_many(unixfs, inos, stbufs, errors, count,
+                         unixfs_internal_ilocate, unixfs_internal_igetattr);
+}
+
 static void
 unixfs_internal_istat(struct inode* ip, struct stat* stbuf)
 {
@@ -223,33 +263,18 @@ unixfs_internal_nextdirentry(struct inode* dp, struct unixfs_dirbuf* dirbuf,
 
 }
 
+static ssize_t
+unixfs_internal_readdir_batch(struct inode* dp, off_t* offset,
+                              struct unixfs_direntry* dents, size_t count)
+{
+    return U_ufs_readdir_batch(dp, offset, dents, count);
+}
+
 static ssize_t
 unixfs_internal_pbread(struct inode* ip, char* buf, size_t nbyte, off_t offset,
                        int* error)
 {
-    char* p = buf;
-    ssize_t done = 0;
-    ssize_t tomove = 0;
-    ssize_t remaining = nbyte;
-    char page[PAGE_SIZE];
-    sector_t beginpgno = offset >> PAGE_CACHE_SHIFT;
-
-    while (remaining > 0) { /* page sized reads */
-        *error = U_ufs_get_page(ip, beginpgno, page);
-        if (*error)
-            break;
-        tomove = (remaining > PAGE_SIZE) ? PAGE_SIZE : remaining;
-        memcpy(p, page, tomove);
-        remaining -= tomove;
-        done += tomove;
-        p += tomove;
-        beginpgno++;
-    }
-
-    if ((done == 0) && *error)
-        return -1;
-    
-    return done;
+    return U_ufs_pbread(ip, buf, nbyte, offset, error);
 }
 
 static int